@@ -0,0 +1,103 @@
+#shader vertex
+#version 460 core
+// Each draw of glMultiDrawArraysIndirect is one line strip of CurveBatch. The transform, the material and
+// the width of the strip are looked up with gl_DrawID. The strip has no vertex attributes, each instance is
+// the segment between vertices gl_BaseInstance + gl_InstanceID and the one after it, which are read from the
+// vertices buffer. The segment is expanded into a quad in screen space in the same way as in thick_line.glsl.
+
+layout(std140, binding = 0) uniform ProjectionView
+{
+	mat4 projectionView;
+	mat4 model;
+};
+
+// Filled from BatchedCurve::UniformBlock
+layout(std140, binding = 1) uniform Material
+{
+	vec2 viewportSize;
+};
+
+// Matches CurveBatch::DrawRecord
+struct DrawRecord {
+	mat4 transform;
+	int materialIndex;
+	float width;
+};
+
+layout(std430, binding = 0) readonly buffer DrawRecords
+{
+	DrawRecord records[];
+};
+
+layout(std430, binding = 1) readonly buffer Materials
+{
+	vec4 colors[];
+};
+
+// The vertices of all strips, three floats each
+layout(std430, binding = 2) readonly buffer Vertices
+{
+	float positions[];
+};
+
+flat out vec2 startPixel;
+flat out vec2 endPixel;
+flat out vec4 vertexColor;
+flat out float halfWidth;
+
+vec3 stripVertex(int index) {
+	return vec3(positions[3 * index], positions[3 * index + 1], positions[3 * index + 2]);
+}
+
+vec2 toPixels(vec4 clip) {
+	return (clip.xy / clip.w * 0.5f + 0.5f) * viewportSize;
+}
+
+void main() {
+	DrawRecord record = records[gl_DrawID];
+	mat4 transform = projectionView * model * record.transform;
+	int first = gl_BaseInstance + gl_InstanceID;
+	vec4 startClip = transform * vec4(stripVertex(first), 1.0f);
+	vec4 endClip = transform * vec4(stripVertex(first + 1), 1.0f);
+	startPixel = toPixels(startClip);
+	endPixel = toPixels(endClip);
+	vertexColor = colors[record.materialIndex];
+	halfWidth = record.width * 0.5f;
+
+	vec2 delta = endPixel - startPixel;
+	float segmentLength = length(delta);
+	vec2 direction = segmentLength > 0.0f ? delta / segmentLength : vec2(1.0f, 0.0f);
+	vec2 normal = vec2(-direction.y, direction.x);
+	float radius = halfWidth + 1.0f;
+
+	// Two triangles: (0, 1, 2) and (2, 1, 3) where corner bit 0 selects the end and bit 1 the side
+	const int corners[6] = int[6](0, 1, 2, 2, 1, 3);
+	int corner = corners[gl_VertexID];
+	float alongEnd = float(corner & 1);
+	float side = (corner & 2) != 0 ? 1.0f : -1.0f;
+	vec2 pixel = mix(startPixel - direction * radius, endPixel + direction * radius, alongEnd) + normal * side * radius;
+
+	float depth = mix(startClip.z / startClip.w, endClip.z / endClip.w, alongEnd);
+	gl_Position = vec4(pixel / viewportSize * 2.0f - 1.0f, depth, 1.0f);
+}
+
+#shader fragment
+#version 460 core
+flat in vec2 startPixel;
+flat in vec2 endPixel;
+flat in vec4 vertexColor;
+flat in float halfWidth;
+out vec4 FragColor;
+
+void main() {
+	// Distance in pixels from the center of the fragment to the segment
+	vec2 delta = endPixel - startPixel;
+	float lengthSquared = dot(delta, delta);
+	float t = lengthSquared > 0.0f ? clamp(dot(gl_FragCoord.xy - startPixel, delta) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+	float distanceToSegment = length(gl_FragCoord.xy - (startPixel + t * delta));
+	float coverage = clamp(halfWidth + 0.5f - distanceToSegment, 0.0f, 1.0f);
+	if (coverage <= 0.0f) {
+		discard;
+	}
+	FragColor = vec4(vertexColor.rgb, vertexColor.a * coverage);
+}
@@ -1,6 +1,10 @@
 #shader vertex
-#version 330 core
+#version 420 core
 layout(location = 0) in vec3 position;
+// Per instance transform of instanced geometry (e.g. the bars of ReimanArea). x is added to the x coordinate
+// and the y coordinate is scaled by y + 1. Geometry which is not instanced does not enable this attribute,
+// so it has the default value (0, 0) which leaves the position unchanged.
+layout(location = 1) in vec2 instanceOffsetScale;
 
 layout(std140, binding = 0) uniform ProjectionView
 {
@@ -8,17 +12,26 @@ layout(std140, binding = 0) uniform ProjectionView
 	mat4 model;
 };
 
-uniform vec3 color;
+// Filled from FlatColor::UniformBlock
+layout(std140, binding = 1) uniform Material
+{
+	vec3 color;
+};
 
 out vec3 vertexColor;
 
 void main() {
-	gl_Position = projectionView * model * vec4(position, 1.0f);
+	vec3 instancePosition = vec3(
+		position.x + instanceOffsetScale.x,
+		position.y * (instanceOffsetScale.y + 1.0f),
+		position.z
+	);
+	gl_Position = projectionView * model * vec4(instancePosition, 1.0f);
 	vertexColor = color;
 }
 
 #shader fragment
-#version 330 core
+#version 420 core
 in vec3 vertexColor;
 out vec4 FragColor;
 void main() {
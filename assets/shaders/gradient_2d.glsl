@@ -1,6 +1,10 @@
 #shader vertex
-#version 330 core
+#version 420 core
 layout(location = 0) in vec3 position;
+// Per instance transform of instanced geometry (e.g. the bars of ReimanArea). x is added to the x coordinate
+// and the y coordinate is scaled by y + 1. Geometry which is not instanced does not enable this attribute,
+// so it has the default value (0, 0) which leaves the position unchanged.
+layout(location = 1) in vec2 instanceOffsetScale;
 
 layout(std140, binding = 0) uniform ProjectionView
 {
@@ -8,21 +12,30 @@ layout(std140, binding = 0) uniform ProjectionView
 	mat4 model;
 };
 
-uniform vec3 start;
-uniform vec3 end;
-uniform vec3 colorStart;
-uniform vec3 colorEnd;
+// Filled from Gradient2D::UniformBlock
+layout(std140, binding = 1) uniform Material
+{
+	vec3 start;
+	vec3 end;
+	vec3 colorStart;
+	vec3 colorEnd;
+};
 
 out vec3 vertexColor;
 
 void main() {
-	float coeff = length(position - start);
-	gl_Position = projectionView * model * vec4(position, 1.0f);
+	vec3 instancePosition = vec3(
+		position.x + instanceOffsetScale.x,
+		position.y * (instanceOffsetScale.y + 1.0f),
+		position.z
+	);
+	float coeff = length(instancePosition - start);
+	gl_Position = projectionView * model * vec4(instancePosition, 1.0f);
 	vertexColor = colorStart + coeff * (colorEnd - colorStart);
 }
 
 #shader fragment
-#version 330 core
+#version 420 core
 in vec3 vertexColor;
 out vec4 FragColor;
 void main() {
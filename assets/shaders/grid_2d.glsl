@@ -0,0 +1,75 @@
+#shader vertex
+#version 420 core
+layout(location = 0) in vec3 position;
+
+layout(std140, binding = 0) uniform ProjectionView
+{
+	mat4 projectionView;
+	mat4 model;
+};
+
+out vec2 worldPosition;
+
+void main() {
+	vec4 world = model * vec4(position, 1.0f);
+	worldPosition = world.xy;
+	gl_Position = projectionView * world;
+}
+
+#shader fragment
+#version 420 core
+in vec2 worldPosition;
+out vec4 FragColor;
+
+// Filled from Grid2D::UniformBlock
+layout(std140, binding = 1) uniform Material
+{
+	vec3 gridColor;
+	// The smallest distance in pixels between two grid lines. Denser levels are faded out.
+	float minCellPixels;
+	vec3 axisColor;
+	// Length in pixels of the tick marks on each side of the axes
+	float tickPixels;
+};
+
+// Coverage of grid lines with the given spacing. The lines are one pixel wide and antialiased,
+// pixelSize is the size of one pixel in world space along each axis.
+float gridCoverage(vec2 position, vec2 pixelSize, float spacing) {
+	vec2 cell = position / spacing;
+	vec2 distanceInPixels = abs(fract(cell - 0.5f) - 0.5f) * spacing / pixelSize;
+	return 1.0f - clamp(min(distanceInPixels.x, distanceInPixels.y), 0.0f, 1.0f);
+}
+
+// Coverage of a one pixel line at distance measured in pixels
+float lineCoverage(float distanceInPixels) {
+	return 1.0f - clamp(distanceInPixels, 0.0f, 1.0f);
+}
+
+void main() {
+	vec2 pixelSize = fwidth(worldPosition);
+	// Grid levels are powers of 10. The minor level is the densest one with cells of at least
+	// minCellPixels, it fades out as zooming out brings it closer to the next level.
+	float lod = log(minCellPixels * max(pixelSize.x, pixelSize.y)) / log(10.0f);
+	float minorSpacing = pow(10.0f, floor(lod));
+	float majorSpacing = minorSpacing * 10.0f;
+	float fade = fract(lod);
+
+	float minor = gridCoverage(worldPosition, pixelSize, minorSpacing) * (1.0f - fade) * 0.3f;
+	float major = gridCoverage(worldPosition, pixelSize, majorSpacing) * mix(0.6f, 0.3f, fade);
+	float grid = max(minor, major);
+
+	// Axes and ticks at the major grid lines
+	vec2 axisDistance = abs(worldPosition) / pixelSize;
+	float axes = max(lineCoverage(axisDistance.x), lineCoverage(axisDistance.y));
+	vec2 tickDistance = abs(fract(worldPosition / majorSpacing - 0.5f) - 0.5f) * majorSpacing / pixelSize;
+	float xTicks = axisDistance.y < tickPixels ? lineCoverage(tickDistance.x) : 0.0f;
+	float yTicks = axisDistance.x < tickPixels ? lineCoverage(tickDistance.y) : 0.0f;
+	axes = max(axes, max(xTicks, yTicks));
+
+	vec3 color = mix(gridColor, axisColor, axes);
+	float alpha = max(grid, axes);
+	if (alpha <= 0.0f) {
+		discard;
+	}
+	FragColor = vec4(color, alpha);
+}
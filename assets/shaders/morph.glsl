@@ -1,7 +1,8 @@
 #shader vertex
-#version 330 core
-layout(location = 0) in vec3 startPos;
-layout(location = 1) in vec3 endPos;
+#version 430 core
+// Blends two keyframes of a MorphSequence. The curve has no vertex attributes, each instance is the segment
+// between vertices gl_InstanceID and gl_InstanceID + 1, which are read from the keyframes buffer. The segment
+// is expanded into a quad in screen space in the same way as in thick_line.glsl.
 
 layout(std140, binding = 0) uniform ProjectionView
 {
@@ -9,16 +10,81 @@ layout(std140, binding = 0) uniform ProjectionView
 	mat4 model;
 };
 
-uniform float lerpCoeff;
+// Filled from Morph::UniformBlock
+layout(std140, binding = 1) uniform Material
+{
+	vec4 color;
+	int fromKeyframe;
+	int toKeyframe;
+	float lerpCoeff;
+	float lineWidth;
+	vec2 viewportSize;
+};
+
+// Matches MorphSequence::KeyframesHeader followed by the vertices of all keyframes one after another
+layout(std430, binding = 2) readonly buffer Keyframes
+{
+	int vertexCount;
+	vec4 vertices[];
+};
+
+flat out vec2 startPixel;
+flat out vec2 endPixel;
+flat out vec4 vertexColor;
+flat out float halfWidth;
+
+vec3 blendedVertex(int index) {
+	vec3 fromPos = vertices[fromKeyframe * vertexCount + index].xyz;
+	vec3 toPos = vertices[toKeyframe * vertexCount + index].xyz;
+	return mix(fromPos, toPos, lerpCoeff);
+}
+
+vec2 toPixels(vec4 clip) {
+	return (clip.xy / clip.w * 0.5f + 0.5f) * viewportSize;
+}
 
 void main() {
-	vec3 mixedPos = mix(startPos, endPos, lerpCoeff);
-	gl_Position = projectionView * model * vec4(mixedPos, 1.0f);
+	vec4 startClip = projectionView * model * vec4(blendedVertex(gl_InstanceID), 1.0f);
+	vec4 endClip = projectionView * model * vec4(blendedVertex(gl_InstanceID + 1), 1.0f);
+	startPixel = toPixels(startClip);
+	endPixel = toPixels(endClip);
+	vertexColor = color;
+	halfWidth = lineWidth * 0.5f;
+
+	vec2 delta = endPixel - startPixel;
+	float segmentLength = length(delta);
+	vec2 direction = segmentLength > 0.0f ? delta / segmentLength : vec2(1.0f, 0.0f);
+	vec2 normal = vec2(-direction.y, direction.x);
+	float radius = halfWidth + 1.0f;
+
+	// Two triangles: (0, 1, 2) and (2, 1, 3) where corner bit 0 selects the end and bit 1 the side
+	const int corners[6] = int[6](0, 1, 2, 2, 1, 3);
+	int corner = corners[gl_VertexID];
+	float alongEnd = float(corner & 1);
+	float side = (corner & 2) != 0 ? 1.0f : -1.0f;
+	vec2 pixel = mix(startPixel - direction * radius, endPixel + direction * radius, alongEnd) + normal * side * radius;
+
+	float depth = mix(startClip.z / startClip.w, endClip.z / endClip.w, alongEnd);
+	gl_Position = vec4(pixel / viewportSize * 2.0f - 1.0f, depth, 1.0f);
 }
 
 #shader fragment
-#version 330 core
+#version 430 core
+flat in vec2 startPixel;
+flat in vec2 endPixel;
+flat in vec4 vertexColor;
+flat in float halfWidth;
 out vec4 FragColor;
+
 void main() {
-	FragColor = vec4(1.0f, 0.0f, 0.0f, 1.0f);
-}
\ No newline at end of file
+	// Distance in pixels from the center of the fragment to the segment
+	vec2 delta = endPixel - startPixel;
+	float lengthSquared = dot(delta, delta);
+	float t = lengthSquared > 0.0f ? clamp(dot(gl_FragCoord.xy - startPixel, delta) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+	float distanceToSegment = length(gl_FragCoord.xy - (startPixel + t * delta));
+	float coverage = clamp(halfWidth + 0.5f - distanceToSegment, 0.0f, 1.0f);
+	if (coverage <= 0.0f) {
+		discard;
+	}
+	FragColor = vec4(vertexColor.rgb, vertexColor.a * coverage);
+}
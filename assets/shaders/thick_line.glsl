@@ -0,0 +1,76 @@
+#shader vertex
+#version 420 core
+// Each instance is one segment of a polyline. The segment is expanded into a quad in screen space which
+// covers the segment, round caps of radius width / 2 and one pixel for antialiasing. Caps of consecutive
+// segments overlap and form round joins.
+layout(location = 0) in vec3 segmentStart;
+layout(location = 1) in vec3 segmentEnd;
+layout(location = 2) in vec4 segmentColor;
+layout(location = 3) in float segmentWidth;
+
+layout(std140, binding = 0) uniform ProjectionView
+{
+	mat4 projectionView;
+	mat4 model;
+};
+
+// Filled from ThickLine::UniformBlock
+layout(std140, binding = 1) uniform Material
+{
+	vec2 viewportSize;
+};
+
+flat out vec2 startPixel;
+flat out vec2 endPixel;
+flat out vec4 color;
+flat out float halfWidth;
+
+vec2 toPixels(vec4 clip) {
+	return (clip.xy / clip.w * 0.5f + 0.5f) * viewportSize;
+}
+
+void main() {
+	vec4 startClip = projectionView * model * vec4(segmentStart, 1.0f);
+	vec4 endClip = projectionView * model * vec4(segmentEnd, 1.0f);
+	startPixel = toPixels(startClip);
+	endPixel = toPixels(endClip);
+	color = segmentColor;
+	halfWidth = segmentWidth * 0.5f;
+
+	vec2 delta = endPixel - startPixel;
+	float segmentLength = length(delta);
+	vec2 direction = segmentLength > 0.0f ? delta / segmentLength : vec2(1.0f, 0.0f);
+	vec2 normal = vec2(-direction.y, direction.x);
+	float radius = halfWidth + 1.0f;
+
+	// Two triangles: (0, 1, 2) and (2, 1, 3) where corner bit 0 selects the end and bit 1 the side
+	const int corners[6] = int[6](0, 1, 2, 2, 1, 3);
+	int corner = corners[gl_VertexID];
+	float alongEnd = float(corner & 1);
+	float side = (corner & 2) != 0 ? 1.0f : -1.0f;
+	vec2 pixel = mix(startPixel - direction * radius, endPixel + direction * radius, alongEnd) + normal * side * radius;
+
+	float depth = mix(startClip.z / startClip.w, endClip.z / endClip.w, alongEnd);
+	gl_Position = vec4(pixel / viewportSize * 2.0f - 1.0f, depth, 1.0f);
+}
+
+#shader fragment
+#version 420 core
+flat in vec2 startPixel;
+flat in vec2 endPixel;
+flat in vec4 color;
+flat in float halfWidth;
+out vec4 FragColor;
+
+void main() {
+	// Distance in pixels from the center of the fragment to the segment
+	vec2 delta = endPixel - startPixel;
+	float lengthSquared = dot(delta, delta);
+	float t = lengthSquared > 0.0f ? clamp(dot(gl_FragCoord.xy - startPixel, delta) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+	float distanceToSegment = length(gl_FragCoord.xy - (startPixel + t * delta));
+	float coverage = clamp(halfWidth + 0.5f - distanceToSegment, 0.0f, 1.0f);
+	if (coverage <= 0.0f) {
+		discard;
+	}
+	FragColor = vec4(color.rgb, color.a * coverage);
+}
@@ -0,0 +1,479 @@
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "error_code.h"
+#include "glutils.h"
+#include "context.h"
+#include "expression.h"
+#include "frame_sink.h"
+#include "geometry_primitives.h"
+#include "data_series.h"
+#include "profiler.h"
+
+MathViz::Context ctx;
+
+#define EXIT_ON_ERROR_CODE(_Err) \
+{ \
+	const EC::ErrorCode& err = _Err; \
+	if(err.hasError()) { \
+		logError(err.getMessage(), __LINE__); \
+		std::exit(err.getStatus()); \
+	} \
+}
+
+void logError(const char* error, int line) {
+	printf("[Error] %d %s\n", line, error);
+}
+
+void printUsage() {
+	printf(
+		"Usage: mathviz_bench [options]\n"
+		"  --filter <text>         Run only the benchmarks whose name contains the text\n"
+		"  --output <path>         Write the results as JSON to the file instead of the standard output\n"
+		"  --min-time <seconds>    The minimal time spent in each benchmark, default 0.5\n"
+		"  --size <width>x<height> The size of the frames in the frame benchmarks, default 1280x720\n"
+		"  --list                  Print the names of the benchmarks without running them\n"
+	);
+}
+
+/// Expressions of the kind which are typed in the plot window, from trivial to deeply nested
+static const char* expressionCorpus[] = {
+	"x",
+	"sin(x)",
+	"x^2 + 3*x - 5",
+	"(x^3 - 2*x) / (1 + x^4)",
+	"sin(x) * cos(2*x) + sqrt(x*x + 1)",
+	"sin(x^2) / (x + 0.1) - cos(3*x) * cos(3*x)",
+	"sin(sin(sin(sin(x)))) + cos(cos(cos(x)))",
+	"1 + x + x^2/2 + x^3/6 + x^4/24 + x^5/120 + x^6/720 + x^7/5040 + x^8/40320 + x^9/362880 + x^10/3628800",
+};
+
+/// Drop all rendered frames, so the frame benchmarks measure only the rendering and the readback
+class NullFrameSink : public MathViz::IFrameSink {
+public:
+	EC::ErrorCode begin(int, int) override {
+		return EC::ErrorCode();
+	}
+	EC::ErrorCode writeFrame(const unsigned char*, int) override {
+		return EC::ErrorCode();
+	}
+	EC::ErrorCode end() override {
+		return EC::ErrorCode();
+	}
+};
+
+/// Runs each benchmark repeatedly until it took at least the minimal time and collects the statistics of the
+/// iterations. Each iteration is timed separately, so a benchmark should do enough work in one iteration to
+/// make the cost of reading the clock negligible, e.g. evaluate thousands of points instead of one.
+class BenchmarkRunner {
+public:
+	enum Flags {
+		None = 0,
+		/// Wait for the GPU at the end of each iteration, so the time includes the GL commands it issued
+		SyncGPU = 1,
+		/// The benchmark calls Profiler::beginFrame and endFrame itself
+		OwnsFrames = 2
+	};
+
+	BenchmarkRunner(std::string filter, double minTime, bool listOnly) :
+		filter(std::move(filter)),
+		minTime(minTime),
+		listOnly(listOnly)
+	{ }
+
+	/// @param[in] name Unique name of the benchmark, used to compare the results of different runs
+	/// @param[in] items The number of items processed by one iteration (points, vertices, frames), used to
+	/// compute the throughput
+	/// @param[in] flags Combination of Flags
+	/// @param[in] f Function with no arguments which runs one iteration and returns EC::ErrorCode
+	template<typename FuncT>
+	EC::ErrorCode run(const char* name, int64_t items, int flags, FuncT&& f) {
+		if (!filter.empty() && strstr(name, filter.c_str()) == nullptr) {
+			return EC::ErrorCode();
+		}
+		if (listOnly) {
+			printf("%s\n", name);
+			return EC::ErrorCode();
+		}
+		// The first iteration warms up the caches and lets the driver finish lazy allocations
+		RETURN_ON_ERROR_CODE(runIteration(flags, f));
+
+		std::vector<double> times;
+		double total = 0.0;
+		while ((total < minTime || int(times.size()) < MinIterations) && int(times.size()) < MaxIterations) {
+			MathViz::Profiler& profiler = MathViz::Profiler::getInstance();
+			if (!(flags & OwnsFrames)) {
+				profiler.beginFrame();
+			}
+			const auto start = std::chrono::steady_clock::now();
+			RETURN_ON_ERROR_CODE(runIteration(flags, f));
+			const auto end = std::chrono::steady_clock::now();
+			// Without frames the profiler would keep the events of all iterations
+			if (!(flags & OwnsFrames)) {
+				profiler.endFrame();
+			}
+			const double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+			times.push_back(ns);
+			total += ns * 1e-9;
+		}
+
+		Result result;
+		result.name = name;
+		result.items = items;
+		result.iterations = int64_t(times.size());
+		std::sort(times.begin(), times.end());
+		result.minNs = times.front();
+		result.maxNs = times.back();
+		result.medianNs = times.size() % 2 ?
+			times[times.size() / 2] :
+			0.5 * (times[times.size() / 2 - 1] + times[times.size() / 2]);
+		result.meanNs = total * 1e9 / times.size();
+		results.push_back(result);
+		fprintf(stderr, "%-60s %12.0f ns (median of %lld)\n", name, result.medianNs, (long long)result.iterations);
+		return EC::ErrorCode();
+	}
+
+	/// @returns true if the benchmarks are only listed, so they do not need their data
+	bool isListing() const {
+		return listOnly;
+	}
+
+	/// Write the results and the description of the machine as JSON
+	EC::ErrorCode writeJSON(FILE* file) const {
+		char date[32] = {};
+		const std::time_t now = std::time(nullptr);
+		std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+		const char* vendor = reinterpret_cast<const char*>(glGetString(GL_VENDOR));
+		const char* renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+		const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+		fprintf(file, "{\n\t\"context\": {\n");
+		fprintf(file, "\t\t\"date\": \"%s\",\n", date);
+		fprintf(file, "\t\t\"gl_vendor\": \"%s\",\n", escape(vendor).c_str());
+		fprintf(file, "\t\t\"gl_renderer\": \"%s\",\n", escape(renderer).c_str());
+		fprintf(file, "\t\t\"gl_version\": \"%s\",\n", escape(version).c_str());
+		fprintf(file, "\t\t\"threads\": %d,\n", ctx.getThreadPool().getThreadCount());
+		fprintf(file, "\t\t\"min_time_s\": %g\n", minTime);
+		fprintf(file, "\t},\n\t\"benchmarks\": [");
+		for (size_t i = 0; i < results.size(); ++i) {
+			const Result& r = results[i];
+			fprintf(file, "%s\n\t\t{\n", i ? "," : "");
+			fprintf(file, "\t\t\t\"name\": \"%s\",\n", escape(r.name.c_str()).c_str());
+			fprintf(file, "\t\t\t\"iterations\": %lld,\n", (long long)r.iterations);
+			fprintf(file, "\t\t\t\"items_per_iteration\": %lld,\n", (long long)r.items);
+			fprintf(file, "\t\t\t\"mean_ns\": %.1f,\n", r.meanNs);
+			fprintf(file, "\t\t\t\"median_ns\": %.1f,\n", r.medianNs);
+			fprintf(file, "\t\t\t\"min_ns\": %.1f,\n", r.minNs);
+			fprintf(file, "\t\t\t\"max_ns\": %.1f,\n", r.maxNs);
+			fprintf(file, "\t\t\t\"items_per_second\": %.1f\n", r.items * 1e9 / r.medianNs);
+			fprintf(file, "\t\t}");
+		}
+		fprintf(file, "\n\t]\n}\n");
+		if (ferror(file)) {
+			return EC::ErrorCode(-1, "Failed to write the benchmark results");
+		}
+		return EC::ErrorCode();
+	}
+private:
+	struct Result {
+		std::string name;
+		int64_t iterations;
+		int64_t items;
+		double meanNs;
+		double medianNs;
+		double minNs;
+		double maxNs;
+	};
+	static constexpr int MinIterations = 5;
+	static constexpr int MaxIterations = 1000000;
+
+	template<typename FuncT>
+	static EC::ErrorCode runIteration(int flags, FuncT& f) {
+		RETURN_ON_ERROR_CODE(f());
+		if (flags & SyncGPU) {
+			RETURN_ON_GL_ERROR(glFinish());
+		}
+		return EC::ErrorCode();
+	}
+
+	static std::string escape(const char* str) {
+		std::string result;
+		for (; str != nullptr && *str; ++str) {
+			if (*str == '"' || *str == '\\') {
+				result += '\\';
+			}
+			if (static_cast<unsigned char>(*str) >= 0x20) {
+				result += *str;
+			}
+		}
+		return result;
+	}
+
+	std::string filter;
+	double minTime;
+	bool listOnly;
+	std::vector<Result> results;
+};
+
+/// Name of a benchmark with a parameter e.g. "Curve::init/1024"
+static std::string benchName(const char* base, const char* parameter) {
+	return std::string(base) + "/" + parameter;
+}
+
+static std::string benchName(const char* base, int64_t parameter) {
+	return benchName(base, std::to_string(parameter).c_str());
+}
+
+static EC::ErrorCode runExpressionBenchmarks(BenchmarkRunner& runner) {
+	const int batchSize = 4096;
+	std::vector<float> xs(batchSize);
+	std::vector<float> ys(batchSize);
+	for (int i = 0; i < batchSize; ++i) {
+		xs[i] = -5.0f + 10.0f * i / (batchSize - 1);
+	}
+
+	for (const char* source : expressionCorpus) {
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Expression::init", source).c_str(), 1, BenchmarkRunner::None, [&]() {
+			MathViz::Expression e;
+			return e.init(source);
+		}));
+
+		MathViz::Expression e;
+		RETURN_ON_ERROR_CODE(e.init(source));
+		MathViz::Expression::Evaluator evaluator;
+		RETURN_ON_ERROR_CODE(e.bind({'x'}, evaluator));
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Expression::evaluate", source).c_str(), batchSize, BenchmarkRunner::None, [&]() {
+			for (int i = 0; i < batchSize; ++i) {
+				ys[i] = evaluator.evaluate(&xs[i]);
+			}
+			return EC::ErrorCode();
+		}));
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Expression::evaluateBatch", source).c_str(), batchSize, BenchmarkRunner::None, [&]() {
+			e.evaluateBatch(xs.data(), ys.data(), batchSize);
+			return EC::ErrorCode();
+		}));
+	}
+
+	// One frame of an animated plot: the parameters are substituted and only the part which depends on x
+	// is evaluated for each sample, compared to evaluating the parameters for each sample
+	const char* animated = "sin(x - t) * sqrt(a*a + b*b) + cos(2*t) * a";
+	const char parameterNames[] = "tab";
+	const float parameterValues[] = {0.5f, 1.5f, -2.0f};
+	MathViz::Expression e;
+	RETURN_ON_ERROR_CODE(e.init(animated));
+	std::vector<std::vector<float>> parameterColumns(e.getVariableCount(), std::vector<float>(batchSize));
+	std::vector<const float*> slots(e.getVariableCount());
+	for (int i = 0; i < int(sizeof(parameterValues) / sizeof(float)); ++i) {
+		const int slot = e.getVariableSlot(parameterNames[i]);
+		if (slot != -1) {
+			std::fill(parameterColumns[slot].begin(), parameterColumns[slot].end(), parameterValues[i]);
+		}
+	}
+	for (int i = 0; i < e.getVariableCount(); ++i) {
+		slots[i] = parameterColumns[i].data();
+	}
+	slots[e.getVariableSlot('x')] = xs.data();
+	RETURN_ON_ERROR_CODE(runner.run(benchName("Expression::evaluateBatch/parameters", animated).c_str(), batchSize, BenchmarkRunner::None, [&]() {
+		e.evaluateBatch(slots.data(), ys.data(), batchSize);
+		return EC::ErrorCode();
+	}));
+	MathViz::Expression specialized;
+	RETURN_ON_ERROR_CODE(runner.run(benchName("Expression::specialize+evaluateBatch", animated).c_str(), batchSize, BenchmarkRunner::None, [&]() {
+		RETURN_ON_ERROR_CODE(e.specialize(parameterNames, parameterValues, specialized));
+		specialized.evaluateBatch(xs.data(), ys.data(), batchSize);
+		return EC::ErrorCode();
+	}));
+	return EC::ErrorCode();
+}
+
+static EC::ErrorCode runGeometryBenchmarks(BenchmarkRunner& runner) {
+	const int flags = BenchmarkRunner::SyncGPU;
+	const MathViz::Range2D xRange(-5, 5);
+	const MathViz::Range2D yRange(-5, 5);
+	const auto f = [](float x) -> float {
+		return std::sin(x) * std::cos(2.0f * x);
+	};
+
+	for (int n : {1 << 10, 1 << 14, 1 << 18}) {
+		MathViz::Plot2D plot;
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Plot2D::init", n).c_str(), n, flags, [&]() {
+			return plot.init(f, xRange, yRange, 2.0f, n);
+		}));
+
+		// Pan by a tenth of the view, only the exposed strip is evaluated and uploaded
+		float offset = 0.0f;
+		RETURN_ON_ERROR_CODE(plot.init(f, xRange, yRange, 2.0f, n));
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Plot2D::setView/pan", n).c_str(), n / 10, flags, [&]() {
+			offset += 1.0f;
+			return plot.setView(MathViz::Range2D(xRange.from + offset, xRange.to + offset), n);
+		}));
+
+		std::vector<glm::vec3> vertices(n);
+		for (int i = 0; i < n; ++i) {
+			const float x = xRange.from + xRange.getLength() * i / (n - 1);
+			vertices[i] = glm::vec3(x, f(x), 0.0f);
+		}
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Plot2D::resetVertices", n).c_str(), n, flags, [&]() {
+			return plot.resetVertices(vertices);
+		}));
+	}
+
+	for (float dh : {0.1f, 0.01f, 0.001f}) {
+		MathViz::ReimanArea area;
+		const int64_t barCount = int64_t(xRange.getLength() / dh);
+		RETURN_ON_ERROR_CODE(runner.run(benchName("ReimanArea::init", barCount).c_str(), barCount, flags, [&]() {
+			return area.init(f, xRange, dh);
+		}));
+	}
+
+	for (int n : {100, 1 << 12, 1 << 16}) {
+		MathViz::Curve circle;
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Curve::init", n).c_str(), n, BenchmarkRunner::None, [&]() {
+			circle.init(MathViz::circleEquation, n, MathViz::Curve::IsClosed);
+			return EC::ErrorCode();
+		}));
+
+		MathViz::Curve square;
+		square.init(MathViz::squareEquation, n, MathViz::Curve::IsClosed);
+		MathViz::Morph2D morph;
+		RETURN_ON_ERROR_CODE(runner.run(benchName("Morph2D::init", n).c_str(), n, flags, [&]() {
+			return morph.init(circle, square);
+		}));
+
+		MathViz::MorphSequence sequence;
+		RETURN_ON_ERROR_CODE(runner.run(benchName("MorphSequence::init", n).c_str(), n, flags, [&]() {
+			return sequence.init({&circle, &square}, n);
+		}));
+	}
+	return EC::ErrorCode();
+}
+
+static EC::ErrorCode runDataSeriesBenchmarks(BenchmarkRunner& runner) {
+	// The series is written to the working directory, together with its pyramid
+	const char* path = "mathviz_bench_series.f32";
+	const std::string pyramidPath = std::string(path) + ".minmax";
+	const int64_t sampleCount = int64_t(1) << 24;
+	const bool createData = !runner.isListing();
+	if (createData) {
+		FILE* file = fopen(path, "wb");
+		if (file == nullptr) {
+			return EC::ErrorCode(-1, "Cannot create %s", path);
+		}
+		std::vector<float> chunk(1 << 16);
+		for (int64_t first = 0; first < sampleCount; first += int64_t(chunk.size())) {
+			for (size_t i = 0; i < chunk.size(); ++i) {
+				const float x = float(first + int64_t(i)) * 1e-4f;
+				chunk[i] = std::sin(x) + 0.1f * std::sin(37.0f * x);
+			}
+			fwrite(chunk.data(), sizeof(float), chunk.size(), file);
+		}
+		fclose(file);
+	}
+
+	MathViz::DataSeries series;
+	RETURN_ON_ERROR_CODE(runner.run(benchName("DataSeries::init/build", sampleCount).c_str(), sampleCount, BenchmarkRunner::None, [&]() {
+		remove(pyramidPath.c_str());
+		return series.init(path, 0.0, 1.0);
+	}));
+
+	// The view has all samples or a tenth of them, panning moves it by a hundredth of the samples
+	MathViz::DataSeriesPlot plot;
+	if (createData) {
+		RETURN_ON_ERROR_CODE(series.init(path, 0.0, 1.0));
+		RETURN_ON_ERROR_CODE(plot.init(series, 1.0f));
+	}
+	const float length = float(sampleCount);
+	for (int columns : {1280, 3840}) {
+		RETURN_ON_ERROR_CODE(runner.run(benchName("DataSeriesPlot::setView/all", columns).c_str(), columns, BenchmarkRunner::None, [&]() {
+			return plot.setView(MathViz::Range2D(0.0f, length), columns);
+		}));
+		float offset = 0.0f;
+		RETURN_ON_ERROR_CODE(runner.run(benchName("DataSeriesPlot::setView/pan", columns).c_str(), columns, BenchmarkRunner::None, [&]() {
+			offset = offset + 0.01f * length > 0.9f * length ? 0.0f : offset + 0.01f * length;
+			return plot.setView(MathViz::Range2D(offset, offset + 0.1f * length), columns);
+		}));
+	}
+	plot.freeMem();
+	series.freeMem();
+	if (createData) {
+		remove(pyramidPath.c_str());
+		remove(path);
+	}
+	return EC::ErrorCode();
+}
+
+static EC::ErrorCode runFrameBenchmarks(BenchmarkRunner& runner, int width, int height) {
+	char size[32];
+	snprintf(size, sizeof(size), "%dx%d", width, height);
+
+	// The animation of the grid, the morph and the Reiman sum, which is also used for the video export.
+	// One iteration renders and reads back all frames, the buffers are created once per iteration.
+	NullFrameSink sink;
+	for (int frameCount : {1, 60}) {
+		const std::string name = benchName(benchName("Frame/animation", size).c_str(), frameCount);
+		const int flags = BenchmarkRunner::SyncGPU | BenchmarkRunner::OwnsFrames;
+		RETURN_ON_ERROR_CODE(runner.run(name.c_str(), frameCount, flags, [&]() {
+			return ctx.renderAnimation(sink, frameCount);
+		}));
+	}
+	return EC::ErrorCode();
+}
+
+int main(int argc, char** argv) {
+	std::string filter;
+	const char* outputPath = nullptr;
+	double minTime = 0.5;
+	bool listOnly = false;
+	int width = 1280;
+	int height = 720;
+	for (int i = 1; i < argc; ++i) {
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--filter") == 0 && hasValue) {
+			filter = argv[++i];
+		} else if (strcmp(argv[i], "--output") == 0 && hasValue) {
+			outputPath = argv[++i];
+		} else if (strcmp(argv[i], "--min-time") == 0 && hasValue) {
+			minTime = std::atof(argv[++i]);
+		} else if (strcmp(argv[i], "--size") == 0 && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+				printUsage();
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--list") == 0) {
+			listOnly = true;
+		} else {
+			printUsage();
+			return 1;
+		}
+	}
+
+	EXIT_ON_ERROR_CODE(ctx.init(width, height, true));
+	BenchmarkRunner runner(filter, minTime, listOnly);
+	EXIT_ON_ERROR_CODE(runExpressionBenchmarks(runner));
+	EXIT_ON_ERROR_CODE(runGeometryBenchmarks(runner));
+	EXIT_ON_ERROR_CODE(runDataSeriesBenchmarks(runner));
+	EXIT_ON_ERROR_CODE(runFrameBenchmarks(runner, width, height));
+
+	if (!listOnly) {
+		FILE* file = outputPath ? fopen(outputPath, "w") : stdout;
+		if (file == nullptr) {
+			logError("Failed to open the output file", __LINE__);
+			return 1;
+		}
+		const EC::ErrorCode writeErr = runner.writeJSON(file);
+		if (file != stdout) {
+			fclose(file);
+		}
+		EXIT_ON_ERROR_CODE(writeErr);
+	}
+	return 0;
+}
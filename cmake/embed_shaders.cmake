@@ -0,0 +1,109 @@
+# Split each registered shader into its stages and write them as constexpr strings into a header, so
+# that the executable does not read or parse shader files. When GLSLANG_VALIDATOR is set each stage
+# is also validated and the build fails on the first shader which does not compile.
+#
+# Run with cmake -P. Lists are passed with | instead of ; as separator.
+#   SOURCE_DIR        - The directory against which the shader paths are resolved
+#   SHADER_PATHS      - The paths of the shaders in the order of ShaderTable
+#   SHADER_ENUMS      - The ShaderTable names of the shaders, used for the stage file names
+#   STAGE_DIR         - Directory where each stage is written as a separate file for the validator
+#   OUTPUT            - The generated header
+#   GLSLANG_VALIDATOR - Optional path to glslangValidator
+cmake_minimum_required(VERSION 3.24)
+
+string(REPLACE "|" ";" SHADER_PATHS "${SHADER_PATHS}")
+string(REPLACE "|" ";" SHADER_ENUMS "${SHADER_ENUMS}")
+file(MAKE_DIRECTORY "${STAGE_DIR}")
+
+# The same delimiter must not appear in the shaders
+set(delimiter "mathviz_glsl")
+set(entries "")
+set(index 0)
+foreach(shader_path ${SHADER_PATHS})
+	list(GET SHADER_ENUMS ${index} shader_enum)
+	math(EXPR index "${index} + 1")
+	file(READ "${SOURCE_DIR}/${shader_path}" content)
+	string(REPLACE "\r\n" "\n" content "${content}")
+
+	set(vertex "")
+	set(fragment "")
+	# Each stage starts with a line #shader <type>, the same convention as GLUtils::Pipeline
+	string(FIND "${content}" "#shader" start)
+	while(NOT start EQUAL -1)
+		string(SUBSTRING "${content}" ${start} -1 content)
+		string(FIND "${content}" "\n" line_end)
+		if(line_end EQUAL -1)
+			message(FATAL_ERROR "${shader_path}: #shader directive without a stage")
+		endif()
+		string(SUBSTRING "${content}" 0 ${line_end} directive)
+		math(EXPR body_start "${line_end} + 1")
+		string(SUBSTRING "${content}" ${body_start} -1 content)
+		string(FIND "${content}" "#shader" start)
+		if(start EQUAL -1)
+			set(body "${content}")
+		else()
+			string(SUBSTRING "${content}" 0 ${start} body)
+		endif()
+
+		string(REGEX MATCH "^#shader[ \t]+([a-z]+)" directive "${directive}")
+		if("${CMAKE_MATCH_1}" STREQUAL "vertex")
+			set(vertex "${body}")
+			set(stage_extension "vert")
+		elseif("${CMAKE_MATCH_1}" STREQUAL "fragment")
+			set(fragment "${body}")
+			set(stage_extension "frag")
+		else()
+			message(FATAL_ERROR "${shader_path}: Unknown shader type: ${CMAKE_MATCH_1}")
+		endif()
+
+		string(FIND "${body}" ")${delimiter}\"" delimiter_position)
+		if(NOT delimiter_position EQUAL -1)
+			message(FATAL_ERROR "${shader_path}: The shader contains )${delimiter}\" which ends the embedded string")
+		endif()
+
+		if(GLSLANG_VALIDATOR)
+			set(stage_path "${STAGE_DIR}/${shader_enum}.${stage_extension}")
+			file(WRITE "${stage_path}" "${body}")
+			execute_process(
+				COMMAND "${GLSLANG_VALIDATOR}" "${stage_path}"
+				RESULT_VARIABLE validator_result
+				OUTPUT_VARIABLE validator_output
+				ERROR_VARIABLE validator_output
+			)
+			if(NOT validator_result EQUAL 0)
+				message(FATAL_ERROR "${shader_path}: ${CMAKE_MATCH_1} shader failed validation\n${validator_output}")
+			endif()
+		endif()
+	endwhile()
+
+	if("${vertex}" STREQUAL "" OR "${fragment}" STREQUAL "")
+		message(FATAL_ERROR "${shader_path}: Embedded shaders must have a vertex and a fragment stage")
+	endif()
+	string(APPEND entries
+		"\t\t// ${shader_path}\n"
+		"\t\t{\n"
+		"\t\t\tR\"${delimiter}(${vertex})${delimiter}\",\n"
+		"\t\t\tR\"${delimiter}(${fragment})${delimiter}\"\n"
+		"\t\t},\n"
+	)
+endforeach()
+
+set(header "")
+string(APPEND header
+	"#pragma once\n"
+	"#include \"shader_bindings.h\"\n"
+	"namespace MathViz {\n"
+	"\t/// The stages of a shader from the shader table, embedded at build time\n"
+	"\tstruct EmbeddedShader {\n"
+	"\t\tconst char* vertex;\n"
+	"\t\tconst char* fragment;\n"
+	"\t};\n"
+	"\tinline constexpr EmbeddedShader embeddedShaders[int(ShaderTable::Count)] = {\n"
+	"${entries}"
+	"\t};\n"
+	"}\n"
+)
+# Keep the timestamp of the header when nothing changed, so that its users are not rebuilt
+file(WRITE "${OUTPUT}.tmp" "${header}")
+file(COPY_FILE "${OUTPUT}.tmp" "${OUTPUT}" ONLY_IF_DIFFERENT)
+file(REMOVE "${OUTPUT}.tmp")
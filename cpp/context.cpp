@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/constants.hpp>
 #include "glutils.h"
 #include "context.h"
 #include "error_code.h"
@@ -14,6 +15,12 @@
 #include "imgui_impl_opengl3.h"
 #include "imgui_stdlib.h"
 #include "expression.h"
+#include "expression_cache.h"
+#include "frame_sink.h"
+#include "plot_evaluator.h"
+#include "data_series.h"
+#include <algorithm>
+#include <tuple>
 
 namespace MathViz {
 
@@ -23,7 +30,8 @@ namespace MathViz {
 			material(nullptr),
 			outlineMaterial(nullptr),
 			geometry(nullptr),
-			flags(0)
+			flags(0),
+			layer(0)
 		{ }
 		enum Flags {
 			None = 0,
@@ -34,6 +42,28 @@ namespace MathViz {
 		IMaterial* outlineMaterial;
 		IGeometry* geometry;
 		unsigned int flags;
+		/// Nodes with lower layer are drawn first. Blended geometry which is behind other geometry
+		/// must be in a lower layer.
+		int layer;
+	};
+
+	/// Order in which the render queue draws the nodes. Nodes which share state are next to each other.
+	struct RenderKey {
+		explicit RenderKey(const Node& node) :
+			layer(node.layer),
+			program(node.material->getProgram().getHandle()),
+			material(node.material),
+			geometry(node.geometry)
+		{ }
+		bool operator<(const RenderKey& other) const {
+			return std::tie(layer, program, material, geometry) <
+				std::tie(other.layer, other.program, other.material, other.geometry);
+		}
+		int layer;
+		GLUtils::ProgramHandle program;
+		const IMaterial* material;
+		/// Each geometry owns its VAO, so this groups the draws which use the same VAO
+		const IGeometry* geometry;
 	};
 
 	static inline void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
@@ -45,6 +75,7 @@ namespace MathViz {
 		window(nullptr, &glfwDestroyWindow),
 		width(0),
 		height(0),
+		headless(false),
 		transforms(ReservedUBOBindings::ProjectionView)
 	{ }
 
@@ -52,9 +83,11 @@ namespace MathViz {
 		freeMem();
 	}
 
-	EC::ErrorCode Context::init(int widthIn, int heightIn) {
+	EC::ErrorCode Context::init(int widthIn, int heightIn, bool headlessIn) {
 		width = widthIn;
 		height = heightIn;
+		headless = headlessIn;
+		RETURN_ON_ERROR_CODE(threadPool.init(-1));
 		const int status = glfwInit();
 		if (status != GLFW_TRUE) {
 			const char* description;
@@ -64,7 +97,18 @@ namespace MathViz {
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
 		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#if GLUTILS_ERROR_CHECK == GLUTILS_ERROR_CHECK_DEBUG_OUTPUT
+		// Some drivers report debug messages only in debug contexts
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+#endif
+		// A hidden window still has a GL context. Headless rendering draws only in offscreen framebuffers.
+		glfwWindowHint(GLFW_VISIBLE, headless ? GLFW_FALSE : GLFW_TRUE);
 		window.reset(glfwCreateWindow(width, height, "mathviz", NULL, NULL));
+		if (window == nullptr) {
+			const char* description;
+			const int errorCode = glfwGetError(&description);
+			return EC::ErrorCode(errorCode, "%s", description);
+		}
 		glfwSetWindowUserPointer(window.get(), this);
 		glfwMakeContextCurrent(window.get());
 		glfwSetFramebufferSizeCallback(window.get(), framebufferSizeCallback);
@@ -72,13 +116,20 @@ namespace MathViz {
 		if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
 			return EC::ErrorCode("Failed to initialize GLAD");
 		}
+		GLUtils::loadExtensions((GLADloadproc)glfwGetProcAddress);
+#if GLUTILS_ERROR_CHECK == GLUTILS_ERROR_CHECK_DEBUG_OUTPUT
+		RETURN_ON_ERROR_CODE(GLUtils::setErrorCheck(GLUtils::ErrorCheck::DebugOutput));
+#endif
 
 		RETURN_ON_ERROR_CODE(loadShaders());
 
-		RETURN_ON_GL_ERROR(glEnable(GL_LINE_SMOOTH));
-		RETURN_ON_GL_ERROR(glHint(GL_LINE_SMOOTH_HINT, GL_NICEST));
-
-		RETURN_ON_GL_ERROR(glEnable(GL_DEPTH_TEST));
+#ifndef NDEBUG
+		GLUtils::StateCache::getCurrent().setStatisticsEnabled(true);
+#endif
+		RETURN_ON_ERROR_CODE(GLUtils::StateCache::getCurrent().setEnabled(GL_DEPTH_TEST, true));
+		// The grid is antialiased with alpha
+		RETURN_ON_GL_ERROR(glEnable(GL_BLEND));
+		RETURN_ON_GL_ERROR(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
 
 		{
 			projection = glm::ortho(-5.f, 5.f, -5.f, 5.f, -5.f, 5.f);
@@ -89,8 +140,12 @@ namespace MathViz {
 			const glm::mat4 pv = projection * view;
 			RETURN_ON_ERROR_CODE(transforms.init(2 * sizeof(glm::mat4), (void*)glm::value_ptr(pv)));
 		}
+		RETURN_ON_ERROR_CODE(materialUniforms.init(ReservedUBOBindings::Material));
 		
-		RETURN_ON_ERROR_CODE(initImgui());
+		RETURN_ON_ERROR_CODE(Profiler::getInstance().init());
+		if (!headless) {
+			RETURN_ON_ERROR_CODE(initImgui());
+		}
 
 		return EC::ErrorCode();
 	}
@@ -130,17 +185,31 @@ namespace MathViz {
 		this->width = width;
 		this->height = height;
 		glViewport(0, 0, width, height);
+		frameScheduler.invalidate();
 	}
 
 	void Context::freeMem() {
 
-		ImGui_ImplOpenGL3_Shutdown();
-		ImGui_ImplGlfw_Shutdown();
-		ImGui::DestroyContext();
+		Profiler::getInstance().freeMem();
+		if (!headless && ImGui::GetCurrentContext() != nullptr) {
+			ImGui_ImplOpenGL3_Shutdown();
+			ImGui_ImplGlfw_Shutdown();
+			ImGui::DestroyContext();
+		}
 
+		materialUniforms.freeMem();
 		materialFactory.freeMem();
 		window.reset();
 		glfwTerminate();
+		threadPool.freeMem();
+	}
+
+	ThreadPool& Context::getThreadPool() {
+		return threadPool;
+	}
+
+	FrameScheduler& Context::getFrameScheduler() {
+		return frameScheduler;
 	}
 
 	EC::ErrorCode Context::mainLoop() {
@@ -150,7 +219,25 @@ namespace MathViz {
 		const auto f = [](float x) -> float {
 			return std::sin(x);
 		};
-		plot.init(f, xRange, yRange, 1.0f, 100);
+		const int plotSampleCount = 100;
+		plot.init(f, xRange, yRange, 1.0f, plotSampleCount);
+
+		// Plots on the CPU are evaluated in the background. The previous plot is drawn until the new one is ready.
+		PlotEvaluator plotEvaluator;
+		RETURN_ON_ERROR_CODE(plotEvaluator.init([this]() {
+			frameScheduler.invalidate();
+		}));
+		PlotEvaluator::Result plotResult;
+		// Results of other requests are ignored, zero is not a valid request id
+		uint64_t plotRequestId = 0;
+		bool showPlotError = false;
+
+		// The same plot evaluated entirely on the GPU. It is used when the expression is plotted on the GPU.
+		const int gpuPlotVertexCount = 1000;
+		MathViz::Plot2D gpuPlot;
+		RETURN_ON_ERROR_CODE(gpuPlot.initProcedural(xRange, yRange, 1.0f, gpuPlotVertexCount));
+		FunctionPlot2D gpuPlotMaterial;
+		gpuPlotMaterial.setSampling(xRange.from, xRange.to, gpuPlotVertexCount);
 
 		FlatColor red = materialFactory.create<FlatColor>(glm::vec3(1.0f, 0.0f, 0.0f));
 		FlatColor blue = materialFactory.create<FlatColor>(glm::vec3{0.0f, 0.0f, 1.0f});
@@ -161,17 +248,77 @@ namespace MathViz {
 			glm::vec3(0.f, 0.5f, 0.8)
 		);
 
+		// Axes and grid cover the whole view behind everything else
+		MathViz::Canvas gridCanvas;
+		RETURN_ON_ERROR_CODE(gridCanvas.init(glm::vec3(-5.0f, -5.0f, -1.0f), glm::vec3(5.0f, 5.0f, -1.0f)));
+		Grid2D grid = materialFactory.create<Grid2D>(glm::vec3(0.4f, 0.4f, 0.4f), glm::vec3(0.9f, 0.9f, 0.9f), 20.0f);
+		Node gridNode;
+		gridNode.material = &grid;
+		gridNode.geometry = &gridCanvas;
+		gridNode.layer = -1;
+
 		Node plotNode;
 		plotNode.material = &red;
 		plotNode.geometry = &plot;
 
+		// All lines which are on the CPU are drawn as thick lines with one draw call. Lines computed on the
+		// GPU (the GPU plot and the morph) are expanded into the same quads by their materials.
+		MathViz::LineBatch lines;
+		RETURN_ON_ERROR_CODE(lines.init());
+		ThickLine lineMaterial = materialFactory.create<ThickLine>();
+		Node linesNode;
+		linesNode.material = &lineMaterial;
+		linesNode.geometry = &lines;
+
+		// Sweep of a * sin(x) for many values of a. All curves share the same samples and differ only by
+		// their transform, the whole sweep is drawn with one indirect draw call.
+		const int sweepCurveCount = 1000;
+		MathViz::CurveBatch sweep;
+		RETURN_ON_ERROR_CODE(sweep.init());
+		{
+			const int sampleCount = 256;
+			std::vector<glm::vec3> samples(sampleCount);
+			for (int i = 0; i < sampleCount; ++i) {
+				const float x = xRange.from + i * xRange.getLength() / (sampleCount - 1);
+				samples[i] = glm::vec3(x, f(x), 0.0f);
+			}
+			const int firstVertex = sweep.addVertices(samples.data(), sampleCount);
+			const int sweepMaterialCount = 16;
+			for (int i = 0; i < sweepMaterialCount; ++i) {
+				const float t = float(i) / (sweepMaterialCount - 1);
+				sweep.addMaterial(glm::vec4(glm::mix(glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(1.0f, 0.0f, 0.0f), t), 1.0f));
+			}
+			for (int i = 0; i < sweepCurveCount; ++i) {
+				const float amplitude = -1.0f + 2.0f * i / (sweepCurveCount - 1);
+				const glm::mat4 transform = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, amplitude, 1.0f));
+				sweep.addDraw(firstVertex, sampleCount, transform, i * sweepMaterialCount / sweepCurveCount, 1.0f);
+			}
+		}
+		RETURN_ON_ERROR_CODE(sweep.upload());
+		BatchedCurve sweepMaterial = materialFactory.create<BatchedCurve>();
+		Node sweepNode;
+		sweepNode.material = &sweepMaterial;
+		sweepNode.geometry = &sweep;
+
+		// Heatmap and implicit curve of f(x, y) evaluated for each pixel, behind the grid
+		MathViz::ScalarField2D field;
+		RETURN_ON_ERROR_CODE(field.init(xRange, yRange, -2.0f));
+		FunctionField2D fieldMaterial;
+		Node fieldNode;
+		fieldNode.material = &fieldMaterial;
+		fieldNode.geometry = &field;
+		fieldNode.layer = -2;
+
+		// Recorded signal from a file, decimated to one min/max pair per pixel column
+		MathViz::DataSeries dataSeries;
+		// The decimated polyline is added to the line batch
+		MathViz::DataSeriesPlot dataPlot;
+
 		MathViz::ReimanArea r;
 		RETURN_ON_ERROR_CODE(r.init(f, xRange, 0.1));
 		Node reimanNode;
 		reimanNode.material = &grad;
 		reimanNode.geometry = &r;
-		reimanNode.outlineMaterial = &red;
-		reimanNode.flags |= Node::Flags::Outline;
 
 		const int morphVerts = 100;
 
@@ -181,9 +328,22 @@ namespace MathViz {
 		MathViz::Curve rect;
 		rect.init(MathViz::squareEquation, morphVerts, MathViz::Curve::IsClosed);
 
-		MathViz::Morph2D morph1, morph2;
-		morph1.init(circle, rect);
-		morph2.init(rect, circle);
+		// The flower has more vertices than the other curves, all keyframes are resampled by arc length
+		MathViz::Curve flower;
+		flower.init([](float t) -> glm::vec3 {
+			const float angle = 2.0f * glm::pi<float>() * t;
+			const float radius = 0.7f + 0.3f * std::cos(5.0f * angle);
+			return {radius * std::cos(angle), radius * std::sin(angle), 0.0f};
+		}, 3 * morphVerts, MathViz::Curve::IsClosed);
+
+		// Circle, square and flower morphed one into another on the GPU, the keyframes are uploaded once
+		MathViz::MorphSequence morphSequence;
+		RETURN_ON_ERROR_CODE(morphSequence.init({&circle, &rect, &flower}, 4 * morphVerts));
+		Morph morphMaterial = materialFactory.create<Morph>(glm::vec4(1.0f, 1.0f, 0.0f, 1.0f));
+		morphMaterial.setLineWidth(3.0f);
+		Node morphNode;
+		morphNode.material = &morphMaterial;
+		morphNode.geometry = &morphSequence;
 
 		const float fov = 45.0f;
 
@@ -197,12 +357,66 @@ namespace MathViz {
 		ImVec4 clear_color = ImVec4(0.0f, 0.0f, 0.0f, 1.00f);
 		std::string expressionText;
 		float plotThickness = 1.0f;
+		bool evaluateOnGPU = false;
+		bool adaptiveSampling = false;
+		bool showSweep = false;
+		std::string fieldText;
+		bool showField = false;
+		float fieldRange = 1.0f;
+		float fieldOpacity = 0.8f;
+		float fieldContourWidth = 2.0f;
+		std::string dataPath;
+		int dataCSVColumn = 0;
+		bool dataCSVHeader = true;
+		bool showData = false;
+		// The number of columns of the last decimation, zero when the data must be decimated again
+		int dataColumns = 0;
+		bool showProfiler = false;
+		bool showMorph = false;
+		bool continuousRendering = false;
 		ImGuiIO& io = ImGui::GetIO(); (void)io;
 
+		// Nothing is rendered while the scene does not change. The loop wakes up on input and at least
+		// once per idleTimeout.
+		const double idleTimeout = 0.5;
+		// Each morph from one keyframe to the next one takes morphTransitionTime seconds
+		const float morphTransitionTime = 2.0f;
+		FrameScheduler::TimelineId morphTimeline = FrameScheduler::InvalidTimeline;
+		FrameScheduler::TimelineId profilerTimeline = FrameScheduler::InvalidTimeline;
+		// Variables other than x, y in the plotted expressions are parameters which can change every frame.
+		// On the GPU they are uniforms, on the CPU they are substituted before sampling.
+		static constexpr char parameterNames[] = "tab";
+		constexpr int parameterCount = sizeof(parameterNames) - 1;
+		float parameters[parameterCount] = {0.0f, 1.0f, 1.0f};
+		// The time t is the time of the timeline plus the time when the animation was paused
+		bool animateTime = false;
+		float pausedTime = 0.0f;
+		FrameScheduler::TimelineId timeTimeline = FrameScheduler::InvalidTimeline;
+		// The request of the CPU plot is sent again when the parameters in it change
+		PlotEvaluator::Request cpuPlotRequest;
+		bool cpuPlotHasParameters = false;
+		// The line batch is built again only when the lines in it change
+		bool linesDirty = true;
 
 		EC::ErrorCode runtimeErr;
 		while (!glfwWindowShouldClose(window.get())) {
-			glfwPollEvents();
+			frameScheduler.setContinuous(continuousRendering);
+			if (!frameScheduler.waitForFrame(idleTimeout)) {
+				continue;
+			}
+			Profiler::getInstance().beginFrame();
+
+			if (plotEvaluator.takeResult(plotResult) && plotResult.requestId == plotRequestId) {
+				if (plotResult.error.hasError()) {
+					runtimeErr = plotResult.error;
+					showPlotError = true;
+				} else {
+					plotNode.material = &red;
+					plotNode.geometry = &plot;
+					RETURN_ON_ERROR_CODE(plot.resetVertices(std::move(plotResult.vertices)));
+					linesDirty = true;
+				}
+			}
 
 			// Start the Dear ImGui frame
 			ImGui_ImplOpenGL3_NewFrame();
@@ -210,6 +424,7 @@ namespace MathViz {
 			ImGui::NewFrame();
 
 			{
+				MATHVIZ_PROFILE_CPU("ImGui UI");
 				const bool collapsed = ImGui::Begin("MathViz!");
 
 				ImGui::ColorEdit3("clear color", (float*)&clear_color);
@@ -219,27 +434,160 @@ namespace MathViz {
 					1000.0f / ImGui::GetIO().Framerate,
 					ImGui::GetIO().Framerate
 				);
+#ifndef NDEBUG
+				{
+					GLUtils::StateCache& stateCache = GLUtils::StateCache::getCurrent();
+					ImGui::Text(
+						"GL state changes %lld issued, %lld elided",
+						(long long)stateCache.getStatistics().issued,
+						(long long)stateCache.getStatistics().elided
+					);
+					stateCache.resetStatistics();
+				}
+#endif
 				ImGui::InputText("Function", &expressionText);
+				ImGui::Checkbox("Evaluate on GPU", &evaluateOnGPU);
+				ImGui::Checkbox("Adaptive sampling", &adaptiveSampling);
+				ImGui::Checkbox("Parameter sweep", &showSweep);
+				ImGui::Checkbox("Profiler", &showProfiler);
+				if (ImGui::Checkbox("Morph", &showMorph)) {
+					if (showMorph) {
+						morphTimeline = frameScheduler.startTimeline(0.0);
+					} else {
+						frameScheduler.stopTimeline(morphTimeline);
+					}
+				}
+				ImGui::Checkbox("Continuous rendering", &continuousRendering);
+				ImGui::Text("Rendered frames: %lld", (long long)frameScheduler.getRenderedFrameCount());
 
 				bool expressionErrorPopupOpen;
 				if (ImGui::Button("Plot")) {
-					MathViz::Expression expr;
-					runtimeErr = expr.init(expressionText.c_str());
+					linesDirty = true;
+					std::shared_ptr<const MathViz::Expression> cachedExpression;
+					runtimeErr = ExpressionCache::getInstance().get(expressionText.c_str(), cachedExpression);
+					// The plot supports only functions of x and the parameters
+					MathViz::Expression::Evaluator evaluator;
+					if (!runtimeErr.hasError()) {
+						runtimeErr = cachedExpression->bind({'x', 't', 'a', 'b'}, evaluator);
+					}
+					if (!runtimeErr.hasError() && evaluateOnGPU) {
+						runtimeErr = gpuPlotMaterial.init(*cachedExpression, red.getColor());
+					}
 					if (runtimeErr.hasError()) {
 						ImGui::OpenPopup("Expression error");
 						expressionErrorPopupOpen = true;
+					} else if (evaluateOnGPU) {
+						expressionErrorPopupOpen = false;
+						plotNode.material = &gpuPlotMaterial;
+						plotNode.geometry = &gpuPlot;
+						// A CPU plot which is still evaluated must not replace this one
+						plotRequestId = 0;
+						cpuPlotHasParameters = false;
 					} else {
 						expressionErrorPopupOpen = false;
-						plot.reset([&expr](float x) {
-							std::unordered_map<char, float> vals;
-							vals['x'] = x;
-							float res;
-							expr.evaluate(&vals, res);
-							return res;
+						cpuPlotRequest = PlotEvaluator::Request();
+						cpuPlotRequest.expression = cachedExpression;
+						cpuPlotRequest.xRange = xRange;
+						cpuPlotRequest.sampleCount = plotSampleCount;
+						// Keep the curve within half a pixel of the function
+						cpuPlotRequest.tolerance = adaptiveSampling ? 0.5f * xRange.getLength() / width : 0.0f;
+						cpuPlotRequest.parameterNames = parameterNames;
+						cpuPlotRequest.parameterValues.assign(parameters, parameters + parameterCount);
+						cpuPlotHasParameters = std::any_of(parameterNames, parameterNames + parameterCount, [&](char name) {
+							return cachedExpression->getVariableSlot(name) != -1;
 						});
+						plotRequestId = plotEvaluator.submit(cpuPlotRequest);
 					}
 				}
 
+				if (ImGui::Checkbox("Animate t", &animateTime)) {
+					if (animateTime) {
+						timeTimeline = frameScheduler.startTimeline(0.0);
+					} else {
+						pausedTime = parameters[0];
+						frameScheduler.stopTimeline(timeTimeline);
+					}
+				}
+				if (animateTime) {
+					parameters[0] = pausedTime + float(frameScheduler.getTimelineTime(timeTimeline));
+				}
+				ImGui::SameLine();
+				ImGui::Text("t = %.2f", parameters[0]);
+				ImGui::SliderFloat("a", &parameters[1], -5.0f, 5.0f);
+				ImGui::SliderFloat("b", &parameters[2], -5.0f, 5.0f);
+
+				ImGui::InputText("Field f(x, y)", &fieldText);
+				if (ImGui::Button("Draw field")) {
+					std::shared_ptr<const MathViz::Expression> cachedExpression;
+					runtimeErr = ExpressionCache::getInstance().get(fieldText.c_str(), cachedExpression);
+					if (!runtimeErr.hasError()) {
+						runtimeErr = fieldMaterial.init(*cachedExpression);
+					}
+					if (runtimeErr.hasError()) {
+						ImGui::OpenPopup("Expression error");
+						expressionErrorPopupOpen = true;
+					} else {
+						showField = true;
+					}
+				}
+				if (showField) {
+					ImGui::SameLine();
+					if (ImGui::Button("Hide field")) {
+						showField = false;
+					}
+					ImGui::SliderFloat("Heatmap range", &fieldRange, 0.01f, 100.0f, "%.2f", ImGuiSliderFlags_Logarithmic);
+					ImGui::SliderFloat("Heatmap opacity", &fieldOpacity, 0.0f, 1.0f);
+					ImGui::SliderFloat("Zero level width", &fieldContourWidth, 0.0f, 10.0f);
+				}
+
+				ImGui::InputText("Data file", &dataPath);
+				ImGui::InputInt("CSV column", &dataCSVColumn);
+				ImGui::Checkbox("CSV header", &dataCSVHeader);
+				if (ImGui::Button("Load data")) {
+					// CSV files are converted to a binary file next to them, other files must be arrays of floats
+					std::string binaryPath = dataPath;
+					const bool isCSV = dataPath.size() > 4 && dataPath.compare(dataPath.size() - 4, 4, ".csv") == 0;
+					runtimeErr = EC::ErrorCode();
+					if (isCSV) {
+						binaryPath += ".f32";
+						runtimeErr = MathViz::DataSeries::convertCSV(dataPath.c_str(), std::max(dataCSVColumn, 0), dataCSVHeader, binaryPath.c_str());
+					}
+					if (!runtimeErr.hasError()) {
+						runtimeErr = dataSeries.init(binaryPath.c_str(), 0.0, 1.0);
+					}
+					if (!runtimeErr.hasError()) {
+						runtimeErr = dataPlot.init(dataSeries, 1.0f);
+					}
+					if (runtimeErr.hasError()) {
+						showData = false;
+						ImGui::OpenPopup("Expression error");
+						expressionErrorPopupOpen = true;
+					} else {
+						// Spread the samples over the view
+						const int64_t sampleCount = dataSeries.getSampleCount();
+						dataSeries.setSampling(xRange.from, xRange.getLength() / double(std::max<int64_t>(sampleCount - 1, 1)));
+						dataColumns = 0;
+						showData = true;
+					}
+					linesDirty = true;
+				}
+				if (showData) {
+					ImGui::SameLine();
+					if (ImGui::Button("Hide data")) {
+						showData = false;
+						linesDirty = true;
+					}
+					ImGui::Text("Samples: %lld, vertices: %d", (long long)dataSeries.getSampleCount(), dataPlot.getVertexCount());
+				}
+				if (showPlotError) {
+					ImGui::OpenPopup("Expression error");
+					expressionErrorPopupOpen = true;
+					showPlotError = false;
+				}
+				if (plotEvaluator.isBusy()) {
+					ImGui::Text("Evaluating...");
+				}
+
 				if (ImGui::BeginPopupModal("Expression error", &expressionErrorPopupOpen)) {
 					ImGui::Text("%s\n", runtimeErr.getMessage());
 					if (ImGui::Button("Close"))
@@ -247,9 +595,51 @@ namespace MathViz {
 					ImGui::EndPopup();
 				}
 
-				ImGui::SliderFloat("float", &plotThickness, 0.0f, 20.0f);
+				if (ImGui::SliderFloat("float", &plotThickness, 0.0f, 20.0f)) {
+					linesDirty = true;
+				}
+
+				ImGui::Text(
+					"Expression cache hits: %lld misses: %lld",
+					(long long)ExpressionCache::getInstance().getHitCount(),
+					(long long)ExpressionCache::getInstance().getMissCount()
+				);
+
+				int errorCheck = int(GLUtils::getErrorCheck());
+				if (ImGui::Combo("GL error check", &errorCheck, "glGetError\0Debug output\0None\0")) {
+					runtimeErr = GLUtils::setErrorCheck(GLUtils::ErrorCheck(errorCheck));
+					if (runtimeErr.hasError()) {
+						ImGui::OpenPopup("Expression error");
+					}
+				}
+				if (ImGui::CollapsingHeader("Driver warnings")) {
+					const std::vector<GLUtils::DebugMessage> messages = GLUtils::getDebugMessages();
+					for (const GLUtils::DebugMessage& message : messages) {
+						ImGui::TextWrapped(
+							"[%s] x%lld %s",
+							message.type == GL_DEBUG_TYPE_PERFORMANCE ? "performance" : "other",
+							(long long)message.count,
+							message.text.c_str()
+						);
+					}
+					if (ImGui::Button("Clear warnings")) {
+						GLUtils::clearDebugMessages();
+					}
+				}
 
 				ImGui::End();
+
+				if (showProfiler) {
+					Profiler::getInstance().drawWindow(&showProfiler);
+				}
+				// The profiler graphs change every frame, the window can also be closed from its title bar
+				if (showProfiler != frameScheduler.isTimelineActive(profilerTimeline)) {
+					if (showProfiler) {
+						profilerTimeline = frameScheduler.startTimeline(0.0);
+					} else {
+						frameScheduler.stopTimeline(profilerTimeline);
+					}
+				}
 			}
 
 			ImGui::Render();
@@ -257,9 +647,77 @@ namespace MathViz {
 			glClearColor(clear_color.x * clear_color.w, clear_color.y * clear_color.w, clear_color.z * clear_color.w, clear_color.w);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-			plot.setLineWidth(plotThickness);
-			drawNode(plotNode);
-			// drawNode(reimanNode);
+			// Wide lines are expanded into quads, glLineWidth above one is not guaranteed in core profiles
+			if (plot.getLineWidth() != plotThickness) {
+				plot.setLineWidth(plotThickness);
+				linesDirty = true;
+			}
+			gpuPlotMaterial.setLineWidth(plotThickness);
+			gpuPlotMaterial.setViewportSize(width, height);
+			// Changing a parameter of a GPU plot or field is only a uniform write
+			for (int i = 0; i < parameterCount; ++i) {
+				gpuPlotMaterial.setParameter(parameterNames[i], parameters[i]);
+				fieldMaterial.setParameter(parameterNames[i], parameters[i]);
+			}
+			// The CPU plot is sampled again with the new parameters. At most one request is in flight, a new
+			// request would cancel the running one and while animating no plot would ever finish.
+			if (
+				cpuPlotHasParameters &&
+				!plotEvaluator.isBusy() &&
+				!std::equal(parameters, parameters + parameterCount, cpuPlotRequest.parameterValues.begin())
+			) {
+				cpuPlotRequest.parameterValues.assign(parameters, parameters + parameterCount);
+				plotRequestId = plotEvaluator.submit(cpuPlotRequest);
+			}
+			if (showField) {
+				// The curve f(x, y) = 0 over a heatmap from -fieldRange (blue) to fieldRange (yellow)
+				fieldMaterial.setHeatmap(-fieldRange, fieldRange, glm::vec3(0.0f, 0.2f, 0.8f), glm::vec3(1.0f, 0.9f, 0.0f), fieldOpacity);
+				fieldMaterial.setContour(0.0f, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), fieldContourWidth);
+				submit(fieldNode);
+			}
+			// The decimation depends only on the view and on the width of the framebuffer
+			if (showData && dataColumns != width) {
+				RETURN_ON_ERROR_CODE(dataPlot.setView(xRange, width));
+				dataColumns = width;
+				linesDirty = true;
+			}
+			submit(gridNode);
+			const bool plotAsLines = plotNode.geometry == &plot;
+			// The lines change only when the plot is reset or the data is decimated again
+			if (linesDirty) {
+				MATHVIZ_PROFILE_CPU("Build plot lines");
+				lines.clear();
+				if (plotAsLines) {
+					plot.appendTo(lines, glm::vec4(red.getColor(), 1.0f));
+				}
+				if (showData) {
+					dataPlot.appendTo(lines, glm::vec4(blue.getColor(), 1.0f));
+				}
+				RETURN_ON_ERROR_CODE(lines.upload());
+				linesDirty = false;
+			}
+			if (lines.getSegmentCount() > 0) {
+				lineMaterial.setViewportSize(width, height);
+				submit(linesNode);
+			}
+			if (showMorph) {
+				// Only the material changes while the morph is playing, the transitions are eased in and out
+				const float position = float(frameScheduler.getTimelineTime(morphTimeline)) / morphTransitionTime;
+				const float transition = position - std::floor(position);
+				const float eased = transition * transition * (3.0f - 2.0f * transition);
+				morphMaterial.setSequencePosition(std::floor(position) + eased, morphSequence.getKeyframeCount());
+				morphMaterial.setViewportSize(width, height);
+				submit(morphNode);
+			}
+			if (!plotAsLines) {
+				submit(plotNode);
+			}
+			if (showSweep) {
+				sweepMaterial.setViewportSize(width, height);
+				submit(sweepNode);
+			}
+			// submit(reimanNode);
+			RETURN_ON_ERROR_CODE(flushRenderQueue());
 
 			if (io.ConfigFlags & ImGuiConfigFlags_ViewportsEnable) {
 				GLFWwindow* backup_current_context = glfwGetCurrentContext();
@@ -268,28 +726,230 @@ namespace MathViz {
 				glfwMakeContextCurrent(backup_current_context);
 			}
 
-			ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+			{
+				MATHVIZ_PROFILE_GPU("ImGui render");
+				ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+			}
+			Profiler::getInstance().endFrame();
 			glfwSwapBuffers(window.get());
+			frameScheduler.frameRendered();
 		}
 		return EC::ErrorCode();
 	}
 
+	EC::ErrorCode Context::renderAnimation(IFrameSink& sink, int frameCount) {
+		// The number of frames which are rendered before the pixels of the first one are needed
+		const int readbackBufferCount = 3;
+		GLUtils::Framebuffer framebuffer;
+		RETURN_ON_ERROR_CODE(framebuffer.init(width, height));
+		GLUtils::PixelReadback readback;
+		RETURN_ON_ERROR_CODE(readback.init(width, height, readbackBufferCount));
+
+		const MathViz::Range2D xRange(-5, 5);
+		const auto f = [](float x) -> float {
+			return std::sin(x);
+		};
+
+		MathViz::Canvas gridCanvas;
+		RETURN_ON_ERROR_CODE(gridCanvas.init(glm::vec3(-5.0f, -5.0f, -1.0f), glm::vec3(5.0f, 5.0f, -1.0f)));
+		Grid2D grid = materialFactory.create<Grid2D>(glm::vec3(0.4f, 0.4f, 0.4f), glm::vec3(0.9f, 0.9f, 0.9f), 20.0f);
+		Node gridNode;
+		gridNode.material = &grid;
+		gridNode.geometry = &gridCanvas;
+		gridNode.layer = -1;
+
+		const int morphVerts = 100;
+		MathViz::Curve circle;
+		circle.init(MathViz::circleEquation, morphVerts, MathViz::Curve::IsClosed);
+		MathViz::Curve rect;
+		rect.init(MathViz::squareEquation, morphVerts, MathViz::Curve::IsClosed);
+		MathViz::Morph2D morph;
+		RETURN_ON_ERROR_CODE(morph.init(circle, rect));
+
+		MathViz::LineBatch lines;
+		RETURN_ON_ERROR_CODE(lines.init());
+		ThickLine lineMaterial = materialFactory.create<ThickLine>();
+		lineMaterial.setViewportSize(width, height);
+		Node linesNode;
+		linesNode.material = &lineMaterial;
+		linesNode.geometry = &lines;
+
+		FlatColor red = materialFactory.create<FlatColor>(glm::vec3(1.0f, 0.0f, 0.0f));
+		Gradient2D grad = materialFactory.create<Gradient2D>(
+			glm::vec3(-5.f, -1.f, 0.f),
+			glm::vec3(5.f, 1.f, 0.f),
+			glm::vec3(0.1f, 0.4f, 0.7f),
+			glm::vec3(0.f, 0.5f, 0.8)
+		);
+		const float maxBarWidth = 1.0f;
+		const float minBarWidth = 0.05f;
+		MathViz::ReimanArea r;
+		RETURN_ON_ERROR_CODE(r.init(f, xRange, maxBarWidth));
+		Node reimanNode;
+		reimanNode.material = &grad;
+		reimanNode.geometry = &r;
+
+		transforms.bind();
+		RETURN_ON_ERROR_CODE(sink.begin(width, height));
+
+		int writtenCount = 0;
+		// Pass the oldest frame in flight to the sink. If wait is false and the frame is not read yet
+		// nothing is written.
+		const auto writeOldest = [&](bool wait, bool& written) -> EC::ErrorCode {
+			const unsigned char* pixels = nullptr;
+			RETURN_ON_ERROR_CODE(readback.mapOldest(wait, pixels));
+			written = pixels != nullptr;
+			if (!written) {
+				return EC::ErrorCode();
+			}
+			const EC::ErrorCode sinkErr = sink.writeFrame(pixels, writtenCount);
+			RETURN_ON_ERROR_CODE(readback.unmapOldest());
+			RETURN_ON_ERROR_CODE(sinkErr);
+			writtenCount++;
+			return EC::ErrorCode();
+		};
+
+		for (int i = 0; i < frameCount; ++i) {
+			Profiler::getInstance().beginFrame();
+			const float t = frameCount > 1 ? float(i) / (frameCount - 1) : 0.0f;
+			RETURN_ON_ERROR_CODE(framebuffer.bind());
+			RETURN_ON_GL_ERROR(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
+			RETURN_ON_GL_ERROR(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+
+			// Circle to square and back, the bars of the Reiman sum get thinner
+			RETURN_ON_ERROR_CODE(r.setBarWidth(glm::mix(maxBarWidth, minBarWidth, t)));
+			lines.clear();
+			morph.appendTo(lines, 0.5f - 0.5f * std::cos(2.0f * glm::pi<float>() * t), glm::vec4(1.0f, 1.0f, 0.0f, 1.0f), 3.0f);
+			r.appendTo(lines, glm::vec4(red.getColor(), 1.0f), 1.5f);
+			RETURN_ON_ERROR_CODE(lines.upload());
+
+			submit(gridNode);
+			submit(reimanNode);
+			submit(linesNode);
+			RETURN_ON_ERROR_CODE(flushRenderQueue());
+
+			// Block only when all buffers are in flight, otherwise write the frames which are already read
+			bool written = false;
+			if (readback.isFull()) {
+				RETURN_ON_ERROR_CODE(writeOldest(true, written));
+			}
+			RETURN_ON_ERROR_CODE(readback.read());
+			do {
+				RETURN_ON_ERROR_CODE(writeOldest(false, written));
+			} while (written && readback.getPendingCount() > 0);
+			Profiler::getInstance().endFrame();
+		}
+		while (readback.getPendingCount() > 0) {
+			bool written = false;
+			RETURN_ON_ERROR_CODE(writeOldest(true, written));
+		}
+
+		RETURN_ON_ERROR_CODE(framebuffer.unbind());
+		RETURN_ON_GL_ERROR(glViewport(0, 0, width, height));
+		return sink.end();
+	}
+
 	EC::ErrorCode Context::loadShaders() {
-		RETURN_ON_ERROR_CODE(materialFactory.init());
+		RETURN_ON_ERROR_CODE(materialFactory.init("shader_cache"));
 		return EC::ErrorCode();
 	}
 
-	EC::ErrorCode Context::drawNode(const Node& node) {
-		const GLUtils::Program& p = node.material->getProgram();
-		RETURN_ON_ERROR_CODE(p.bind());
-		RETURN_ON_ERROR_CODE(transforms.upload(sizeof(glm::mat4), sizeof(glm::mat4), (void*)glm::value_ptr(node.transform)));
-		RETURN_ON_ERROR_CODE(node.material->setUniforms());
-		if (node.flags & Node::Flags::Outline) {
-			RETURN_ON_ERROR_CODE(node.geometry->outline(*node.material, *node.outlineMaterial));
-		} else {
-			RETURN_ON_ERROR_CODE(node.geometry->draw());
+	void Context::submit(const Node& node) {
+		renderQueue.push_back(&node);
+	}
+
+	EC::ErrorCode Context::flushRenderQueue() {
+		MATHVIZ_PROFILE_GPU("Render queue");
+		std::stable_sort(renderQueue.begin(), renderQueue.end(), [](const Node* a, const Node* b) {
+			return RenderKey(*a) < RenderKey(*b);
+		});
+
+		// Pack the parameters of all materials in one buffer. Nodes with the same material are next to each
+		// other after sorting, so their parameters are added once.
+		materialUniforms.clear();
+		materialOffsets.resize(2 * renderQueue.size());
+		const IMaterial* lastMaterial = nullptr;
+		const IMaterial* lastOutlineMaterial = nullptr;
+		for (int i = 0; i < int(renderQueue.size()); ++i) {
+			const Node& node = *renderQueue[i];
+			if (node.material != lastMaterial) {
+				materialOffsets[2 * i] = materialUniforms.add(*node.material);
+				lastMaterial = node.material;
+			} else {
+				materialOffsets[2 * i] = materialOffsets[2 * (i - 1)];
+			}
+			if ((node.flags & Node::Flags::Outline) && node.outlineMaterial != lastOutlineMaterial) {
+				materialOffsets[2 * i + 1] = materialUniforms.add(*node.outlineMaterial);
+				lastOutlineMaterial = node.outlineMaterial;
+			} else {
+				materialOffsets[2 * i + 1] = i > 0 ? materialOffsets[2 * (i - 1) + 1] : -1;
+			}
 		}
-		p.unbind();
-		return EC::ErrorCode();
+		RETURN_ON_ERROR_CODE(materialUniforms.upload());
+
+		// State set by the previous node, it is set again only if it changes
+		const GLUtils::Program* boundProgram = nullptr;
+		const IMaterial* boundMaterial = nullptr;
+		const glm::mat4* uploadedTransform = nullptr;
+		const auto setState = [&](const IMaterial& material, int64_t materialOffset, const glm::mat4& transform) -> EC::ErrorCode {
+			const GLUtils::Program& p = material.getProgram();
+			if (boundProgram != &p) {
+				RETURN_ON_ERROR_CODE(p.bind());
+				boundProgram = &p;
+				boundMaterial = nullptr;
+			}
+			if (uploadedTransform == nullptr || *uploadedTransform != transform) {
+				RETURN_ON_ERROR_CODE(transforms.upload(sizeof(glm::mat4), sizeof(glm::mat4), (void*)glm::value_ptr(transform)));
+				uploadedTransform = &transform;
+			}
+			if (boundMaterial != &material) {
+				RETURN_ON_ERROR_CODE(materialUniforms.bind(materialOffset, material));
+				RETURN_ON_ERROR_CODE(material.setUniforms());
+				boundMaterial = &material;
+			}
+			return EC::ErrorCode();
+		};
+
+		EC::ErrorCode result;
+		bool hasOutlines = false;
+		for (int i = 0; i < int(renderQueue.size()); ++i) {
+			const Node* node = renderQueue[i];
+			MATHVIZ_PROFILE_GPU("Draw node");
+			result = setState(*node->material, materialOffsets[2 * i], node->transform);
+			if (!result.hasError()) {
+				result = node->geometry->draw();
+			}
+			if (result.hasError()) {
+				break;
+			}
+			hasOutlines |= (node->flags & Node::Flags::Outline) != 0;
+		}
+
+		if (!result.hasError() && hasOutlines) {
+			result = GLUtils::StateCache::getCurrent().setEnabled(GL_DEPTH_TEST, false);
+			for (int i = 0; i < int(renderQueue.size()); ++i) {
+				const Node* node = renderQueue[i];
+				if (result.hasError()) {
+					break;
+				}
+				if (!(node->flags & Node::Flags::Outline)) {
+					continue;
+				}
+				MATHVIZ_PROFILE_GPU("Draw outline");
+				result = setState(*node->outlineMaterial, materialOffsets[2 * i + 1], node->transform);
+				if (!result.hasError()) {
+					result = node->geometry->drawOutline();
+				}
+			}
+			if (!result.hasError()) {
+				result = GLUtils::StateCache::getCurrent().setEnabled(GL_DEPTH_TEST, true);
+			}
+		}
+
+		if (boundProgram != nullptr) {
+			boundProgram->unbind();
+		}
+		renderQueue.clear();
+		return result;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,447 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <string>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "data_series.h"
+#include "profiler.h"
+
+namespace MathViz {
+	// =========================================================
+	// ====================== MAPPED FILE ======================
+	// =========================================================
+
+	MappedFile::MappedFile() :
+		data(nullptr),
+		size(0)
+	{ }
+
+	MappedFile::~MappedFile() {
+		freeMem();
+	}
+
+	MappedFile::MappedFile(MappedFile&& other) noexcept :
+		data(other.data),
+		size(other.size)
+	{
+		other.data = nullptr;
+		other.size = 0;
+	}
+
+	MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+		if (this != &other) {
+			freeMem();
+			data = other.data;
+			size = other.size;
+			other.data = nullptr;
+			other.size = 0;
+		}
+		return *this;
+	}
+
+	EC::ErrorCode MappedFile::init(const char* path) {
+		freeMem();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return EC::ErrorCode(int(GetLastError()), "Cannot open file %s", path);
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			CloseHandle(file);
+			return EC::ErrorCode(-1, "Cannot map empty file %s", path);
+		}
+		// The view keeps the mapping alive, both handles can be closed when it is created
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (mapping == nullptr) {
+			return EC::ErrorCode(int(GetLastError()), "Cannot map file %s", path);
+		}
+		void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (view == nullptr) {
+			return EC::ErrorCode(int(GetLastError()), "Cannot map file %s", path);
+		}
+		data = static_cast<const unsigned char*>(view);
+		size = int64_t(fileSize.QuadPart);
+#else
+		const int file = open(path, O_RDONLY);
+		if (file < 0) {
+			return EC::ErrorCode(errno, "Cannot open file %s: %s", path, strerror(errno));
+		}
+		struct stat fileStat;
+		if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+			close(file);
+			return EC::ErrorCode(-1, "Cannot map empty file %s", path);
+		}
+		// The mapping stays valid after the descriptor is closed
+		void* view = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		close(file);
+		if (view == MAP_FAILED) {
+			return EC::ErrorCode(errno, "Cannot map file %s: %s", path, strerror(errno));
+		}
+		data = static_cast<const unsigned char*>(view);
+		size = int64_t(fileStat.st_size);
+#endif
+		return EC::ErrorCode();
+	}
+
+	void MappedFile::freeMem() {
+		if (data == nullptr) {
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(const_cast<unsigned char*>(data), size_t(size));
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const unsigned char* MappedFile::getData() const {
+		return data;
+	}
+
+	int64_t MappedFile::getSize() const {
+		return size;
+	}
+
+	// =========================================================
+	// ====================== DATA SERIES ======================
+	// =========================================================
+
+	/// Entry which is the identity of merge
+	static DataSeries::MinMax emptyMinMax() {
+		return {std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()};
+	}
+
+	/// NaN fails both comparisons, so it never changes the result
+	static void merge(DataSeries::MinMax& result, float value) {
+		if (value < result.min) {
+			result.min = value;
+		}
+		if (value > result.max) {
+			result.max = value;
+		}
+	}
+
+	static void merge(DataSeries::MinMax& result, const DataSeries::MinMax& other) {
+		merge(result, other.min);
+		merge(result, other.max);
+	}
+
+	/// fseek with 64 bit offsets, the pyramids of large files are larger than 2GB
+	static int seek(FILE* file, int64_t position) {
+#ifdef _WIN32
+		return _fseeki64(file, position, SEEK_SET);
+#else
+		return fseeko(file, off_t(position), SEEK_SET);
+#endif
+	}
+
+	DataSeries::DataSeries() :
+		sampleCount(0),
+		xStart(0.0),
+		xStep(1.0)
+	{ }
+
+	EC::ErrorCode DataSeries::init(const char* path, double xStartIn, double xStepIn) {
+		MATHVIZ_PROFILE_CPU("DataSeries::init");
+		assert(xStepIn > 0.0);
+		freeMem();
+		setSampling(xStartIn, xStepIn);
+		RETURN_ON_ERROR_CODE(samples.init(path));
+		if (samples.getSize() % sizeof(float) != 0) {
+			const int64_t size = samples.getSize();
+			samples.freeMem();
+			return EC::ErrorCode(-1, "The size of %s is %lld bytes, it is not an array of floats", path, (long long)size);
+		}
+		sampleCount = samples.getSize() / int64_t(sizeof(float));
+		computeLevels();
+
+		std::error_code fsErr;
+		const auto writeTime = std::filesystem::last_write_time(path, fsErr);
+		const int64_t sourceTime = fsErr ? 0 : int64_t(writeTime.time_since_epoch().count());
+		const std::string pyramidPath = std::string(path) + ".minmax";
+		const int64_t expectedSize = int64_t(sizeof(PyramidHeader)) +
+			(levelOffsets.back() + levelSizes.back()) * int64_t(sizeof(MinMax));
+		const auto isValid = [&]() -> bool {
+			if (pyramid.init(pyramidPath.c_str()).hasError() || pyramid.getSize() != expectedSize) {
+				return false;
+			}
+			PyramidHeader header;
+			memcpy(&header, pyramid.getData(), sizeof(header));
+			return header.magic == PyramidHeader::Magic &&
+				header.branching == uint32_t(Branching) &&
+				header.sampleCount == uint64_t(sampleCount) &&
+				header.sourceTime == sourceTime;
+		};
+		if (!isValid()) {
+			pyramid.freeMem();
+			RETURN_ON_ERROR_CODE(buildPyramid(pyramidPath.c_str(), sourceTime));
+			if (!isValid()) {
+				freeMem();
+				return EC::ErrorCode(-1, "Failed to load the pyramid %s", pyramidPath.c_str());
+			}
+		}
+		return EC::ErrorCode();
+	}
+
+	void DataSeries::freeMem() {
+		samples.freeMem();
+		pyramid.freeMem();
+		levelSizes.clear();
+		levelOffsets.clear();
+		sampleCount = 0;
+	}
+
+	void DataSeries::setSampling(double xStartIn, double xStepIn) {
+		xStart = xStartIn;
+		xStep = xStepIn;
+	}
+
+	int64_t DataSeries::getSampleCount() const {
+		return sampleCount;
+	}
+
+	float DataSeries::getSample(int64_t index) const {
+		assert(index >= 0 && index < sampleCount);
+		float value;
+		memcpy(&value, samples.getData() + index * int64_t(sizeof(float)), sizeof(float));
+		return value;
+	}
+
+	double DataSeries::getX(int64_t index) const {
+		return xStart + double(index) * xStep;
+	}
+
+	double DataSeries::getXStep() const {
+		return xStep;
+	}
+
+	Range2D DataSeries::getXRange() const {
+		return Range2D(float(xStart), float(getX(std::max<int64_t>(sampleCount - 1, 0))));
+	}
+
+	DataSeries::MinMax DataSeries::getMinMax(int64_t first, int64_t last) const {
+		MinMax result = emptyMinMax();
+		int64_t lo = std::max<int64_t>(first, 0);
+		int64_t hi = std::min(last, sampleCount);
+		// Merge the samples up to the first and from the last boundary of a level 0 block, then go up one
+		// level with the blocks between them. At most 2 * (Branching - 1) values are read on each level.
+		while (lo < hi && lo % Branching != 0) {
+			merge(result, getSample(lo++));
+		}
+		while (lo < hi && hi % Branching != 0) {
+			merge(result, getSample(--hi));
+		}
+		lo /= Branching;
+		hi /= Branching;
+		const int levelCount = int(levelSizes.size());
+		for (int level = 0; level < levelCount && lo < hi; ++level) {
+			if (level == levelCount - 1) {
+				// The top level has at most Branching entries
+				for (; lo < hi; ++lo) {
+					merge(result, getEntry(level, lo));
+				}
+				break;
+			}
+			while (lo < hi && lo % Branching != 0) {
+				merge(result, getEntry(level, lo++));
+			}
+			while (lo < hi && hi % Branching != 0) {
+				merge(result, getEntry(level, --hi));
+			}
+			lo /= Branching;
+			hi /= Branching;
+		}
+		return result;
+	}
+
+	void DataSeries::computeLevels() {
+		levelSizes.clear();
+		levelOffsets.clear();
+		int64_t size = (sampleCount + Branching - 1) / Branching;
+		int64_t offset = 0;
+		while (true) {
+			levelSizes.push_back(size);
+			levelOffsets.push_back(offset);
+			offset += size;
+			if (size <= Branching) {
+				break;
+			}
+			size = (size + Branching - 1) / Branching;
+		}
+	}
+
+	const DataSeries::MinMax& DataSeries::getEntry(int level, int64_t index) const {
+		assert(index >= 0 && index < levelSizes[level]);
+		const unsigned char* entries = pyramid.getData() + sizeof(PyramidHeader);
+		return reinterpret_cast<const MinMax*>(entries)[levelOffsets[level] + index];
+	}
+
+	EC::ErrorCode DataSeries::buildPyramid(const char* pyramidPath, int64_t sourceTime) const {
+		MATHVIZ_PROFILE_CPU("DataSeries::buildPyramid");
+		// The pyramid is written to a temporary file, so a build which is interrupted is never loaded
+		const std::string tempPath = std::string(pyramidPath) + ".tmp";
+		{
+			std::unique_ptr<FILE, decltype(&fclose)> file(fopen(tempPath.c_str(), "wb"), &fclose);
+			if (file == nullptr) {
+				return EC::ErrorCode(errno, "Cannot open file %s: %s", tempPath.c_str(), strerror(errno));
+			}
+			const PyramidHeader header{PyramidHeader::Magic, uint32_t(Branching), uint64_t(sampleCount), sourceTime};
+			if (fwrite(&header, sizeof(header), 1, file.get()) != 1) {
+				return EC::ErrorCode(-1, "Failed to write %s", tempPath.c_str());
+			}
+
+			// All levels are built in one pass over the samples. Each level keeps the block which is being
+			// merged and a chunk of finished entries which is written at the position of the level in the file,
+			// so the memory does not depend on the number of samples.
+			const int ChunkSize = 4096;
+			struct Level {
+				MinMax block;
+				int blockCount;
+				std::vector<MinMax> chunk;
+				int64_t written;
+			};
+			const int levelCount = int(levelSizes.size());
+			std::vector<Level> levels(levelCount, Level{emptyMinMax(), 0, {}, 0});
+			const auto flush = [&](int level) -> bool {
+				Level& l = levels[level];
+				if (l.chunk.empty()) {
+					return true;
+				}
+				const int64_t position = int64_t(sizeof(PyramidHeader)) + (levelOffsets[level] + l.written) * int64_t(sizeof(MinMax));
+				if (seek(file.get(), position) != 0 ||
+					fwrite(l.chunk.data(), sizeof(MinMax), l.chunk.size(), file.get()) != l.chunk.size()
+				) {
+					return false;
+				}
+				l.written += int64_t(l.chunk.size());
+				l.chunk.clear();
+				return true;
+			};
+
+			MinMax rawBlock = emptyMinMax();
+			for (int64_t i = 0; i < sampleCount; ++i) {
+				merge(rawBlock, getSample(i));
+				const bool isLast = i == sampleCount - 1;
+				if ((i + 1) % Branching != 0 && !isLast) {
+					continue;
+				}
+				// A finished block goes to its level and is merged in the block of the level above. The last
+				// sample finishes the partial blocks of all levels.
+				MinMax entry = rawBlock;
+				rawBlock = emptyMinMax();
+				for (int level = 0; level < levelCount; ++level) {
+					Level& l = levels[level];
+					l.chunk.push_back(entry);
+					if (int(l.chunk.size()) == ChunkSize && !flush(level)) {
+						return EC::ErrorCode(-1, "Failed to write %s", tempPath.c_str());
+					}
+					if (level + 1 == levelCount) {
+						break;
+					}
+					Level& parent = levels[level + 1];
+					merge(parent.block, entry);
+					parent.blockCount++;
+					if (parent.blockCount < Branching && !isLast) {
+						break;
+					}
+					entry = parent.block;
+					parent.block = emptyMinMax();
+					parent.blockCount = 0;
+				}
+			}
+			for (int level = 0; level < levelCount; ++level) {
+				if (!flush(level)) {
+					return EC::ErrorCode(-1, "Failed to write %s", tempPath.c_str());
+				}
+			}
+		}
+		std::error_code fsErr;
+		std::filesystem::rename(tempPath, pyramidPath, fsErr);
+		if (fsErr) {
+			return EC::ErrorCode(fsErr.value(), "Cannot write %s: %s", pyramidPath, fsErr.message().c_str());
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode DataSeries::convertCSV(const char* csvPath, int column, bool skipHeader, const char* outputPath) {
+		MATHVIZ_PROFILE_CPU("DataSeries::convertCSV");
+		std::unique_ptr<FILE, decltype(&fclose)> input(fopen(csvPath, "rb"), &fclose);
+		if (input == nullptr) {
+			return EC::ErrorCode(errno, "Cannot open file %s: %s", csvPath, strerror(errno));
+		}
+		std::unique_ptr<FILE, decltype(&fclose)> output(fopen(outputPath, "wb"), &fclose);
+		if (output == nullptr) {
+			return EC::ErrorCode(errno, "Cannot open file %s: %s", outputPath, strerror(errno));
+		}
+
+		const int ChunkSize = 4096;
+		std::vector<float> chunk;
+		chunk.reserve(ChunkSize);
+		std::string line;
+		char buffer[4096];
+		bool isHeader = skipHeader;
+		bool atEnd = false;
+		while (!atEnd) {
+			// Lines can be longer than the buffer
+			line.clear();
+			while (fgets(buffer, sizeof(buffer), input.get()) != nullptr) {
+				line += buffer;
+				if (!line.empty() && line.back() == '\n') {
+					break;
+				}
+			}
+			atEnd = feof(input.get()) != 0;
+			if (line.empty() || (line.size() == 1 && line[0] == '\n') || isHeader) {
+				isHeader = false;
+				continue;
+			}
+			const char* field = line.c_str();
+			for (int i = 0; i < column && field != nullptr; ++i) {
+				field = strchr(field, ',');
+				field = field != nullptr ? field + 1 : nullptr;
+			}
+			float value = std::numeric_limits<float>::quiet_NaN();
+			if (field != nullptr) {
+				char* end = nullptr;
+				const float parsed = strtof(field, &end);
+				if (end != field) {
+					value = parsed;
+				}
+			}
+			chunk.push_back(value);
+			if (int(chunk.size()) == ChunkSize) {
+				if (fwrite(chunk.data(), sizeof(float), chunk.size(), output.get()) != chunk.size()) {
+					return EC::ErrorCode(-1, "Failed to write %s", outputPath);
+				}
+				chunk.clear();
+			}
+		}
+		if (!chunk.empty() && fwrite(chunk.data(), sizeof(float), chunk.size(), output.get()) != chunk.size()) {
+			return EC::ErrorCode(-1, "Failed to write %s", outputPath);
+		}
+		if (ferror(input.get())) {
+			return EC::ErrorCode(-1, "Failed to read %s", csvPath);
+		}
+		return EC::ErrorCode();
+	}
+}
@@ -1,7 +1,11 @@
 #include "expression.h"
+#include "expression_kernels.h"
 #include "error_code.h"
 #include <cctype>
 #include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
 
 namespace MathViz {
 
@@ -48,7 +52,7 @@ struct Token {
 	Type t;
 };
 
-inline static Expression::Operator tokenToOperator(const std::vector<Token>& tokens, const int tokenIndex) {
+inline static Expression::Operator tokenToOperator(const std::pmr::vector<Token>& tokens, const int tokenIndex) {
 	const Token::Type t = tokens[tokenIndex].t;
 	switch (t) {
 		case Token::Type::Plus : return Expression::Operator::Plus;
@@ -176,11 +180,12 @@ inline static Token::Type parseOperator(const char* start, int& len) {
 }
 
 /// Check if the first symbols of start contain some of the allowed variable names. Currently they are x y z t
+/// and the parameters a b
 /// @param[in] start The string where we look for variables
 /// @param[out] len The length of the variable. If no variable is found this will be 0
 /// @retval 1 if variable name is found 0 otherwise
 inline static bool parseVariable(const char* start, int& len) {
-	if (*start == 'x' || *start == 'y' || *start == 'z' || *start == 't') {
+	if (*start == 'x' || *start == 'y' || *start == 'z' || *start == 't' || *start == 'a' || *start == 'b') {
 		len = 1;
 		return true;
 	}
@@ -231,7 +236,7 @@ inline static int getOperatorPrecedence(Expression::Operator op) {
 /// @param[in] stack The stack where the operator is going to be pushed
 /// @param[in] current The operator for which we check if poping is needed
 /// @retval 1 if we need to pop operators before pushing current to the stack, 0 if we don't need to pop
-inline static bool shouldPop(const std::vector<Expression::Operator>& stack, const Expression::Operator current) {
+inline static bool shouldPop(const std::pmr::vector<Expression::Operator>& stack, const Expression::Operator current) {
 	if (stack.empty()) return false;
 	const int topPrecedence = getOperatorPrecedence(stack.back());
 	const int currentPrecendece = getOperatorPrecedence(current);
@@ -243,7 +248,7 @@ inline static bool shouldPop(const std::vector<Expression::Operator>& stack, con
 	return false;
 }
 
-static EC::ErrorCode tokenize(const char* expression, std::vector<Token>& tokens) {
+static EC::ErrorCode tokenize(const char* expression, std::pmr::vector<Token>& tokens) {
 	const char* it = expression; // Iterator for the expression. Holds the next char to be parsed
 	Token::Type type; // Used to keep the result from parseOperator
 	int length = 0; // Used to keep the length of parsed tokens in order to advance the iterator after parsing
@@ -276,9 +281,9 @@ static EC::ErrorCode tokenize(const char* expression, std::vector<Token>& tokens
 }
 
 EC::ErrorCode Expression::popOperators(
-	std::vector<Expression::Operator>& operatorStack,
-	std::vector<int>& pendingOperands,
-	std::vector<Node>& tree
+	std::pmr::vector<Expression::Operator>& operatorStack,
+	std::pmr::vector<int>& pendingOperands,
+	std::pmr::vector<Node>& tree
 ) {
 	const Expression::Operator op = operatorStack.back();
 	const int numArguments = getNumOperatorArgs(op);
@@ -318,6 +323,15 @@ EC::ErrorCode Expression::popOperators(
 }
 
 EC::ErrorCode Expression::init(const char* expression) {
+	return init(expression, std::pmr::get_default_resource());
+}
+
+EC::ErrorCode Expression::init(const char* expression, std::pmr::memory_resource* arena) {
+	tree.clear();
+	program.clear();
+	variables.clear();
+	// The tree is first built as it is parsed, then it is simplified into the tree member
+	std::pmr::vector<Node> parsed(arena);
 	// This is a stack to hold the operands which are to be combined in an expression
 	// An operand is any node in the expression tree. If the node is a leaf then the
 	// value of the operand is the value held in that leaf, if the node not a leaf then
@@ -325,13 +339,13 @@ EC::ErrorCode Expression::init(const char* expression) {
 	// The operands are stored by their element index (position) in the tree. The top
 	// of this stack holds the first operand which must be included in the new node of
 	// the expression.
-	std::vector<int> pendingOperands;
+	std::pmr::vector<int> pendingOperands(arena);
 	// Stack which holds the operators which must be applied to the operands in pendingOperands
 	// The top of this stack is the next operator which must be applied.
-	std::vector<Operator> operatorStack;
+	std::pmr::vector<Operator> operatorStack(arena);
 	// This will hold tokenized version of the string expression. The tokens are in the
 	// same order as in the string version of the expression.
-	std::vector<Token> tokens;
+	std::pmr::vector<Token> tokens(arena);
 	RETURN_ON_ERROR_CODE(tokenize(expression, tokens));
 	// The loop which creates the tree. The tree is build bottom up all values and variables are leaves.
 	// At each step check the current operand. If it's a value/variable push it to the tree as a leaf and
@@ -352,7 +366,7 @@ EC::ErrorCode Expression::init(const char* expression) {
 		if (t.isOperator()) {
 			const Expression::Operator op = tokenToOperator(tokens, i);
 			while (shouldPop(operatorStack, op)) {
-				RETURN_ON_ERROR_CODE(popOperators(operatorStack, pendingOperands, tree));
+				RETURN_ON_ERROR_CODE(popOperators(operatorStack, pendingOperands, parsed));
 			}
 			operatorStack.push_back(op);
 			// We assume that function arguments are surrounded by () this would ensure that we will first evaluate
@@ -367,16 +381,16 @@ EC::ErrorCode Expression::init(const char* expression) {
 				}
 			}
 		} else if (t.t == Token::Type::Number) {
-			pendingOperands.push_back(tree.size());
-			tree.emplace_back(t.val);
+			pendingOperands.push_back(parsed.size());
+			parsed.emplace_back(t.val);
 		} else if (t.t == Token::Type::Variable) {
-			pendingOperands.push_back(tree.size());
-			tree.emplace_back(t.name);
+			pendingOperands.push_back(parsed.size());
+			parsed.emplace_back(t.name);
 		} else if (t.t == Token::Type::OpenParen) {
 			operatorStack.emplace_back(Expression::Operator::OpenParen);
 		} else if (t.t == Token::Type::CloseParen) {
 			while (operatorStack.size() && operatorStack.back() != Operator::OpenParen) {
-				RETURN_ON_ERROR_CODE(popOperators(operatorStack, pendingOperands, tree));
+				RETURN_ON_ERROR_CODE(popOperators(operatorStack, pendingOperands, parsed));
 			}
 			if (operatorStack.empty()) {
 				return EC::ErrorCode("Error parsing expression: %s. Mismatched brackets.", expression);
@@ -389,56 +403,1011 @@ EC::ErrorCode Expression::init(const char* expression) {
 	// for example if all operators have the same precendence. This final loop iterates over all operators
 	// and operands and produces the final tree.
 	while (operatorStack.size()) {
-		popOperators(operatorStack, pendingOperands, tree);
+		popOperators(operatorStack, pendingOperands, parsed);
 	}
 	// At the end of the algorithm pendingOperands must have one operand which is the root of the tree
 	if (pendingOperands.size() != 1) {
 		return EC::ErrorCode("Wrong expression: %s", expression);
 	}
+	// Rebuild the tree with constant subtrees folded and algebraic identities simplified. Repeated
+	// subtrees are left as they are, they are deduplicated when the tree is compiled.
+	parsedNodeCount = parsed.size();
+	tree.reserve(parsed.size());
+	simplify(parsed.data(), parsed.size() - 1);
+	RETURN_ON_ERROR_CODE(compile(arena));
 	return EC::ErrorCode();
 }
 
+void Expression::simplify(const Node* source, const int nodeIndex) {
+	const Node& node = source[nodeIndex];
+	if (node.isLeaf()) {
+		tree.push_back(node);
+		return;
+	}
+	const auto isConstant = [this](const int index) -> bool {
+		return tree[index].isLeaf() && !tree[index].isSymbolic();
+	};
+	const auto isNumber = [&](const int index, const float value) -> bool {
+		return isConstant(index) && tree[index].getValue() == value;
+	};
+	const auto isOperator = [this](const int index, const Operator op) -> bool {
+		return !tree[index].isLeaf() && tree[index].getOperator() == op;
+	};
+	const Operator op = node.getOperator();
+	if (node.getNumberOfArguments() == 1) {
+		simplify(source, nodeIndex - 1);
+		const int operand = tree.size() - 1;
+		if (isConstant(operand)) {
+			tree[operand] = Node(evaluateOperator(op, tree[operand].getValue()));
+		} else if (op == Operator::UnaryMinus && isOperator(operand, Operator::UnaryMinus)) {
+			// --x = x
+			tree.pop_back();
+		} else {
+			tree.emplace_back(op);
+		}
+		return;
+	}
+
+	const int leftBegin = tree.size();
+	simplify(source, node.getLeftIndex());
+	const int left = tree.size() - 1;
+	const int rightBegin = tree.size();
+	simplify(source, nodeIndex - 1);
+	const int right = tree.size() - 1;
+
+	if (isConstant(left) && isConstant(right)) {
+		const float value = evaluateOperator(op, tree[left].getValue(), tree[right].getValue());
+		tree.erase(tree.begin() + leftBegin, tree.end());
+		tree.emplace_back(value);
+		return;
+	}
+
+	// The result of the operator is the left operand. Drop the right subtree.
+	const auto keepLeft = [&]() {
+		tree.erase(tree.begin() + rightBegin, tree.end());
+	};
+	// The result of the operator is the right operand. Drop the left subtree.
+	const auto keepRight = [&]() {
+		eraseNodes(leftBegin, rightBegin);
+	};
+
+	switch (op) {
+		case Operator::Plus: {
+			if (isNumber(right, 0.0f)) {
+				keepLeft();
+				return;
+			} else if (isNumber(left, 0.0f)) {
+				keepRight();
+				return;
+			}
+		} break;
+		case Operator::Minus: {
+			if (isNumber(right, 0.0f)) {
+				keepLeft();
+				return;
+			} else if (isNumber(left, 0.0f)) {
+				// 0 - x = -x
+				const bool isNegated = isOperator(right, Operator::UnaryMinus);
+				keepRight();
+				if (isNegated) {
+					tree.pop_back();
+				} else {
+					tree.emplace_back(Operator::UnaryMinus);
+				}
+				return;
+			}
+		} break;
+		case Operator::Multiply: {
+			if (isNumber(right, 1.0f)) {
+				keepLeft();
+				return;
+			} else if (isNumber(left, 1.0f)) {
+				keepRight();
+				return;
+			}
+		} break;
+		case Operator::Divide: {
+			if (isNumber(right, 1.0f)) {
+				keepLeft();
+				return;
+			}
+		} break;
+		case Operator::Power: {
+			if (isNumber(right, 1.0f)) {
+				keepLeft();
+				return;
+			} else if (isNumber(right, 0.0f)) {
+				// pow returns 1 for zero exponent even if the base is nan
+				tree.erase(tree.begin() + leftBegin, tree.end());
+				tree.emplace_back(1.0f);
+				return;
+			} else if (isNumber(right, 2.0f)) {
+				// x^2 = x*x. The base is duplicated and compile will evaluate it only once.
+				keepLeft();
+				copyNodes(leftBegin, rightBegin);
+				tree.emplace_back(left, Operator::Multiply);
+				return;
+			}
+		} break;
+		default: break;
+	}
+	tree.emplace_back(left, op);
+}
+
+void Expression::eraseNodes(const int begin, const int end) {
+	const int count = end - begin;
+	tree.erase(tree.begin() + begin, tree.begin() + end);
+	const int treeSize = tree.size();
+	for (int i = begin; i < treeSize; ++i) {
+		const Node& node = tree[i];
+		if (!node.isLeaf() && node.getNumberOfArguments() == 2) {
+			assert(node.getLeftIndex() >= end);
+			tree[i] = Node(node.getLeftIndex() - count, node.getOperator());
+		}
+	}
+}
+
+void Expression::copyNodes(const int begin, const int end) {
+	const int offset = tree.size() - begin;
+	for (int i = begin; i < end; ++i) {
+		const Node node = tree[i];
+		if (!node.isLeaf() && node.getNumberOfArguments() == 2) {
+			tree.emplace_back(node.getLeftIndex() + offset, node.getOperator());
+		} else {
+			tree.push_back(node);
+		}
+	}
+}
+
+/// Describes the value computed by a node in terms of the values of its children. Nodes with equal
+/// keys compute the same value.
+struct ValueKey {
+	enum class Kind : unsigned char {
+		Constant,
+		Variable,
+		Operator
+	};
+	bool operator==(const ValueKey& other) const {
+		return kind == other.kind && op == other.op && payload == other.payload && right == other.right;
+	}
+	Kind kind;
+	Expression::Operator op;
+	/// The bits of the value for constants, the name for variables, the value number of the left
+	/// operand for binary operators and -1 for unary operators
+	int payload;
+	/// The value number of the right operand (the only operand for unary operators)
+	int right;
+};
+
+struct Expression::CompileState {
+	explicit CompileState(std::pmr::memory_resource* arena) :
+		valueNumbers(arena),
+		useCounts(arena),
+		temporaries(arena)
+	{ }
+	/// The value number of each node in the tree. Nodes with equal value numbers compute the same value.
+	std::pmr::vector<int> valueNumbers;
+	/// How many times the value with given value number is used as an operand of a distinct node
+	std::pmr::vector<int> useCounts;
+	/// The temporary in which the value with given value number is stored or -1 if it is not computed yet
+	std::pmr::vector<int> temporaries;
+	int temporaryCount = 0;
+	int stackDepth = 0;
+	int maxDepth = 0;
+};
+
+EC::ErrorCode Expression::compile(std::pmr::memory_resource* arena) {
+	program.clear();
+	variables.clear();
+	program.reserve(tree.size());
+
+	// Value numbering. Children are always before their parents in the tree so one pass is enough.
+	CompileState state(arena);
+	std::pmr::vector<ValueKey> values(arena);
+	values.reserve(tree.size());
+	const int treeSize = tree.size();
+	state.valueNumbers.resize(treeSize);
+	for (int i = 0; i < treeSize; ++i) {
+		const Node& node = tree[i];
+		ValueKey key;
+		if (node.isLeaf()) {
+			key.op = Operator::Invalid;
+			key.right = -1;
+			if (node.isSymbolic()) {
+				key.kind = ValueKey::Kind::Variable;
+				key.payload = node.getName();
+			} else {
+				const float value = node.getValue();
+				key.kind = ValueKey::Kind::Constant;
+				memcpy(&key.payload, &value, sizeof(float));
+			}
+		} else {
+			key.kind = ValueKey::Kind::Operator;
+			key.op = node.getOperator();
+			key.payload = node.getNumberOfArguments() == 2 ? state.valueNumbers[node.getLeftIndex()] : -1;
+			key.right = state.valueNumbers[i - 1];
+		}
+		const std::pmr::vector<ValueKey>::const_iterator it = std::find(values.begin(), values.end(), key);
+		if (it != values.end()) {
+			state.valueNumbers[i] = int(it - values.begin());
+			continue;
+		}
+		state.valueNumbers[i] = values.size();
+		values.push_back(key);
+		state.useCounts.push_back(0);
+		if (key.kind == ValueKey::Kind::Operator) {
+			if (key.payload != -1) {
+				state.useCounts[key.payload]++;
+			}
+			state.useCounts[key.right]++;
+		}
+	}
+	state.temporaries.assign(values.size(), -1);
+	optimizedNodeCount = values.size();
+
+	compile(treeSize - 1, state);
+	assert(state.stackDepth == 1);
+	if (state.maxDepth > MaxStackDepth) {
+		return EC::ErrorCode(
+			"Expression is too complex. It needs evaluation stack of depth %d. Max allowed is %d",
+			state.maxDepth,
+			MaxStackDepth
+		);
+	}
+	return EC::ErrorCode();
+}
+
+void Expression::compile(const int nodeIndex, CompileState& state) {
+	const Node& node = tree[nodeIndex];
+	if (node.isLeaf()) {
+		if (node.isSymbolic()) {
+			int slot = getVariableSlot(node.getName());
+			if (slot == -1) {
+				slot = variables.size();
+				variables.push_back(node.getName());
+			}
+			program.emplace_back(OpCode::PushVariable, slot);
+		} else {
+			program.emplace_back(OpCode::PushConstant, node.getValue());
+		}
+		state.stackDepth++;
+		state.maxDepth = std::max(state.maxDepth, state.stackDepth);
+		return;
+	}
+	// Subexpressions which are used more than once are computed the first time they are needed and
+	// then stored in a temporary. All other uses load the temporary.
+	const int valueNumber = state.valueNumbers[nodeIndex];
+	const bool isShared = state.useCounts[valueNumber] > 1;
+	if (isShared && state.temporaries[valueNumber] != -1) {
+		program.emplace_back(OpCode::LoadTemp, state.temporaries[valueNumber]);
+		state.stackDepth++;
+		state.maxDepth = std::max(state.maxDepth, state.stackDepth);
+		return;
+	}
+	if (node.getNumberOfArguments() == 2) {
+		compile(node.getLeftIndex(), state);
+		compile(nodeIndex - 1, state);
+		// Binary operator consumes two values and pushes one
+		state.stackDepth--;
+	} else {
+		compile(nodeIndex - 1, state);
+	}
+	switch (node.getOperator()) {
+		case Operator::Plus: program.emplace_back(OpCode::Plus); break;
+		case Operator::Minus: program.emplace_back(OpCode::Minus); break;
+		case Operator::UnaryMinus: program.emplace_back(OpCode::UnaryMinus); break;
+		case Operator::Multiply: program.emplace_back(OpCode::Multiply); break;
+		case Operator::Divide: program.emplace_back(OpCode::Divide); break;
+		case Operator::Power: program.emplace_back(OpCode::Power); break;
+		case Operator::Sin: program.emplace_back(OpCode::Sin); break;
+		case Operator::Cos: program.emplace_back(OpCode::Cos); break;
+		case Operator::Sqrt: program.emplace_back(OpCode::Sqrt); break;
+		default: assert(false);
+	}
+	if (isShared && state.temporaryCount < MaxTemporaryCount) {
+		state.temporaries[valueNumber] = state.temporaryCount++;
+		program.emplace_back(OpCode::StoreTemp, state.temporaries[valueNumber]);
+	}
+}
+
+/// Append a float constant in a form which is valid GLSL literal
+static void appendGLSLFloat(const float value, std::string& out) {
+	if (std::isnan(value)) {
+		out += "uintBitsToFloat(0x7fc00000u)";
+	} else if (std::isinf(value)) {
+		out += value > 0 ? "uintBitsToFloat(0x7f800000u)" : "uintBitsToFloat(0xff800000u)";
+	} else {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), value < 0 ? "(%.9g" : "%.9g", value);
+		out += buffer;
+		// Integer literals in GLSL are ints and there is no implicit conversion in all contexts
+		if (!strpbrk(buffer, ".eE")) {
+			out += ".0";
+		}
+		if (value < 0) {
+			out += ')';
+		}
+	}
+}
+
+void Expression::toGLSL(const char* functionName, const char* arguments, std::string& outSource) const {
+	for (const char variable : variables) {
+		if (!strchr(arguments, variable)) {
+			outSource += "uniform float ";
+			outSource += variable;
+			outSource += ";\n";
+		}
+	}
+
+	const std::string powName = std::string(functionName) + "Pow";
+	const bool hasPower = std::any_of(program.begin(), program.end(), [](const Instruction& instruction) {
+		return instruction.op == OpCode::Power;
+	});
+	if (hasPower) {
+		// GLSL pow is undefined for negative base and for zero base with non-positive exponent.
+		// The helper matches powf which is used on the CPU.
+		outSource += "float " + powName + "(float x, float y) {\n"
+			"\tif (y == 0.0) return 1.0;\n"
+			"\tif (x == 0.0) return y > 0.0 ? 0.0 : uintBitsToFloat(0x7f800000u);\n"
+			"\tfloat r = pow(abs(x), y);\n"
+			"\tif (x > 0.0) return r;\n"
+			"\tif (fract(y) != 0.0) return uintBitsToFloat(0x7fc00000u);\n"
+			"\treturn mod(y, 2.0) == 0.0 ? r : -r;\n"
+			"}\n";
+	}
+
+	outSource += "float ";
+	outSource += functionName;
+	outSource += '(';
+	for (const char* argument = arguments; *argument; ++argument) {
+		if (argument != arguments) {
+			outSource += ", ";
+		}
+		outSource += "float ";
+		outSource += *argument;
+	}
+	outSource += ") {\n";
+
+	// Run the program symbolically. The stack holds GLSL expressions for the values and each operator
+	// result is assigned to a new local variable, so common subexpressions are computed only once.
+	std::vector<std::string> stack;
+	std::string temporaries[MaxTemporaryCount];
+	int localCount = 0;
+	const auto define = [&](const std::string& value) -> std::string {
+		std::string name = "v" + std::to_string(localCount++);
+		outSource += "\tfloat " + name + " = " + value + ";\n";
+		return name;
+	};
+	const auto binary = [&](const char* op) {
+		const std::string right = std::move(stack.back());
+		stack.pop_back();
+		stack.back() = define(stack.back() + op + right);
+	};
+	const auto unary = [&](const char* function) {
+		stack.back() = define(function + stack.back() + ")");
+	};
+	for (const Instruction& instruction : program) {
+		switch (instruction.op) {
+			case OpCode::PushConstant: {
+				stack.emplace_back();
+				appendGLSLFloat(instruction.value, stack.back());
+			} break;
+			case OpCode::PushVariable: stack.emplace_back(1, variables[instruction.slot]); break;
+			case OpCode::StoreTemp: temporaries[instruction.slot] = stack.back(); break;
+			case OpCode::LoadTemp: stack.push_back(temporaries[instruction.slot]); break;
+			case OpCode::Plus: binary(" + "); break;
+			case OpCode::Minus: binary(" - "); break;
+			case OpCode::Multiply: binary(" * "); break;
+			case OpCode::Divide: binary(" / "); break;
+			case OpCode::Power: {
+				const std::string right = std::move(stack.back());
+				stack.pop_back();
+				stack.back() = define(powName + "(" + stack.back() + ", " + right + ")");
+			} break;
+			case OpCode::UnaryMinus: unary("-("); break;
+			case OpCode::Sin: unary("sin("); break;
+			case OpCode::Cos: unary("cos("); break;
+			case OpCode::Sqrt: unary("sqrt("); break;
+		}
+	}
+	assert(stack.size() == 1);
+	outSource += "\treturn " + stack.back() + ";\n}\n";
+}
+
+int Expression::getVariableCount() const {
+	return variables.size();
+}
+
+int Expression::getVariableSlot(const char name) const {
+	const std::vector<char>::const_iterator it = std::find(variables.begin(), variables.end(), name);
+	return it == variables.end() ? -1 : int(it - variables.begin());
+}
+
+int Expression::getParsedNodeCount() const {
+	return parsedNodeCount;
+}
+
+int Expression::getOptimizedNodeCount() const {
+	return optimizedNodeCount;
+}
+
 EC::ErrorCode Expression::evaluate(const std::unordered_map<char, float>* variables, float& outResult) const {
-	return evaluate(variables, outResult, tree.size() - 1);
+	// Resolve all variables once and then run the compiled program
+	float slots[MaxStackDepth];
+	const int variableCount = getVariableCount();
+	assert(variableCount <= MaxStackDepth);
+	for (int i = 0; i < variableCount; ++i) {
+		const char name = this->variables[i];
+		if (!variables) {
+			return EC::ErrorCode("Missing variable: %c. No variables table is passed at all", name);
+		}
+		const std::unordered_map<char, float>::const_iterator it = variables->find(name);
+		if (it == variables->end()) {
+			return EC::ErrorCode("Missing variable: %c", name);
+		}
+		slots[i] = it->second;
+	}
+	outResult = evaluate(slots);
+	return EC::ErrorCode();
+}
+
+float Expression::evaluate(const float* slots) const noexcept {
+	float stack[MaxStackDepth];
+	float temporaries[MaxTemporaryCount];
+	// Index of the top-most element in the stack
+	int top = -1;
+	for (const Instruction& instruction : program) {
+		switch (instruction.op) {
+			case OpCode::PushConstant: stack[++top] = instruction.value; break;
+			case OpCode::PushVariable: stack[++top] = slots[instruction.slot]; break;
+			case OpCode::StoreTemp: temporaries[instruction.slot] = stack[top]; break;
+			case OpCode::LoadTemp: stack[++top] = temporaries[instruction.slot]; break;
+			case OpCode::Plus: stack[top - 1] = stack[top - 1] + stack[top]; --top; break;
+			case OpCode::Minus: stack[top - 1] = stack[top - 1] - stack[top]; --top; break;
+			case OpCode::Multiply: stack[top - 1] = stack[top - 1] * stack[top]; --top; break;
+			case OpCode::Divide: stack[top - 1] = stack[top - 1] / stack[top]; --top; break;
+			case OpCode::Power: stack[top - 1] = powf(stack[top - 1], stack[top]); --top; break;
+			case OpCode::UnaryMinus: stack[top] = -stack[top]; break;
+			case OpCode::Sin: stack[top] = sinf(stack[top]); break;
+			case OpCode::Cos: stack[top] = cosf(stack[top]); break;
+			case OpCode::Sqrt: stack[top] = sqrtf(stack[top]); break;
+		}
+	}
+	assert(top == 0);
+	return stack[0];
+}
+
+Expression::Evaluator::Evaluator() :
+	expression(nullptr),
+	variableCount(0),
+	isIdentity(true)
+{ }
+
+EC::ErrorCode Expression::bind(const std::initializer_list<char> arguments, Evaluator& outEvaluator) const {
+	const int variableCount = getVariableCount();
+	if (variableCount > Evaluator::MaxVariableCount) {
+		return EC::ErrorCode(
+			"Expression has %d variables. At most %d can be bound.",
+			variableCount,
+			Evaluator::MaxVariableCount
+		);
+	}
+	bool isIdentity = true;
+	for (int slot = 0; slot < variableCount; ++slot) {
+		const char name = variables[slot];
+		const std::initializer_list<char>::const_iterator it = std::find(arguments.begin(), arguments.end(), name);
+		if (it == arguments.end()) {
+			return EC::ErrorCode("Unbound variable: %c", name);
+		}
+		const int argument = int(it - arguments.begin());
+		outEvaluator.argumentIndex[slot] = argument;
+		isIdentity &= argument == slot;
+	}
+	outEvaluator.expression = this;
+	outEvaluator.variableCount = variableCount;
+	outEvaluator.isIdentity = isIdentity;
+	return EC::ErrorCode();
 }
 
-EC::ErrorCode Expression::evaluate(
-	const std::unordered_map<char, float>* variables,
-	float& outResult,
-	const int nodeIdx
-) const {
-	const Node& node = tree[nodeIdx];
+float Expression::Evaluator::evaluate(const float* arguments) const noexcept {
+	if (isIdentity) {
+		return expression->evaluate(arguments);
+	}
+	float slots[MaxVariableCount];
+	for (int i = 0; i < variableCount; ++i) {
+		slots[i] = arguments[argumentIndex[i]];
+	}
+	return expression->evaluate(slots);
+}
+
+void Expression::Evaluator::evaluateBatch(const float* const* arguments, float* out, const size_t n) const noexcept {
+	if (isIdentity) {
+		expression->evaluateBatch(arguments, out, n);
+		return;
+	}
+	const float* slots[MaxVariableCount];
+	for (int i = 0; i < variableCount; ++i) {
+		slots[i] = arguments[argumentIndex[i]];
+	}
+	expression->evaluateBatch(slots, out, n);
+}
+
+void Expression::evaluateBatch(const float* xs, float* out, size_t n) const noexcept {
+	assert(getVariableCount() <= 1);
+	evaluateBatch(&xs, out, n);
+}
+
+void Expression::evaluateBatch(const float* const* slots, float* out, const size_t n) const noexcept {
+	const Kernels::KernelTable& kernels = Kernels::getKernelTable();
+	// Each element of the stack is a block of values. Variables are not copied, the stack points
+	// directly into the input arrays. Results of operators are written into the storage block which
+	// corresponds to the stack position of the result. Common subexpressions are copied into temporaries
+	// because the storage block of their stack position will be overwritten.
+	alignas(32) float storage[MaxStackDepth][BatchBlockSize];
+	alignas(32) float temporaries[MaxTemporaryCount][BatchBlockSize];
+	const float* stack[MaxStackDepth];
+	for (size_t blockStart = 0; blockStart < n; blockStart += BatchBlockSize) {
+		const int count = int(std::min(size_t(BatchBlockSize), n - blockStart));
+		int top = -1;
+		const auto binary = [&](const Kernels::BinaryKernel kernel) {
+			kernel(stack[top - 1], stack[top], storage[top - 1], count);
+			--top;
+			stack[top] = storage[top];
+		};
+		const auto unary = [&](const Kernels::UnaryKernel kernel) {
+			kernel(stack[top], storage[top], count);
+			stack[top] = storage[top];
+		};
+		for (const Instruction& instruction : program) {
+			switch (instruction.op) {
+				case OpCode::PushConstant: {
+					++top;
+					std::fill_n(storage[top], count, instruction.value);
+					stack[top] = storage[top];
+				} break;
+				case OpCode::PushVariable: {
+					++top;
+					stack[top] = slots[instruction.slot] + blockStart;
+				} break;
+				case OpCode::StoreTemp: {
+					std::copy_n(stack[top], count, temporaries[instruction.slot]);
+				} break;
+				case OpCode::LoadTemp: {
+					++top;
+					stack[top] = temporaries[instruction.slot];
+				} break;
+				case OpCode::Plus: binary(kernels.add); break;
+				case OpCode::Minus: binary(kernels.subtract); break;
+				case OpCode::Multiply: binary(kernels.multiply); break;
+				case OpCode::Divide: binary(kernels.divide); break;
+				case OpCode::Power: binary(kernels.power); break;
+				case OpCode::UnaryMinus: unary(kernels.negate); break;
+				case OpCode::Sin: unary(kernels.sin); break;
+				case OpCode::Cos: unary(kernels.cos); break;
+				case OpCode::Sqrt: unary(kernels.sqrt); break;
+			}
+		}
+		assert(top == 0);
+		std::copy_n(stack[0], count, out + blockStart);
+	}
+}
+
+// =========================================================
+// ================ INTERVAL ARITHMETIC ====================
+// =========================================================
+
+static Interval emptyInterval() {
+	return Interval(nanf(""), nanf(""));
+}
+
+static Interval infiniteInterval() {
+	return Interval(-INFINITY, INFINITY);
+}
+
+static bool isEmpty(const Interval& a) {
+	return std::isnan(a.lo) || std::isnan(a.hi);
+}
+
+static bool containsZero(const Interval& a) {
+	return a.lo <= 0.0f && a.hi >= 0.0f;
+}
+
+/// Smallest interval which contains all of the given values. Nan values (e.g. 0 * inf) are ignored.
+static Interval hull(const float a, const float b, const float c, const float d) {
+	return Interval(
+		std::fmin(std::fmin(a, b), std::fmin(c, d)),
+		std::fmax(std::fmax(a, b), std::fmax(c, d))
+	);
+}
+
+static Interval intervalMultiply(const Interval& a, const Interval& b) {
+	return hull(a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi);
+}
+
+static Interval intervalDivide(const Interval& a, const Interval& b) {
+	if (containsZero(b)) {
+		return infiniteInterval();
+	}
+	return intervalMultiply(a, Interval(1.0f / b.hi, 1.0f / b.lo));
+}
+
+/// Sine of interval. The cosine is computed as sin(x + pi/2), the shift is done in double precision
+static Interval intervalSin(const double lo, const double hi) {
+	constexpr double pi = 3.14159265358979323846;
+	if (std::isnan(lo) || std::isnan(hi)) {
+		return emptyInterval();
+	}
+	if (!(hi - lo < 2 * pi)) {
+		return Interval(-1.0f, 1.0f);
+	}
+	const double sinLo = std::sin(lo);
+	const double sinHi = std::sin(hi);
+	float resultLo = float(std::min(sinLo, sinHi));
+	float resultHi = float(std::max(sinLo, sinHi));
+	// The maximums are at pi/2 + 2k*pi and the minimums at -pi/2 + 2k*pi
+	const double firstMax = pi / 2 + std::ceil((lo - pi / 2) / (2 * pi)) * 2 * pi;
+	if (firstMax <= hi) {
+		resultHi = 1.0f;
+	}
+	const double firstMin = -pi / 2 + std::ceil((lo + pi / 2) / (2 * pi)) * 2 * pi;
+	if (firstMin <= hi) {
+		resultLo = -1.0f;
+	}
+	return Interval(resultLo, resultHi);
+}
+
+static Interval intervalPower(const Interval& base, const Interval& exponent) {
+	if (isEmpty(base) || isEmpty(exponent)) {
+		return emptyInterval();
+	}
+	if (exponent.lo == exponent.hi) {
+		const float y = exponent.lo;
+		if (y == 0.0f) {
+			return Interval(1.0f);
+		}
+		if (y == std::floor(y)) {
+			// Integer powers are defined for negative bases. They are monotonic on each side of zero and
+			// negative powers have a pole at zero.
+			if (y < 0.0f && containsZero(base)) {
+				return infiniteInterval();
+			}
+			const float powLo = powf(base.lo, y);
+			const float powHi = powf(base.hi, y);
+			const bool isEven = std::fmod(y, 2.0f) == 0.0f;
+			if (isEven && containsZero(base)) {
+				return Interval(0.0f, std::max(powLo, powHi));
+			}
+			return Interval(std::min(powLo, powHi), std::max(powLo, powHi));
+		}
+	} else if (base.lo < 0.0f) {
+		// The result for negative base is defined only for the integers in the exponent interval
+		return infiniteInterval();
+	}
+	// Non-integer exponents are defined only for non-negative base. For non-negative base pow is monotonic
+	// in each argument, so the extremes are at the corners.
+	if (base.hi < 0.0f) {
+		return emptyInterval();
+	}
+	const float lo = std::max(base.lo, 0.0f);
+	const float hi = base.hi;
+	return hull(
+		powf(lo, exponent.lo),
+		powf(lo, exponent.hi),
+		powf(hi, exponent.lo),
+		powf(hi, exponent.hi)
+	);
+}
+
+Interval Expression::evaluateInterval(const Interval* slots) const noexcept {
+	return evaluateInterval(tree.size() - 1, slots);
+}
+
+Interval Expression::evaluateInterval(const int nodeIndex, const Interval* slots) const noexcept {
+	constexpr double halfPi = 3.14159265358979323846 / 2;
+	const Node& node = tree[nodeIndex];
 	if (node.isLeaf()) {
 		if (node.isSymbolic()) {
-			if (!variables) {
-				return EC::ErrorCode("Missing variable: %c. No variables table is passed at all", node.getName());
+			return slots[getVariableSlot(node.getName())];
+		}
+		return Interval(node.getValue());
+	}
+	if (node.getNumberOfArguments() == 1) {
+		const Interval a = evaluateInterval(nodeIndex - 1, slots);
+		switch (node.getOperator()) {
+			case Operator::UnaryMinus: return Interval(-a.hi, -a.lo);
+			case Operator::Sin: return intervalSin(a.lo, a.hi);
+			case Operator::Cos: return intervalSin(double(a.lo) + halfPi, double(a.hi) + halfPi);
+			case Operator::Sqrt: {
+				if (a.hi < 0.0f || isEmpty(a)) {
+					return emptyInterval();
+				}
+				return Interval(sqrtf(std::max(a.lo, 0.0f)), sqrtf(a.hi));
 			}
-			const std::unordered_map<char, float>::const_iterator it = variables->find(node.getName());
-			if (it == variables->end()) {
-				return EC::ErrorCode("Missing variable: %c", node.getName());
-			} else {
-				outResult = it->second;
-				return EC::ErrorCode();
+			default: {
+				assert(false);
+				return emptyInterval();
 			}
-		} else {
-			outResult = node.getValue();
-			return EC::ErrorCode();
-		}
-	}
-	const uint8_t numOperands = node.getNumberOfArguments();
-	if (numOperands == 1) {
-		float childRes = 0;
-		RETURN_ON_ERROR_CODE(evaluate(variables, childRes, nodeIdx - 1));
-		outResult = evaluateOperator(node.getOperator(), childRes);
-	} else if (numOperands == 2) {
-		float left = 0, right = 0;
-		RETURN_ON_ERROR_CODE(evaluate(variables, left, node.getLeftIndex()));
-		RETURN_ON_ERROR_CODE(evaluate(variables, right, nodeIdx - 1));
-		outResult = evaluateOperator(node.getOperator(), left, right);
+		}
+	}
+	const Interval a = evaluateInterval(node.getLeftIndex(), slots);
+	const Interval b = evaluateInterval(nodeIndex - 1, slots);
+	switch (node.getOperator()) {
+		case Operator::Plus: return Interval(a.lo + b.lo, a.hi + b.hi);
+		case Operator::Minus: return Interval(a.lo - b.hi, a.hi - b.lo);
+		case Operator::Multiply: {
+			// Simplification rewrites x^2 as x*x. Multiplying the intervals would treat the operands as independent
+			// and lose the sign of the square, e.g. [-1;2]*[-1;2] = [-2;4] instead of [0;4].
+			if (a.lo == b.lo && a.hi == b.hi && containsZero(a) && isSameSubtree(node.getLeftIndex(), nodeIndex - 1)) {
+				return intervalPower(a, Interval(2.0f));
+			}
+			return intervalMultiply(a, b);
+		}
+		case Operator::Divide: return intervalDivide(a, b);
+		case Operator::Power: return intervalPower(a, b);
+		default: {
+			assert(false);
+			return emptyInterval();
+		}
+	}
+}
+
+bool Expression::isSameSubtree(const int lhs, const int rhs) const noexcept {
+	if (lhs == rhs) {
+		return true;
+	}
+	const Node& a = tree[lhs];
+	const Node& b = tree[rhs];
+	if (a.isLeaf() || b.isLeaf()) {
+		if (!a.isLeaf() || !b.isLeaf() || a.isSymbolic() != b.isSymbolic()) {
+			return false;
+		}
+		return a.isSymbolic() ? a.getName() == b.getName() : a.getValue() == b.getValue();
+	}
+	if (a.getOperator() != b.getOperator()) {
+		return false;
+	}
+	if (a.getNumberOfArguments() == 2 && !isSameSubtree(a.getLeftIndex(), b.getLeftIndex())) {
+		return false;
+	}
+	return isSameSubtree(lhs - 1, rhs - 1);
+}
+
+// =========================================================
+// =================== DIFFERENTIATION =====================
+// =========================================================
+
+bool Expression::dependsOn(const int nodeIndex, const char variable) const {
+	const Node& node = tree[nodeIndex];
+	if (node.isLeaf()) {
+		return node.isSymbolic() && node.getName() == variable;
+	}
+	if (node.getNumberOfArguments() == 2 && dependsOn(node.getLeftIndex(), variable)) {
+		return true;
+	}
+	return dependsOn(nodeIndex - 1, variable);
+}
+
+void Expression::copySubtree(const int nodeIndex, std::vector<Node>& out) const {
+	const Node& node = tree[nodeIndex];
+	if (node.isLeaf()) {
+		out.push_back(node);
+	} else if (node.getNumberOfArguments() == 1) {
+		copySubtree(nodeIndex - 1, out);
+		out.emplace_back(node.getOperator());
 	} else {
-		assert(false);
+		copySubtree(node.getLeftIndex(), out);
+		const int left = out.size() - 1;
+		copySubtree(nodeIndex - 1, out);
+		out.emplace_back(left, node.getOperator());
+	}
+}
+
+EC::ErrorCode Expression::differentiate(const int nodeIndex, const char variable, std::vector<Node>& out) const {
+	const Node& node = tree[nodeIndex];
+	if (!dependsOn(nodeIndex, variable)) {
+		out.emplace_back(0.0f);
+		return EC::ErrorCode();
 	}
+	if (node.isLeaf()) {
+		// The leaf depends on the variable, so it is the variable itself
+		out.emplace_back(1.0f);
+		return EC::ErrorCode();
+	}
+	// In the comments below u is the left (or the only) operand and v is the right operand.
+	// The root of each appended subtree is the last node in out, so the index of the left
+	// operand of a binary node is taken right after the left operand is appended.
+	if (node.getNumberOfArguments() == 1) {
+		const int operand = nodeIndex - 1;
+		switch (node.getOperator()) {
+			case Operator::UnaryMinus: {
+				// -u'
+				RETURN_ON_ERROR_CODE(differentiate(operand, variable, out));
+				out.emplace_back(Operator::UnaryMinus);
+			} break;
+			case Operator::Sin: {
+				// cos(u) * u'
+				copySubtree(operand, out);
+				out.emplace_back(Operator::Cos);
+				const int cosU = out.size() - 1;
+				RETURN_ON_ERROR_CODE(differentiate(operand, variable, out));
+				out.emplace_back(cosU, Operator::Multiply);
+			} break;
+			case Operator::Cos: {
+				// -sin(u) * u'
+				copySubtree(operand, out);
+				out.emplace_back(Operator::Sin);
+				out.emplace_back(Operator::UnaryMinus);
+				const int minusSinU = out.size() - 1;
+				RETURN_ON_ERROR_CODE(differentiate(operand, variable, out));
+				out.emplace_back(minusSinU, Operator::Multiply);
+			} break;
+			case Operator::Sqrt: {
+				// u' / (2 * sqrt(u))
+				RETURN_ON_ERROR_CODE(differentiate(operand, variable, out));
+				const int du = out.size() - 1;
+				out.emplace_back(2.0f);
+				const int two = out.size() - 1;
+				copySubtree(operand, out);
+				out.emplace_back(Operator::Sqrt);
+				out.emplace_back(two, Operator::Multiply);
+				out.emplace_back(du, Operator::Divide);
+			} break;
+			default: {
+				assert(false);
+				return EC::ErrorCode("Unknown unary operator");
+			}
+		}
+		return EC::ErrorCode();
+	}
+
+	const int u = node.getLeftIndex();
+	const int v = nodeIndex - 1;
+	const bool uDepends = dependsOn(u, variable);
+	const bool vDepends = dependsOn(v, variable);
+	switch (node.getOperator()) {
+		case Operator::Plus:
+		case Operator::Minus: {
+			// u' + v' or u' - v'
+			if (!vDepends) {
+				RETURN_ON_ERROR_CODE(differentiate(u, variable, out));
+			} else if (!uDepends) {
+				RETURN_ON_ERROR_CODE(differentiate(v, variable, out));
+				if (node.getOperator() == Operator::Minus) {
+					out.emplace_back(Operator::UnaryMinus);
+				}
+			} else {
+				RETURN_ON_ERROR_CODE(differentiate(u, variable, out));
+				const int du = out.size() - 1;
+				RETURN_ON_ERROR_CODE(differentiate(v, variable, out));
+				out.emplace_back(du, node.getOperator());
+			}
+		} break;
+		case Operator::Multiply: {
+			// u' * v + u * v'
+			int duV = -1;
+			if (uDepends) {
+				RETURN_ON_ERROR_CODE(differentiate(u, variable, out));
+				const int du = out.size() - 1;
+				copySubtree(v, out);
+				out.emplace_back(du, Operator::Multiply);
+				duV = out.size() - 1;
+			}
+			if (vDepends) {
+				copySubtree(u, out);
+				const int uCopy = out.size() - 1;
+				RETURN_ON_ERROR_CODE(differentiate(v, variable, out));
+				out.emplace_back(uCopy, Operator::Multiply);
+				if (duV != -1) {
+					out.emplace_back(duV, Operator::Plus);
+				}
+			}
+		} break;
+		case Operator::Divide: {
+			if (!vDepends) {
+				// u' / v
+				RETURN_ON_ERROR_CODE(differentiate(u, variable, out));
+				const int du = out.size() - 1;
+				copySubtree(v, out);
+				out.emplace_back(du, Operator::Divide);
+				break;
+			}
+			// (u' * v - u * v') / (v * v)
+			int duV = -1;
+			if (uDepends) {
+				RETURN_ON_ERROR_CODE(differentiate(u, variable, out));
+				const int du = out.size() - 1;
+				copySubtree(v, out);
+				out.emplace_back(du, Operator::Multiply);
+				duV = out.size() - 1;
+			}
+			copySubtree(u, out);
+			const int uCopy = out.size() - 1;
+			RETURN_ON_ERROR_CODE(differentiate(v, variable, out));
+			out.emplace_back(uCopy, Operator::Multiply);
+			if (duV != -1) {
+				out.emplace_back(duV, Operator::Minus);
+			} else {
+				out.emplace_back(Operator::UnaryMinus);
+			}
+			const int numerator = out.size() - 1;
+			copySubtree(v, out);
+			const int vCopy = out.size() - 1;
+			copySubtree(v, out);
+			out.emplace_back(vCopy, Operator::Multiply);
+			out.emplace_back(numerator, Operator::Divide);
+		} break;
+		case Operator::Power: {
+			if (!vDepends) {
+				// v * u^(v - 1) * u'
+				copySubtree(v, out);
+				const int vCopy = out.size() - 1;
+				copySubtree(u, out);
+				const int uCopy = out.size() - 1;
+				copySubtree(v, out);
+				const int exponent = out.size() - 1;
+				out.emplace_back(1.0f);
+				out.emplace_back(exponent, Operator::Minus);
+				out.emplace_back(uCopy, Operator::Power);
+				out.emplace_back(vCopy, Operator::Multiply);
+				const int factor = out.size() - 1;
+				RETURN_ON_ERROR_CODE(differentiate(u, variable, out));
+				out.emplace_back(factor, Operator::Multiply);
+			} else if (!uDepends && tree[u].isLeaf() && !tree[u].isSymbolic()) {
+				// u^v * ln(u) * v', where u is a number
+				copySubtree(nodeIndex, out);
+				const int power = out.size() - 1;
+				out.emplace_back(logf(tree[u].getValue()));
+				out.emplace_back(power, Operator::Multiply);
+				const int factor = out.size() - 1;
+				RETURN_ON_ERROR_CODE(differentiate(v, variable, out));
+				out.emplace_back(factor, Operator::Multiply);
+			} else {
+				return EC::ErrorCode(
+					"Cannot differentiate power whose exponent depends on %c. The derivative requires logarithm.",
+					variable
+				);
+			}
+		} break;
+		default: {
+			assert(false);
+			return EC::ErrorCode("Unknown binary operator");
+		}
+	}
+	return EC::ErrorCode();
+}
+
+EC::ErrorCode Expression::derivative(const char variable, Expression& outDerivative) const {
+	std::vector<Node> derivativeTree;
+	RETURN_ON_ERROR_CODE(differentiate(tree.size() - 1, variable, derivativeTree));
+	outDerivative.tree.clear();
+	outDerivative.program.clear();
+	outDerivative.variables.clear();
+	outDerivative.parsedNodeCount = derivativeTree.size();
+	outDerivative.tree.reserve(derivativeTree.size());
+	outDerivative.simplify(derivativeTree.data(), derivativeTree.size() - 1);
+	RETURN_ON_ERROR_CODE(outDerivative.compile(std::pmr::get_default_resource()));
 	return EC::ErrorCode();
 }
 
-}
\ No newline at end of file
+EC::ErrorCode Expression::specialize(const char* parameters, const float* values, Expression& outSpecialized) const {
+	assert(&outSpecialized != this);
+	std::vector<Node> specializedTree(tree.begin(), tree.end());
+	for (Node& node : specializedTree) {
+		if (node.isLeaf() && node.isSymbolic()) {
+			const char* parameter = strchr(parameters, node.getName());
+			if (parameter != nullptr) {
+				node = Node(values[parameter - parameters]);
+			}
+		}
+	}
+	outSpecialized.tree.clear();
+	outSpecialized.program.clear();
+	outSpecialized.variables.clear();
+	outSpecialized.parsedNodeCount = parsedNodeCount;
+	outSpecialized.tree.reserve(specializedTree.size());
+	outSpecialized.simplify(specializedTree.data(), specializedTree.size() - 1);
+	RETURN_ON_ERROR_CODE(outSpecialized.compile(std::pmr::get_default_resource()));
+	return EC::ErrorCode();
+}
+
+}
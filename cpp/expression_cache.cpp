@@ -0,0 +1,109 @@
+#include "expression_cache.h"
+#include "error_code.h"
+#include "profiler.h"
+#include <cctype>
+#include <functional>
+#include <memory_resource>
+#include <string_view>
+
+namespace MathViz {
+
+	/// Characters which can be part of multi-character tokens (numbers, functions and constants)
+	static bool isWordChar(const char c) {
+		return std::isalnum(static_cast<unsigned char>(c)) || c == '.';
+	}
+
+	ExpressionCache::ExpressionCache() :
+		arenaBuffer(new unsigned char[ArenaSize]),
+		useCounter(0),
+		hitCount(0),
+		missCount(0)
+	{ }
+
+	ExpressionCache& ExpressionCache::getInstance() {
+		static ExpressionCache cache;
+		return cache;
+	}
+
+	void ExpressionCache::normalize(const char* expression) {
+		normalizedKey.clear();
+		bool pendingSpace = false;
+		for (const char* it = expression; *it; ++it) {
+			if (std::isspace(static_cast<unsigned char>(*it))) {
+				pendingSpace = true;
+				continue;
+			}
+			if (pendingSpace && !normalizedKey.empty() && isWordChar(normalizedKey.back()) && isWordChar(*it)) {
+				normalizedKey.push_back(' ');
+			}
+			pendingSpace = false;
+			normalizedKey.push_back(*it);
+		}
+	}
+
+	EC::ErrorCode ExpressionCache::get(const char* expression, std::shared_ptr<const Expression>& outExpression) {
+		std::lock_guard<std::mutex> lock(mutex);
+		normalize(expression);
+		const uint64_t hash = std::hash<std::string_view>()(normalizedKey);
+		useCounter++;
+
+		Entry* leastRecentlyUsed = &entries[0];
+		for (Entry& entry : entries) {
+			if (entry.lastUse != 0 && entry.hash == hash && entry.key == normalizedKey) {
+				entry.lastUse = useCounter;
+				hitCount++;
+				outExpression = entry.expression;
+				return EC::ErrorCode();
+			}
+			if (entry.lastUse < leastRecentlyUsed->lastUse) {
+				leastRecentlyUsed = &entry;
+			}
+		}
+
+		missCount++;
+		Entry& victim = *leastRecentlyUsed;
+		// Reuse the memory of the evicted expression if nobody outside of the cache holds it.
+		// In that case the entry is invalid until the new expression is parsed.
+		std::shared_ptr<Expression> parsed;
+		if (victim.expression && victim.expression.use_count() == 1) {
+			parsed = victim.expression;
+			victim.lastUse = 0;
+			victim.key.clear();
+		} else {
+			parsed = std::make_shared<Expression>();
+		}
+
+		{
+			MATHVIZ_PROFILE_CPU("Parse expression");
+			std::pmr::monotonic_buffer_resource arena(arenaBuffer.get(), ArenaSize);
+			RETURN_ON_ERROR_CODE(parsed->init(normalizedKey.c_str(), &arena));
+		}
+
+		victim.key.assign(normalizedKey);
+		victim.hash = hash;
+		victim.lastUse = useCounter;
+		victim.expression = std::move(parsed);
+		outExpression = victim.expression;
+		return EC::ErrorCode();
+	}
+
+	void ExpressionCache::clear() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (Entry& entry : entries) {
+			entry.key.clear();
+			entry.expression.reset();
+			entry.hash = 0;
+			entry.lastUse = 0;
+		}
+	}
+
+	int64_t ExpressionCache::getHitCount() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return hitCount;
+	}
+
+	int64_t ExpressionCache::getMissCount() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return missCount;
+	}
+}
@@ -0,0 +1,233 @@
+#include "expression_kernels.h"
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define MATHVIZ_X86
+	#include <emmintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	#define MATHVIZ_NEON
+	#include <arm_neon.h>
+#endif
+
+namespace MathViz {
+namespace Kernels {
+
+// =========================================================
+// ====================== SCALAR ===========================
+// =========================================================
+
+static void scalarAdd(const float* a, const float* b, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = a[i] + b[i];
+}
+
+static void scalarSubtract(const float* a, const float* b, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = a[i] - b[i];
+}
+
+static void scalarMultiply(const float* a, const float* b, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = a[i] * b[i];
+}
+
+static void scalarDivide(const float* a, const float* b, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = a[i] / b[i];
+}
+
+static void scalarPower(const float* a, const float* b, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = powf(a[i], b[i]);
+}
+
+static void scalarNegate(const float* a, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = -a[i];
+}
+
+static void scalarSin(const float* a, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = sinf(a[i]);
+}
+
+static void scalarCos(const float* a, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = cosf(a[i]);
+}
+
+static void scalarSqrt(const float* a, float* out, int count) {
+	for (int i = 0; i < count; ++i) out[i] = sqrtf(a[i]);
+}
+
+const KernelTable& getScalarKernelTable() {
+	static const KernelTable table = {
+		&scalarAdd,
+		&scalarSubtract,
+		&scalarMultiply,
+		&scalarDivide,
+		&scalarPower,
+		&scalarNegate,
+		&scalarSin,
+		&scalarCos,
+		&scalarSqrt,
+		"Scalar"
+	};
+	return table;
+}
+
+// =========================================================
+// ======================= SSE2 ============================
+// =========================================================
+
+#ifdef MATHVIZ_X86
+namespace {
+	struct SSE2Traits {
+		using F = __m128;
+		using M = __m128;
+		using I = __m128i;
+		static constexpr int Width = 4;
+		static F load(const float* p) { return _mm_loadu_ps(p); }
+		static void store(float* p, F a) { _mm_storeu_ps(p, a); }
+		static F set1(float a) { return _mm_set1_ps(a); }
+		static F add(F a, F b) { return _mm_add_ps(a, b); }
+		static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+		static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+		static F div(F a, F b) { return _mm_div_ps(a, b); }
+		static F madd(F a, F b, F c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+		static F sqrt(F a) { return _mm_sqrt_ps(a); }
+		static F min(F a, F b) { return _mm_min_ps(a, b); }
+		static F max(F a, F b) { return _mm_max_ps(a, b); }
+		static F neg(F a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+		static F abs(F a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+		static M cmplt(F a, F b) { return _mm_cmplt_ps(a, b); }
+		static M cmple(F a, F b) { return _mm_cmple_ps(a, b); }
+		static M cmpgt(F a, F b) { return _mm_cmpgt_ps(a, b); }
+		static M cmpge(F a, F b) { return _mm_cmpge_ps(a, b); }
+		static M cmpeq(F a, F b) { return _mm_cmpeq_ps(a, b); }
+		static M andM(M a, M b) { return _mm_and_ps(a, b); }
+		static M notM(M a) { return _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+		static F select(M m, F a, F b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+		static bool anyTrue(M m) { return _mm_movemask_ps(m) != 0; }
+		static I set1I(int a) { return _mm_set1_epi32(a); }
+		static I roundToInt(F a) { return _mm_cvtps_epi32(a); }
+		static F toFloat(I a) { return _mm_cvtepi32_ps(a); }
+		static I asInt(F a) { return _mm_castps_si128(a); }
+		static F asFloat(I a) { return _mm_castsi128_ps(a); }
+		static I addI(I a, I b) { return _mm_add_epi32(a, b); }
+		static I subI(I a, I b) { return _mm_sub_epi32(a, b); }
+		static I andI(I a, I b) { return _mm_and_si128(a, b); }
+		static I orI(I a, I b) { return _mm_or_si128(a, b); }
+		static M cmpeqI(I a, I b) { return _mm_castsi128_ps(_mm_cmpeq_epi32(a, b)); }
+		template<int N> static I shiftLeftI(I a) { return _mm_slli_epi32(a, N); }
+		template<int N> static I shiftRightLogicalI(I a) { return _mm_srli_epi32(a, N); }
+		template<int N> static I shiftRightArithI(I a) { return _mm_srai_epi32(a, N); }
+	};
+}
+
+static const KernelTable& getSSE2KernelTable() {
+	static const KernelTable table = makeKernelTable<SSE2Traits>("SSE2");
+	return table;
+}
+
+/// Check if the CPU and the OS support AVX2 and FMA.
+static bool hasAVX2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	const bool hasFMA = (info[2] & (1 << 12)) != 0;
+	const bool hasOSXSAVE = (info[2] & (1 << 27)) != 0;
+	if (!hasFMA || !hasOSXSAVE) {
+		return false;
+	}
+	// The OS must save the YMM registers on context switch
+	if ((_xgetbv(0) & 0x6) != 0x6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+#endif
+
+// =========================================================
+// ======================= NEON ============================
+// =========================================================
+
+#ifdef MATHVIZ_NEON
+namespace {
+	struct NEONTraits {
+		using F = float32x4_t;
+		using M = uint32x4_t;
+		using I = int32x4_t;
+		static constexpr int Width = 4;
+		static F load(const float* p) { return vld1q_f32(p); }
+		static void store(float* p, F a) { vst1q_f32(p, a); }
+		static F set1(float a) { return vdupq_n_f32(a); }
+		static F add(F a, F b) { return vaddq_f32(a, b); }
+		static F sub(F a, F b) { return vsubq_f32(a, b); }
+		static F mul(F a, F b) { return vmulq_f32(a, b); }
+		static F div(F a, F b) { return vdivq_f32(a, b); }
+		static F madd(F a, F b, F c) { return vfmaq_f32(c, a, b); }
+		static F sqrt(F a) { return vsqrtq_f32(a); }
+		static F min(F a, F b) { return vminq_f32(a, b); }
+		static F max(F a, F b) { return vmaxq_f32(a, b); }
+		static F neg(F a) { return vnegq_f32(a); }
+		static F abs(F a) { return vabsq_f32(a); }
+		static M cmplt(F a, F b) { return vcltq_f32(a, b); }
+		static M cmple(F a, F b) { return vcleq_f32(a, b); }
+		static M cmpgt(F a, F b) { return vcgtq_f32(a, b); }
+		static M cmpge(F a, F b) { return vcgeq_f32(a, b); }
+		static M cmpeq(F a, F b) { return vceqq_f32(a, b); }
+		static M andM(M a, M b) { return vandq_u32(a, b); }
+		static M notM(M a) { return vmvnq_u32(a); }
+		static F select(M m, F a, F b) { return vbslq_f32(m, a, b); }
+		static bool anyTrue(M m) { return vmaxvq_u32(m) != 0; }
+		static I set1I(int a) { return vdupq_n_s32(a); }
+		static I roundToInt(F a) { return vcvtnq_s32_f32(a); }
+		static F toFloat(I a) { return vcvtq_f32_s32(a); }
+		static I asInt(F a) { return vreinterpretq_s32_f32(a); }
+		static F asFloat(I a) { return vreinterpretq_f32_s32(a); }
+		static I addI(I a, I b) { return vaddq_s32(a, b); }
+		static I subI(I a, I b) { return vsubq_s32(a, b); }
+		static I andI(I a, I b) { return vandq_s32(a, b); }
+		static I orI(I a, I b) { return vorrq_s32(a, b); }
+		static M cmpeqI(I a, I b) { return vceqq_s32(a, b); }
+		template<int N> static I shiftLeftI(I a) { return vshlq_n_s32(a, N); }
+		template<int N> static I shiftRightLogicalI(I a) {
+			return vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(a), N));
+		}
+		template<int N> static I shiftRightArithI(I a) { return vshrq_n_s32(a, N); }
+	};
+}
+
+static const KernelTable& getNEONKernelTable() {
+	static const KernelTable table = makeKernelTable<NEONTraits>("NEON");
+	return table;
+}
+#endif
+
+/// Pick the best kernel table for the current CPU
+static const KernelTable& detectKernelTable() {
+#if defined(MATHVIZ_X86)
+	const KernelTable* avx2 = getAVX2KernelTable();
+	if (avx2 && hasAVX2()) {
+		return *avx2;
+	}
+	return getSSE2KernelTable();
+#elif defined(MATHVIZ_NEON)
+	return getNEONKernelTable();
+#else
+	return getScalarKernelTable();
+#endif
+}
+
+const KernelTable& getKernelTable() {
+	static const KernelTable& table = detectKernelTable();
+	return table;
+}
+
+}
+}
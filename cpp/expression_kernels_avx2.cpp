@@ -0,0 +1,75 @@
+// This file must be compiled with AVX2 and FMA enabled. The build system sets the flags only for it, the
+// kernels are used only after runtime check that the CPU supports the instructions.
+#include "expression_kernels.h"
+
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#include <immintrin.h>
+
+namespace MathViz {
+namespace Kernels {
+
+namespace {
+	struct AVX2Traits {
+		using F = __m256;
+		using M = __m256;
+		using I = __m256i;
+		static constexpr int Width = 8;
+		static F load(const float* p) { return _mm256_loadu_ps(p); }
+		static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+		static F set1(float a) { return _mm256_set1_ps(a); }
+		static F add(F a, F b) { return _mm256_add_ps(a, b); }
+		static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+		static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+		static F div(F a, F b) { return _mm256_div_ps(a, b); }
+		static F madd(F a, F b, F c) { return _mm256_fmadd_ps(a, b, c); }
+		static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+		static F min(F a, F b) { return _mm256_min_ps(a, b); }
+		static F max(F a, F b) { return _mm256_max_ps(a, b); }
+		static F neg(F a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+		static F abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+		static M cmplt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static M cmple(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+		static M cmpgt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+		static M cmpge(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+		static M cmpeq(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+		static M andM(M a, M b) { return _mm256_and_ps(a, b); }
+		static M notM(M a) { return _mm256_xor_ps(a, _mm256_castsi256_ps(_mm256_set1_epi32(-1))); }
+		static F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+		static bool anyTrue(M m) { return _mm256_movemask_ps(m) != 0; }
+		static I set1I(int a) { return _mm256_set1_epi32(a); }
+		static I roundToInt(F a) { return _mm256_cvtps_epi32(a); }
+		static F toFloat(I a) { return _mm256_cvtepi32_ps(a); }
+		static I asInt(F a) { return _mm256_castps_si256(a); }
+		static F asFloat(I a) { return _mm256_castsi256_ps(a); }
+		static I addI(I a, I b) { return _mm256_add_epi32(a, b); }
+		static I subI(I a, I b) { return _mm256_sub_epi32(a, b); }
+		static I andI(I a, I b) { return _mm256_and_si256(a, b); }
+		static I orI(I a, I b) { return _mm256_or_si256(a, b); }
+		static M cmpeqI(I a, I b) { return _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)); }
+		template<int N> static I shiftLeftI(I a) { return _mm256_slli_epi32(a, N); }
+		template<int N> static I shiftRightLogicalI(I a) { return _mm256_srli_epi32(a, N); }
+		template<int N> static I shiftRightArithI(I a) { return _mm256_srai_epi32(a, N); }
+	};
+}
+
+const KernelTable* getAVX2KernelTable() {
+	static const KernelTable table = makeKernelTable<AVX2Traits>("AVX2");
+	return &table;
+}
+
+}
+}
+
+#else
+
+namespace MathViz {
+namespace Kernels {
+
+const KernelTable* getAVX2KernelTable() {
+	return nullptr;
+}
+
+}
+}
+
+#endif
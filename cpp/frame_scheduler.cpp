@@ -0,0 +1,100 @@
+#include <algorithm>
+#include "GLFW/glfw3.h"
+#include "frame_scheduler.h"
+
+namespace MathViz {
+	FrameScheduler::FrameScheduler() :
+		pendingFrames(FramesPerInvalidate),
+		renderedFrameCount(0),
+		continuous(false)
+	{ }
+
+	void FrameScheduler::invalidate() {
+		pendingFrames = FramesPerInvalidate;
+		glfwPostEmptyEvent();
+	}
+
+	void FrameScheduler::setContinuous(bool continuousIn) {
+		continuous = continuousIn;
+	}
+
+	bool FrameScheduler::isContinuous() const {
+		return continuous;
+	}
+
+	FrameScheduler::TimelineId FrameScheduler::startTimeline(double duration) {
+		const Timeline timeline{glfwGetTime(), duration, true};
+		// Reuse the slots of timelines which ended, ids stay small
+		for (int i = 0; i < int(timelines.size()); ++i) {
+			if (!timelines[i].active) {
+				timelines[i] = timeline;
+				return i;
+			}
+		}
+		timelines.push_back(timeline);
+		return TimelineId(timelines.size() - 1);
+	}
+
+	void FrameScheduler::stopTimeline(TimelineId id) {
+		if (isTimelineActive(id)) {
+			timelines[id].active = false;
+			// Draw the state after the timeline
+			pendingFrames = std::max(pendingFrames.load(), 1);
+		}
+	}
+
+	bool FrameScheduler::isTimelineActive(TimelineId id) const {
+		return id >= 0 && id < int(timelines.size()) && timelines[id].active;
+	}
+
+	double FrameScheduler::getTimelineTime(TimelineId id) const {
+		if (!isTimelineActive(id)) {
+			return 0.0;
+		}
+		return glfwGetTime() - timelines[id].start;
+	}
+
+	bool FrameScheduler::updateTimelines() {
+		const double now = glfwGetTime();
+		bool anyActive = false;
+		for (int i = 0; i < int(timelines.size()); ++i) {
+			Timeline& timeline = timelines[i];
+			if (timeline.active && timeline.duration > 0.0 && now - timeline.start >= timeline.duration) {
+				stopTimeline(i);
+			}
+			anyActive |= timeline.active;
+		}
+		return anyActive;
+	}
+
+	bool FrameScheduler::needsFrame() {
+		const bool animating = updateTimelines();
+		return continuous || animating || pendingFrames.load() > 0;
+	}
+
+	bool FrameScheduler::waitForFrame(double idleTimeout) {
+		if (needsFrame()) {
+			glfwPollEvents();
+			return true;
+		}
+		const double waitStart = glfwGetTime();
+		glfwWaitEventsTimeout(idleTimeout);
+		// Returning before the timeout means that an event arrived. The events of all windows wake up the wait,
+		// including the ImGui viewports which have their own callbacks, so this catches all input.
+		if (glfwGetTime() - waitStart < idleTimeout) {
+			pendingFrames = FramesPerInvalidate;
+		}
+		return needsFrame();
+	}
+
+	void FrameScheduler::frameRendered() {
+		renderedFrameCount++;
+		int pending = pendingFrames.load();
+		// invalidate from another thread wins over the decrement
+		while (pending > 0 && !pendingFrames.compare_exchange_weak(pending, pending - 1)) {}
+	}
+
+	int64_t FrameScheduler::getRenderedFrameCount() const {
+		return renderedFrameCount;
+	}
+}
@@ -0,0 +1,224 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "frame_sink.h"
+#include "error_code.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#ifndef _WIN32
+	#include <csignal>
+	#include <fcntl.h>
+	#include <spawn.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
+	extern char** environ;
+#endif
+
+namespace MathViz {
+	/// Check that the pattern has exactly one integer conversion and no other conversions except %%.
+	/// The pattern is passed to snprintf, so any other conversion would read arguments which are not there.
+	static bool isValidFramePattern(const std::string& pattern) {
+		int conversions = 0;
+		for (size_t i = 0; i < pattern.size(); ++i) {
+			if (pattern[i] != '%') {
+				continue;
+			}
+			++i;
+			if (i < pattern.size() && pattern[i] == '%') {
+				continue;
+			}
+			while (i < pattern.size() && strchr("-+ #0", pattern[i])) {
+				++i;
+			}
+			while (i < pattern.size() && isdigit(static_cast<unsigned char>(pattern[i]))) {
+				++i;
+			}
+			if (i < pattern.size() && pattern[i] == '.') {
+				++i;
+				while (i < pattern.size() && isdigit(static_cast<unsigned char>(pattern[i]))) {
+					++i;
+				}
+			}
+			if (i == pattern.size() || !strchr("di", pattern[i])) {
+				return false;
+			}
+			++conversions;
+		}
+		return conversions == 1;
+	}
+
+	PNGSequenceSink::PNGSequenceSink(std::string pattern) :
+		pattern(std::move(pattern)),
+		width(0),
+		height(0)
+	{ }
+
+	EC::ErrorCode PNGSequenceSink::begin(int widthIn, int heightIn) {
+		if (!isValidFramePattern(pattern)) {
+			return EC::ErrorCode(-1, "Invalid file name pattern %s. It must have exactly one %%d conversion for the frame index", pattern.c_str());
+		}
+		width = widthIn;
+		height = heightIn;
+		// glReadPixels returns the rows bottom to top
+		stbi_flip_vertically_on_write(1);
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode PNGSequenceSink::writeFrame(const unsigned char* rgba, int index) {
+		const int length = snprintf(nullptr, 0, pattern.c_str(), index);
+		std::vector<char> fileName(length + 1);
+		snprintf(fileName.data(), fileName.size(), pattern.c_str(), index);
+		if (!stbi_write_png(fileName.data(), width, height, 4, rgba, width * 4)) {
+			return EC::ErrorCode(-1, "Failed to write frame %d to %s", index, fileName.data());
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode PNGSequenceSink::end() {
+		stbi_flip_vertically_on_write(0);
+		return EC::ErrorCode();
+	}
+
+	FFmpegPipeSink::FFmpegPipeSink(std::string path, int fps) :
+		path(std::move(path)),
+		pipe(nullptr),
+		pid(-1),
+		fps(fps),
+		width(0),
+		height(0)
+	{ }
+
+#ifndef _WIN32
+	/// Wait for the child process to exit
+	/// @returns The status reported by waitpid or -1 if waiting failed
+	static int waitForProcess(int pid) {
+		int status = 0;
+		while (waitpid(pid_t(pid), &status, 0) == -1) {
+			if (errno != EINTR) {
+				return -1;
+			}
+		}
+		return status;
+	}
+#endif
+
+	FFmpegPipeSink::~FFmpegPipeSink() {
+#ifdef _WIN32
+		if (pipe) {
+			_pclose(pipe);
+		}
+#else
+		if (pipe) {
+			fclose(pipe);
+		}
+		if (pid != -1) {
+			waitForProcess(pid);
+		}
+#endif
+	}
+
+	EC::ErrorCode FFmpegPipeSink::begin(int widthIn, int heightIn) {
+		width = widthIn;
+		height = heightIn;
+		const std::string size = std::to_string(width) + "x" + std::to_string(height);
+		const std::string rate = std::to_string(fps);
+		// The frames are bottom to top, vflip turns them around. yuv420p is the format most players support.
+		const char* args[] = {
+			"ffmpeg", "-y", "-loglevel", "error", "-f", "rawvideo", "-pix_fmt", "rgba", "-s", size.c_str(),
+			"-r", rate.c_str(), "-i", "-", "-vf", "vflip", "-pix_fmt", "yuv420p", path.c_str(), nullptr
+		};
+#ifdef _WIN32
+		// _popen always goes through cmd.exe. Inside double quotes only " and % are special, so they are rejected
+		// instead of escaped.
+		if (path.find_first_of("\"%") != std::string::npos) {
+			return EC::ErrorCode(-1, "The video path %s must not contain \" or %%", path.c_str());
+		}
+		// The last argument is the path, the others do not need quotes
+		const int argCount = sizeof(args) / sizeof(args[0]) - 1;
+		std::string command;
+		for (int i = 0; i < argCount - 1; ++i) {
+			command += args[i];
+			command += ' ';
+		}
+		command += "\"" + path + "\"";
+		pipe = _popen(command.c_str(), "wb");
+		if (pipe == nullptr) {
+			return EC::ErrorCode(errno, "Failed to start ffmpeg: %s", strerror(errno));
+		}
+#else
+		// If ffmpeg exits early writing to the pipe raises SIGPIPE, which would kill the process. With the
+		// signal ignored fwrite fails with EPIPE and writeFrame reports the error.
+		signal(SIGPIPE, SIG_IGN);
+		// ffmpeg is started directly with an argument array, so the path is never seen by a shell
+		int fds[2];
+		if (::pipe(fds) != 0) {
+			return EC::ErrorCode(errno, "Failed to create pipe for ffmpeg: %s", strerror(errno));
+		}
+		fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions, fds[0]);
+		pid_t child = -1;
+		const int spawnErr = posix_spawnp(&child, "ffmpeg", &actions, nullptr, const_cast<char* const*>(args), environ);
+		posix_spawn_file_actions_destroy(&actions);
+		close(fds[0]);
+		if (spawnErr != 0) {
+			close(fds[1]);
+			return EC::ErrorCode(spawnErr, "Failed to start ffmpeg: %s", strerror(spawnErr));
+		}
+		pid = child;
+		pipe = fdopen(fds[1], "w");
+		if (pipe == nullptr) {
+			const int err = errno;
+			close(fds[1]);
+			waitForProcess(pid);
+			pid = -1;
+			return EC::ErrorCode(err, "Failed to open pipe to ffmpeg: %s", strerror(err));
+		}
+#endif
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode FFmpegPipeSink::writeFrame(const unsigned char* rgba, int index) {
+		const size_t size = size_t(width) * height * 4;
+		if (fwrite(rgba, 1, size, pipe) != size) {
+			return EC::ErrorCode(errno, "Failed to write frame %d to ffmpeg: %s", index, strerror(errno));
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode FFmpegPipeSink::end() {
+#ifdef _WIN32
+		if (pipe == nullptr) {
+			return EC::ErrorCode();
+		}
+		const int status = _pclose(pipe);
+		pipe = nullptr;
+		if (status != 0) {
+			return EC::ErrorCode(status, "ffmpeg failed to encode %s", path.c_str());
+		}
+#else
+		// Closing the pipe signals the end of the input to ffmpeg
+		if (pipe != nullptr) {
+			fclose(pipe);
+			pipe = nullptr;
+		}
+		if (pid == -1) {
+			return EC::ErrorCode();
+		}
+		const int status = waitForProcess(pid);
+		pid = -1;
+		if (status == -1) {
+			return EC::ErrorCode(errno, "Failed to wait for ffmpeg: %s", strerror(errno));
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			return EC::ErrorCode(status, "ffmpeg failed to encode %s", path.c_str());
+		}
+#endif
+		return EC::ErrorCode();
+	}
+}
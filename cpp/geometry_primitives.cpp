@@ -2,15 +2,233 @@
 #include "error_code.h"
 #include "context.h"
 #include "material.h"
+#include "expression.h"
+#include "data_series.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
 
 extern 	MathViz::Context ctx;
 
 namespace MathViz {
 
+	ThreadPool& getThreadPool() {
+		return ctx.getThreadPool();
+	}
+
+	LineBatch::LineBatch() :
+		capacity(0),
+		uploadedCount(0)
+	{ }
+
+	EC::ErrorCode LineBatch::init() {
+		capacity = 0;
+		uploadedCount = 0;
+		segments.clear();
+		RETURN_ON_ERROR_CODE(vao.init());
+		return EC::ErrorCode();
+	}
+
+	void LineBatch::clear() {
+		segments.clear();
+	}
+
+	void LineBatch::addLine(const glm::vec3& start, const glm::vec3& end, const glm::vec4& color, float width) {
+		segments.push_back(Segment{start, end, color, width});
+	}
+
+	void LineBatch::addPolyline(const glm::vec3* points, int count, const glm::vec4& color, float width, bool closed) {
+		if (count < 2) {
+			return;
+		}
+		segments.reserve(segments.size() + count);
+		for (int i = 0; i + 1 < count; ++i) {
+			segments.push_back(Segment{points[i], points[i + 1], color, width});
+		}
+		if (closed) {
+			segments.push_back(Segment{points[count - 1], points[0], color, width});
+		}
+	}
+
+	EC::ErrorCode LineBatch::upload() {
+		MATHVIZ_PROFILE_CPU("LineBatch::upload");
+		const int count = int(segments.size());
+		const int64_t byteSize = int64_t(count) * sizeof(Segment);
+		if (count > capacity) {
+			// Grow geometrically so that a few more segments do not reallocate every frame
+			const int newCapacity = std::max(count, 2 * capacity);
+			GLUtils::BufferLayout layout;
+			layout.addAttribute(GLUtils::VertexType::Float, 3);
+			layout.addAttribute(GLUtils::VertexType::Float, 3);
+			layout.addAttribute(GLUtils::VertexType::Float, 4);
+			layout.addAttribute(GLUtils::VertexType::Float, 1);
+			layout.setInstanceDivisor(1);
+			static_assert(sizeof(Segment) == 11 * sizeof(float), "Segment must match the buffer layout");
+			segmentBuffer.freeMem();
+			RETURN_ON_ERROR_CODE(vao.bind());
+			RETURN_ON_ERROR_CODE(segmentBuffer.init(int64_t(newCapacity) * sizeof(Segment), nullptr, layout));
+			RETURN_ON_ERROR_CODE(vao.unbind());
+			capacity = newCapacity;
+		}
+		if (count > 0) {
+			RETURN_ON_ERROR_CODE(segmentBuffer.upload(0, byteSize, segments.data()));
+		}
+		uploadedCount = count;
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode LineBatch::draw() const {
+		if (uploadedCount == 0) {
+			return EC::ErrorCode();
+		}
+		RETURN_ON_ERROR_CODE(vao.bind());
+		RETURN_ON_GL_ERROR(glDrawArraysInstanced(GL_TRIANGLES, 0, 6, uploadedCount));
+		RETURN_ON_ERROR_CODE(vao.unbind());
+		return EC::ErrorCode();
+	}
+
+	int LineBatch::getSegmentCount() const {
+		return int(segments.size());
+	}
+
+	CurveBatch::CurveBatch() :
+		vertexBuffer(StorageBindings::Vertices),
+		recordBuffer(StorageBindings::DrawRecords),
+		materialBuffer(StorageBindings::Materials),
+		vertexCapacity(0),
+		recordCapacity(0),
+		materialCapacity(0),
+		commandCapacity(0),
+		verticesDirty(false),
+		commandsDirty(false),
+		recordsDirty(false),
+		materialsDirty(false),
+		uploadedDrawCount(0)
+	{ }
+
+	EC::ErrorCode CurveBatch::init() {
+		clear();
+		vertexCapacity = 0;
+		recordCapacity = 0;
+		materialCapacity = 0;
+		commandCapacity = 0;
+		uploadedDrawCount = 0;
+		RETURN_ON_ERROR_CODE(vao.init());
+		return EC::ErrorCode();
+	}
+
+	void CurveBatch::clear() {
+		vertices.clear();
+		records.clear();
+		commands.clear();
+		materials.clear();
+		verticesDirty = commandsDirty = recordsDirty = materialsDirty = true;
+	}
+
+	int CurveBatch::addMaterial(const glm::vec4& color) {
+		materials.push_back(color);
+		materialsDirty = true;
+		return int(materials.size()) - 1;
+	}
+
+	int CurveBatch::addVertices(const glm::vec3* points, int count) {
+		const int first = int(vertices.size());
+		vertices.insert(vertices.end(), points, points + count);
+		verticesDirty = true;
+		return first;
+	}
+
+	int CurveBatch::addDraw(int firstVertex, int count, const glm::mat4& transform, int materialIndex, float width) {
+		assert(firstVertex >= 0 && firstVertex + count <= int(vertices.size()));
+		assert(materialIndex >= 0 && materialIndex < int(materials.size()));
+		// One quad of 6 vertices for each segment. The base instance is the first vertex of the strip,
+		// so the shader finds the segment at gl_BaseInstance + gl_InstanceID.
+		const unsigned segmentCount = unsigned(std::max(count - 1, 0));
+		commands.push_back(GLUtils::DrawArraysIndirectCommand{6, segmentCount, 0, unsigned(firstVertex)});
+		records.push_back(DrawRecord{transform, materialIndex, width, {0, 0}});
+		commandsDirty = recordsDirty = true;
+		return int(records.size()) - 1;
+	}
+
+	int CurveBatch::addCurve(const glm::vec3* points, int count, const glm::mat4& transform, int materialIndex, float width) {
+		return addDraw(addVertices(points, count), count, transform, materialIndex, width);
+	}
+
+	void CurveBatch::setTransform(int drawIndex, const glm::mat4& transform) {
+		records[drawIndex].transform = transform;
+		recordsDirty = true;
+	}
+
+	void CurveBatch::setMaterial(int drawIndex, int materialIndex) {
+		assert(materialIndex >= 0 && materialIndex < int(materials.size()));
+		records[drawIndex].materialIndex = materialIndex;
+		recordsDirty = true;
+	}
+
+	template<typename BufferT, typename T>
+	EC::ErrorCode CurveBatch::uploadStorage(BufferT& buffer, int64_t& capacity, const std::vector<T>& data) {
+		const int64_t byteSize = int64_t(data.size()) * sizeof(T);
+		if (byteSize > capacity) {
+			const int64_t newCapacity = std::max(byteSize, 2 * capacity);
+			buffer.freeMem();
+			RETURN_ON_ERROR_CODE(buffer.init(newCapacity));
+			capacity = newCapacity;
+		}
+		if (byteSize > 0) {
+			RETURN_ON_ERROR_CODE(buffer.upload(0, byteSize, data.data()));
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode CurveBatch::upload() {
+		MATHVIZ_PROFILE_CPU("CurveBatch::upload");
+		static_assert(sizeof(DrawRecord) == 80, "DrawRecord must match the std430 layout in the shader");
+		static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "The shader reads the vertices as a tightly packed float array");
+		if (verticesDirty) {
+			RETURN_ON_ERROR_CODE(uploadStorage(vertexBuffer, vertexCapacity, vertices));
+			verticesDirty = false;
+		}
+		if (commandsDirty) {
+			RETURN_ON_ERROR_CODE(uploadStorage(commandBuffer, commandCapacity, commands));
+			commandsDirty = false;
+		}
+		if (recordsDirty) {
+			RETURN_ON_ERROR_CODE(uploadStorage(recordBuffer, recordCapacity, records));
+			recordsDirty = false;
+		}
+		if (materialsDirty) {
+			RETURN_ON_ERROR_CODE(uploadStorage(materialBuffer, materialCapacity, materials));
+			materialsDirty = false;
+		}
+		uploadedDrawCount = int(commands.size());
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode CurveBatch::draw() const {
+		if (uploadedDrawCount == 0) {
+			return EC::ErrorCode();
+		}
+		RETURN_ON_ERROR_CODE(vao.bind());
+		RETURN_ON_ERROR_CODE(vertexBuffer.bind());
+		RETURN_ON_ERROR_CODE(recordBuffer.bind());
+		RETURN_ON_ERROR_CODE(materialBuffer.bind());
+		RETURN_ON_ERROR_CODE(commandBuffer.bind());
+		RETURN_ON_GL_ERROR(glMultiDrawArraysIndirect(GL_TRIANGLES, nullptr, uploadedDrawCount, 0));
+		RETURN_ON_ERROR_CODE(commandBuffer.unbind());
+		RETURN_ON_ERROR_CODE(vao.unbind());
+		return EC::ErrorCode();
+	}
+
+	int CurveBatch::getDrawCount() const {
+		return int(records.size());
+	}
+
 	Line::Line() :
 		start{0.0f, 0.0f, 0.0f},
 		end{0.0f, 0.0f, 0.0f},
@@ -61,12 +279,15 @@ namespace MathViz {
 
 	EC::ErrorCode Line::draw() const {
 		RETURN_ON_ERROR_CODE(vao.bind());
-		RETURN_ON_GL_ERROR(glLineWidth(width));
 		RETURN_ON_GL_ERROR(glDrawArrays(GL_LINES, 0, 2));
 		RETURN_ON_ERROR_CODE(vao.unbind());
 		return EC::ErrorCode();
 	}
 
+	void Line::appendTo(LineBatch& batch, const glm::vec4& color) const {
+		batch.addLine(start, end, color, width);
+	}
+
 	void Line::freeMem() {
 		vertexBuffer.freeMem();
 		vao.freeMem();
@@ -91,7 +312,7 @@ namespace MathViz {
 		const int totalLinesCount = xMarksCount + yMarksCount + axisCount;
 		const int totalVertices = totalLinesCount * 2;
 		const float z = 0.0f;
-		std::vector<glm::vec3> lineVertices;
+		lineVertices.clear();
 		lineVertices.reserve(totalVertices);
 		// x axis
 		const float xAxisYCoordinate = yRange.contains(0.0f) ? 0.0f : yRange.getMid();
@@ -134,85 +355,553 @@ namespace MathViz {
 		return EC::ErrorCode();
 	}
 
+	void Axes::appendTo(LineBatch& batch, const glm::vec4& color, float width) const {
+		for (size_t i = 0; i + 1 < lineVertices.size(); i += 2) {
+			batch.addLine(lineVertices[i], lineVertices[i + 1], color, width);
+		}
+	}
+
 	Plot2D::Plot2D() :
 		xRange{0, 0},
 		yRange{0, 0},
 		lineWidth{1.0f},
-		n{0} {}
+		n{0},
+		vertexCount{0},
+		capacity{0},
+		sampling{Sampling::Uniform},
+		streamingRegionCount{0},
+		gridLevel{0},
+		firstIndex{0},
+		lastIndex{-1},
+		ringAnchorIndex{0},
+		ringAnchorSlot{0} {}
 
-	EC::ErrorCode Plot2D::upload() {
-		RETURN_ON_ERROR_CODE(vertexBuffer.bind());
-		void* mapped;
-		RETURN_ON_ERROR_CODE(vertexBuffer.map(mapped, GLUtils::BufferAccessType::Write));
-		
-		float maxHeight = f(xRange.from);
-		float minHeight = maxHeight;
-		const float dh = std::abs(xRange.getLength()) / (n-1);
-		for (int i = 0; i < n; ++i) {
-			const float x = xRange.from + i * dh;
-			const float y = f(x);
-			maxHeight = std::max(maxHeight, y);
-			minHeight = std::min(minHeight, y);
-			const glm::vec3 point(xRange.from + i * dh, y, 0.0f);
-			static_cast<glm::vec3*>(mapped)[i] = point;
+	EC::ErrorCode Plot2D::init(
+		BatchFunction f,
+		const Range2D& xRange,
+		const Range2D& yRange,
+		float lineWidth,
+		int n
+	) {
+		this->f = std::move(f);
+		this->xRange = xRange;
+		this->yRange = yRange;
+		this->lineWidth = lineWidth;
+		this->n = n;
+		this->vertexCount = 0;
+		this->capacity = 0;
+		this->sampling = Sampling::Uniform;
+		this->streamingRegionCount = 0;
+		sampleCache.clear();
+		RETURN_ON_ERROR_CODE(vao.init());
+		RETURN_ON_ERROR_CODE(resample(true));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Plot2D::reset(BatchFunction f) {
+		assert(sampling != Sampling::Procedural);
+		this->f = std::move(f);
+		sampling = Sampling::Uniform;
+		sampleCache.clear();
+		adaptiveVertices.clear();
+		RETURN_ON_ERROR_CODE(resample(true));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Plot2D::setView(const Range2D& xRange, int n) {
+		assert(sampling == Sampling::Uniform);
+		this->xRange = xRange;
+		this->n = n;
+		RETURN_ON_ERROR_CODE(resample(false));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Plot2D::enableStreaming(int regionCount) {
+		assert(sampling == Sampling::Uniform && regionCount > 0);
+		streamingRegionCount = regionCount;
+		// Force reallocation of the buffer
+		capacity = 0;
+		RETURN_ON_ERROR_CODE(resample(true));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Plot2D::reserve(int vertexCount, bool& grown) {
+		grown = false;
+		if (vertexCount <= capacity) {
+			return EC::ErrorCode();
+		}
+		GLUtils::BufferLayout layout;
+		layout.addAttribute(GLUtils::VertexType::Float, 3);
+		vertexBuffer.freeMem();
+		streamingBuffer.freeMem();
+		const int64_t byteSize = int64_t(vertexCount) * sizeof(glm::vec3);
+		RETURN_ON_ERROR_CODE(vao.bind());
+		if (streamingRegionCount > 0) {
+			RETURN_ON_ERROR_CODE(streamingBuffer.init(byteSize, streamingRegionCount, layout));
+		} else {
+			RETURN_ON_ERROR_CODE(vertexBuffer.init(byteSize, nullptr, layout));
+		}
+		RETURN_ON_ERROR_CODE(vao.unbind());
+		capacity = vertexCount;
+		grown = true;
+		return EC::ErrorCode();
+	}
+
+	int Plot2D::getSlot(const int64_t index) const {
+		const int ringSize = capacity - 1;
+		const int64_t slot = (ringAnchorSlot + (index - ringAnchorIndex)) % ringSize;
+		return int(slot < 0 ? slot + ringSize : slot);
+	}
+
+	EC::ErrorCode Plot2D::resample(bool forceFullUpdate) {
+		MATHVIZ_PROFILE_CPU("Plot2D::resample");
+		// The largest power of two spacing which gives at least n points in the range. Grid points are
+		// integer multiples of the spacing, so the x coordinates do not depend on the view and grids of
+		// different levels have common points.
+		if (n < 2) {
+			return EC::ErrorCode("A plot needs at least 2 points, got %d", n);
+		}
+		const float dh = std::abs(xRange.getLength()) / (n - 1);
+		// log2 of zero is -inf and its conversion to int is undefined. Below the smallest normal float the
+		// spacing of the grid would round to zero.
+		if (!(dh >= std::numeric_limits<float>::min()) || !std::isfinite(dh)) {
+			return EC::ErrorCode("Cannot plot over the range [%f;%f] with %d points", xRange.from, xRange.to, n);
+		}
+		const int newLevel = int(std::floor(std::log2(dh)));
+		const float h = std::ldexp(1.0f, newLevel);
+		const float xMin = std::min(xRange.from, xRange.to);
+		const float xMax = std::max(xRange.from, xRange.to);
+		const int64_t newFirst = int64_t(std::floor(xMin / h));
+		const int64_t newLast = int64_t(std::ceil(xMax / h));
+		const int64_t count = newLast - newFirst + 1;
+
+		// h > dh / 2, so there are at most 2n points. The extra space in the ring avoids reallocations
+		// when panning makes the grid one point larger.
+		bool grown = false;
+		if (count + 1 > capacity) {
+			RETURN_ON_ERROR_CODE(reserve(2 * n + 3, grown));
+		}
+		const bool overlaps = newFirst <= lastIndex && newLast >= firstIndex;
+		// Each streaming region is written from scratch. The samples come from the cache, so only the
+		// new strip is evaluated, but all vertices are copied.
+		const bool isStreaming = streamingRegionCount > 0;
+		if (forceFullUpdate || grown || isStreaming || newLevel != gridLevel || !overlaps) {
+			gridLevel = newLevel;
+			firstIndex = newFirst;
+			lastIndex = newLast;
+			ringAnchorIndex = newFirst;
+			ringAnchorSlot = 0;
+			if (isStreaming) {
+				void* region;
+				RETURN_ON_ERROR_CODE(streamingBuffer.beginWrite(region));
+				evaluateSamples(newFirst, newLast, static_cast<glm::vec3*>(region));
+				streamingBuffer.endWrite();
+			} else {
+				RETURN_ON_ERROR_CODE(uploadSamples(newFirst, newLast));
+			}
+			return EC::ErrorCode();
+		}
+		// Points in [firstIndex;lastIndex] are already in the buffer, only the new strips are computed
+		const int64_t oldFirst = firstIndex;
+		const int64_t oldLast = lastIndex;
+		firstIndex = newFirst;
+		lastIndex = newLast;
+		if (newFirst < oldFirst) {
+			RETURN_ON_ERROR_CODE(uploadSamples(newFirst, oldFirst - 1));
+		}
+		if (newLast > oldLast) {
+			RETURN_ON_ERROR_CODE(uploadSamples(oldLast + 1, newLast));
 		}
-		RETURN_ON_ERROR_CODE(vertexBuffer.unmap());
-		RETURN_ON_ERROR_CODE(vertexBuffer.unbind());
+		return EC::ErrorCode();
+	}
+
+	void Plot2D::evaluateSamples(const int64_t first, const int64_t last, glm::vec3* out) {
+		MATHVIZ_PROFILE_CPU("Plot2D::evaluateSamples");
+		if (sampleCache.size() + (last - first + 1) > MaxCachedSamples) {
+			sampleCache.clear();
+		}
+		// The cache is not thread safe, look up the samples first and evaluate only the missing ones in parallel
+		std::vector<float> missingX;
+		std::vector<int> missingOut;
+		for (int64_t index = first; index <= last; ++index) {
+			const float x = std::ldexp(float(index), gridLevel);
+			uint32_t key;
+			std::memcpy(&key, &x, sizeof(key));
+			const auto cached = sampleCache.find(key);
+			if (cached != sampleCache.end()) {
+				out[index - first] = glm::vec3(x, cached->second, 0.0f);
+			} else {
+				missingX.push_back(x);
+				missingOut.push_back(int(index - first));
+			}
+		}
+		std::vector<float> missingY(missingX.size());
+		getThreadPool().parallelFor(missingX.size(), BatchFunctionChunkSize, [&](int64_t begin, int64_t end) {
+			for (int64_t chunkStart = begin; chunkStart < end; chunkStart += BatchFunctionChunkSize) {
+				const int count = int(std::min<int64_t>(BatchFunctionChunkSize, end - chunkStart));
+				f(&missingX[chunkStart], &missingY[chunkStart], count);
+			}
+		});
+		for (size_t i = 0; i < missingX.size(); ++i) {
+			out[missingOut[i]] = glm::vec3(missingX[i], missingY[i], 0.0f);
+			uint32_t key;
+			std::memcpy(&key, &missingX[i], sizeof(key));
+			sampleCache.emplace(key, missingY[i]);
+		}
+	}
+
+	EC::ErrorCode Plot2D::uploadSamples(const int64_t first, const int64_t last) {
+		MATHVIZ_PROFILE_CPU("Plot2D::uploadSamples");
+		const int count = int(last - first + 1);
+		std::vector<glm::vec3> vertices(count);
+		evaluateSamples(first, last, vertices.data());
+		// Consecutive points are in consecutive slots except where the ring wraps
+		const int ringSize = capacity - 1;
+		int uploaded = 0;
+		while (uploaded < count) {
+			const int slot = getSlot(first + uploaded);
+			const int runLength = std::min(count - uploaded, ringSize - slot);
+			RETURN_ON_ERROR_CODE(vertexBuffer.upload(
+				int64_t(slot) * sizeof(glm::vec3),
+				int64_t(runLength) * sizeof(glm::vec3),
+				&vertices[uploaded]
+			));
+			if (slot == 0) {
+				RETURN_ON_ERROR_CODE(vertexBuffer.upload(
+					int64_t(ringSize) * sizeof(glm::vec3),
+					sizeof(glm::vec3),
+					&vertices[uploaded]
+				));
+			}
+			uploaded += runLength;
+		}
+		return EC::ErrorCode();
+	}
+
+	/// Sample f on xRange so that the polyline through the samples is within tolerance of f. By the mean
+	/// value theorem the slope of the chord on [a;b] is in f'([a;b]), so the distance between the chord and
+	/// f is at most (b - a) / 2 * width(f'([a;b])). Segments are split until this bound is below the tolerance.
+	/// If f cannot be differentiated, segments are split until the midpoint is within tolerance of the chord.
+	bool sampleAdaptive(
+		const Expression& f,
+		const Range2D& xRange,
+		const float tolerance,
+		std::vector<glm::vec3>& vertices,
+		const std::function<bool()>& isCancelled
+	) {
+		// Checking for cancellation on every segment would cost more than the check is worth
+		constexpr int cancelCheckInterval = 1024;
+		// Without the derivative bound the midpoint test can miss features (e.g. sin on a symmetric range),
+		// the initial uniform split makes this less likely.
+		constexpr int initialSegments = 32;
+		std::vector<float> slots(f.getVariableCount(), 0.0f);
+		const int xSlot = f.getVariableSlot('x');
+		const auto evaluate = [&](const float x) -> float {
+			if (xSlot != -1) {
+				slots[xSlot] = x;
+			}
+			return f.evaluate(slots.data());
+		};
+
+		std::vector<Interval> intervalSlots(f.getVariableCount(), Interval(0.0f));
+		// Check if f is not defined anywhere in [a;b], there is nothing to refine there
+		const auto isUndefined = [&](const float a, const float b) -> bool {
+			if (xSlot != -1) {
+				intervalSlots[xSlot] = Interval(a, b);
+			}
+			const Interval values = f.evaluateInterval(intervalSlots.data());
+			return std::isnan(values.lo) && std::isnan(values.hi);
+		};
+
+		Expression df;
+		const bool hasDerivative = !f.derivative('x', df).hasError();
+		std::vector<Interval> derivativeSlots(df.getVariableCount(), Interval(0.0f));
+		const int derivativeXSlot = df.getVariableSlot('x');
+
+		struct Segment {
+			float a;
+			float fa;
+			float b;
+			float fb;
+		};
+		std::vector<Segment> segments;
+		const float dh = xRange.getLength() / initialSegments;
+		float fPrev = evaluate(xRange.from);
+		vertices.emplace_back(xRange.from, fPrev, 0.0f);
+		// Segments are processed in a stack, push them in reverse order so that vertices are produced left to right
+		float fNext = evaluate(xRange.to);
+		for (int i = initialSegments - 1; i >= 0; --i) {
+			const float a = i == 0 ? xRange.from : xRange.from + i * dh;
+			const float fa = i == 0 ? fPrev : evaluate(a);
+			const float b = i == initialSegments - 1 ? xRange.to : xRange.from + (i + 1) * dh;
+			segments.push_back({a, fa, b, fNext});
+			fNext = fa;
+		}
+
+		int64_t iteration = 0;
+		while (!segments.empty()) {
+			if (isCancelled && ++iteration % cancelCheckInterval == 0 && isCancelled()) {
+				return false;
+			}
+			const Segment segment = segments.back();
+			segments.pop_back();
+			const float length = segment.b - segment.a;
+			const float mid = segment.a + length / 2;
+			bool accept = length <= tolerance;
+			if (!accept && std::isnan(segment.fa) && std::isnan(segment.fb)) {
+				accept = isUndefined(segment.a, segment.b);
+			}
+			float fMid = 0.0f;
+			if (!accept && hasDerivative) {
+				if (derivativeXSlot != -1) {
+					derivativeSlots[derivativeXSlot] = Interval(segment.a, segment.b);
+				}
+				const Interval slope = df.evaluateInterval(derivativeSlots.data());
+				// Nan width (e.g. empty interval) fails the comparison and the segment is split
+				accept = length / 2 * slope.getWidth() <= tolerance;
+				if (!accept) {
+					fMid = evaluate(mid);
+				}
+			} else if (!accept) {
+				fMid = evaluate(mid);
+				accept = std::abs(fMid - (segment.fa + segment.fb) / 2) <= tolerance;
+			}
+			if (accept) {
+				vertices.emplace_back(segment.b, segment.fb, 0.0f);
+			} else {
+				segments.push_back({mid, fMid, segment.b, segment.fb});
+				segments.push_back({segment.a, segment.fa, mid, fMid});
+			}
+		}
+		return true;
+	}
+
+	EC::ErrorCode Plot2D::initAdaptive(
+		const Expression& f,
+		const Range2D& xRange,
+		const Range2D& yRange,
+		float lineWidth,
+		float tolerance
+	) {
+		this->xRange = xRange;
+		this->yRange = yRange;
+		this->lineWidth = lineWidth;
+		this->capacity = 0;
+		this->sampling = Sampling::Adaptive;
+		RETURN_ON_ERROR_CODE(vao.init());
+		RETURN_ON_ERROR_CODE(resetAdaptive(f, tolerance));
+		// Density used if the plot is later reset to uniform sampling
+		this->n = vertexCount;
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Plot2D::resetAdaptive(const Expression& f, float tolerance) {
+		MATHVIZ_PROFILE_CPU("Plot2D::resetAdaptive");
+		assert(sampling != Sampling::Procedural);
+		std::vector<glm::vec3> vertices;
+		sampleAdaptive(f, xRange, tolerance, vertices);
+		return resetVertices(std::move(vertices));
+	}
+
+	EC::ErrorCode Plot2D::resetVertices(std::vector<glm::vec3> verticesIn) {
+		assert(sampling != Sampling::Procedural);
+		adaptiveVertices = std::move(verticesIn);
+		const std::vector<glm::vec3>& vertices = adaptiveVertices;
+		// The uniform sampling can no longer be used to recompute the plot
+		this->f = nullptr;
+		sampling = Sampling::Adaptive;
+		sampleCache.clear();
+		vertexCount = int(vertices.size());
+		bool grown;
+		RETURN_ON_ERROR_CODE(reserve(vertexCount, grown));
+		const int64_t byteSize = int64_t(vertexCount) * sizeof(glm::vec3);
+		if (streamingRegionCount > 0) {
+			void* region;
+			RETURN_ON_ERROR_CODE(streamingBuffer.beginWrite(region));
+			std::memcpy(region, vertices.data(), byteSize);
+			streamingBuffer.endWrite();
+		} else {
+			RETURN_ON_ERROR_CODE(vertexBuffer.upload(0, byteSize, vertices.data()));
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Plot2D::initProcedural(
+		const Range2D& xRange,
+		const Range2D& yRange,
+		float lineWidth,
+		int n
+	) {
+		this->xRange = xRange;
+		this->yRange = yRange;
+		this->lineWidth = lineWidth;
+		this->n = n;
+		this->vertexCount = n;
+		this->sampling = Sampling::Procedural;
+		f = nullptr;
+		sampleCache.clear();
+		// Core profile requires a bound VAO even if the draw call does not use any attributes
+		RETURN_ON_ERROR_CODE(vao.init());
 		return EC::ErrorCode();
 	}
 
 	EC::ErrorCode Plot2D::draw() const {
 		RETURN_ON_ERROR_CODE(vao.bind());
-		RETURN_ON_GL_ERROR(glLineWidth(lineWidth));
-		RETURN_ON_GL_ERROR(glDrawArrays(GL_LINE_STRIP, 0, n));
+		const bool isStreaming = streamingRegionCount > 0;
+		const int regionStart = isStreaming ? streamingBuffer.getFirstVertex() : 0;
+		if (sampling == Sampling::Procedural) {
+			// The material expands each segment between two consecutive samples into a quad
+			RETURN_ON_GL_ERROR(glDrawArraysInstanced(GL_TRIANGLES, 0, 6, vertexCount - 1));
+		} else if (sampling != Sampling::Uniform) {
+			RETURN_ON_GL_ERROR(glDrawArrays(GL_LINE_STRIP, regionStart, vertexCount));
+		} else if (capacity > 0) {
+			const int count = int(lastIndex - firstIndex + 1);
+			const int ringSize = capacity - 1;
+			const int firstSlot = getSlot(firstIndex);
+			if (firstSlot + count <= ringSize) {
+				RETURN_ON_GL_ERROR(glDrawArrays(GL_LINE_STRIP, regionStart + firstSlot, count));
+			} else {
+				// The first strip ends at the mirror of slot 0, so that it connects to the second strip
+				const int firstStripCount = ringSize - firstSlot;
+				RETURN_ON_GL_ERROR(glDrawArrays(GL_LINE_STRIP, regionStart + firstSlot, firstStripCount + 1));
+				RETURN_ON_GL_ERROR(glDrawArrays(GL_LINE_STRIP, regionStart, count - firstStripCount));
+			}
+		}
+		if (isStreaming) {
+			RETURN_ON_ERROR_CODE(streamingBuffer.fence());
+		}
 		RETURN_ON_ERROR_CODE(vao.unbind());
 		return EC::ErrorCode();
 	}
 
+	void Plot2D::appendTo(LineBatch& batch, const glm::vec4& color) {
+		assert(sampling != Sampling::Procedural);
+		if (sampling == Sampling::Adaptive) {
+			batch.addPolyline(adaptiveVertices.data(), int(adaptiveVertices.size()), color, lineWidth, false);
+			return;
+		}
+		if (lastIndex < firstIndex) {
+			return;
+		}
+		std::vector<glm::vec3> vertices(lastIndex - firstIndex + 1);
+		evaluateSamples(firstIndex, lastIndex, vertices.data());
+		batch.addPolyline(vertices.data(), int(vertices.size()), color, lineWidth, false);
+	}
+
 	void Plot2D::setLineWidth(const float lineWidth) {
 		this->lineWidth = lineWidth;
 	}
 
+	float Plot2D::getLineWidth() const {
+		return lineWidth;
+	}
+
 	ReimanArea::ReimanArea() :
-		vertexCount(0),
-		barCount(0)
+		dh(0.0f),
+		barCount(0),
+		instanceCapacity(0)
 	{}
 
-	EC::ErrorCode ReimanArea::draw() const {
+	EC::ErrorCode ReimanArea::init(BatchFunction f, const Range2D& xRange, float dh) {
+		MATHVIZ_PROFILE_CPU("ReimanArea::init");
+		this->f = std::move(f);
+		this->xRange = xRange;
+		this->dh = dh;
+		instanceCapacity = 0;
+		GLUtils::BufferLayout l;
+		l.addAttribute(GLUtils::VertexType::Float, 3);
+		const int64_t byteSize = FillVertexCount * sizeof(glm::vec3);
+		RETURN_ON_ERROR_CODE(vao.init());
 		RETURN_ON_ERROR_CODE(vao.bind());
-		RETURN_ON_GL_ERROR(glDrawArrays(GL_TRIANGLES, 0, vertexCount));
+		RETURN_ON_ERROR_CODE(barBuffer.init(byteSize, nullptr, l));
 		RETURN_ON_ERROR_CODE(vao.unbind());
+		RETURN_ON_ERROR_CODE(uploadBar());
+		RETURN_ON_ERROR_CODE(uploadInstances());
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode ReimanArea::setBarWidth(float dh) {
+		this->dh = dh;
+		RETURN_ON_ERROR_CODE(uploadBar());
+		RETURN_ON_ERROR_CODE(uploadInstances());
 		return EC::ErrorCode();
 	}
 
-	EC::ErrorCode ReimanArea::outline(const IMaterial& m, const IMaterial& om) const {
+	EC::ErrorCode ReimanArea::uploadBar() {
+		const float z = BarZ;
+		const std::array<glm::vec3, FillVertexCount> vertices = {
+			glm::vec3(dh, 1.0f, z), // up right
+			glm::vec3(0.0f, 1.0f, z), // up left
+			glm::vec3(0.0f, 0.0f, z), // bottom left
+
+			glm::vec3(dh, 1.0f, z), // up right
+			glm::vec3(0.0f, 0.0f, z), // bottom left
+			glm::vec3(dh, 0.0f, z) // bottom right
+		};
+		RETURN_ON_ERROR_CODE(barBuffer.upload(0, sizeof(vertices), vertices.data()));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode ReimanArea::uploadInstances() {
+		MATHVIZ_PROFILE_CPU("ReimanArea::uploadInstances");
+		barCount = int(xRange.getLength() / dh);
+		if (barCount > instanceCapacity) {
+			GLUtils::BufferLayout l;
+			l.addAttribute(GLUtils::VertexType::Float, 2);
+			l.setFirstLocation(1);
+			l.setInstanceDivisor(1);
+			instanceBuffer.freeMem();
+			RETURN_ON_ERROR_CODE(vao.bind());
+			RETURN_ON_ERROR_CODE(instanceBuffer.init(int64_t(barCount) * sizeof(glm::vec2), nullptr, l));
+			RETURN_ON_ERROR_CODE(vao.unbind());
+			instanceCapacity = barCount;
+		}
+		bars.resize(barCount);
+		if (barCount == 0) {
+			return EC::ErrorCode();
+		}
+
+		// Each chunk of bars writes to its own part of the array
+		getThreadPool().parallelFor(barCount, BatchFunctionChunkSize, [&](int64_t begin, int64_t end) {
+			float barMid[BatchFunctionChunkSize];
+			float fAtBarCenter[BatchFunctionChunkSize];
+			for (int64_t chunkStart = begin; chunkStart < end; chunkStart += BatchFunctionChunkSize) {
+				const int count = int(std::min<int64_t>(BatchFunctionChunkSize, end - chunkStart));
+				for (int bar = 0; bar < count; ++bar) {
+					barMid[bar] = xRange.from + (chunkStart + bar) * dh + dh / 2;
+				}
+				f(barMid, fAtBarCenter, count);
+				for (int bar = 0; bar < count; ++bar) {
+					// Scaling the unit bar by a negative height flips it below the x axis
+					const float barStart = xRange.from + (chunkStart + bar) * dh;
+					bars[chunkStart + bar] = glm::vec2(barStart, fAtBarCenter[bar] - 1.0f);
+				}
+			}
+		});
+		RETURN_ON_ERROR_CODE(instanceBuffer.upload(0, int64_t(barCount) * sizeof(glm::vec2), bars.data()));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode ReimanArea::draw() const {
 		RETURN_ON_ERROR_CODE(vao.bind());
-		
-		RETURN_ON_GL_ERROR(glDrawArrays(GL_TRIANGLES, 0, vertexCount));
-		
-		RETURN_ON_GL_ERROR(glDisable(GL_DEPTH_TEST));
-		
-		const GLUtils::Program& p = om.getProgram();
-		RETURN_ON_ERROR_CODE(p.bind());
-		RETURN_ON_ERROR_CODE(om.setUniforms());
-		
-		const glm::mat4 ortho = glm::ortho(-5.f, 5.f, -5.f, 5.f, -5.f, 5.f);
-		const glm::mat4 perspective = glm::perspective(glm::radians(60.f), float(800) / float(900), -1.f, 10.f);
-		
-		const glm::vec3 cameraPos(0.0f, 0.0f, -1.0f);
-		const glm::vec3 lookAtPoint(0.0f, 0.0f, 0.0f);
-		const glm::vec3 cameraUp(0.0f, 1.0f, 0.0f);
-		const glm::mat4 view = glm::lookAt(cameraPos, lookAtPoint, cameraUp);
-		RETURN_ON_ERROR_CODE(p.setUniform("projection", ortho, false));
-		RETURN_ON_ERROR_CODE(p.setUniform("view", view, false));
-		
-		RETURN_ON_GL_ERROR(glDrawArrays(GL_LINES, vertexCount, barCount * 8));
-		
-		RETURN_ON_GL_ERROR(glEnable(GL_DEPTH_TEST));
+		RETURN_ON_GL_ERROR(glDrawArraysInstanced(GL_TRIANGLES, 0, FillVertexCount, barCount));
 		RETURN_ON_ERROR_CODE(vao.unbind());
 		return EC::ErrorCode();
 	}
 
+	void ReimanArea::appendTo(LineBatch& batch, const glm::vec4& color, float width) const {
+		for (const glm::vec2& bar : bars) {
+			const float height = bar.y + 1.0f;
+			const glm::vec3 corners[4] = {
+				glm::vec3(bar.x + dh, height, OutlineZ), // up right
+				glm::vec3(bar.x, height, OutlineZ), // up left
+				glm::vec3(bar.x, 0.0f, OutlineZ), // bottom left
+				glm::vec3(bar.x + dh, 0.0f, OutlineZ) // bottom right
+			};
+			batch.addPolyline(corners, 4, color, width, true);
+		}
+	}
+
 	Canvas::Canvas() :
 		lowLeft{0, 0, 0},
 		upRight{0, 0, 0}
@@ -261,6 +950,97 @@ namespace MathViz {
 		return EC::ErrorCode();
 	}
 
+	DataSeriesPlot::DataSeriesPlot() :
+		series(nullptr),
+		lineWidth(1.0f)
+	{ }
+
+	EC::ErrorCode DataSeriesPlot::init(const DataSeries& seriesIn, float lineWidthIn) {
+		freeMem();
+		series = &seriesIn;
+		lineWidth = lineWidthIn;
+		return EC::ErrorCode();
+	}
+
+	void DataSeriesPlot::freeMem() {
+		series = nullptr;
+		vertices.clear();
+	}
+
+	EC::ErrorCode DataSeriesPlot::setView(const Range2D& xRange, int columns) {
+		MATHVIZ_PROFILE_CPU("DataSeriesPlot::setView");
+		assert(series != nullptr && columns > 0);
+		vertices.clear();
+		const int64_t n = series->getSampleCount();
+		if (n == 0) {
+			return EC::ErrorCode();
+		}
+		// The samples just outside of the view are included, so that the line reaches its edges
+		const double x0 = series->getX(0);
+		const double step = series->getXStep();
+		const int64_t first = std::clamp<int64_t>(int64_t(std::floor((xRange.from - x0) / step)), 0, n - 1);
+		const int64_t last = std::clamp<int64_t>(int64_t(std::ceil((xRange.to - x0) / step)), 0, n - 1);
+		const int64_t visible = last - first + 1;
+
+		vertices.reserve(2 * columns);
+		if (visible <= 2 * int64_t(columns)) {
+			for (int64_t i = first; i <= last; ++i) {
+				const float y = series->getSample(i);
+				if (!std::isnan(y)) {
+					vertices.emplace_back(float(series->getX(i)), y, 0.0f);
+				}
+			}
+		} else {
+			// Column c has the samples in [first + c * visible / columns; first + (c + 1) * visible / columns)
+			for (int c = 0; c < columns; ++c) {
+				const int64_t columnFirst = first + visible * c / columns;
+				const int64_t columnLast = first + visible * (c + 1) / columns;
+				const DataSeries::MinMax extremes = series->getMinMax(columnFirst, columnLast);
+				if (extremes.min > extremes.max) {
+					continue;
+				}
+				const float x = float(x0 + step * 0.5 * double(columnFirst + columnLast - 1));
+				vertices.emplace_back(x, extremes.min, 0.0f);
+				vertices.emplace_back(x, extremes.max, 0.0f);
+			}
+		}
+		return EC::ErrorCode();
+	}
+
+	void DataSeriesPlot::setLineWidth(float lineWidthIn) {
+		lineWidth = lineWidthIn;
+	}
+
+	int DataSeriesPlot::getVertexCount() const {
+		return int(vertices.size());
+	}
+
+	void DataSeriesPlot::appendTo(LineBatch& batch, const glm::vec4& color) const {
+		if (vertices.size() < 2) {
+			return;
+		}
+		batch.addPolyline(vertices.data(), int(vertices.size()), color, lineWidth, false);
+	}
+
+	ScalarField2D::ScalarField2D() :
+		xRange(0, 0),
+		yRange(0, 0)
+	{ }
+
+	EC::ErrorCode ScalarField2D::init(const Range2D& xRange, const Range2D& yRange, float z) {
+		this->xRange = xRange;
+		this->yRange = yRange;
+		return Canvas::init(glm::vec3(xRange.from, yRange.from, z), glm::vec3(xRange.to, yRange.to, z));
+	}
+
+	const Range2D& ScalarField2D::getXRange() const {
+		return xRange;
+	}
+
+	const Range2D& ScalarField2D::getYRange() const {
+		return yRange;
+	}
+
 	glm::vec3 circleEquation(float t) {
 		t *= 2 * PI;
 		return {std::cos(t), std::sin(t), 0.0f};
@@ -293,6 +1073,7 @@ namespace MathViz {
 	Morph2D::Morph2D(Morph2D&& other) noexcept :
 		vao(std::move(other.vao)),
 		vertexBuffer(std::move(other.vertexBuffer)),
+		vertices(std::move(other.vertices)),
 		vertexCount(other.vertexCount)
 	{ }
 
@@ -300,16 +1081,56 @@ namespace MathViz {
 		freeMem();
 		vao = std::move(other.vao);
 		vertexBuffer = std::move(other.vertexBuffer);
+		vertices = std::move(other.vertices);
 		vertexCount = other.vertexCount;
 		return *this;
 	}
 
+	void resampleByArcLength(const glm::vec3* points, int pointCount, int outCount, glm::vec3* out) {
+		assert(pointCount >= 1 && outCount >= 2);
+		// arcLength[i] is the length of the polyline from the first point to point i
+		std::vector<float> arcLength(pointCount);
+		arcLength[0] = 0.0f;
+		getThreadPool().parallelFor(pointCount - 1, BatchFunctionChunkSize, [&](int64_t chunkBegin, int64_t chunkEnd) {
+			for (int64_t i = chunkBegin; i < chunkEnd; ++i) {
+				arcLength[i + 1] = glm::length(points[i + 1] - points[i]);
+			}
+		});
+		std::partial_sum(arcLength.begin(), arcLength.end(), arcLength.begin());
+		const float totalLength = arcLength.back();
+		if (totalLength <= 0.0f) {
+			std::fill(out, out + outCount, points[0]);
+			return;
+		}
+
+		getThreadPool().parallelFor(outCount, BatchFunctionChunkSize, [&](int64_t chunkBegin, int64_t chunkEnd) {
+			// The targets increase within the chunk, so the segment is searched once and then advanced
+			const float firstTarget = totalLength * float(chunkBegin) / float(outCount - 1);
+			int64_t segment = std::upper_bound(arcLength.begin(), arcLength.end(), firstTarget) - arcLength.begin() - 1;
+			segment = std::clamp<int64_t>(segment, 0, pointCount - 2);
+			for (int64_t i = chunkBegin; i < chunkEnd; ++i) {
+				const float target = i == outCount - 1 ? totalLength : totalLength * float(i) / float(outCount - 1);
+				while (segment < pointCount - 2 && arcLength[segment + 1] < target) {
+					segment++;
+				}
+				const float segmentLength = arcLength[segment + 1] - arcLength[segment];
+				const float t = segmentLength > 0.0f ? (target - arcLength[segment]) / segmentLength : 0.0f;
+				out[i] = glm::mix(points[segment], points[segment + 1], std::clamp(t, 0.0f, 1.0f));
+			}
+		});
+	}
+
 	EC::ErrorCode Morph2D::init(const Morphable2D& start, const Morphable2D& end) {
+		MATHVIZ_PROFILE_CPU("Morph2D::init");
 		vertexCount = std::max(start.getVertexCount(), end.getVertexCount());
-		std::vector<glm::vec3> data(vertexCount * 2);
-		for (int i = 0, idx = 0; i < vertexCount; ++i, idx += 2) {
-			data[idx] = start.getVertices()[i];
-			data[idx + 1] = end.getVertices()[i];
+		std::vector<glm::vec3> startVertices(vertexCount);
+		std::vector<glm::vec3> endVertices(vertexCount);
+		resampleByArcLength(start.getVertices(), start.getVertexCount(), vertexCount, startVertices.data());
+		resampleByArcLength(end.getVertices(), end.getVertexCount(), vertexCount, endVertices.data());
+		vertices.resize(vertexCount * 2);
+		for (int i = 0; i < vertexCount; ++i) {
+			vertices[2 * i] = startVertices[i];
+			vertices[2 * i + 1] = endVertices[i];
 		}
 
 
@@ -317,26 +1138,94 @@ namespace MathViz {
 		layout.addAttribute(GLUtils::VertexType::Float, 3);
 		layout.addAttribute(GLUtils::VertexType::Float, 3);
 
-		const int64_t dataByteSize = data.size() * sizeof(glm::vec3);
+		const int64_t dataByteSize = vertices.size() * sizeof(glm::vec3);
 
 		RETURN_ON_ERROR_CODE(vao.init());
 		RETURN_ON_ERROR_CODE(vao.bind());
-		RETURN_ON_ERROR_CODE(vertexBuffer.init(dataByteSize, (void*)data.data(), layout));
+		RETURN_ON_ERROR_CODE(vertexBuffer.init(dataByteSize, (void*)vertices.data(), layout));
 		RETURN_ON_ERROR_CODE(vao.unbind());
 
 		return EC::ErrorCode();
 	}
 
+	void Morph2D::appendTo(LineBatch& batch, float lerpCoeff, const glm::vec4& color, float width) const {
+		// Same interpolation as the morph shader
+		std::vector<glm::vec3> points(vertexCount);
+		for (int i = 0; i < vertexCount; ++i) {
+			points[i] = glm::mix(vertices[2 * i], vertices[2 * i + 1], lerpCoeff);
+		}
+		batch.addPolyline(points.data(), vertexCount, color, width, false);
+	}
+
 	void Morph2D::freeMem() {
 		vao.freeMem();
 		vertexBuffer.freeMem();
+		vertices.clear();
 	}
 
 	EC::ErrorCode Morph2D::draw() const {
 		RETURN_ON_ERROR_CODE(vao.bind());
-		RETURN_ON_GL_ERROR(glLineWidth(2));
 		RETURN_ON_GL_ERROR(glDrawArrays(GL_LINE_STRIP, 0, vertexCount));
 		RETURN_ON_ERROR_CODE(vao.unbind());
 		return EC::ErrorCode();
 	}
-}
\ No newline at end of file
+
+	MorphSequence::MorphSequence() :
+		keyframeBuffer(StorageBindings::Keyframes),
+		keyframeCount(0),
+		vertexCount(0)
+	{ }
+
+	EC::ErrorCode MorphSequence::init(const std::vector<const Morphable2D*>& keyframes, int vertexCountIn) {
+		MATHVIZ_PROFILE_CPU("MorphSequence::init");
+		assert(!keyframes.empty() && vertexCountIn >= 2);
+		freeMem();
+		keyframeCount = int(keyframes.size());
+		vertexCount = vertexCountIn;
+
+		// std430 arrays of vec3 have a stride of 16 bytes, the vertices are stored as vec4
+		static_assert(sizeof(KeyframesHeader) == 16, "KeyframesHeader must match the std430 layout in the shader");
+		const int64_t vertexTotal = int64_t(keyframeCount) * vertexCount;
+		std::vector<unsigned char> data(sizeof(KeyframesHeader) + vertexTotal * sizeof(glm::vec4));
+		const KeyframesHeader header{vertexCount, {0, 0, 0}};
+		memcpy(data.data(), &header, sizeof(header));
+		glm::vec4* storage = reinterpret_cast<glm::vec4*>(data.data() + sizeof(KeyframesHeader));
+		std::vector<glm::vec3> resampled(vertexCount);
+		for (int k = 0; k < keyframeCount; ++k) {
+			resampleByArcLength(keyframes[k]->getVertices(), keyframes[k]->getVertexCount(), vertexCount, resampled.data());
+			for (int i = 0; i < vertexCount; ++i) {
+				storage[int64_t(k) * vertexCount + i] = glm::vec4(resampled[i], 1.0f);
+			}
+		}
+
+		RETURN_ON_ERROR_CODE(vao.init());
+		RETURN_ON_ERROR_CODE(keyframeBuffer.init(int64_t(data.size()), data.data()));
+		return EC::ErrorCode();
+	}
+
+	void MorphSequence::freeMem() {
+		vao.freeMem();
+		keyframeBuffer.freeMem();
+		keyframeCount = 0;
+		vertexCount = 0;
+	}
+
+	int MorphSequence::getKeyframeCount() const {
+		return keyframeCount;
+	}
+
+	int MorphSequence::getVertexCount() const {
+		return vertexCount;
+	}
+
+	EC::ErrorCode MorphSequence::draw() const {
+		if (keyframeCount == 0) {
+			return EC::ErrorCode();
+		}
+		RETURN_ON_ERROR_CODE(vao.bind());
+		RETURN_ON_ERROR_CODE(keyframeBuffer.bind());
+		RETURN_ON_GL_ERROR(glDrawArraysInstanced(GL_TRIANGLES, 0, 6, vertexCount - 1));
+		RETURN_ON_ERROR_CODE(vao.unbind());
+		return EC::ErrorCode();
+	}
+}
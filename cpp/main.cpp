@@ -1,12 +1,17 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <array>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "error_code.h"
 #include "glutils.h"
 #include "context.h"
+#include "frame_sink.h"
 
 MathViz::Context ctx;
 
@@ -24,7 +29,50 @@ void logError(const char* error, int line) {
 	printf("[Error] %d %s\n", line, error);
 }
 
-int main() {
-	EXIT_ON_ERROR_CODE(ctx.init(800, 900));
+void printUsage() {
+	printf(
+		"Usage: mathviz [options]\n"
+		"  --export-png <pattern>  Render the animation without a window, one PNG per frame e.g. frame_%%04d.png\n"
+		"  --export-video <path>   Render the animation without a window and encode it with ffmpeg\n"
+		"  --frames <count>        The number of exported frames, default 120\n"
+		"  --size <width>x<height> The size of the window or of the exported frames, default 800x900\n"
+	);
+}
+
+int main(int argc, char** argv) {
+	int width = 800;
+	int height = 900;
+	int frameCount = 120;
+	const int fps = 60;
+	std::unique_ptr<MathViz::IFrameSink> sink;
+	for (int i = 1; i < argc; ++i) {
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--export-png") == 0 && hasValue) {
+			sink = std::make_unique<MathViz::PNGSequenceSink>(argv[++i]);
+		} else if (strcmp(argv[i], "--export-video") == 0 && hasValue) {
+			sink = std::make_unique<MathViz::FFmpegPipeSink>(argv[++i], fps);
+		} else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+			frameCount = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--size") == 0 && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+				printUsage();
+				return 1;
+			}
+		} else {
+			printUsage();
+			return 1;
+		}
+	}
+	if (width <= 0 || height <= 0 || frameCount <= 0) {
+		printUsage();
+		return 1;
+	}
+
+	if (sink) {
+		EXIT_ON_ERROR_CODE(ctx.init(width, height, true));
+		EXIT_ON_ERROR_CODE(ctx.renderAnimation(*sink, frameCount));
+		return 0;
+	}
+	EXIT_ON_ERROR_CODE(ctx.init(width, height));
 	EXIT_ON_ERROR_CODE(ctx.mainLoop());
 }
\ No newline at end of file
@@ -1,8 +1,16 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <unordered_map>
 #include "glutils.h"
 #include "material.h"
 #include "shader_bindings.h"
+#include "expression.h"
+#include "profiler.h"
+#ifdef MATHVIZ_EMBED_SHADERS
+#include "shader_sources.h"
+#endif
 
 namespace MathViz {
 	FlatColor::FlatColor(const GLUtils::Program& p) :
@@ -11,20 +19,59 @@ namespace MathViz {
 
 	FlatColor::FlatColor(const GLUtils::Program& p, const glm::vec3& col) :
 		IMaterial(p),
-		color{col}
+		block{col}
 	{ }
 
 	void FlatColor::setColor(const glm::vec3& col) {
-		this->color = col;
+		block.color = col;
 	}
 
 	glm::vec3 FlatColor::getColor() const {
-		return color;
+		return block.color;
 	}
 
-	EC::ErrorCode FlatColor::setUniforms() const {
-		RETURN_ON_ERROR_CODE(program.setUniform("color", color));
-		return EC::ErrorCode();
+	const void* FlatColor::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	Morph::Morph(const GLUtils::Program& p) :
+		Morph(p, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f))
+	{ }
+
+	Morph::Morph(const GLUtils::Program& p, const glm::vec4& color) :
+		IMaterial(p),
+		block{color, 0, 0, 0.0f, 2.0f, glm::vec2(1.0f, 1.0f)}
+	{ }
+
+	void Morph::setKeyframes(int from, int to, float lerpCoeff) {
+		block.fromKeyframe = from;
+		block.toKeyframe = to;
+		block.lerpCoeff = lerpCoeff;
+	}
+
+	void Morph::setSequencePosition(float position, int keyframeCount) {
+		assert(keyframeCount > 0);
+		const float wrapped = position - std::floor(position / keyframeCount) * keyframeCount;
+		const int from = std::min(int(wrapped), keyframeCount - 1);
+		setKeyframes(from, (from + 1) % keyframeCount, wrapped - from);
+	}
+
+	void Morph::setColor(const glm::vec4& color) {
+		block.color = color;
+	}
+
+	void Morph::setLineWidth(float width) {
+		block.lineWidth = width;
+	}
+
+	void Morph::setViewportSize(int width, int height) {
+		block.viewportSize = glm::vec2(float(width), float(height));
+	}
+
+	const void* Morph::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
 	}
 
 	Gradient2D::Gradient2D(const GLUtils::Program& p) :
@@ -45,17 +92,458 @@ namespace MathViz {
 		const glm::vec3& colorEnd
 	) :
 		IMaterial(p),
-		start(start),
-		end(end),
-		colorStart(colorStart),
-		colorEnd(colorEnd)
+		block{start, 0.0f, end, 0.0f, colorStart, 0.0f, colorEnd}
+	{ }
+
+	const void* Gradient2D::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	Grid2D::Grid2D(const GLUtils::Program& p) :
+		Grid2D(p, glm::vec3(0.5f, 0.5f, 0.5f), glm::vec3(1.0f, 1.0f, 1.0f), 20.0f)
+	{ }
+
+	Grid2D::Grid2D(
+		const GLUtils::Program& p,
+		const glm::vec3& gridColor,
+		const glm::vec3& axisColor,
+		float minCellPixels
+	) :
+		IMaterial(p),
+		block{gridColor, minCellPixels, axisColor, 5.0f}
+	{ }
+
+	const void* Grid2D::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	ThickLine::ThickLine(const GLUtils::Program& p) :
+		IMaterial(p),
+		block{glm::vec2(1.0f, 1.0f)}
+	{ }
+
+	void ThickLine::setViewportSize(int width, int height) {
+		block.viewportSize = glm::vec2(float(width), float(height));
+	}
+
+	const void* ThickLine::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	BatchedCurve::BatchedCurve(const GLUtils::Program& p) :
+		IMaterial(p),
+		block{glm::vec2(1.0f, 1.0f)}
+	{ }
+
+	void BatchedCurve::setViewportSize(int width, int height) {
+		block.viewportSize = glm::vec2(float(width), float(height));
+	}
+
+	const void* BatchedCurve::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	void ParameterUniforms::set(char name, float value) {
+		for (std::pair<char, float>& parameter : values) {
+			if (parameter.first == name) {
+				parameter.second = value;
+				return;
+			}
+		}
+		values.emplace_back(name, value);
+	}
+
+	EC::ErrorCode ParameterUniforms::apply(const GLUtils::Program& program) const {
+		for (const std::pair<char, float>& parameter : values) {
+			const char name[2] = {parameter.first, '\0'};
+			RETURN_ON_ERROR_CODE(program.setUniform(name, parameter.second));
+		}
+		return EC::ErrorCode();
+	}
+
+	/// The shader for FunctionPlot2D is assembled from these two parts with the GLSL
+	/// code for the expression between them.
+	static const char* functionPlot2DVertexPrefix = R"(
+#shader vertex
+#version 420 core
+layout(std140, binding = 0) uniform ProjectionView
+{
+	mat4 projectionView;
+	mat4 model;
+};
+
+layout(std140, binding = 1) uniform Material
+{
+	vec3 color;
+	float xFrom;
+	float xStep;
+	float lineWidth;
+	vec2 viewportSize;
+};
+
+flat out vec2 startPixel;
+flat out vec2 endPixel;
+flat out vec3 vertexColor;
+flat out float halfWidth;
+)";
+
+	static const char* functionPlot2DVertexSuffix = R"(
+vec2 toPixels(vec4 clip) {
+	return (clip.xy / clip.w * 0.5f + 0.5f) * viewportSize;
+}
+
+// Each instance is the segment between samples gl_InstanceID and gl_InstanceID + 1. It is expanded into
+// a quad in screen space in the same way as in thick_line.glsl.
+void main() {
+	float xStart = xFrom + float(gl_InstanceID) * xStep;
+	float xEnd = xStart + xStep;
+	vec4 startClip = projectionView * model * vec4(xStart, mathvizFunction(xStart), 0.0f, 1.0f);
+	vec4 endClip = projectionView * model * vec4(xEnd, mathvizFunction(xEnd), 0.0f, 1.0f);
+	startPixel = toPixels(startClip);
+	endPixel = toPixels(endClip);
+	vertexColor = color;
+	halfWidth = lineWidth * 0.5f;
+
+	vec2 delta = endPixel - startPixel;
+	float segmentLength = length(delta);
+	vec2 direction = segmentLength > 0.0f ? delta / segmentLength : vec2(1.0f, 0.0f);
+	vec2 normal = vec2(-direction.y, direction.x);
+	float radius = halfWidth + 1.0f;
+
+	const int corners[6] = int[6](0, 1, 2, 2, 1, 3);
+	int corner = corners[gl_VertexID];
+	float alongEnd = float(corner & 1);
+	float side = (corner & 2) != 0 ? 1.0f : -1.0f;
+	vec2 pixel = mix(startPixel - direction * radius, endPixel + direction * radius, alongEnd) + normal * side * radius;
+
+	float depth = mix(startClip.z / startClip.w, endClip.z / endClip.w, alongEnd);
+	gl_Position = vec4(pixel / viewportSize * 2.0f - 1.0f, depth, 1.0f);
+}
+
+#shader fragment
+#version 420 core
+flat in vec2 startPixel;
+flat in vec2 endPixel;
+flat in vec3 vertexColor;
+flat in float halfWidth;
+out vec4 FragColor;
+void main() {
+	vec2 delta = endPixel - startPixel;
+	float lengthSquared = dot(delta, delta);
+	float t = lengthSquared > 0.0f ? clamp(dot(gl_FragCoord.xy - startPixel, delta) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+	float distanceToSegment = length(gl_FragCoord.xy - (startPixel + t * delta));
+	float coverage = clamp(halfWidth + 0.5f - distanceToSegment, 0.0f, 1.0f);
+	// Samples where the function is not defined do not produce a segment
+	if (coverage <= 0.0f || any(isnan(vec4(startPixel, endPixel)))) {
+		discard;
+	}
+	FragColor = vec4(vertexColor, coverage);
+}
+)";
+
+	FunctionPlot2D::FunctionPlot2D() :
+		FunctionPlot2D(std::make_unique<GLUtils::Program>())
+	{ }
+
+	FunctionPlot2D::FunctionPlot2D(std::unique_ptr<GLUtils::Program> program) :
+		IMaterial(*program),
+		ownedProgram(std::move(program)),
+		block{glm::vec3(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, 1.0f, glm::vec2(1.0f, 1.0f)}
+	{ }
+
+	EC::ErrorCode FunctionPlot2D::init(const Expression& f, const glm::vec3& color) {
+		std::string source = functionPlot2DVertexPrefix;
+		f.toGLSL("mathvizFunction", "x", source);
+		source += functionPlot2DVertexSuffix;
+
+		GLUtils::Pipeline pipeline;
+		RETURN_ON_ERROR_CODE(pipeline.initFromSource(source));
+		// Keep the previous program if the new one fails to compile
+		GLUtils::Program newProgram;
+		RETURN_ON_ERROR_CODE(newProgram.init(pipeline));
+		*ownedProgram = std::move(newProgram);
+		block.color = color;
+		return EC::ErrorCode();
+	}
+
+	void FunctionPlot2D::setSampling(float from, float to, int n) {
+		block.xFrom = from;
+		block.xStep = n > 1 ? (to - from) / (n - 1) : 0.0f;
+	}
+
+	void FunctionPlot2D::setColor(const glm::vec3& color) {
+		block.color = color;
+	}
+
+	void FunctionPlot2D::setLineWidth(float width) {
+		block.lineWidth = width;
+	}
+
+	void FunctionPlot2D::setViewportSize(int width, int height) {
+		block.viewportSize = glm::vec2(float(width), float(height));
+	}
+
+	void FunctionPlot2D::setParameter(char name, float value) {
+		parameters.set(name, value);
+	}
+
+	EC::ErrorCode FunctionPlot2D::setUniforms() const {
+		return parameters.apply(program);
+	}
+
+	const void* FunctionPlot2D::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	/// The shader for FunctionField2D is assembled from these two parts with the GLSL
+	/// code for the expression between them.
+	static const char* functionField2DPrefix = R"(
+#shader vertex
+#version 420 core
+layout(location = 0) in vec3 position;
+
+layout(std140, binding = 0) uniform ProjectionView
+{
+	mat4 projectionView;
+	mat4 model;
+};
+
+out vec2 worldPosition;
+
+void main() {
+	vec4 world = model * vec4(position, 1.0f);
+	worldPosition = world.xy;
+	gl_Position = projectionView * world;
+}
+
+#shader fragment
+#version 420 core
+in vec2 worldPosition;
+out vec4 FragColor;
+
+layout(std140, binding = 1) uniform Material
+{
+	vec3 colorFrom;
+	float valueFrom;
+	vec3 colorTo;
+	float valueTo;
+	vec4 contourColor;
+	float contourLevel;
+	float contourWidth;
+	float heatmapOpacity;
+};
+)";
+
+	static const char* functionField2DSuffix = R"(
+void main() {
+	float value = mathvizField(worldPosition.x, worldPosition.y);
+	// The derivatives must be computed before any fragment of the quad is discarded. The distance to the
+	// level set in pixels is approximated with the first order Taylor expansion |f - level| / |grad f|.
+	float pixelGradient = length(vec2(dFdx(value), dFdy(value)));
+	if (isnan(value) || isinf(value)) {
+		discard;
+	}
+	float t = clamp((value - valueFrom) / (valueTo - valueFrom), 0.0f, 1.0f);
+	vec4 color = vec4(mix(colorFrom, colorTo, t), heatmapOpacity);
+
+	float distanceInPixels = abs(value - contourLevel) / max(pixelGradient, 1e-30f);
+	float coverage = contourWidth > 0.0f ? clamp(0.5f * contourWidth + 0.5f - distanceInPixels, 0.0f, 1.0f) : 0.0f;
+	float contourAlpha = coverage * contourColor.a;
+	// The curve is blended over the heatmap
+	float alpha = contourAlpha + color.a * (1.0f - contourAlpha);
+	if (alpha <= 0.0f) {
+		discard;
+	}
+	vec3 rgb = (contourColor.rgb * contourAlpha + color.rgb * color.a * (1.0f - contourAlpha)) / alpha;
+	FragColor = vec4(rgb, alpha);
+}
+)";
+
+	FunctionField2D::FunctionField2D() :
+		FunctionField2D(std::make_unique<GLUtils::Program>())
+	{ }
+
+	FunctionField2D::FunctionField2D(std::unique_ptr<GLUtils::Program> program) :
+		IMaterial(*program),
+		ownedProgram(std::move(program)),
+		block{
+			glm::vec3(0.0f, 0.0f, 0.5f), -1.0f,
+			glm::vec3(1.0f, 1.0f, 0.0f), 1.0f,
+			glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), 0.0f, 2.0f, 1.0f
+		}
+	{ }
+
+	EC::ErrorCode FunctionField2D::init(const Expression& f) {
+		std::string source = functionField2DPrefix;
+		f.toGLSL("mathvizField", "xy", source);
+		source += functionField2DSuffix;
+
+		GLUtils::Pipeline pipeline;
+		RETURN_ON_ERROR_CODE(pipeline.initFromSource(source));
+		// Keep the previous program if the new one fails to compile
+		GLUtils::Program newProgram;
+		RETURN_ON_ERROR_CODE(newProgram.init(pipeline));
+		*ownedProgram = std::move(newProgram);
+		return EC::ErrorCode();
+	}
+
+	void FunctionField2D::setHeatmap(
+		float valueFrom,
+		float valueTo,
+		const glm::vec3& colorFrom,
+		const glm::vec3& colorTo,
+		float opacity
+	) {
+		assert(valueFrom != valueTo);
+		block.valueFrom = valueFrom;
+		block.valueTo = valueTo;
+		block.colorFrom = colorFrom;
+		block.colorTo = colorTo;
+		block.heatmapOpacity = opacity;
+	}
+
+	void FunctionField2D::setContour(float level, const glm::vec4& color, float width) {
+		block.contourLevel = level;
+		block.contourColor = color;
+		block.contourWidth = width;
+	}
+
+	void FunctionField2D::setParameter(char name, float value) {
+		parameters.set(name, value);
+	}
+
+	EC::ErrorCode FunctionField2D::setUniforms() const {
+		return parameters.apply(program);
+	}
+
+	const void* FunctionField2D::getUniformBlock(int& size) const {
+		size = sizeof(UniformBlock);
+		return &block;
+	}
+
+	/// std140 blocks are padded to a multiple of 16 bytes and the bound range must cover the padding
+	static int64_t getPaddedBlockSize(int size) {
+		return (int64_t(size) + 15) / 16 * 16;
+	}
+
+	EC::ErrorCode MaterialFactory::init(const char* cacheDirectory) {
+		MATHVIZ_PROFILE_CPU("MaterialFactory::init");
+		GLUtils::ProgramBinaryCache cache;
+		// The cache only makes the start faster, the programs are compiled when it does not work
+		const bool useCache = cacheDirectory != nullptr && !cache.init(cacheDirectory).hasError() && cache.isEnabled();
+
+		std::array<GLUtils::Pipeline, int(ShaderTable::Count)> pipelines;
+		std::array<uint64_t, int(ShaderTable::Count)> keys;
+		std::vector<int> pending;
+		for (int i = 0; i < int(ShaderTable::Count); ++i) {
+#ifdef MATHVIZ_EMBED_SHADERS
+			// The stages were split at build time, the source is used only for the cache key
+			const EmbeddedShader& embedded = embeddedShaders[i];
+			const std::string source = std::string(embedded.vertex) + embedded.fragment;
+#else
+			std::string source;
+			RETURN_ON_ERROR_CODE(GLUtils::readFile(shaderPaths[i], source));
+#endif
+			if (useCache) {
+				keys[i] = cache.getKey(source);
+				if (cache.load(keys[i], programs[i])) {
+					continue;
+				}
+			}
+#ifdef MATHVIZ_EMBED_SHADERS
+			const int vertexLength = int(strlen(embedded.vertex));
+			const int fragmentLength = int(source.size()) - vertexLength;
+			RETURN_ON_ERROR_CODE(pipelines[i].compileStage(GLUtils::ShaderType::Vertex, embedded.vertex, vertexLength));
+			RETURN_ON_ERROR_CODE(pipelines[i].compileStage(GLUtils::ShaderType::Fragment, embedded.fragment, fragmentLength));
+#else
+			RETURN_ON_ERROR_CODE(pipelines[i].compileFromSource(source));
+#endif
+			RETURN_ON_ERROR_CODE(programs[i].link(pipelines[i]));
+			pending.push_back(i);
+		}
+
+		// Finish the programs which the driver is done with first, wait only when none is done
+		while (!pending.empty()) {
+			auto it = std::find_if(pending.begin(), pending.end(), [this](int i) {
+				return programs[i].isLinkComplete();
+			});
+			if (it == pending.end()) {
+				it = pending.begin();
+			}
+			const int i = *it;
+			pending.erase(it);
+			const EC::ErrorCode err = programs[i].finishLink(pipelines[i]);
+			if (err.hasError()) {
+				return EC::ErrorCode(err.getStatus(), "%s: %s", shaderPaths[i], err.getMessage());
+			}
+			if (useCache) {
+				// A program which is not stored is compiled again on the next start
+				(void)cache.store(keys[i], programs[i]);
+			}
+		}
+		return EC::ErrorCode();
+	}
+
+	MaterialUniformBuffer::MaterialUniformBuffer() :
+		capacity(0)
 	{ }
 
-	EC::ErrorCode Gradient2D::setUniforms() const {
-		RETURN_ON_ERROR_CODE(program.setUniform("start", start));
-		RETURN_ON_ERROR_CODE(program.setUniform("end", end));
-		RETURN_ON_ERROR_CODE(program.setUniform("colorStart", colorStart));
-		RETURN_ON_ERROR_CODE(program.setUniform("colorEnd", colorEnd));
+	EC::ErrorCode MaterialUniformBuffer::init(int bindingPosition) {
+		freeMem();
+		buffer.setBindingPosition(bindingPosition);
+		return EC::ErrorCode();
+	}
+
+	void MaterialUniformBuffer::freeMem() {
+		buffer.freeMem();
+		staging.clear();
+		uploaded.clear();
+		capacity = 0;
+	}
+
+	void MaterialUniformBuffer::clear() {
+		staging.clear();
+	}
+
+	int64_t MaterialUniformBuffer::add(const IMaterial& material) {
+		int size = 0;
+		const void* block = material.getUniformBlock(size);
+		if (block == nullptr) {
+			return -1;
+		}
+		const int64_t alignment = GLUtils::UniformBuffer::getOffsetAlignment();
+		const int64_t offset = (int64_t(staging.size()) + alignment - 1) / alignment * alignment;
+		staging.resize(offset + getPaddedBlockSize(size));
+		memcpy(staging.data() + offset, block, size);
+		return offset;
+	}
+
+	EC::ErrorCode MaterialUniformBuffer::upload() {
+		MATHVIZ_PROFILE_CPU("MaterialUniformBuffer::upload");
+		if (staging.empty() || staging == uploaded) {
+			return EC::ErrorCode();
+		}
+		if (int64_t(staging.size()) > capacity) {
+			buffer.freeMem();
+			capacity = std::max<int64_t>(staging.size(), 2 * capacity);
+			RETURN_ON_ERROR_CODE(buffer.init(capacity));
+		}
+		RETURN_ON_ERROR_CODE(buffer.upload(0, staging.size(), staging.data()));
+		uploaded = staging;
 		return EC::ErrorCode();
 	}
+
+	EC::ErrorCode MaterialUniformBuffer::bind(int64_t offset, const IMaterial& material) {
+		if (offset < 0) {
+			return EC::ErrorCode();
+		}
+		int size = 0;
+		material.getUniformBlock(size);
+		return buffer.bindRange(offset, getPaddedBlockSize(size));
+	}
 }
\ No newline at end of file
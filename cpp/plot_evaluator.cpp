@@ -0,0 +1,148 @@
+#include <algorithm>
+#include "plot_evaluator.h"
+#include "expression.h"
+#include "profiler.h"
+
+namespace MathViz {
+	PlotEvaluator::PlotEvaluator() :
+		hasPendingRequest(false),
+		stop(false),
+		latestRequestId(0),
+		finishedRequestId(0)
+	{ }
+
+	PlotEvaluator::~PlotEvaluator() {
+		freeMem();
+	}
+
+	EC::ErrorCode PlotEvaluator::init(std::function<void()> onResultIn) {
+		freeMem();
+		onResult = std::move(onResultIn);
+		stop = false;
+		worker = std::thread(&PlotEvaluator::workerLoop, this);
+		return EC::ErrorCode();
+	}
+
+	void PlotEvaluator::freeMem() {
+		if (!worker.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			hasPendingRequest = false;
+			// Cancels the running request
+			latestRequestId++;
+		}
+		wakeUp.notify_one();
+		worker.join();
+	}
+
+	uint64_t PlotEvaluator::submit(Request request) {
+		uint64_t id;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pendingRequest = std::move(request);
+			hasPendingRequest = true;
+			id = ++latestRequestId;
+		}
+		wakeUp.notify_one();
+		return id;
+	}
+
+	bool PlotEvaluator::takeResult(Result& result) {
+		if (!results.update()) {
+			return false;
+		}
+		std::swap(result, results.getReadSlot());
+		return true;
+	}
+
+	bool PlotEvaluator::isBusy() const {
+		return finishedRequestId.load() != latestRequestId.load();
+	}
+
+	bool PlotEvaluator::isCancelled(uint64_t id) const {
+		return latestRequestId.load(std::memory_order_relaxed) != id;
+	}
+
+	void PlotEvaluator::workerLoop() {
+		while (true) {
+			Request request;
+			uint64_t id;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeUp.wait(lock, [this]() { return stop || hasPendingRequest; });
+				if (stop) {
+					return;
+				}
+				request = std::move(pendingRequest);
+				hasPendingRequest = false;
+				id = latestRequestId.load();
+			}
+			Result& result = results.getWriteSlot();
+			if (!evaluate(request, id, result)) {
+				continue;
+			}
+			results.publish();
+			finishedRequestId = id;
+			if (onResult) {
+				onResult();
+			}
+		}
+	}
+
+	bool PlotEvaluator::evaluate(const Request& request, uint64_t id, Result& result) const {
+		MATHVIZ_PROFILE_CPU("PlotEvaluator::evaluate");
+		result.requestId = id;
+		result.error = EC::ErrorCode();
+		result.vertices.clear();
+		const auto cancelled = [this, id]() -> bool {
+			return isCancelled(id);
+		};
+		const Expression* f = request.expression.get();
+		Expression specialized;
+		if (!request.parameterNames.empty()) {
+			assert(request.parameterNames.size() == request.parameterValues.size());
+			result.error = f->specialize(request.parameterNames.c_str(), request.parameterValues.data(), specialized);
+			if (result.error.hasError()) {
+				return true;
+			}
+			f = &specialized;
+		}
+		if (request.tolerance > 0.0f) {
+			return sampleAdaptive(*f, request.xRange, request.tolerance, result.vertices, cancelled);
+		}
+
+		Expression::Evaluator evaluator;
+		result.error = f->bind({'x'}, evaluator);
+		if (result.error.hasError()) {
+			return true;
+		}
+		const int n = std::max(request.sampleCount, 2);
+		const float dh = request.xRange.getLength() / (n - 1);
+		std::vector<float> x(n);
+		std::vector<float> y(n);
+		for (int i = 0; i < n; ++i) {
+			x[i] = request.xRange.from + i * dh;
+		}
+		// Chunks which start after the request was cancelled are skipped
+		getThreadPool().parallelFor(n, BatchFunctionChunkSize, [&](int64_t begin, int64_t end) {
+			for (int64_t chunkStart = begin; chunkStart < end; chunkStart += BatchFunctionChunkSize) {
+				if (cancelled()) {
+					return;
+				}
+				const float* chunkX = &x[chunkStart];
+				evaluator.evaluateBatch(&chunkX, &y[chunkStart], size_t(std::min<int64_t>(BatchFunctionChunkSize, end - chunkStart)));
+			}
+		});
+		if (cancelled()) {
+			return false;
+		}
+		result.vertices.resize(n);
+		for (int i = 0; i < n; ++i) {
+			result.vertices[i] = glm::vec3(x[i], y[i], 0.0f);
+		}
+		return true;
+	}
+}
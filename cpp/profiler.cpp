@@ -0,0 +1,403 @@
+#include "profiler.h"
+#include "error_code.h"
+#include "glad/glad.h"
+#include "glutils.h"
+#include "imgui.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <string_view>
+#include <unordered_map>
+
+namespace MathViz {
+
+	/// The maximal nesting of CPU scopes in one thread
+	static constexpr int MaxCpuDepth = 64;
+
+	/// Scopes of the calling thread which are not finished
+	struct ThreadScopes {
+		int index = -1;
+		int depth = 0;
+		std::array<const char*, MaxCpuDepth> names;
+		std::array<int64_t, MaxCpuDepth> starts;
+	};
+	static thread_local ThreadScopes threadScopes;
+
+	/// Write the string as a JSON string literal
+	static void writeJSONString(FILE* file, const char* str) {
+		fputc('"', file);
+		for (const char* it = str; *it; ++it) {
+			if (*it == '"' || *it == '\\') {
+				fputc('\\', file);
+			}
+			fputc(*it, file);
+		}
+		fputc('"', file);
+	}
+
+	Profiler::Profiler() :
+		startTime(std::chrono::steady_clock::now()),
+		gpuClockOffset(0),
+		gpuEnabled(false),
+		threadCount(0),
+		mainThread(0),
+		gpuDepth(0),
+		frameIndex(0),
+		frameStart(0),
+		captureFirstFrame(-1),
+		captureFrameCount(0),
+		captureFrameInput(60)
+	{ }
+
+	Profiler& Profiler::getInstance() {
+		static Profiler profiler;
+		return profiler;
+	}
+
+	EC::ErrorCode Profiler::init() {
+		freeMem();
+		for (GpuFrame& gpuFrame : gpuFrames) {
+			RETURN_ON_GL_ERROR(glGenQueries(int(gpuFrame.queries.size()), gpuFrame.queries.data()));
+			gpuFrame.frameIndex = -1;
+			gpuFrame.scopeCount = 0;
+		}
+		GLint64 gpuTime = 0;
+		RETURN_ON_GL_ERROR(glGetInteger64v(GL_TIMESTAMP, &gpuTime));
+		gpuClockOffset = now() - gpuTime;
+		gpuEnabled = true;
+		mainThread = getThreadIndex();
+		return EC::ErrorCode();
+	}
+
+	void Profiler::freeMem() {
+		if (gpuEnabled) {
+			for (GpuFrame& gpuFrame : gpuFrames) {
+				glDeleteQueries(int(gpuFrame.queries.size()), gpuFrame.queries.data());
+			}
+		}
+		gpuEnabled = false;
+	}
+
+	int64_t Profiler::now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+	}
+
+	int Profiler::getThreadIndex() {
+		if (threadScopes.index == -1) {
+			threadScopes.index = threadCount++;
+		}
+		return threadScopes.index;
+	}
+
+	void Profiler::beginFrame() {
+		frameStart = now();
+		if (gpuEnabled) {
+			GpuFrame& gpuFrame = gpuFrames[frameIndex % FrameLatency];
+			if (gpuFrame.frameIndex >= 0) {
+				readGpuFrame(gpuFrame);
+			}
+			gpuFrame.frameIndex = frameIndex;
+			gpuFrame.scopeCount = 0;
+			gpuDepth = 0;
+		}
+		updateCapture();
+	}
+
+	void Profiler::endFrame() {
+		Frame& frame = history[frameIndex % HistorySize];
+		frame.index = frameIndex;
+		frame.start = frameStart;
+		frame.end = now();
+		frame.gpuEvents.clear();
+		frame.gpuReady = !gpuEnabled;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frame.cpuEvents.swap(cpuEvents);
+			cpuEvents.clear();
+		}
+		frameIndex++;
+	}
+
+	void Profiler::beginCpuScope(const char* name) {
+		ThreadScopes& scopes = threadScopes;
+		if (scopes.depth < MaxCpuDepth) {
+			scopes.names[scopes.depth] = name;
+			scopes.starts[scopes.depth] = now();
+		}
+		scopes.depth++;
+	}
+
+	void Profiler::endCpuScope() {
+		ThreadScopes& scopes = threadScopes;
+		scopes.depth--;
+		if (scopes.depth >= MaxCpuDepth) {
+			return;
+		}
+		const int thread = getThreadIndex();
+		const Event event{scopes.names[scopes.depth], scopes.starts[scopes.depth], now(), thread, scopes.depth};
+		std::lock_guard<std::mutex> lock(mutex);
+		cpuEvents.push_back(event);
+	}
+
+	int Profiler::beginGpuScope(const char* name) {
+		if (!gpuEnabled) {
+			return -1;
+		}
+		GpuFrame& gpuFrame = gpuFrames[frameIndex % FrameLatency];
+		if (gpuFrame.scopeCount == MaxGpuScopes) {
+			return -1;
+		}
+		const int index = gpuFrame.scopeCount++;
+		gpuFrame.names[index] = name;
+		gpuFrame.depths[index] = gpuDepth++;
+		glQueryCounter(gpuFrame.queries[2 * index], GL_TIMESTAMP);
+		return index;
+	}
+
+	void Profiler::endGpuScope(int index) {
+		if (index < 0) {
+			return;
+		}
+		GpuFrame& gpuFrame = gpuFrames[frameIndex % FrameLatency];
+		glQueryCounter(gpuFrame.queries[2 * index + 1], GL_TIMESTAMP);
+		gpuDepth--;
+	}
+
+	void Profiler::readGpuFrame(GpuFrame& gpuFrame) {
+		Frame* frame = findFrame(gpuFrame.frameIndex);
+		if (frame == nullptr) {
+			return;
+		}
+		frame->gpuReady = true;
+		if (gpuFrame.scopeCount == 0) {
+			return;
+		}
+		// Queries finish in order, if the last one is ready all others are ready too. If it is not ready the
+		// frame is dropped instead of waiting for the GPU.
+		GLint available = 0;
+		glGetQueryObjectiv(gpuFrame.queries[2 * gpuFrame.scopeCount - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			return;
+		}
+		frame->gpuEvents.resize(gpuFrame.scopeCount);
+		for (int i = 0; i < gpuFrame.scopeCount; ++i) {
+			GLint64 start = 0, end = 0;
+			glGetQueryObjecti64v(gpuFrame.queries[2 * i], GL_QUERY_RESULT, &start);
+			glGetQueryObjecti64v(gpuFrame.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+			frame->gpuEvents[i] = Event{
+				gpuFrame.names[i],
+				start + gpuClockOffset,
+				end + gpuClockOffset,
+				GpuThread,
+				gpuFrame.depths[i]
+			};
+		}
+	}
+
+	Profiler::Frame* Profiler::findFrame(int64_t index) {
+		Frame& frame = history[index % HistorySize];
+		return frame.index == index ? &frame : nullptr;
+	}
+
+	void Profiler::requestCapture(int frameCount, const char* path) {
+		capture.clear();
+		captureFirstFrame = frameIndex + 1;
+		captureFrameCount = frameCount;
+		capturePath = path;
+		captureStatus = "Recording";
+	}
+
+	bool Profiler::isCapturing() const {
+		return captureFirstFrame >= 0;
+	}
+
+	void Profiler::updateCapture() {
+		if (captureFirstFrame < 0) {
+			return;
+		}
+		// Frames are added in order once their GPU events are known
+		while (int(capture.size()) < captureFrameCount) {
+			Frame* frame = findFrame(captureFirstFrame + int64_t(capture.size()));
+			if (frame == nullptr || !frame->gpuReady) {
+				return;
+			}
+			capture.push_back(*frame);
+		}
+		const EC::ErrorCode err = writeCapture();
+		captureStatus = err.hasError() ? err.getMessage() : "Written to " + capturePath;
+		captureFirstFrame = -1;
+		capture.clear();
+	}
+
+	EC::ErrorCode Profiler::writeCapture() const {
+		FILE* file = fopen(capturePath.c_str(), "w");
+		if (file == nullptr) {
+			return EC::ErrorCode(errno, "Failed to open %s for writing", capturePath.c_str());
+		}
+		fprintf(file, "{\"traceEvents\":[\n");
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", GpuThread);
+		const auto writeEvent = [file](const Event& event) {
+			fprintf(file, ",\n{\"name\":");
+			writeJSONString(file, event.name);
+			fprintf(
+				file,
+				",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				event.thread,
+				event.start / 1000.0,
+				(event.end - event.start) / 1000.0
+			);
+		};
+		for (const Frame& frame : capture) {
+			writeEvent(Event{"Frame", frame.start, frame.end, mainThread, 0});
+			std::for_each(frame.cpuEvents.begin(), frame.cpuEvents.end(), writeEvent);
+			std::for_each(frame.gpuEvents.begin(), frame.gpuEvents.end(), writeEvent);
+		}
+		fprintf(file, "\n]}\n");
+		const bool failed = ferror(file);
+		fclose(file);
+		if (failed) {
+			return EC::ErrorCode(-1, "Failed to write %s", capturePath.c_str());
+		}
+		return EC::ErrorCode();
+	}
+
+	void Profiler::drawFlameGraph(const Frame& frame, bool gpu) {
+		const std::vector<Event>& events = gpu ? frame.gpuEvents : frame.cpuEvents;
+		const float rowHeight = ImGui::GetTextLineHeightWithSpacing();
+		int maxDepth = 0;
+		int64_t begin = frame.start, end = frame.end;
+		for (const Event& event : events) {
+			maxDepth = std::max(maxDepth, event.depth);
+			// GPU work of the frame can finish after the CPU part of the frame ends
+			begin = std::min(begin, event.start);
+			end = std::max(end, event.end);
+		}
+		const ImVec2 origin = ImGui::GetCursorScreenPos();
+		const float width = std::max(ImGui::GetContentRegionAvail().x, 1.0f);
+		const double scale = width / double(std::max<int64_t>(end - begin, 1));
+		ImDrawList* drawList = ImGui::GetWindowDrawList();
+		for (const Event& event : events) {
+			// Only the main thread is shown, worker threads are in the captured trace
+			if (!gpu && event.thread != mainThread) {
+				continue;
+			}
+			const ImVec2 min(origin.x + float((event.start - begin) * scale), origin.y + event.depth * rowHeight);
+			const ImVec2 max(
+				std::max(origin.x + float((event.end - begin) * scale), min.x + 1.0f),
+				min.y + rowHeight - 1.0f
+			);
+			const ImU32 color = gpu ? IM_COL32(200, 90, 60, 255) : IM_COL32(60, 120, 200, 255);
+			drawList->AddRectFilled(min, max, color);
+			drawList->PushClipRect(min, max, true);
+			drawList->AddText(ImVec2(min.x + 2.0f, min.y), IM_COL32_WHITE, event.name);
+			drawList->PopClipRect();
+			if (ImGui::IsMouseHoveringRect(min, max)) {
+				ImGui::SetTooltip("%s %.3f ms", event.name, (event.end - event.start) / 1e6);
+			}
+		}
+		ImGui::Dummy(ImVec2(width, (maxDepth + 1) * rowHeight));
+	}
+
+	void Profiler::drawWindow(bool* open) {
+		if (!ImGui::Begin("Profiler", open)) {
+			ImGui::End();
+			return;
+		}
+
+		ImGui::SetNextItemWidth(100.0f);
+		ImGui::InputInt("##frames", &captureFrameInput);
+		captureFrameInput = std::max(captureFrameInput, 1);
+		ImGui::SameLine();
+		if (ImGui::Button("Capture frames") && !isCapturing()) {
+			requestCapture(captureFrameInput, "mathviz_trace.json");
+		}
+		if (!captureStatus.empty()) {
+			ImGui::Text("%s", captureStatus.c_str());
+		}
+
+		const int64_t shownFrame = frameIndex - 1;
+		const Frame* cpuFrame = findFrame(shownFrame);
+		if (cpuFrame != nullptr) {
+			ImGui::Text("CPU frame %.3f ms", (cpuFrame->end - cpuFrame->start) / 1e6);
+			drawFlameGraph(*cpuFrame, false);
+		}
+		// GPU results arrive a few frames later
+		for (int64_t i = shownFrame; i > shownFrame - HistorySize && i >= 0; --i) {
+			const Frame* gpuFrame = findFrame(i);
+			if (gpuFrame != nullptr && gpuFrame->gpuReady && !gpuFrame->gpuEvents.empty()) {
+				ImGui::Text("GPU frame %lld", (long long)i);
+				drawFlameGraph(*gpuFrame, true);
+				break;
+			}
+		}
+
+		// Sum of each scope in each frame, the percentiles are over the frames in the history
+		struct ScopeTimes {
+			std::vector<float> cpu;
+			std::vector<float> gpu;
+		};
+		std::unordered_map<std::string_view, ScopeTimes> scopes;
+		std::unordered_map<std::string_view, float> frameSums;
+		const auto collect = [&](const std::vector<Event>& events, bool gpu) {
+			frameSums.clear();
+			for (const Event& event : events) {
+				frameSums[event.name] += (event.end - event.start) / 1e6f;
+			}
+			for (const auto& it : frameSums) {
+				ScopeTimes& times = scopes[it.first];
+				(gpu ? times.gpu : times.cpu).push_back(it.second);
+			}
+		};
+		for (const Frame& frame : history) {
+			if (frame.index < 0) {
+				continue;
+			}
+			collect(frame.cpuEvents, false);
+			if (frame.gpuReady) {
+				collect(frame.gpuEvents, true);
+			}
+		}
+		const auto percentile = [](std::vector<float>& values, float p) -> float {
+			if (values.empty()) {
+				return 0.0f;
+			}
+			const size_t index = std::min(values.size() - 1, size_t(p * values.size()));
+			std::nth_element(values.begin(), values.begin() + index, values.end());
+			return values[index];
+		};
+		if (ImGui::BeginTable("Scopes", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+			ImGui::TableSetupColumn("Scope");
+			ImGui::TableSetupColumn("CPU p50");
+			ImGui::TableSetupColumn("CPU p95");
+			ImGui::TableSetupColumn("CPU p99");
+			ImGui::TableSetupColumn("GPU p50");
+			ImGui::TableSetupColumn("GPU p95");
+			ImGui::TableSetupColumn("GPU p99");
+			ImGui::TableHeadersRow();
+			std::vector<std::string_view> names;
+			names.reserve(scopes.size());
+			for (const auto& it : scopes) {
+				names.push_back(it.first);
+			}
+			std::sort(names.begin(), names.end());
+			for (const std::string_view& name : names) {
+				ScopeTimes& times = scopes[name];
+				ImGui::TableNextRow();
+				ImGui::TableNextColumn();
+				ImGui::TextUnformatted(name.data(), name.data() + name.size());
+				for (std::vector<float>* values : {&times.cpu, &times.gpu}) {
+					for (const float p : {0.5f, 0.95f, 0.99f}) {
+						ImGui::TableNextColumn();
+						if (values->empty()) {
+							ImGui::TextUnformatted("-");
+						} else {
+							ImGui::Text("%.3f", percentile(*values, p));
+						}
+					}
+				}
+			}
+			ImGui::EndTable();
+		}
+		ImGui::End();
+	}
+}
@@ -0,0 +1,153 @@
+#include "thread_pool.h"
+#include "error_code.h"
+#include <algorithm>
+#include <iterator>
+#include <system_error>
+
+namespace MathViz {
+
+	/// The pool which owns the current thread and the index of its queue. Not set for threads which are not workers.
+	static thread_local const ThreadPool* currentPool = nullptr;
+	static thread_local int currentQueueIndex = -1;
+
+	ThreadPool::ThreadPool() :
+		queueCount(0),
+		pendingTasks(0),
+		stop(false)
+	{ }
+
+	ThreadPool::~ThreadPool() {
+		freeMem();
+	}
+
+	EC::ErrorCode ThreadPool::init(int workerCount) {
+		freeMem();
+		if (workerCount < 0) {
+			workerCount = std::max(int(std::thread::hardware_concurrency()) - 1, 0);
+		}
+		queueCount = workerCount + 1;
+		queues.reset(new Queue[queueCount]);
+		stop = false;
+		workers.reserve(workerCount);
+		try {
+			for (int i = 0; i < workerCount; ++i) {
+				workers.emplace_back(&ThreadPool::workerLoop, this, i);
+			}
+		} catch (const std::system_error& e) {
+			freeMem();
+			return EC::ErrorCode(e.code().value(), "Failed to start worker thread: %s", e.what());
+		}
+		return EC::ErrorCode();
+	}
+
+	void ThreadPool::freeMem() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stop = true;
+		}
+		wakeUp.notify_all();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		workers.clear();
+		queues.reset();
+		queueCount = 0;
+	}
+
+	int ThreadPool::getThreadCount() const {
+		return int(workers.size()) + 1;
+	}
+
+	int ThreadPool::getQueueIndex() const {
+		return currentPool == this ? currentQueueIndex : queueCount - 1;
+	}
+
+	void ThreadPool::run(Job& job, int64_t count, int64_t grainSize) {
+		if (count <= 0) {
+			return;
+		}
+		grainSize = std::max<int64_t>(grainSize, 1);
+		const int64_t taskCount = (count + grainSize - 1) / grainSize;
+		if (workers.empty() || taskCount == 1) {
+			job.run(job.data, 0, count);
+			return;
+		}
+		// A few tasks per thread so that stealing can balance chunks with different cost
+		const int64_t tasksPerThread = 4;
+		const int64_t grainsPerTask = std::max<int64_t>(taskCount / (queueCount * tasksPerThread), 1);
+		const int64_t taskSize = grainsPerTask * grainSize;
+		const int64_t splitCount = (count + taskSize - 1) / taskSize;
+		job.remaining = splitCount;
+
+		// Consecutive tasks go to the same queue, so that each thread works on neighbouring memory
+		const int64_t tasksPerQueue = (splitCount + queueCount - 1) / queueCount;
+		int64_t begin = 0;
+		for (int queue = 0; queue < queueCount && begin < count; ++queue) {
+			std::lock_guard<std::mutex> lock(queues[queue].mutex);
+			for (int64_t i = 0; i < tasksPerQueue && begin < count; ++i) {
+				const int64_t end = std::min(begin + taskSize, count);
+				queues[queue].tasks.push_back(Task{&job, begin, end});
+				begin = end;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			pendingTasks += splitCount;
+		}
+		wakeUp.notify_all();
+
+		// Help only with this job. Running tasks of other jobs would block the caller until they finish, e.g.
+		// the render thread could end up evaluating a chunk of a background plot.
+		const int queueIndex = getQueueIndex();
+		while (job.remaining.load() > 0) {
+			if (!tryRunTask(queueIndex, &job)) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	bool ThreadPool::tryRunTask(int queueIndex, const Job* only) {
+		Task task{nullptr, 0, 0};
+		const auto matches = [only](const Task& t) { return only == nullptr || t.job == only; };
+		// The own queue is processed from the front and the other queues are robbed from the back
+		for (int i = 0; i < queueCount && task.job == nullptr; ++i) {
+			Queue& queue = queues[(queueIndex + i) % queueCount];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (i == 0) {
+				const auto it = std::find_if(queue.tasks.begin(), queue.tasks.end(), matches);
+				if (it != queue.tasks.end()) {
+					task = *it;
+					queue.tasks.erase(it);
+				}
+			} else {
+				const auto it = std::find_if(queue.tasks.rbegin(), queue.tasks.rend(), matches);
+				if (it != queue.tasks.rend()) {
+					task = *it;
+					queue.tasks.erase(std::next(it).base());
+				}
+			}
+		}
+		if (task.job == nullptr) {
+			return false;
+		}
+		pendingTasks--;
+		task.job->run(task.job->data, task.begin, task.end);
+		task.job->remaining--;
+		return true;
+	}
+
+	void ThreadPool::workerLoop(int queueIndex) {
+		currentPool = this;
+		currentQueueIndex = queueIndex;
+		while (true) {
+			if (tryRunTask(queueIndex, nullptr)) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wakeUp.wait(lock, [this]() { return stop || pendingTasks.load() > 0; });
+			if (stop) {
+				return;
+			}
+		}
+	}
+}
@@ -1,6 +1,10 @@
 #include <memory>
+#include <vector>
 #include "GLFW/glfw3.h"
 #include "material.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include "frame_scheduler.h"
 namespace EC {
 	class ErrorCode;
 }
@@ -13,6 +17,7 @@ struct GLFWwindow;
 
 namespace MathViz {
 	class Node;
+	class IFrameSink;
 
 	class Context {
 	public:
@@ -20,30 +25,63 @@ namespace MathViz {
 		Context(const Context&) = delete;
 		Context& operator=(const Context&) = delete;
 		~Context();
+		/// @param[in] width The width of the window and of the rendered frames
+		/// @param[in] height The height of the window and of the rendered frames
+		/// @param[in] headless If true the window is hidden and ImGui is not initialized. Use it with
+		/// renderAnimation to export frames without showing anything on the screen.
 		[[nodiscard]]
-		EC::ErrorCode init(int width, int height);
+		EC::ErrorCode init(int width, int height, bool headless = false);
 		EC::ErrorCode initImgui();
 		void onResize(int width, int height);
 		void freeMem();
 		[[nodiscard]]
 		EC::ErrorCode mainLoop();
+		/// Workers shared by everything which needs to run in parallel e.g. geometry generation.
+		/// GL calls must still be made only from the thread which called init.
+		ThreadPool& getThreadPool();
+		/// Request frames when something changes outside of the input handling, e.g. when a background job is done
+		FrameScheduler& getFrameScheduler();
+		/// Render the animation of the morphs and the Reiman sum into an offscreen framebuffer and pass
+		/// each frame to the sink. The pixels are read asynchronously, so the GPU renders the next frames
+		/// while the previous ones are written.
+		/// @param[in] sink Where the frames are written
+		/// @param[in] frameCount The number of frames of the animation
+		[[nodiscard]]
+		EC::ErrorCode renderAnimation(IFrameSink& sink, int frameCount);
 	private:
 		enum ReservedUBOBindings {
-			ProjectionView = 0
+			ProjectionView = 0,
+			Material = 1
 		};
 
 		EC::ErrorCode loadShaders();
-		EC::ErrorCode drawNode(const Node& node);
+		/// Add the node to the nodes drawn by the next call to flushRenderQueue. The node must
+		/// be alive until then.
+		void submit(const Node& node);
+		/// Draw all submitted nodes sorted by layer, program, material and geometry, so that programs,
+		/// uniforms and transforms are set only when they change. Outlines are drawn in a second pass
+		/// without depth test. The queue is empty afterwards.
+		[[nodiscard]]
+		EC::ErrorCode flushRenderQueue();
 		EC::ErrorCode setMatrices(const GLUtils::Program& program);
 		std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)> window;
 		MaterialFactory materialFactory;
+		ThreadPool threadPool;
+		FrameScheduler frameScheduler;
 		int width;
 		int height;
+		bool headless;
 
 		// TODO: Create a camera class
 		glm::mat4 view;
 		glm::mat4 projection;
 		/// ProjectionVew + Model transform
 		GLUtils::UniformBuffer transforms;
+		/// The parameters of all materials used in the frame
+		MaterialUniformBuffer materialUniforms;
+		/// Nodes submitted since the last flush
+		std::vector<const Node*> renderQueue;
+		/// Offsets in materialUniforms of the material and the outline material of each node in the queue
+		std::vector<int64_t> materialOffsets;
 	};
 }
\ No newline at end of file
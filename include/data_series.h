@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "error_code.h"
+#include "geometry_primitives.h"
+
+namespace MathViz {
+	/// Read only memory mapping of a whole file. The pages are loaded by the OS when they are touched and can be
+	/// evicted under memory pressure, so mapping a file larger than the memory is fine.
+	class MappedFile {
+	public:
+		MappedFile();
+		~MappedFile();
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile(MappedFile&& other) noexcept;
+		MappedFile& operator=(MappedFile&& other) noexcept;
+		/// @param[in] path The file which will be mapped, it must not be empty
+		EC::ErrorCode init(const char* path);
+		void freeMem();
+		const unsigned char* getData() const;
+		int64_t getSize() const;
+	private:
+		const unsigned char* data;
+		int64_t size;
+	};
+
+	/// Uniformly sampled signal stored in a binary file of little endian 32 bit floats. Sample i is at
+	/// x = xStart + i * xStep. A pyramid with the minimum and the maximum of blocks of Branching^(level + 1)
+	/// samples is built next to the file the first time it is opened and reused while the file does not
+	/// change. With it the extremes of any range of samples are found by reading O(log(n)) values, so the
+	/// cost of decimating the signal to the screen does not depend on the number of samples. Neither the
+	/// samples nor the pyramid are copied into memory, both are memory mapped.
+	class DataSeries {
+	public:
+		/// The number of blocks of each level which are merged in one block of the next level
+		static constexpr int Branching = 4;
+
+		struct MinMax {
+			float min;
+			float max;
+		};
+
+		DataSeries();
+		DataSeries(const DataSeries&) = delete;
+		DataSeries& operator=(const DataSeries&) = delete;
+		/// Map the samples and the pyramid. The pyramid is written to path + ".minmax" if it does not
+		/// exist or was built for another version of the file.
+		/// @param[in] path The file with the samples
+		/// @param[in] xStart The x coordinate of the first sample
+		/// @param[in] xStep The distance between two samples along the x axis, must be positive
+		EC::ErrorCode init(const char* path, double xStart, double xStep);
+		void freeMem();
+		/// Change the x coordinates of the samples
+		void setSampling(double xStart, double xStep);
+		int64_t getSampleCount() const;
+		float getSample(int64_t index) const;
+		double getX(int64_t index) const;
+		/// The distance between two samples along the x axis
+		double getXStep() const;
+		/// The x coordinates of the first and the last sample
+		Range2D getXRange() const;
+		/// The minimum and the maximum of the samples with index in [first;last). NaN samples are skipped.
+		/// If all samples are NaN or the range is empty the minimum is larger than the maximum.
+		MinMax getMinMax(int64_t first, int64_t last) const;
+		/// Convert one column of a CSV file into a file which can be opened with init. The file is read one
+		/// line at a time, lines where the column is not a number become NaN samples.
+		/// @param[in] csvPath The CSV file, values are separated by commas
+		/// @param[in] column The zero based index of the column
+		/// @param[in] skipHeader If true the first line is not converted
+		/// @param[in] outputPath The binary file which will be written
+		static EC::ErrorCode convertCSV(const char* csvPath, int column, bool skipHeader, const char* outputPath);
+	private:
+		struct PyramidHeader {
+			static constexpr uint32_t Magic = 0x4d4d564d; // MVMM
+			uint32_t magic;
+			uint32_t branching;
+			uint64_t sampleCount;
+			/// Last write time of the samples file, the pyramid is rebuilt when it does not match
+			int64_t sourceTime;
+		};
+
+		/// Compute the number of entries in each level of the pyramid
+		void computeLevels();
+		EC::ErrorCode buildPyramid(const char* pyramidPath, int64_t sourceTime) const;
+		const MinMax& getEntry(int level, int64_t index) const;
+
+		MappedFile samples;
+		MappedFile pyramid;
+		/// The number of entries in each level, level 0 has blocks of Branching samples
+		std::vector<int64_t> levelSizes;
+		/// The index of the first entry of each level in the pyramid
+		std::vector<int64_t> levelOffsets;
+		int64_t sampleCount;
+		double xStart;
+		double xStep;
+	};
+}
@@ -1,14 +1,30 @@
 #pragma once
 #include <vector>
+#include <string>
 #include <cstring>
 #include <cassert>
+#include <cstdint>
 #include <unordered_map>
+#include <initializer_list>
+#include <memory_resource>
 
 namespace EC {
 	class ErrorCode;
 }
 
 namespace MathViz {
+	/// Closed interval of real numbers. An empty interval (e.g. the square root of negative numbers) has nan bounds.
+	struct Interval {
+		Interval() : lo(0), hi(0) {}
+		Interval(float lo, float hi) : lo(lo), hi(hi) {}
+		explicit Interval(float value) : lo(value), hi(value) {}
+		float getWidth() const {
+			return hi - lo;
+		}
+		float lo;
+		float hi;
+	};
+
 	class Expression {
 	public:
 		enum class Operator : unsigned char {
@@ -26,12 +42,45 @@ namespace MathViz {
 			CloseParen
 		};
 	public:
+		/// Lightweight handle for evaluation of an expression whose variables were checked once by Expression::bind.
+		/// The evaluation does not do any error checking. The handle refers to the expression, which must outlive it.
+		class Evaluator {
+		public:
+			/// The maximal number of variables which can be bound
+			static constexpr int MaxVariableCount = 16;
+			Evaluator();
+			/// Evaluate the expression
+			/// @param[in] arguments Values for the variables, in the order in which the names were passed to bind
+			/// @returns The result of the expression
+			float evaluate(const float* arguments) const noexcept;
+			/// Evaluate the expression for many values of all variables at once.
+			/// @param[in] arguments Pointers to n values for each variable, in the order in which the names were
+			/// passed to bind
+			/// @param[out] out Array where the n results will be written
+			/// @param[in] n The number of values to evaluate
+			void evaluateBatch(const float* const* arguments, float* out, size_t n) const noexcept;
+		private:
+			friend class Expression;
+			const Expression* expression;
+			/// For each variable slot of the expression the index of the argument with the value for it
+			int8_t argumentIndex[MaxVariableCount];
+			int variableCount;
+			/// The arguments are in the same order as the slots, so they can be passed directly
+			bool isIdentity;
+		};
+
 		Expression() = default;
 		Expression(Expression&&) = default;
 		Expression& operator=(Expression&&) = default;
 		Expression(const Expression&) = delete;
 		Expression& operator=(const Expression&) = delete;
 		EC::ErrorCode init(const char* expression);
+		/// Parse and compile the expression. All temporary data used while parsing is allocated from the given
+		/// memory resource, only the compiled expression is stored in the members. Calling init again on the
+		/// same expression reuses the memory of the members.
+		/// @param[in] expression The string with the expression
+		/// @param[in] arena Memory resource for the temporary data, e.g. std::pmr::monotonic_buffer_resource
+		EC::ErrorCode init(const char* expression, std::pmr::memory_resource* arena);
 		/// Evaluate the expression.
 		/// @param[in] variables Map which holds key-value pairs between all variables in the expression
 		/// and values which the user provides for them. It can be null if the expression does not have
@@ -39,7 +88,116 @@ namespace MathViz {
 		/// @param[out] outResult The result of the expression
 		/// @returns ErrorCode for the operation
 		EC::ErrorCode evaluate(const std::unordered_map<char, float>* variables, float& outResult) const;
+		/// Evaluate the compiled version of the expression. This does not do any error checking, the
+		/// caller is responsible for providing values for all variables in the expression.
+		/// @param[in] slots Array with values for all variables in the expression. The value for each
+		/// variable must be at the index returned by getVariableSlot. It can be null if the expression
+		/// does not have any variables in it.
+		/// @returns The result of the expression
+		float evaluate(const float* slots) const noexcept;
+		/// Evaluate expression which has at most one variable for many values of the variable at once.
+		/// The evaluation uses the SIMD kernels for the best instruction set supported by the CPU.
+		/// @param[in] xs Array with n values for the variable. It is not used if there are no variables.
+		/// @param[out] out Array where the n results will be written
+		/// @param[in] n The number of values to evaluate
+		void evaluateBatch(const float* xs, float* out, size_t n) const noexcept;
+		/// Evaluate the expression for many values of all variables at once.
+		/// @param[in] slots Array with getVariableCount() pointers. The pointer with index equal to the slot
+		/// of a variable (see getVariableSlot) must point to n values for that variable.
+		/// @param[out] out Array where the n results will be written
+		/// @param[in] n The number of values to evaluate
+		void evaluateBatch(const float* const* slots, float* out, size_t n) const noexcept;
+		/// Evaluate the expression using interval arithmetic. The result contains all values which the expression
+		/// takes when each variable takes any value in its interval. The bounds are not rounded outwards, so they can
+		/// be off by a few ulps. Division by an interval which contains zero gives [-inf;inf].
+		/// @param[in] slots Array with intervals for all variables. The interval for each variable must be at the
+		/// index returned by getVariableSlot. It can be null if the expression does not have any variables in it.
+		/// @returns Interval which contains the values of the expression
+		Interval evaluateInterval(const Interval* slots) const noexcept;
+		/// Create the derivative of the expression with respect to a variable. The result is simplified
+		/// and compiled, so it can be evaluated as any other expression.
+		/// @param[in] variable The name of the variable
+		/// @param[out] outDerivative The derivative of the expression
+		/// @returns ErrorCode for the operation. Derivatives of u^v where both u and v depend on the variable, or
+		/// u is not a number, need a logarithm which is not supported and result in an error.
+		EC::ErrorCode derivative(char variable, Expression& outDerivative) const;
+		/// Substitute values for some of the variables and simplify the result. Subtrees which depend only on the
+		/// substituted variables are folded into constants, so they are not evaluated for each value of the other
+		/// variables. Used for parameters which are fixed while the function is sampled, e.g. the time t in sin(x - t).
+		/// @param[in] parameters Null terminated string where each character is the name of a substituted variable.
+		/// Names which are not used in the expression are allowed.
+		/// @param[in] values The value of each parameter, in the order of the names in the string
+		/// @param[out] outSpecialized The simplified and compiled expression without the parameters
+		/// @returns ErrorCode for the operation
+		EC::ErrorCode specialize(const char* parameters, const float* values, Expression& outSpecialized) const;
+		/// Check that all variables in the expression are among the given names and create a handle for fast evaluation.
+		/// Names which are not used in the expression are allowed.
+		/// @param[in] arguments Names of the variables in the order in which the evaluator will receive their values
+		/// @param[out] outEvaluator The handle which evaluates the expression
+		/// @returns ErrorCode with the name of the first variable which is not among the arguments
+		EC::ErrorCode bind(std::initializer_list<char> arguments, Evaluator& outEvaluator) const;
+		/// Generate a GLSL function which evaluates the compiled expression. The generated function returns float
+		/// and has one float argument for each of the given variable names. All other variables in the expression
+		/// are declared as float uniforms with the same name as the variable. Helper functions needed by the
+		/// expression are prefixed with the function name and generated before the function.
+		/// @param[in] functionName The name of the generated GLSL function
+		/// @param[in] arguments Null terminated string where each character is the name of an argument of
+		/// the generated function. The order of the arguments matches the order in the string.
+		/// @param[out] outSource The generated GLSL source will be appended to this string
+		void toGLSL(const char* functionName, const char* arguments, std::string& outSource) const;
+		/// Get the number of distinct variables in the expression. This is the size of the slot array
+		/// which must be passed to evaluate.
+		int getVariableCount() const;
+		/// Get the index in the slot array where the value for a variable must be placed
+		/// @param[in] name The name of the variable
+		/// @retval -1 if the expression does not have a variable with this name, otherwise the slot index
+		int getVariableSlot(char name) const;
+		/// Get the number of nodes in the expression tree as it was parsed, before any optimizations
+		int getParsedNodeCount() const;
+		/// Get the number of distinct nodes which are computed for each evaluation after constant folding,
+		/// algebraic simplifications and common subexpression elimination
+		int getOptimizedNodeCount() const;
+		/// The maximal depth of the evaluation stack. Expressions which need deeper stack will fail to init.
+		static constexpr int MaxStackDepth = 64;
+		/// Batch evaluation processes the values in blocks of this size.
+		static constexpr int BatchBlockSize = 128;
+		/// The maximal number of common subexpressions whose results are stored in temporaries during the evaluation.
+		/// Repeated subtrees in expressions which exceed this are computed multiple times.
+		static constexpr int MaxTemporaryCount = 16;
 	private:
+		/// Instruction codes for the compiled version of the expression. The compiled expression is a program
+		/// for a stack machine. Push instructions add one value on the top of the stack, unary operators replace
+		/// the top of the stack with the result, binary operators consume the two top-most values (the right
+		/// operand is on top) and push the result. StoreTemp copies the top of the stack into a temporary without
+		/// popping it, LoadTemp pushes the value of a temporary. They are used for repeated subexpressions.
+		enum class OpCode : unsigned char {
+			PushConstant,
+			PushVariable,
+			StoreTemp,
+			LoadTemp,
+			Plus,
+			Minus,
+			UnaryMinus,
+			Multiply,
+			Divide,
+			Power,
+			Sin,
+			Cos,
+			Sqrt
+		};
+		struct Instruction {
+			explicit Instruction(OpCode op) : slot(0), op(op) {}
+			Instruction(OpCode op, float value) : value(value), op(op) {}
+			Instruction(OpCode op, int slot) : slot(slot), op(op) {}
+			union {
+				/// The value for OpCode::PushConstant
+				float value;
+				/// Index in the slot array for OpCode::PushVariable or index of the temporary for
+				/// OpCode::StoreTemp and OpCode::LoadTemp
+				int slot;
+			};
+			OpCode op;
+		};
 		class Node {
 		public:
 			/// Create leaf with numeric value
@@ -98,11 +256,46 @@ namespace MathViz {
 		};
 		/// Given operator stack and the pending operands. Pop the top most operator and create new node in the tree
 		EC::ErrorCode popOperators(
-			std::vector<Expression::Operator>& operatorStack,
-			std::vector<int>& pendingOperands,
-			std::vector<Node>& tree
+			std::pmr::vector<Expression::Operator>& operatorStack,
+			std::pmr::vector<int>& pendingOperands,
+			std::pmr::vector<Node>& tree
 		);
-		EC::ErrorCode evaluate(const std::unordered_map<char, float>* variables, float& outResult, const int index) const;
+		/// Copy the subtree with root at the given index from the source tree to the end of the tree member.
+		/// Constant subtrees are folded into a single leaf and algebraic identities are simplified on the way.
+		/// @param[in] source The tree as it was parsed
+		/// @param[in] nodeIndex Index in the source tree for the root of the subtree
+		void simplify(const Node* source, int nodeIndex);
+		/// Remove the nodes in [begin, end) from the tree and fix the left indexes of all nodes after them.
+		/// No node after the range may reference a node in the range.
+		void eraseNodes(int begin, int end);
+		/// Append a copy of the subtree whose nodes are in [begin, end) to the end of the tree.
+		void copyNodes(int begin, int end);
+		/// Evaluate the subtree with root at the given index using interval arithmetic
+		Interval evaluateInterval(int nodeIndex, const Interval* slots) const noexcept;
+		/// Check if the subtrees with roots at the given indexes have the same structure and leaves
+		bool isSameSubtree(int lhs, int rhs) const noexcept;
+		/// Check if the subtree with root at the given index contains the given variable
+		bool dependsOn(int nodeIndex, char variable) const;
+		/// Append a copy of the subtree with root at the given index to another tree
+		/// @param[in] nodeIndex Index in the tree for the root of the subtree
+		/// @param[out] out The tree where the copy is appended. The root of the copy is the last node in it.
+		void copySubtree(int nodeIndex, std::vector<Node>& out) const;
+		/// Append the derivative of the subtree with root at the given index to another tree
+		/// @param[in] nodeIndex Index in the tree for the root of the subtree
+		/// @param[in] variable The variable with respect to which the derivative is taken
+		/// @param[out] out The tree where the derivative is appended. The root of the derivative is the last node in it.
+		EC::ErrorCode differentiate(int nodeIndex, char variable, std::vector<Node>& out) const;
+		/// State shared between the recursive calls of compile. Defined in the translation unit.
+		struct CompileState;
+		/// Convert the tree into a program for a stack machine and resolve all variables to slot indexes.
+		/// Identical subtrees are computed once and then reused via temporaries. Must be called after the tree is built.
+		/// @param[in] arena Memory resource for the temporary data used during the compilation
+		EC::ErrorCode compile(std::pmr::memory_resource* arena);
+		/// Append the instructions for the subtree with root at the given index to the program
+		/// @param[in] nodeIndex Index in the tree for the root of the subtree
+		/// @param[inout] state Stack depth and common subexpression bookkeeping. The stack depth will be
+		/// increased by one after the instructions are appended
+		void compile(int nodeIndex, CompileState& state);
 		/// The tree of the expression is linearized into this array. The tree is represented in a "backwards" fashion.
 		/// The root of the expression tree is the last element in this array. Leaf nodes in the tree represent either
 		/// values or "variables" which must be substituted with values provided by the user during the evaluation.
@@ -111,6 +304,15 @@ namespace MathViz {
 		/// will always be at the previous index in the array, while the left hand side operand can be at an arbitrary
 		/// position in the array, this position is stored in the node.
 		std::vector<Node> tree;
+		/// Compiled version of the tree. The instructions are executed in order on a stack with
+		/// at most MaxStackDepth elements. At the end the result is the only element on the stack.
+		std::vector<Instruction> program;
+		/// The name of the variable for each slot. The slot of a variable is its index in this array.
+		std::vector<char> variables;
+		/// The number of nodes in the tree before the optimizations
+		int parsedNodeCount = 0;
+		/// The number of distinct nodes after the optimizations
+		int optimizedNodeCount = 0;
 	};
 
 	inline Expression::Node::Node(float v) :
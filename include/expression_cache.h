@@ -0,0 +1,67 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include "expression.h"
+
+namespace EC {
+	class ErrorCode;
+}
+
+namespace MathViz {
+	/// Process-wide least recently used cache of compiled expressions. The cache is keyed on the normalized
+	/// expression string and returns shared immutable expressions, so the same expression can be requested
+	/// many times while it is parsed only once. The cache is thread safe.
+	class ExpressionCache {
+	public:
+		/// The maximal number of expressions kept in the cache
+		static constexpr int Capacity = 32;
+		/// Size in bytes of the buffer used for temporary data while parsing. Expressions which need
+		/// more memory fall back to the default memory resource.
+		static constexpr int ArenaSize = 64 * 1024;
+
+		ExpressionCache();
+		ExpressionCache(const ExpressionCache&) = delete;
+		ExpressionCache& operator=(const ExpressionCache&) = delete;
+
+		/// Get the cache which is shared by the whole process
+		static ExpressionCache& getInstance();
+
+		/// Get the compiled expression for the given string. If it is not in the cache it is parsed and
+		/// stored in place of the least recently used expression. Expressions which fail to parse are not cached.
+		/// @param[in] expression The string with the expression
+		/// @param[out] outExpression The compiled expression. It is not changed in case of an error.
+		/// @returns ErrorCode for the parsing of the expression
+		EC::ErrorCode get(const char* expression, std::shared_ptr<const Expression>& outExpression);
+		/// Remove all expressions from the cache. The hit and miss counters are not reset.
+		void clear();
+		/// The number of calls to get which found the expression in the cache
+		int64_t getHitCount() const;
+		/// The number of calls to get which had to parse the expression
+		int64_t getMissCount() const;
+	private:
+		struct Entry {
+			Entry() : hash(0), lastUse(0) {}
+			std::string key;
+			std::shared_ptr<Expression> expression;
+			uint64_t hash;
+			/// Value of the use counter when the entry was last accessed. Zero for empty entries.
+			uint64_t lastUse;
+		};
+		/// Write the expression in normalizedKey with all whitespace removed, except for whitespace which
+		/// separates two tokens that would otherwise merge into one (e.g. two numbers)
+		void normalize(const char* expression);
+		std::array<Entry, Capacity> entries;
+		/// Buffer for the monotonic resource used while parsing. It is reused for each parse.
+		std::unique_ptr<unsigned char[]> arenaBuffer;
+		/// Reused for the normalized version of the requested expression
+		std::string normalizedKey;
+		mutable std::mutex mutex;
+		/// Incremented on each access. Used to find the least recently used entry.
+		uint64_t useCounter;
+		int64_t hitCount;
+		int64_t missCount;
+	};
+}
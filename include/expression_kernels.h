@@ -0,0 +1,342 @@
+#pragma once
+#include <cmath>
+#include <cstring>
+
+namespace MathViz {
+namespace Kernels {
+	/// Apply unary function to each element of a. The output can be the same array as the input.
+	using UnaryKernel = void(*)(const float* a, float* out, int count);
+	/// Apply binary operator to each pair of elements a[i] op b[i]. The output can be the same array
+	/// as any of the inputs.
+	using BinaryKernel = void(*)(const float* a, const float* b, float* out, int count);
+
+	/// Table with all kernels needed to evaluate an expression over arrays of values.
+	/// There is one table for each supported instruction set.
+	struct KernelTable {
+		BinaryKernel add;
+		BinaryKernel subtract;
+		BinaryKernel multiply;
+		BinaryKernel divide;
+		BinaryKernel power;
+		UnaryKernel negate;
+		UnaryKernel sin;
+		UnaryKernel cos;
+		UnaryKernel sqrt;
+		/// Name of the instruction set used by the kernels
+		const char* name;
+	};
+
+	/// Get the table with kernels for the best instruction set supported by the current CPU.
+	/// The instruction set is detected on the first call.
+	const KernelTable& getKernelTable();
+	/// Get the table with kernels which do not use any SIMD instructions
+	const KernelTable& getScalarKernelTable();
+	/// Get the table with kernels using AVX2 and FMA instructions
+	/// @retval nullptr if the kernels were not compiled in the current build
+	const KernelTable* getAVX2KernelTable();
+
+	/// Vectorized versions of the math functions used by the expression.
+	/// @tparam T Traits class for an instruction set. It defines the float vector type F, the mask type M
+	/// the int vector type I, the number of lanes Width and static functions which map to instructions.
+	///
+	/// sin, cos, log and exp use the Cephes polynomial approximations. The results are within a few ulps
+	/// compared to the standard library for the arguments which are handled here. Arguments out of the
+	/// supported range are reported by the isSpecial functions and must be computed by the standard library.
+	///
+	/// The templates are instantiated in translation units compiled with different instruction sets. They must
+	/// not call inline or template library functions (std::abs, std::fill_n, ...). Such functions are emitted as
+	/// weak symbols in every translation unit and the linker keeps a single copy, which could be the AVX2 one.
+	template<typename T>
+	struct VectorMath {
+		using F = typename T::F;
+		using M = typename T::M;
+		using I = typename T::I;
+
+		static float abs(float x) {
+			return x < 0.0f ? -x : x;
+		}
+
+		/// Compute sin(x) or cos(x). The argument is reduced to [-Pi/4; Pi/4] by subtracting the closest
+		/// multiple of Pi/2 (Cody-Waite reduction) and then a polynomial for sin or cos is chosen based on
+		/// the quadrant. cos(x) is computed as sin(x + Pi/2) by shifting the quadrant.
+		template<bool Cosine>
+		static F sinCos(F x) {
+			const I j = T::roundToInt(T::mul(x, T::set1(0.63661977236758134308f)));
+			const F y = T::toFloat(j);
+			F r = T::sub(x, T::mul(y, T::set1(1.5703125f)));
+			r = T::sub(r, T::mul(y, T::set1(4.837512969970703125e-4f)));
+			r = T::sub(r, T::mul(y, T::set1(7.54978995489188216e-8f)));
+			const I quadrant = Cosine ? T::addI(j, T::set1I(1)) : j;
+			const F z = T::mul(r, r);
+
+			F s = T::madd(T::set1(-1.9515295891e-4f), z, T::set1(8.3321608736e-3f));
+			s = T::madd(s, z, T::set1(-1.6666654611e-1f));
+			s = T::madd(T::mul(s, z), r, r);
+
+			F c = T::madd(T::set1(2.443315711809948e-5f), z, T::set1(-1.388731625493765e-3f));
+			c = T::madd(c, z, T::set1(4.166664568298827e-2f));
+			c = T::add(T::sub(T::mul(T::mul(c, z), z), T::mul(T::set1(0.5f), z)), T::set1(1.0f));
+
+			// Quadrant 0: sin(r), 1: cos(r), 2: -sin(r), 3: -cos(r)
+			const M useCos = T::cmpeqI(T::andI(quadrant, T::set1I(1)), T::set1I(1));
+			const M negate = T::cmpeqI(T::andI(quadrant, T::set1I(2)), T::set1I(2));
+			const F result = T::select(useCos, c, s);
+			return T::select(negate, T::neg(result), result);
+		}
+
+		/// The argument reduction loses precision for large arguments. They must be handled by the
+		/// standard library. This also catches inf and nan.
+		static M isSinCosSpecial(F x) {
+			return T::notM(T::cmple(T::abs(x), T::set1(8192.0f)));
+		}
+
+		static bool isSinCosSpecial(float x) {
+			return !(abs(x) <= 8192.0f);
+		}
+
+		/// Natural logarithm for positive normal numbers. x is split into mantissa m in [sqrt(0.5); sqrt(2))
+		/// and exponent e, so that log(x) = log(m) + e * log(2)
+		static F log(F x) {
+			const I bits = T::asInt(x);
+			I exponent = T::subI(T::template shiftRightLogicalI<23>(bits), T::set1I(126));
+			F m = T::asFloat(T::orI(T::andI(bits, T::set1I(0x007FFFFF)), T::set1I(0x3F000000)));
+			F e = T::toFloat(exponent);
+			const M small = T::cmplt(m, T::set1(0.707106781186547524f));
+			const F one = T::set1(1.0f);
+			e = T::select(small, T::sub(e, one), e);
+			m = T::sub(T::select(small, T::add(m, m), m), one);
+
+			const F z = T::mul(m, m);
+			F y = T::madd(T::set1(7.0376836292e-2f), m, T::set1(-1.1514610310e-1f));
+			y = T::madd(y, m, T::set1(1.1676998740e-1f));
+			y = T::madd(y, m, T::set1(-1.2420140846e-1f));
+			y = T::madd(y, m, T::set1(1.4249322787e-1f));
+			y = T::madd(y, m, T::set1(-1.6668057665e-1f));
+			y = T::madd(y, m, T::set1(2.0000714765e-1f));
+			y = T::madd(y, m, T::set1(-2.4999993993e-1f));
+			y = T::madd(y, m, T::set1(3.3333331174e-1f));
+			y = T::mul(T::mul(y, m), z);
+			y = T::madd(e, T::set1(-2.12194440e-4f), y);
+			y = T::sub(y, T::mul(T::set1(0.5f), z));
+			return T::madd(e, T::set1(0.693359375f), T::add(m, y));
+		}
+
+		/// e^x computed as 2^n * e^r where n = round(x / log(2)) and |r| <= log(2)/2
+		static F exp(F x) {
+			const M overflow = T::cmpgt(x, T::set1(88.7228391f));
+			const M underflow = T::cmplt(x, T::set1(-103.972084f));
+			x = T::min(T::max(x, T::set1(-103.972084f)), T::set1(88.7228391f));
+			const I n = T::roundToInt(T::mul(x, T::set1(1.44269504088896341f)));
+			const F fn = T::toFloat(n);
+			F r = T::sub(x, T::mul(fn, T::set1(0.693359375f)));
+			r = T::sub(r, T::mul(fn, T::set1(-2.12194440e-4f)));
+			const F z = T::mul(r, r);
+			F p = T::madd(T::set1(1.9875691500e-4f), r, T::set1(1.3981999507e-3f));
+			p = T::madd(p, r, T::set1(8.3334519073e-3f));
+			p = T::madd(p, r, T::set1(4.1665795894e-2f));
+			p = T::madd(p, r, T::set1(1.6666665459e-1f));
+			p = T::madd(p, r, T::set1(5.0000001201e-1f));
+			p = T::add(T::madd(p, z, r), T::set1(1.0f));
+			// 2^n does not fit in a single float for all n in the range, so it's split in two multiplications
+			const I n1 = T::template shiftRightArithI<1>(n);
+			const I n2 = T::subI(n, n1);
+			const F pow2n1 = T::asFloat(T::template shiftLeftI<23>(T::addI(n1, T::set1I(127))));
+			const F pow2n2 = T::asFloat(T::template shiftLeftI<23>(T::addI(n2, T::set1I(127))));
+			F result = T::mul(T::mul(p, pow2n1), pow2n2);
+			result = T::select(overflow, T::set1(INFINITY), result);
+			return T::select(underflow, T::set1(0.0f), result);
+		}
+
+		/// x^y computed as e^(y * log(|x|)). For negative x the result is defined only when y is an integer.
+		static F pow(F x, F y) {
+			const F result = exp(T::mul(y, log(T::abs(x))));
+			const I yInt = T::roundToInt(y);
+			const M yIsInt = T::cmpeq(T::toFloat(yInt), y);
+			const M yIsOdd = T::andM(yIsInt, T::cmpeqI(T::andI(yInt, T::set1I(1)), T::set1I(1)));
+			const M xIsNegative = T::cmplt(x, T::set1(0.0f));
+			const F withSign = T::select(T::andM(xIsNegative, yIsOdd), T::neg(result), result);
+			return T::select(T::andM(xIsNegative, T::notM(yIsInt)), T::set1(NAN), withSign);
+		}
+
+		/// Zero, denormals, inf and nan for the base as well as huge or non finite exponents are left to
+		/// the standard library
+		static M isPowSpecial(F x, F y) {
+			const F ax = T::abs(x);
+			const M regular = T::andM(
+				T::andM(T::cmpge(ax, T::set1(1.17549435e-38f)), T::cmple(ax, T::set1(3.40282347e+38f))),
+				T::cmplt(T::abs(y), T::set1(16777216.0f))
+			);
+			return T::notM(regular);
+		}
+
+		static bool isPowSpecial(float x, float y) {
+			const float ax = abs(x);
+			return !(ax >= 1.17549435e-38f && ax <= 3.40282347e+38f && abs(y) < 16777216.0f);
+		}
+	};
+
+	template<typename T>
+	struct AddOp {
+		static constexpr bool HasSpecialCases = false;
+		static typename T::F apply(typename T::F a, typename T::F b) { return T::add(a, b); }
+	};
+
+	template<typename T>
+	struct SubtractOp {
+		static constexpr bool HasSpecialCases = false;
+		static typename T::F apply(typename T::F a, typename T::F b) { return T::sub(a, b); }
+	};
+
+	template<typename T>
+	struct MultiplyOp {
+		static constexpr bool HasSpecialCases = false;
+		static typename T::F apply(typename T::F a, typename T::F b) { return T::mul(a, b); }
+	};
+
+	template<typename T>
+	struct DivideOp {
+		static constexpr bool HasSpecialCases = false;
+		static typename T::F apply(typename T::F a, typename T::F b) { return T::div(a, b); }
+	};
+
+	template<typename T>
+	struct PowerOp {
+		static constexpr bool HasSpecialCases = true;
+		static typename T::F apply(typename T::F a, typename T::F b) { return VectorMath<T>::pow(a, b); }
+		static typename T::M isSpecial(typename T::F a, typename T::F b) { return VectorMath<T>::isPowSpecial(a, b); }
+		static bool isSpecial(float a, float b) { return VectorMath<T>::isPowSpecial(a, b); }
+		static float scalar(float a, float b) { return powf(a, b); }
+	};
+
+	template<typename T>
+	struct NegateOp {
+		static constexpr bool HasSpecialCases = false;
+		static typename T::F apply(typename T::F a) { return T::neg(a); }
+	};
+
+	template<typename T>
+	struct SqrtOp {
+		static constexpr bool HasSpecialCases = false;
+		static typename T::F apply(typename T::F a) { return T::sqrt(a); }
+	};
+
+	template<typename T>
+	struct SinOp {
+		static constexpr bool HasSpecialCases = true;
+		static typename T::F apply(typename T::F a) { return VectorMath<T>::template sinCos<false>(a); }
+		static typename T::M isSpecial(typename T::F a) { return VectorMath<T>::isSinCosSpecial(a); }
+		static bool isSpecial(float a) { return VectorMath<T>::isSinCosSpecial(a); }
+		static float scalar(float a) { return sinf(a); }
+	};
+
+	template<typename T>
+	struct CosOp {
+		static constexpr bool HasSpecialCases = true;
+		static typename T::F apply(typename T::F a) { return VectorMath<T>::template sinCos<true>(a); }
+		static typename T::M isSpecial(typename T::F a) { return VectorMath<T>::isSinCosSpecial(a); }
+		static bool isSpecial(float a) { return VectorMath<T>::isSinCosSpecial(a); }
+		static float scalar(float a) { return cosf(a); }
+	};
+
+	/// Process exactly T::Width elements. If some of the lanes can't be handled by the vector code
+	/// they are recomputed with the scalar version of the operator.
+	template<typename T, template<typename> class Op>
+	inline void unaryBlock(const float* a, float* out) {
+		const typename T::F x = T::load(a);
+		if constexpr (Op<T>::HasSpecialCases) {
+			if (T::anyTrue(Op<T>::isSpecial(x))) {
+				// Keep a copy of the input since the output can alias it
+				alignas(32) float in[T::Width];
+				T::store(in, x);
+				T::store(out, Op<T>::apply(x));
+				for (int i = 0; i < T::Width; ++i) {
+					if (Op<T>::isSpecial(in[i])) {
+						out[i] = Op<T>::scalar(in[i]);
+					}
+				}
+				return;
+			}
+		}
+		T::store(out, Op<T>::apply(x));
+	}
+
+	template<typename T, template<typename> class Op>
+	inline void binaryBlock(const float* a, const float* b, float* out) {
+		const typename T::F x = T::load(a);
+		const typename T::F y = T::load(b);
+		if constexpr (Op<T>::HasSpecialCases) {
+			if (T::anyTrue(Op<T>::isSpecial(x, y))) {
+				alignas(32) float inA[T::Width];
+				alignas(32) float inB[T::Width];
+				T::store(inA, x);
+				T::store(inB, y);
+				T::store(out, Op<T>::apply(x, y));
+				for (int i = 0; i < T::Width; ++i) {
+					if (Op<T>::isSpecial(inA[i], inB[i])) {
+						out[i] = Op<T>::scalar(inA[i], inB[i]);
+					}
+				}
+				return;
+			}
+		}
+		T::store(out, Op<T>::apply(x, y));
+	}
+
+	template<typename T, template<typename> class Op>
+	void unaryKernel(const float* a, float* out, int count) {
+		int i = 0;
+		for (; i + T::Width <= count; i += T::Width) {
+			unaryBlock<T, Op>(a + i, out + i);
+		}
+		if (i < count) {
+			// The tail is padded with ones so that it does not hit the slow paths
+			const int rest = count - i;
+			alignas(32) float tail[T::Width];
+			for (int j = 0; j < T::Width; ++j) {
+				tail[j] = 1.0f;
+			}
+			std::memcpy(tail, a + i, rest * sizeof(float));
+			unaryBlock<T, Op>(tail, tail);
+			std::memcpy(out + i, tail, rest * sizeof(float));
+		}
+	}
+
+	template<typename T, template<typename> class Op>
+	void binaryKernel(const float* a, const float* b, float* out, int count) {
+		int i = 0;
+		for (; i + T::Width <= count; i += T::Width) {
+			binaryBlock<T, Op>(a + i, b + i, out + i);
+		}
+		if (i < count) {
+			const int rest = count - i;
+			alignas(32) float tailA[T::Width];
+			alignas(32) float tailB[T::Width];
+			for (int j = 0; j < T::Width; ++j) {
+				tailA[j] = 1.0f;
+				tailB[j] = 1.0f;
+			}
+			std::memcpy(tailA, a + i, rest * sizeof(float));
+			std::memcpy(tailB, b + i, rest * sizeof(float));
+			binaryBlock<T, Op>(tailA, tailB, tailA);
+			std::memcpy(out + i, tailA, rest * sizeof(float));
+		}
+	}
+
+	/// Create a kernel table for the instruction set described by the traits class T
+	template<typename T>
+	KernelTable makeKernelTable(const char* name) {
+		KernelTable table;
+		table.add = &binaryKernel<T, AddOp>;
+		table.subtract = &binaryKernel<T, SubtractOp>;
+		table.multiply = &binaryKernel<T, MultiplyOp>;
+		table.divide = &binaryKernel<T, DivideOp>;
+		table.power = &binaryKernel<T, PowerOp>;
+		table.negate = &unaryKernel<T, NegateOp>;
+		table.sin = &unaryKernel<T, SinOp>;
+		table.cos = &unaryKernel<T, CosOp>;
+		table.sqrt = &unaryKernel<T, SqrtOp>;
+		table.name = name;
+		return table;
+	}
+}
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace MathViz {
+	/// Decides when the main loop renders. A frame is rendered when something requested it with invalidate,
+	/// when an event arrived or while any timeline is active. Otherwise waitForFrame blocks in
+	/// glfwWaitEventsTimeout, so a static scene uses neither the CPU nor the GPU.
+	class FrameScheduler {
+	public:
+		using TimelineId = int;
+		static constexpr TimelineId InvalidTimeline = -1;
+		/// The number of frames rendered after each invalidate. ImGui needs a few frames to settle after
+		/// input, e.g. the hover state of a widget is known one frame after the mouse moved.
+		static constexpr int FramesPerInvalidate = 3;
+
+		FrameScheduler();
+		/// Request frames because something changed. Can be called from any thread, it wakes up waitForFrame.
+		void invalidate();
+		/// Render every frame as fast as possible, even when nothing changes
+		void setContinuous(bool continuous);
+		[[nodiscard]]
+		bool isContinuous() const;
+
+		/// Render continuously until the timeline ends
+		/// @param[in] duration Length of the timeline in seconds, zero or less for a timeline which runs until it is stopped
+		/// @returns Id for the other timeline functions
+		[[nodiscard]]
+		TimelineId startTimeline(double duration);
+		void stopTimeline(TimelineId id);
+		[[nodiscard]]
+		bool isTimelineActive(TimelineId id) const;
+		/// @returns Seconds since the timeline started, 0 for timelines which are not active
+		[[nodiscard]]
+		double getTimelineTime(TimelineId id) const;
+
+		/// Process the pending events and wait until a frame must be rendered
+		/// @param[in] idleTimeout The longest time in seconds the call blocks when nothing happens
+		/// @returns true if a frame must be rendered, false if it returned because of the timeout
+		[[nodiscard]]
+		bool waitForFrame(double idleTimeout);
+		/// Must be called after each rendered frame
+		void frameRendered();
+		/// @returns The number of frames rendered since the scheduler was created
+		[[nodiscard]]
+		int64_t getRenderedFrameCount() const;
+	private:
+		struct Timeline {
+			double start;
+			double duration;
+			bool active;
+		};
+		/// End the timelines which are over
+		/// @returns true if any timeline is still active
+		bool updateTimelines();
+		[[nodiscard]]
+		bool needsFrame();
+
+		std::vector<Timeline> timelines;
+		/// The number of frames which must be rendered because of invalidate
+		std::atomic<int> pendingFrames;
+		int64_t renderedFrameCount;
+		bool continuous;
+	};
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdio>
+#include <string>
+
+namespace EC {
+	class ErrorCode;
+}
+
+namespace MathViz {
+	/// Destination of the frames rendered by Context::renderAnimation
+	class IFrameSink {
+	public:
+		virtual ~IFrameSink() {}
+		/// Called once before the first frame
+		/// @param[in] width The width of each frame in pixels
+		/// @param[in] height The height of each frame in pixels
+		virtual EC::ErrorCode begin(int width, int height) = 0;
+		/// @param[in] rgba The pixels of the frame, 4 bytes per pixel, the rows are bottom to top as
+		/// returned by glReadPixels. Valid only during the call.
+		/// @param[in] index The index of the frame in the animation
+		virtual EC::ErrorCode writeFrame(const unsigned char* rgba, int index) = 0;
+		/// Called once after the last frame
+		virtual EC::ErrorCode end() = 0;
+	};
+
+	/// Write each frame in a separate PNG file
+	class PNGSequenceSink : public IFrameSink {
+	public:
+		/// @param[in] pattern printf pattern for the file names with exactly one %d conversion for the frame index
+		/// e.g. frame_%04d.png. Other conversions except %% are rejected by begin.
+		explicit PNGSequenceSink(std::string pattern);
+		EC::ErrorCode begin(int width, int height) override;
+		EC::ErrorCode writeFrame(const unsigned char* rgba, int index) override;
+		EC::ErrorCode end() override;
+	private:
+		std::string pattern;
+		int width;
+		int height;
+	};
+
+	/// Pipe the raw frames to ffmpeg, which must be in the PATH, and encode them in a video
+	class FFmpegPipeSink : public IFrameSink {
+	public:
+		/// @param[in] path The file where the video will be written, ffmpeg picks the format from the extension
+		/// @param[in] fps Frames per second of the video
+		FFmpegPipeSink(std::string path, int fps);
+		~FFmpegPipeSink() override;
+		FFmpegPipeSink(const FFmpegPipeSink&) = delete;
+		FFmpegPipeSink& operator=(const FFmpegPipeSink&) = delete;
+		EC::ErrorCode begin(int width, int height) override;
+		EC::ErrorCode writeFrame(const unsigned char* rgba, int index) override;
+		EC::ErrorCode end() override;
+	private:
+		std::string path;
+		/// The write end of the pipe connected to the standard input of ffmpeg
+		FILE* pipe;
+		/// The process id of ffmpeg, -1 if it is not running. Not used on Windows where _popen owns the process.
+		int pid;
+		int fps;
+		int width;
+		int height;
+	};
+}
@@ -1,9 +1,17 @@
 #pragma once
 #include "glm/vec3.hpp"
+#include "glm/vec4.hpp"
 #include "glutils.h"
 #include "error_code.h"
+#include "thread_pool.h"
+#include "profiler.h"
 #include <array>
+#include <cassert>
 #include <functional>
+#include <unordered_map>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
 
 namespace EC {
 	class ErrorCode;
@@ -12,6 +20,8 @@ namespace EC {
 namespace MathViz {
 
 	struct IMaterial;
+	class Expression;
+	class DataSeries;
 
 	struct Range2D {
 		Range2D() : from(0), to(0) {}
@@ -33,16 +43,183 @@ namespace MathViz {
 
 	constexpr float PI = 3.141592653589793f;
 
+	/// Function which evaluates many points at once. It receives an array of count x coordinates
+	/// and must write the corresponding y coordinates in the output array. Geometry is generated on
+	/// several threads, so the function can be called concurrently with different arrays.
+	using BatchFunction = std::function<void(const float* x, float* y, int count)>;
+
+	/// Geometry which is created from a BatchFunction evaluates it with at most this many points at once.
+	constexpr int BatchFunctionChunkSize = 256;
+
+	/// The workers which generate geometry. They are owned by the context.
+	ThreadPool& getThreadPool();
+
+	/// Sample f on xRange so that the polyline through the samples is within tolerance of f. The samples are
+	/// appended to vertices from left to right. Does not use GL, so it can run on any thread.
+	/// @param f The function which will be sampled. Variables other than x will be 0.
+	/// @param xRange The range where f is sampled
+	/// @param tolerance The maximal distance in world space between the polyline and the function
+	/// @param vertices The samples are added at the end
+	/// @param isCancelled If set it is called regularly, when it returns true sampling stops
+	/// @returns false if sampling was cancelled, the vertices are then incomplete
+	bool sampleAdaptive(
+		const Expression& f,
+		const Range2D& xRange,
+		float tolerance,
+		std::vector<glm::vec3>& vertices,
+		const std::function<bool()>& isCancelled = nullptr
+	);
+
+	/// Wrap a callable into BatchFunction. Callables which can be called with (const float*, float*, int)
+	/// are used directly. Callables which accept single float and return float are called once for each point.
+	template<typename FuncT>
+	BatchFunction makeBatchFunction(FuncT&& f) {
+		if constexpr (std::is_invocable_v<FuncT, const float*, float*, int>) {
+			return BatchFunction(std::forward<FuncT>(f));
+		} else {
+			return [f = std::forward<FuncT>(f)](const float* x, float* y, int count) {
+				for (int i = 0; i < count; ++i) {
+					y[i] = f(x[i]);
+				}
+			};
+		}
+	}
+
 	class IGeometry {
 	public:
 		virtual ~IGeometry() {}
 		virtual EC::ErrorCode draw() const = 0;
-		virtual EC::ErrorCode outline(const IMaterial& objectMaterial, const IMaterial& outlineMaterial) const {
+		/// Draw the outline of the geometry. The program of the outline material is already bound and
+		/// the depth test is disabled, so that the outline is on top of everything drawn before it.
+		virtual EC::ErrorCode drawOutline() const {
 			return EC::ErrorCode("Not implemented");
 		}
 	};
 
-	/// @brief A straight line
+	/// Thick antialiased lines of any width. All segments added during a frame are drawn with one instanced
+	/// draw call, each segment has its own color and width. The vertex shader expands each segment into a
+	/// screen space quad and the fragment shader computes the coverage from the distance to the segment.
+	/// Segments have round caps, so consecutive segments of a polyline have round joins. Must be drawn
+	/// with the ThickLine material.
+	class LineBatch : public IGeometry {
+	public:
+		LineBatch();
+		EC::ErrorCode init();
+		/// Remove all segments, the GPU memory is kept for the next frame
+		void clear();
+		/// @brief Add one segment
+		/// @param start The start of the line in world space
+		/// @param end The end of the line in world space
+		/// @param color The color and the opacity of the line
+		/// @param width The width of the line in pixels
+		void addLine(const glm::vec3& start, const glm::vec3& end, const glm::vec4& color, float width);
+		/// @brief Add a segment between each two consecutive points
+		/// @param points The points of the polyline in world space
+		/// @param count The number of points
+		/// @param color The color and the opacity of the line
+		/// @param width The width of the line in pixels
+		/// @param closed If true the last point is connected to the first one
+		void addPolyline(const glm::vec3* points, int count, const glm::vec4& color, float width, bool closed);
+		/// Upload all segments added since the last clear. Must be called before draw.
+		EC::ErrorCode upload();
+		EC::ErrorCode draw() const override;
+		int getSegmentCount() const;
+	private:
+		struct Segment {
+			glm::vec3 start;
+			glm::vec3 end;
+			glm::vec4 color;
+			float width;
+		};
+		std::vector<Segment> segments;
+		GLUtils::VAO vao;
+		GLUtils::VertexBuffer segmentBuffer;
+		/// The number of segments which fit in segmentBuffer
+		int capacity;
+		/// The number of segments drawn by draw
+		int uploadedCount;
+	};
+
+	/// Many line strips which share one vertex buffer and are drawn with one glMultiDrawArraysIndirect.
+	/// The transform, the material index and the width of each strip are in a shader storage buffer which
+	/// is indexed with gl_DrawID, so strips can be moved or recolored without touching the vertices and
+	/// without any state change between them. Vertices can be shared by several strips, e.g. a parameter
+	/// sweep can add the plot once and draw it with many transforms. Each segment of a strip is one instance
+	/// which is expanded into a screen space quad as in LineBatch, so batched curves look the same as other
+	/// thick lines. Must be drawn with the BatchedCurve material, the node transform is applied after the
+	/// transform of each strip.
+	class CurveBatch : public IGeometry {
+	public:
+		/// Shader storage bindings used by the BatchedCurve shader
+		enum StorageBindings {
+			DrawRecords = 0,
+			Materials = 1,
+			Vertices = 2
+		};
+		CurveBatch();
+		EC::ErrorCode init();
+		/// Remove all vertices, strips and materials. The GPU memory is kept.
+		void clear();
+		/// @brief Add a color which can be used by the strips
+		/// @returns The index of the material which is passed to addDraw
+		int addMaterial(const glm::vec4& color);
+		/// @brief Append vertices to the shared vertex buffer
+		/// @param points The vertices in the space of the strip
+		/// @param count The number of vertices
+		/// @returns The index of the first vertex which is passed to addDraw
+		int addVertices(const glm::vec3* points, int count);
+		/// @brief Add a line strip which uses vertices added by addVertices
+		/// @param firstVertex The first vertex of the strip
+		/// @param count The number of vertices in the strip
+		/// @param transform Transform from the space of the strip to the space of the node
+		/// @param materialIndex Index returned by addMaterial
+		/// @param width The width of the strip in pixels
+		/// @returns The index of the strip which is passed to setTransform and setMaterial
+		int addDraw(int firstVertex, int count, const glm::mat4& transform, int materialIndex, float width);
+		/// Add the vertices and a strip which uses them
+		int addCurve(const glm::vec3* points, int count, const glm::mat4& transform, int materialIndex, float width);
+		void setTransform(int drawIndex, const glm::mat4& transform);
+		void setMaterial(int drawIndex, int materialIndex);
+		/// Upload everything which changed since the last upload. Must be called before draw.
+		EC::ErrorCode upload();
+		EC::ErrorCode draw() const override;
+		int getDrawCount() const;
+	private:
+		/// Matches struct DrawRecord in the BatchedCurve shader (std430)
+		struct DrawRecord {
+			glm::mat4 transform;
+			int materialIndex;
+			float width;
+			int padding[2];
+		};
+		/// Grow the buffer if needed and upload the data
+		template<typename BufferT, typename T>
+		static EC::ErrorCode uploadStorage(BufferT& buffer, int64_t& capacity, const std::vector<T>& data);
+
+		std::vector<glm::vec3> vertices;
+		std::vector<DrawRecord> records;
+		std::vector<GLUtils::DrawArraysIndirectCommand> commands;
+		std::vector<glm::vec4> materials;
+		/// No attributes, the shader reads the vertices from vertexBuffer
+		GLUtils::VAO vao;
+		GLUtils::ShaderStorageBuffer vertexBuffer;
+		GLUtils::ShaderStorageBuffer recordBuffer;
+		GLUtils::ShaderStorageBuffer materialBuffer;
+		GLUtils::DrawIndirectBuffer commandBuffer;
+		/// Capacities of the buffers in bytes
+		int64_t vertexCapacity;
+		int64_t recordCapacity;
+		int64_t materialCapacity;
+		int64_t commandCapacity;
+		/// Vertex and command upload is skipped when only transforms and materials change
+		bool verticesDirty;
+		bool commandsDirty;
+		bool recordsDirty;
+		bool materialsDirty;
+		/// The number of strips drawn by draw
+		int uploadedDrawCount;
+	};
+
 	class Line : public IGeometry {
 	public:
 		Line();
@@ -52,12 +229,13 @@ namespace MathViz {
 		/// @brief Inititialize the line
 		/// @param start The start of the line in world space
 		/// @param end The end of the line in world space
-		/// @param width The width of the line in pixel. Fractional values are supported for
-		/// antialiased lines only. In case of fractional value without antialiasing the width
-		/// will be rounded.
+		/// @param width The width of the line in pixels when it is added to a LineBatch
 		EC::ErrorCode init(const glm::vec3& start, const glm::vec3& end, float width);
-		/// @brief Issue a draw call. Must be called only after init and upload are called. 
+		/// @brief Draw the line one pixel wide. Wide lines are drawn with appendTo, core profiles do not
+		/// guarantee glLineWidth larger than one.
 		EC::ErrorCode draw() const override;
+		/// Add the line to a batch of thick lines
+		void appendTo(LineBatch& batch, const glm::vec4& color) const;
 		void freeMem();
 	private:
 		/// The start of the line in world space
@@ -78,9 +256,13 @@ namespace MathViz {
 			float markDh
 		);
 		EC::ErrorCode draw() const override;
+		/// Add the axes and their marks to a batch of thick lines
+		void appendTo(LineBatch& batch, const glm::vec4& color, float width) const;
 	private:
 		Range2D xRange;
 		Range2D yRange;
+		/// Pairs of vertices, one pair for each line
+		std::vector<glm::vec3> lineVertices;
 		GLUtils::VAO vao;
 		GLUtils::VertexBuffer vertexBuffer;
 		/// Used by the draw call. The number of vertices (not lines)
@@ -90,20 +272,28 @@ namespace MathViz {
 
 	/// @brief Create a curve following a 2D plot.
 	/// Each x coordinate in world space will corelate to a y coordinate in world space.
+	/// With uniform sampling the function is evaluated on a grid with power of two spacing. Evaluated samples are
+	/// cached by their x coordinate, grids of neighbouring densities share every other point, so zooming reuses the
+	/// samples which already exist and panning evaluates only the newly exposed strip. The vertex buffer is a ring
+	/// buffer and only the changed vertices are uploaded.
 	class Plot2D : public IGeometry {
 	public:
+		/// When the sample cache grows beyond this many samples it is cleared
+		static constexpr int MaxCachedSamples = 1 << 20;
+
 		Plot2D();
 		/// @brief Initialize the curve
-		/// @tparam FuncT Type of the fuctor which will eval the function. It must accept one float and
-		/// return a float.
+		/// @tparam FuncT Type of the fuctor which will eval the function. It must either accept one float and
+		/// return a float or evaluate a batch of points (see BatchFunction).
 		/// @param f The function which will be plotted.
-		/// @param from The minimal x value of the function in world space.
-		/// @param to The maximal x value of the function in world space.
+		/// @param xRange The minimal and maximal x value of the function in world space.
+		/// @param yRange The minimal and maximal y value of the function in world space.
 		/// @param lineWidth The width of the line in pixel. Fractional values are supported for
 		/// antialiased lines only. In case of fractional value without antialiasing the width
 		/// will be rounded.
-		/// @param n Number of points where the plot will be evaluated. The larger this value
-		/// the smoother the plot
+		/// @param n Minimal number of points where the plot will be evaluated, at least 2. The larger this value
+		/// the smoother the plot. Because of the power of two grid up to twice as many points can be used.
+		/// @returns Error if n is less than 2 or xRange is empty
 		template<typename FuncT>
 		EC::ErrorCode init(
 			FuncT&& f,
@@ -112,125 +302,188 @@ namespace MathViz {
 			float lineWidth,
 			int n
 		) {
-			this->f = std::forward<FuncT>(f);
-			this->xRange = xRange;
-			this->yRange = yRange;
-			this->lineWidth = lineWidth;
-			this->n = n;
-
-			GLUtils::BufferLayout layout;
-			layout.addAttribute(GLUtils::VertexType::Float, 3);
-
-			RETURN_ON_ERROR_CODE(vao.init());
-			RETURN_ON_ERROR_CODE(vao.bind());
-			RETURN_ON_ERROR_CODE(vertexBuffer.init(n * sizeof(glm::vec3), nullptr, layout));
-			RETURN_ON_ERROR_CODE(vao.unbind());
-
-			RETURN_ON_ERROR_CODE(upload());
-
-			return EC::ErrorCode();
+			return init(makeBatchFunction(std::forward<FuncT>(f)), xRange, yRange, lineWidth, n);
 		}
+		EC::ErrorCode init(
+			BatchFunction f,
+			const Range2D& xRange,
+			const Range2D& yRange,
+			float lineWidth,
+			int n
+		);
+		/// @brief Initialize the curve with adaptive sampling. Regions where the function is flat get few vertices,
+		/// regions with high curvature or near singularities are refined until the curve is within the tolerance
+		/// of the function. The bound uses interval evaluation of the derivative of the function.
+		/// @param f The function which will be plotted. Variables other than x will be 0.
+		/// @param xRange The minimal and maximal x value of the function in world space.
+		/// @param yRange The minimal and maximal y value of the function in world space.
+		/// @param lineWidth The width of the line in pixel.
+		/// @param tolerance The maximal distance in world space between the curve and the function, typically
+		/// the size of half a pixel. Segments shorter than this are not refined any further.
+		EC::ErrorCode initAdaptive(
+			const Expression& f,
+			const Range2D& xRange,
+			const Range2D& yRange,
+			float lineWidth,
+			float tolerance
+		);
+		/// @brief Sample a new function adaptively. The plot must be initialized with init or initAdaptive.
+		/// @param f The function which will be plotted. Variables other than x will be 0.
+		/// @param tolerance The maximal distance in world space between the curve and the function
+		EC::ErrorCode resetAdaptive(const Expression& f, float tolerance);
+		/// @brief Plot vertices which were computed elsewhere, e.g. by PlotEvaluator. The plot is drawn as
+		/// a polyline through them, like an adaptive plot. The plot must be initialized with init or initAdaptive.
+		/// @param vertices The vertices of the polyline from left to right
+		EC::ErrorCode resetVertices(std::vector<glm::vec3> vertices);
+		/// @brief Initialize the curve for evaluation on the GPU. No vertex data is created, the draw call issues
+		/// one instance of a quad without any attributes for each of the n - 1 segments and the material computes
+		/// their positions from gl_InstanceID. The curve must be drawn with FunctionPlot2D material whose sampling
+		/// matches xRange and n, the width of the line is set in the material.
+		/// @param xRange The minimal and maximal x value of the function in world space.
+		/// @param yRange The minimal and maximal y value of the function in world space.
+		/// @param lineWidth Unused, the width of procedural plots is set with FunctionPlot2D::setLineWidth.
+		/// @param n Number of points where the plot will be evaluated.
+		EC::ErrorCode initProcedural(
+			const Range2D& xRange,
+			const Range2D& yRange,
+			float lineWidth,
+			int n
+		);
+		/// @brief Draw the plot. Procedural plots are drawn as thick lines by their material, the other plots
+		/// are drawn one pixel wide. Wide CPU plots are drawn with appendTo.
 		EC::ErrorCode draw() const override;
+		/// @brief Plot a new function with uniform sampling over the current view. All cached samples are dropped.
 		template<typename FuncT>
 		EC::ErrorCode reset(FuncT&& f) {
-			this->f = std::forward<FuncT>(f);
-			// TODO:
-			// this->xRange = xRange;
-			// this->yRange = yRange;
-			// this->lineWidth = lineWidth;
-			// this->n = n;
-			RETURN_ON_ERROR_CODE(upload());
-			return EC::ErrorCode();
+			return reset(makeBatchFunction(std::forward<FuncT>(f)));
 		}
+		EC::ErrorCode reset(BatchFunction f);
+		/// @brief Change the visible range and the density of a uniformly sampled plot. Only samples which are
+		/// not in the cache are evaluated and only the vertices which are not already in the buffer are uploaded.
+		/// @param xRange The minimal and maximal x value which will be plotted
+		/// @param n Minimal number of points in the range, at least 2
+		/// @returns Error if n is less than 2 or xRange is empty
+		EC::ErrorCode setView(const Range2D& xRange, int n);
+		/// @brief Use a persistently mapped buffer for plots which are updated every frame. Each update writes
+		/// all vertices to a region of the buffer which the GPU is not reading, so updates do not wait for the
+		/// previous frames to be drawn. The plot must use uniform sampling, its current view is resampled.
+		/// @param regionCount The number of regions in the buffer, should be at least the number of frames
+		/// which the GPU can queue. Three is enough in most cases.
+		EC::ErrorCode enableStreaming(int regionCount);
+		/// Add the curve to a batch of thick lines with the width of the plot. Uniformly sampled plots take
+		/// the samples from the cache. Procedural plots are evaluated on the GPU and cannot be batched.
+		void appendTo(LineBatch& batch, const glm::vec4& color);
 		void setLineWidth(const float lineWidth);
+		float getLineWidth() const;
 	private:
-		EC::ErrorCode upload();
-
-		std::function<float(float)> f;
+		enum class Sampling {
+			/// Power of two grid with cached samples, see setView
+			Uniform,
+			/// Vertices are placed by resetAdaptive
+			Adaptive,
+			/// The vertices are computed on the GPU and there is no vertex buffer
+			Procedural
+		};
+		/// Make sure that the vertex buffer (or each region of the streaming buffer) can hold at least the
+		/// given number of vertices. The contents of the buffer are lost if it has to grow.
+		/// @param[out] grown True if a new buffer was allocated
+		EC::ErrorCode reserve(int vertexCount, bool& grown);
+		/// Compute the grid for the current view and update the vertices in the ring buffer which changed
+		/// @param[in] forceFullUpdate Rewrite all vertices even if some of them are already in the buffer
+		EC::ErrorCode resample(bool forceFullUpdate);
+		/// Write the vertices for the grid points with indexes in [first;last] to out. Values are taken from
+		/// the cache, the missing ones are evaluated in batches and added to the cache.
+		void evaluateSamples(int64_t first, int64_t last, glm::vec3* out);
+		/// Upload the vertices for the grid points with indexes in [first;last] to their ring slots
+		EC::ErrorCode uploadSamples(int64_t first, int64_t last);
+		/// The slot in the ring buffer for the grid point with the given index
+		int getSlot(int64_t index) const;
+
+		BatchFunction f;
 		GLUtils::VertexBuffer vertexBuffer;
+		/// Used instead of vertexBuffer when streaming is enabled
+		GLUtils::StreamingBuffer streamingBuffer;
+		/// The vertices of the last adaptive sampling
+		std::vector<glm::vec3> adaptiveVertices;
 		GLUtils::VAO vao;
+		/// Cached values of the function. The key is the bit pattern of the x coordinate.
+		std::unordered_map<uint32_t, float> sampleCache;
 		/// min and max x coordinate to show on the plot
 		/// points which are outside of the range will not be computed
 		Range2D xRange;
 		/// min and max y coordinate to show on the plot
 		Range2D yRange;
 		float lineWidth;
+		/// Minimal number of points in the view for uniform sampling
 		int n;
+		/// The number of vertices which are drawn with adaptive and procedural sampling
+		int vertexCount;
+		/// The number of vertices which fit in the vertex buffer. With uniform sampling the last vertex
+		/// mirrors the first one, so that a line strip can continue over the end of the ring.
+		int capacity;
+		Sampling sampling;
+		/// The number of regions of the streaming buffer, zero if streaming is disabled
+		int streamingRegionCount;
+		/// The spacing of the uniform grid is 2^gridLevel
+		int gridLevel;
+		/// Indexes of the first and the last grid point in the view. Grid point i has x = i * 2^gridLevel.
+		int64_t firstIndex;
+		int64_t lastIndex;
+		/// Grid point with index ringAnchorIndex is in slot ringAnchorSlot, the other points follow it modulo
+		/// the ring size. The anchor does not change while panning, so points which stay in view keep their slot.
+		int64_t ringAnchorIndex;
+		int ringAnchorSlot;
 	};
 
+	/// Bars of a Reiman sum. All bars are instances of one unit bar, each instance stores only the
+	/// start of the bar and its height. Materials apply the instance transform in the vertex shader.
 	class ReimanArea : public IGeometry {
 	public:
 		ReimanArea();
 		template<typename FuncT>
 		EC::ErrorCode init(FuncT&& f, const Range2D& xRange, float dh) {
-			barCount = int(xRange.getLength() / dh);
-			const float z = 1.0f;
-			std::vector<glm::vec3> vertices(barCount * 14);
-			// Each bar is represented by 2 triangles each triangle has 3 verts
-			// First 6 * barCount verts are the presented Reiman area
-			// Second 6 * barCount verts are slightly scaled and used for outlining
-			float barStart = xRange.from;
-			int i = 0, j = 6 * barCount;
-			for (int bar = 0; bar < barCount; ++bar) {
-				const float barMid = barStart + dh / 2;
-				const float barEnd = barStart + dh;
-				const float fAtBarCenter = f(barMid);
-				const float barBottom = fAtBarCenter > 0 ? 0.0f : fAtBarCenter;
-				const float barTop = fAtBarCenter > 0 ? fAtBarCenter : 0.0f;
-
-				vertices[i++] = glm::vec3(barEnd, barTop, z); // up right
-				vertices[i++] = glm::vec3(barStart, barTop, z); // up left
-				vertices[i++] = glm::vec3(barStart, barBottom, z); // bottom left
-
-				vertices[i++] = glm::vec3(barEnd, barTop, z); // up right
-				vertices[i++] = glm::vec3(barStart, barBottom, z); // bottom left
-				vertices[i++] = glm::vec3(barEnd, barBottom, z); // bottom right
-
-				// ===========================================================
-				// ====================== OUTLINE ============================
-				// ===========================================================
-				// const float scale = dh * 0.1;
-				// vertices[j++] = glm::vec3(barEnd + scale, barTop + scale, z); // up right
-				// vertices[j++] = glm::vec3(barStart - scale, barTop + scale, z); // up left
-				// vertices[j++] = glm::vec3(barStart - scale, barBottom - scale, z); // bottom left
-				// 
-				// vertices[j++] = glm::vec3(barEnd + scale, barTop + scale, z); // up right
-				// vertices[j++] = glm::vec3(barStart - scale, barBottom - scale, z); // bottom left
-				// vertices[j++] = glm::vec3(barEnd + scale, barBottom - scale, z); // bottom right
-
-
-				vertices[j++] = glm::vec3(barEnd, barTop, z); // up right
-				vertices[j++] = glm::vec3(barStart, barTop, z); // up left
-
-				vertices[j++] = glm::vec3(barStart, barTop, z); // up left
-				vertices[j++] = glm::vec3(barStart, barBottom, z); // bottom left
-
-				vertices[j++] = glm::vec3(barStart, barBottom, z); // bottom left
-				vertices[j++] = glm::vec3(barEnd, barBottom, z); // bottom right
-
-				vertices[j++] = glm::vec3(barEnd, barBottom, z); // bottom right
-				vertices[j++] = glm::vec3(barEnd, barTop, z); // up right
-
-				barStart += dh;
-			}
-			vertexCount = barCount * 6;
-			GLUtils::BufferLayout l;
-			l.addAttribute(GLUtils::VertexType::Float, 3);
-			const int64_t byteSize = vertices.size() * sizeof(vertices[0]);
-			RETURN_ON_ERROR_CODE(vao.init());
-			RETURN_ON_ERROR_CODE(vao.bind());
-			RETURN_ON_ERROR_CODE(vertexBuffer.init(byteSize, vertices.data(), l));
-			RETURN_ON_ERROR_CODE(vao.unbind());
-			return EC::ErrorCode();
+			return init(makeBatchFunction(std::forward<FuncT>(f)), xRange, dh);
 		}
+		/// @brief Create the bars of the Reiman sum. The height of each bar is the value of
+		/// the function at the middle of the bar.
+		/// @param f The function for which the Reiman sum is created
+		/// @param xRange The range where the Reiman sum is created
+		/// @param dh The width of each bar
+		EC::ErrorCode init(BatchFunction f, const Range2D& xRange, float dh);
+		/// @brief Change the width of the bars. Only the unit bar and the per instance data are uploaded.
+		/// @param dh The width of each bar
+		EC::ErrorCode setBarWidth(float dh);
 
 		EC::ErrorCode draw() const override;
-		EC::ErrorCode outline(const IMaterial& m, const IMaterial& om) const override;
+		/// @brief Add the outline of each bar to a batch of thick lines. The outline is slightly in front of
+		/// the bars, so it is not hidden by them.
+		/// @param batch The batch where the outlines are added
+		/// @param color The color and the opacity of the outline
+		/// @param width The width of the outline in pixels
+		void appendTo(LineBatch& batch, const glm::vec4& color, float width) const;
 	private:
+		/// Vertices of the unit bar, two triangles which span [0;dh] in x and [0;1] in y
+		static constexpr int FillVertexCount = 6;
+		/// The z coordinate of the bars and of their outlines
+		static constexpr float BarZ = 1.0f;
+		static constexpr float OutlineZ = 1.01f;
+		/// Write the unit bar for the current bar width
+		EC::ErrorCode uploadBar();
+		/// Evaluate the function at the middle of each bar and write the instances
+		EC::ErrorCode uploadInstances();
+
+		BatchFunction f;
 		GLUtils::VAO vao;
-		GLUtils::VertexBuffer vertexBuffer;
-		int vertexCount;
+		GLUtils::VertexBuffer barBuffer;
+		/// For each bar (bar start, bar height - 1), see instanceOffsetScale in the shaders
+		GLUtils::VertexBuffer instanceBuffer;
+		/// The data in instanceBuffer, kept for the outlines
+		std::vector<glm::vec2> bars;
+		Range2D xRange;
+		float dh;
 		int barCount;
+		/// The number of instances which fit in instanceBuffer
+		int instanceCapacity;
 	};
 
 	class Canvas : public IGeometry {
@@ -245,6 +498,54 @@ namespace MathViz {
 		GLUtils::VAO vao;
 	};
 
+	/// @brief Plot of a DataSeries decimated to the resolution of the view. Each pixel column gets the minimum
+	/// and the maximum of the samples under it, so no peak is lost and at most two vertices per column are
+	/// written, however many samples are visible. Views with fewer samples than that plot the samples directly.
+	/// The polyline is drawn with the other lines of the frame by adding it to a LineBatch, so its width and
+	/// antialiasing match the other plots.
+	class DataSeriesPlot {
+	public:
+		DataSeriesPlot();
+		/// @param series The series which will be plotted. It must be alive while the plot is used.
+		/// @param lineWidth The width of the line in pixels.
+		EC::ErrorCode init(const DataSeries& series, float lineWidth);
+		void freeMem();
+		/// @brief Decimate the visible part of the series. Call it when the view or the size of the framebuffer
+		/// changes. The cost depends on the number of columns, not on the number of samples.
+		/// @param xRange The minimal and maximal x value which will be plotted
+		/// @param columns The width of the view in pixels
+		EC::ErrorCode setView(const Range2D& xRange, int columns);
+		void setLineWidth(float lineWidth);
+		/// The number of vertices written by the last call to setView
+		int getVertexCount() const;
+		/// Add the polyline of the last call to setView to a batch of thick lines
+		/// @param batch The batch where the polyline is added
+		/// @param color The color and the opacity of the line
+		void appendTo(LineBatch& batch, const glm::vec4& color) const;
+	private:
+		const DataSeries* series;
+		/// The min/max pairs of the columns or the visible samples, the memory is reused by setView
+		std::vector<glm::vec3> vertices;
+		float lineWidth;
+	};
+
+	/// @brief The domain of a scalar field f(x, y). The field is not sampled on the CPU, the material evaluates
+	/// it for each fragment of the rectangle, so the cost depends only on the number of covered pixels and the
+	/// field stays sharp at any zoom. It must be drawn with FunctionField2D material.
+	class ScalarField2D : public Canvas {
+	public:
+		ScalarField2D();
+		/// @param xRange The minimal and maximal x value of the field in world space.
+		/// @param yRange The minimal and maximal y value of the field in world space.
+		/// @param z The depth of the rectangle, use it to put the field behind the other geometry
+		EC::ErrorCode init(const Range2D& xRange, const Range2D& yRange, float z);
+		const Range2D& getXRange() const;
+		const Range2D& getYRange() const;
+	private:
+		Range2D xRange;
+		Range2D yRange;
+	};
+
 	class Morphable2D {
 	public:
 		virtual int getVertexCount() const = 0;
@@ -259,20 +560,23 @@ namespace MathViz {
 			// the first and the last vertex will be the same.
 			IsClosed = 1
 		};
+		/// @brief Sample a parametric curve at vertexCountIn points in [0;1). The samples are computed
+		/// in parallel, so f must be safe to call from many threads at once.
 		template<typename FuncT>
 		void init(FuncT&& f, int vertexCountIn, CurveFlags flags) {
+			MATHVIZ_PROFILE_CPU("Curve::init");
 			assert(vertexCountIn > 1);
 			const bool isClosed = flags & CurveFlags::IsClosed;
 			this->vertexCount = vertexCountIn + isClosed;
-			vertices.clear();
-			vertices.reserve(vertexCount);
+			vertices.resize(vertexCount);
 			const float dh = 1.0f / vertexCountIn;
-			float t = 0.0f;
-			for (int i = 0; i < vertexCountIn; ++i, t += dh) {
-				vertices.push_back(f(t));
-			}
+			getThreadPool().parallelFor(vertexCountIn, BatchFunctionChunkSize, [&](int64_t begin, int64_t end) {
+				for (int64_t i = begin; i < end; ++i) {
+					vertices[i] = f(i * dh);
+				}
+			});
 			if (isClosed) {
-				vertices.push_back(vertices[0]);
+				vertices[vertexCountIn] = vertices[0];
 			}
 		}
 
@@ -291,6 +595,17 @@ namespace MathViz {
 	glm::vec3 circleEquation(float t);
 	glm::vec3 squareEquation(float t);
 
+	/// @brief Resample a polyline at points which are uniformly spaced along its length. The first and the last
+	/// point of the result are the first and the last point of the polyline. The segment lengths and the
+	/// resampling run on the thread pool, the prefix sum of the lengths between them is serial.
+	/// @param points The vertices of the polyline
+	/// @param pointCount The number of vertices of the polyline, at least 1
+	/// @param outCount The number of points in the result, at least 2
+	/// @param out Array where outCount points will be written
+	void resampleByArcLength(const glm::vec3* points, int pointCount, int outCount, glm::vec3* out);
+
+	/// @brief Morph between two curves. Both curves are resampled by arc length to the vertex count of the
+	/// larger one, so they can have different vertex counts and parametrizations.
 	class Morph2D : public IGeometry {
 	public:
 		Morph2D();
@@ -300,10 +615,50 @@ namespace MathViz {
 		Morph2D& operator=(Morph2D&& other) noexcept;
 		EC::ErrorCode init(const Morphable2D& start, const Morphable2D& end);
 		void freeMem();
+		/// @brief Draw the curve one pixel wide. Wide curves are drawn with appendTo.
 		EC::ErrorCode draw() const override;
+		/// @brief Add the curve at some point of the morph to a batch of thick lines
+		/// @param batch The batch where the curve is added
+		/// @param lerpCoeff 0 for the start curve, 1 for the end curve
+		/// @param color The color and the opacity of the curve
+		/// @param width The width of the curve in pixels
+		void appendTo(LineBatch& batch, float lerpCoeff, const glm::vec4& color, float width) const;
 	private:
 		GLUtils::VAO vao;
 		GLUtils::VertexBuffer vertexBuffer;
+		/// Start and end position of each vertex, interleaved
+		std::vector<glm::vec3> vertices;
+		int vertexCount;
+	};
+
+	/// @brief Sequence of curves which are morphed one into another on the GPU. All curves are resampled by
+	/// arc length to the same vertex count and uploaded once to a shader storage buffer. The Morph material
+	/// selects the two keyframes which are blended, so going through the sequence changes only the material
+	/// parameters and never the buffers. The curve is drawn without vertex attributes, one instance of a quad
+	/// for each segment, and the material expands the segments into thick lines like ThickLine.
+	class MorphSequence : public IGeometry {
+	public:
+		/// Shader storage bindings used by the Morph shader
+		enum StorageBindings {
+			Keyframes = 2
+		};
+		MorphSequence();
+		/// @param keyframes The curves of the sequence in order
+		/// @param vertexCount The number of vertices of each keyframe, at least 2
+		EC::ErrorCode init(const std::vector<const Morphable2D*>& keyframes, int vertexCount);
+		void freeMem();
+		int getKeyframeCount() const;
+		int getVertexCount() const;
+		EC::ErrorCode draw() const override;
+	private:
+		/// Matches the header of the Keyframes buffer in the Morph shader (std430)
+		struct KeyframesHeader {
+			int vertexCount;
+			int padding[3];
+		};
+		GLUtils::VAO vao;
+		GLUtils::ShaderStorageBuffer keyframeBuffer;
+		int keyframeCount;
 		int vertexCount;
 	};
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include <vector>
 #include <array>
+#include <memory>
 #include "glutils.h"
 #include "error_code.h"
 #include "shader_bindings.h"
@@ -13,12 +14,26 @@ namespace GLUtils {
 
 namespace MathViz {
 
+	class Expression;
+
 	class IMaterial {
 	public:
 		using ShaderId = int;
 		IMaterial(const GLUtils::Program& p) : program {p} {}
 		virtual ~IMaterial() {}
-		virtual EC::ErrorCode setUniforms() const = 0;
+		/// Set the uniforms which are not in the Material uniform block e.g. samplers.
+		/// The program is bound when this is called.
+		virtual EC::ErrorCode setUniforms() const {
+			return EC::ErrorCode();
+		}
+		/// The parameters of the material in std140 layout. They are copied into MaterialUniformBuffer
+		/// and bound to the Material uniform block of the shader.
+		/// @param[out] size The size of the block in bytes. Zero if the shader has no Material block.
+		/// @returns Pointer to the parameters or nullptr if the shader has no Material block
+		virtual const void* getUniformBlock(int& size) const {
+			size = 0;
+			return nullptr;
+		}
 		const GLUtils::Program& getProgram() const {
 			return program;
 		}
@@ -32,9 +47,12 @@ namespace MathViz {
 		FlatColor(const GLUtils::Program& p, const glm::vec3& color);
 		void setColor(const glm::vec3& color);
 		glm::vec3 getColor() const;
-		EC::ErrorCode setUniforms() const override;
+		const void* getUniformBlock(int& size) const override;
 	private:
-		glm::vec3 color;
+		struct UniformBlock {
+			glm::vec3 color;
+		};
+		UniformBlock block;
 	};
 
 	class Gradient2D : public IMaterial {
@@ -47,25 +65,253 @@ namespace MathViz {
 			const glm::vec3& col0rStart,
 			const glm::vec3& col0rEnd
 		);
+		const void* getUniformBlock(int& size) const override;
+	private:
+		/// In std140 each vec3 starts at a multiple of 16 bytes
+		struct UniformBlock {
+			glm::vec3 start;
+			float padding0;
+			glm::vec3 end;
+			float padding1;
+			glm::vec3 colorStart;
+			float padding2;
+			glm::vec3 colorEnd;
+		};
+		UniformBlock block;
+	};
+
+	/// Axes and grid computed in the fragment shader from the world position of each fragment. It is drawn
+	/// on a Canvas which covers the view, so its cost does not depend on the range of the axes. Grid levels
+	/// are powers of 10 and fade in and out with the zoom.
+	class Grid2D : public IMaterial {
+	public:
+		explicit Grid2D(const GLUtils::Program& p);
+		/// @param[in] p The program for the Grid2D shader
+		/// @param[in] gridColor The color of the grid lines
+		/// @param[in] axisColor The color of the axes and their ticks
+		/// @param[in] minCellPixels The smallest distance in pixels between two grid lines
+		Grid2D(const GLUtils::Program& p, const glm::vec3& gridColor, const glm::vec3& axisColor, float minCellPixels);
+		const void* getUniformBlock(int& size) const override;
+	private:
+		struct UniformBlock {
+			glm::vec3 gridColor;
+			float minCellPixels;
+			glm::vec3 axisColor;
+			/// Length in pixels of the tick marks on each side of the axes
+			float tickPixels;
+		};
+		UniformBlock block;
+	};
+
+	/// Material for LineBatch. The widths of the lines are in pixels, so it needs the size of the viewport.
+	class ThickLine : public IMaterial {
+	public:
+		explicit ThickLine(const GLUtils::Program& p);
+		/// Must be called when the framebuffer is resized
+		/// @param[in] width The width of the viewport in pixels
+		/// @param[in] height The height of the viewport in pixels
+		void setViewportSize(int width, int height);
+		const void* getUniformBlock(int& size) const override;
+	private:
+		struct UniformBlock {
+			glm::vec2 viewportSize;
+		};
+		UniformBlock block;
+	};
+
+	/// Material for CurveBatch. The colors and the widths are in the batch, the material has only the size
+	/// of the viewport, because the widths are in pixels.
+	class BatchedCurve : public IMaterial {
+	public:
+		explicit BatchedCurve(const GLUtils::Program& p);
+		/// Must be called when the framebuffer is resized
+		/// @param[in] width The width of the viewport in pixels
+		/// @param[in] height The height of the viewport in pixels
+		void setViewportSize(int width, int height);
+		const void* getUniformBlock(int& size) const override;
+	private:
+		struct UniformBlock {
+			glm::vec2 viewportSize;
+		};
+		UniformBlock block;
+	};
+
+	/// Material for MorphSequence. It selects the two keyframes which are blended and how far the morph
+	/// between them is, so the whole sequence is played by changing only these parameters.
+	class Morph : public IMaterial {
+	public:
+		explicit Morph(const GLUtils::Program& p);
+		Morph(const GLUtils::Program& p, const glm::vec4& color);
+		/// @param[in] from The index of the keyframe at lerpCoeff 0
+		/// @param[in] to The index of the keyframe at lerpCoeff 1
+		/// @param[in] lerpCoeff How far the morph from the first to the second keyframe is
+		void setKeyframes(int from, int to, float lerpCoeff);
+		/// Select the keyframes at a point of a looping sequence, e.g. 1.25 is a quarter of the way from
+		/// keyframe 1 to keyframe 2. After the last keyframe the sequence morphs back to the first one.
+		/// @param[in] position The point in the sequence, measured in keyframes
+		/// @param[in] keyframeCount The number of keyframes in the sequence
+		void setSequencePosition(float position, int keyframeCount);
+		void setColor(const glm::vec4& color);
+		/// @param[in] width The width of the curve in pixels
+		void setLineWidth(float width);
+		/// Must match the size of the framebuffer, the width of the curve is in pixels
+		void setViewportSize(int width, int height);
+		const void* getUniformBlock(int& size) const override;
+	private:
+		/// In std140 the vec2 starts at a multiple of 8 bytes
+		struct UniformBlock {
+			glm::vec4 color;
+			int fromKeyframe;
+			int toKeyframe;
+			float lerpCoeff;
+			float lineWidth;
+			glm::vec2 viewportSize;
+		};
+		UniformBlock block;
+	};
+
+	/// Values of the variables of an expression which are uniforms of a generated shader, e.g. the time t in
+	/// sin(x - t). Changing a parameter costs one uniform write when the material is bound, the program is
+	/// not generated again.
+	class ParameterUniforms {
+	public:
+		/// @param[in] name The name of the variable in the expression
+		/// @param[in] value The value of the uniform
+		void set(char name, float value);
+		/// Write all values to the uniforms of the bound program. Parameters which are not in the
+		/// expression are ignored.
+		EC::ErrorCode apply(const GLUtils::Program& program) const;
+	private:
+		std::vector<std::pair<char, float>> values;
+	};
+
+	/// Material which evaluates an expression in the vertex shader. It must be used with a Plot2D
+	/// initialized with Plot2D::initProcedural. Each instance is one segment, the x coordinates of its
+	/// ends are computed from gl_InstanceID and the sampling range, the y coordinates are the values of
+	/// the expression. The segments are expanded into antialiased thick lines like in ThickLine.
+	/// The shader program is generated from the expression, so each material owns its program.
+	class FunctionPlot2D : public IMaterial {
+	public:
+		FunctionPlot2D();
+		/// Generate and compile the shader program for the given expression.
+		/// @param[in] f The function which will be plotted. Variables other than x are
+		/// uniforms, their value is 0 unless it is set with setParameter.
+		/// @param[in] color The color of the plot
+		EC::ErrorCode init(const Expression& f, const glm::vec3& color);
+		/// Set the value of a variable other than x. The value is kept when the expression changes.
+		void setParameter(char name, float value);
+		/// Set the points at which the function is evaluated. These must match the range
+		/// and the vertex count of the Plot2D which is drawn with this material.
+		/// @param[in] from The x coordinate of the first vertex
+		/// @param[in] to The x coordinate of the last vertex
+		/// @param[in] n The number of vertices
+		void setSampling(float from, float to, int n);
+		void setColor(const glm::vec3& color);
+		/// @param[in] width The width of the line in pixels
+		void setLineWidth(float width);
+		/// Must match the size of the framebuffer, the width of the line is in pixels
+		void setViewportSize(int width, int height);
+		EC::ErrorCode setUniforms() const override;
+		const void* getUniformBlock(int& size) const override;
+	private:
+		/// In std140 the vec2 starts at a multiple of 8 bytes
+		struct UniformBlock {
+			glm::vec3 color;
+			float xFrom;
+			float xStep;
+			float lineWidth;
+			glm::vec2 viewportSize;
+		};
+		explicit FunctionPlot2D(std::unique_ptr<GLUtils::Program> program);
+		std::unique_ptr<GLUtils::Program> ownedProgram;
+		ParameterUniforms parameters;
+		UniformBlock block;
+	};
+
+	/// Material which evaluates an expression of x and y for each fragment. It must be used with a
+	/// ScalarField2D, the expression is evaluated at the world position of the fragment. The field is
+	/// drawn as a heatmap between two colors and the level set f(x, y) = level is drawn on top of it
+	/// as an antialiased implicit curve. The shader program is generated from the expression, so each
+	/// material owns its program.
+	class FunctionField2D : public IMaterial {
+	public:
+		FunctionField2D();
+		/// Generate and compile the shader program for the given expression.
+		/// @param[in] f The field which will be drawn. Variables other than x and y are
+		/// uniforms, their value is 0 unless it is set with setParameter.
+		EC::ErrorCode init(const Expression& f);
+		/// Set the value of a variable other than x and y. The value is kept when the expression changes.
+		void setParameter(char name, float value);
+		/// Set the colors of the heatmap. Values outside of the range get the color of the closest end.
+		/// @param[in] valueFrom The value which gets colorFrom
+		/// @param[in] valueTo The value which gets colorTo, must be different from valueFrom
+		/// @param[in] colorFrom The color of valueFrom
+		/// @param[in] colorTo The color of valueTo
+		/// @param[in] opacity The opacity of the heatmap, 0 draws only the implicit curve
+		void setHeatmap(float valueFrom, float valueTo, const glm::vec3& colorFrom, const glm::vec3& colorTo, float opacity);
+		/// Set the implicit curve f(x, y) = level
+		/// @param[in] level The value of the field along the curve
+		/// @param[in] color The color and the opacity of the curve
+		/// @param[in] width The width of the curve in pixels, 0 hides the curve
+		void setContour(float level, const glm::vec4& color, float width);
 		EC::ErrorCode setUniforms() const override;
+		const void* getUniformBlock(int& size) const override;
 	private:
-		glm::vec3 start;
-		glm::vec3 end;
-		glm::vec3 colorStart;
-		glm::vec3 colorEnd;
+		/// In std140 each vec3 and vec4 starts at a multiple of 16 bytes
+		struct UniformBlock {
+			glm::vec3 colorFrom;
+			float valueFrom;
+			glm::vec3 colorTo;
+			float valueTo;
+			glm::vec4 contourColor;
+			float contourLevel;
+			float contourWidth;
+			float heatmapOpacity;
+		};
+		explicit FunctionField2D(std::unique_ptr<GLUtils::Program> program);
+		std::unique_ptr<GLUtils::Program> ownedProgram;
+		ParameterUniforms parameters;
+		UniformBlock block;
+	};
+
+	/// Uniform buffer shared by all materials. Before drawing, the blocks of the materials which will be
+	/// used are packed one after another and uploaded together, so switching between materials only binds
+	/// another range of the buffer. The upload is skipped when no material changed since the last frame.
+	class MaterialUniformBuffer {
+	public:
+		MaterialUniformBuffer();
+		/// @param[in] bindingPosition The binding of the Material uniform block in the shaders
+		EC::ErrorCode init(int bindingPosition);
+		void freeMem();
+		/// Remove all blocks added since the last upload
+		void clear();
+		/// Copy the block of the material to the end of the buffer
+		/// @param[in] material The material which will be drawn
+		/// @returns The offset of the block which must be passed to bind, -1 if the material has no block
+		int64_t add(const IMaterial& material);
+		/// Upload all added blocks to the GPU
+		EC::ErrorCode upload();
+		/// Bind the block which starts at offset to the Material uniform block
+		/// @param[in] offset Value returned by add
+		/// @param[in] material The material passed to add
+		EC::ErrorCode bind(int64_t offset, const IMaterial& material);
+	private:
+		GLUtils::UniformBuffer buffer;
+		/// The blocks added since the last upload
+		std::vector<unsigned char> staging;
+		/// The blocks which are in the buffer
+		std::vector<unsigned char> uploaded;
+		int64_t capacity;
 	};
 
 	class MaterialFactory {
 	public:
 		MaterialFactory() = default;
-		EC::ErrorCode init() {
-			for (int i = 0; i < int(ShaderTable::Count); ++i) {
-				GLUtils::Pipeline pipeline;
-				RETURN_ON_ERROR_CODE(pipeline.init(shaderPaths[i]));
-				RETURN_ON_ERROR_CODE(programs[i].init(pipeline));
-			}
-			return EC::ErrorCode();
-		}
+		/// Create the programs of all shaders in the shader table. Programs are loaded from the binary cache
+		/// when possible. The others are all compiled and linked before waiting for any of them, so with
+		/// parallel shader compile the driver builds them at the same time.
+		/// @param[in] cacheDirectory Directory of the program binary cache, nullptr disables the cache
+		EC::ErrorCode init(const char* cacheDirectory);
 
 		template<typename T, typename... Ts>
 		T create(Ts... args) {
@@ -87,11 +333,31 @@ namespace MathViz {
 			return int(ShaderTable::FlatColor);
 		}
 		 
+		template<>
+		constexpr int shaderIndex<Morph>() const {
+			return int(ShaderTable::Morph);
+		}
+
 		template<>
 		constexpr int shaderIndex<Gradient2D>() const {
 			return int(ShaderTable::Gradient2D);
 		}
 
+		template<>
+		constexpr int shaderIndex<Grid2D>() const {
+			return int(ShaderTable::Grid2D);
+		}
+
+		template<>
+		constexpr int shaderIndex<ThickLine>() const {
+			return int(ShaderTable::ThickLine);
+		}
+
+		template<>
+		constexpr int shaderIndex<BatchedCurve>() const {
+			return int(ShaderTable::BatchedCurve);
+		}
+
 		std::array<GLUtils::Program, int(ShaderTable::Count)> programs;
 	};
 }
\ No newline at end of file
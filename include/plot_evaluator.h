@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "glm/vec3.hpp"
+#include "error_code.h"
+#include "geometry_primitives.h"
+#include "triple_buffer.h"
+
+namespace MathViz {
+	class Expression;
+
+	/// Evaluates plots on a background thread, so that expensive expressions do not stall the frame. Requests
+	/// are processed one at a time. A new request cancels the one which is running, the evaluation checks for
+	/// this regularly and stops. Finished results are handed to the render thread with a TripleBuffer, so
+	/// taking them never waits.
+	class PlotEvaluator {
+	public:
+		struct Request {
+			Request() : sampleCount(0), tolerance(0.0f) {}
+			/// The function of x which is plotted
+			std::shared_ptr<const Expression> expression;
+			Range2D xRange;
+			/// The number of uniformly spaced samples, used when tolerance is zero
+			int sampleCount;
+			/// The tolerance of sampleAdaptive, zero for uniform sampling
+			float tolerance;
+			/// Names of variables other than x which are fixed for the whole plot, e.g. the time. They are
+			/// substituted with Expression::specialize before sampling, so subtrees which depend only on them
+			/// are computed once instead of once per sample.
+			std::string parameterNames;
+			/// The value of each parameter, in the order of parameterNames
+			std::vector<float> parameterValues;
+		};
+		struct Result {
+			Result() : requestId(0) {}
+			/// The value returned by submit for the request
+			uint64_t requestId;
+			EC::ErrorCode error;
+			/// The vertices of the plot from left to right
+			std::vector<glm::vec3> vertices;
+		};
+
+		PlotEvaluator();
+		PlotEvaluator(const PlotEvaluator&) = delete;
+		PlotEvaluator& operator=(const PlotEvaluator&) = delete;
+		~PlotEvaluator();
+		/// Start the worker thread
+		/// @param[in] onResult Called on the worker thread after each result is published, e.g. to wake up
+		/// the render loop. Can be empty.
+		EC::ErrorCode init(std::function<void()> onResult);
+		/// Cancel the current request and join the worker
+		void freeMem();
+		/// Evaluate the plot on the worker. A request which is still waiting is replaced and the one which
+		/// is running is cancelled.
+		/// @returns The id of the request which will be in its result
+		uint64_t submit(Request request);
+		/// Take the newest finished result. Must be called from one thread only, usually at the start of the frame.
+		/// @param[out] result The result, the previous content is reused by the worker for later results
+		/// @returns true if there is a result which was not taken yet
+		bool takeResult(Result& result);
+		/// @returns true while the last submitted request is not finished
+		bool isBusy() const;
+	private:
+		void workerLoop();
+		/// @returns false if the request was cancelled
+		bool evaluate(const Request& request, uint64_t id, Result& result) const;
+		bool isCancelled(uint64_t id) const;
+
+		std::thread worker;
+		std::mutex mutex;
+		std::condition_variable wakeUp;
+		/// The request which the worker takes next, protected by mutex
+		Request pendingRequest;
+		bool hasPendingRequest;
+		bool stop;
+		/// The id of the last submitted request, the worker cancels any other request
+		std::atomic<uint64_t> latestRequestId;
+		/// The id of the last published result
+		std::atomic<uint64_t> finishedRequestId;
+		TripleBuffer<Result> results;
+		std::function<void()> onResult;
+	};
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace EC {
+	class ErrorCode;
+}
+
+namespace MathViz {
+	/// Frame profiler with CPU and GPU timers. CPU timers can be used from any thread. GPU timers use
+	/// GL_TIMESTAMP queries and must be used from the thread which owns the GL context. The results of the
+	/// GPU queries are read FrameLatency frames after they are issued, so reading them never waits for the GPU.
+	/// Use it through the MATHVIZ_PROFILE_CPU and MATHVIZ_PROFILE_GPU macros.
+	class Profiler {
+	public:
+		/// The number of frames after which the results of the GPU queries are read
+		static constexpr int FrameLatency = 3;
+		/// The maximal number of GPU scopes in one frame, the following scopes in the frame are ignored
+		static constexpr int MaxGpuScopes = 128;
+		/// The number of frames used for the percentiles
+		static constexpr int HistorySize = 240;
+
+		Profiler();
+		Profiler(const Profiler&) = delete;
+		Profiler& operator=(const Profiler&) = delete;
+		/// Get the profiler which is shared by the whole process
+		static Profiler& getInstance();
+		/// Create the GPU queries. Must be called after the GL context is created.
+		EC::ErrorCode init();
+		void freeMem();
+
+		/// Must be called at the start of each frame on the thread which owns the GL context
+		void beginFrame();
+		/// Must be called at the end of each frame after all GPU work of the frame is issued
+		void endFrame();
+
+		/// @param[in] name Name of the scope. It must be alive for the lifetime of the profiler, e.g. a literal.
+		void beginCpuScope(const char* name);
+		void endCpuScope();
+		/// @param[in] name Name of the scope. It must be alive for the lifetime of the profiler, e.g. a literal.
+		/// @returns Index which must be passed to endGpuScope, -1 if the scope is not recorded
+		int beginGpuScope(const char* name);
+		void endGpuScope(int index);
+
+		/// Record the next frameCount frames and write them as Chrome trace JSON (chrome://tracing or Perfetto)
+		/// @param[in] frameCount The number of frames in the capture
+		/// @param[in] path The file which will be written when the capture is done
+		void requestCapture(int frameCount, const char* path);
+		/// @returns true while a requested capture is still recording
+		bool isCapturing() const;
+
+		/// Draw the profiler window with ImGui
+		/// @param[in] open Pointer to the visibility of the window, can be nullptr
+		void drawWindow(bool* open);
+	private:
+		struct Event {
+			const char* name;
+			/// Time in nanoseconds since the profiler was created
+			int64_t start;
+			int64_t end;
+			/// Index of the thread which recorded the event, GpuThread for GPU events
+			int thread;
+			/// Nesting level of the event in its thread
+			int depth;
+		};
+		struct Frame {
+			int64_t index = -1;
+			int64_t start = 0;
+			int64_t end = 0;
+			std::vector<Event> cpuEvents;
+			std::vector<Event> gpuEvents;
+			/// Set when the GPU events are read
+			bool gpuReady = false;
+		};
+		/// Queries of one frame in flight. Each scope uses two queries, one for the start and one for the end.
+		struct GpuFrame {
+			int64_t frameIndex = -1;
+			int scopeCount = 0;
+			std::array<const char*, MaxGpuScopes> names;
+			std::array<int, MaxGpuScopes> depths;
+			std::array<unsigned int, 2 * MaxGpuScopes> queries;
+		};
+		static constexpr int GpuThread = 1 << 16;
+
+		int64_t now() const;
+		int getThreadIndex();
+		/// Read the queries of the given frame in flight if they are ready
+		void readGpuFrame(GpuFrame& gpuFrame);
+		Frame* findFrame(int64_t index);
+		/// Add the finished frames to the capture and write it when all frames are in
+		void updateCapture();
+		EC::ErrorCode writeCapture() const;
+		void drawFlameGraph(const Frame& frame, bool gpu);
+
+		std::chrono::steady_clock::time_point startTime;
+		/// Added to GPU timestamps to get the time on the CPU clock
+		int64_t gpuClockOffset;
+		bool gpuEnabled;
+
+		/// Protects cpuEvents and threadCount
+		mutable std::mutex mutex;
+		std::vector<Event> cpuEvents;
+		std::atomic<int> threadCount;
+		/// The thread which called init, only its scopes are shown in the flame graph
+		int mainThread;
+
+		std::array<GpuFrame, FrameLatency> gpuFrames;
+		int gpuDepth;
+		/// The last HistorySize frames
+		std::array<Frame, HistorySize> history;
+		int64_t frameIndex;
+		int64_t frameStart;
+
+		std::vector<Frame> capture;
+		int64_t captureFirstFrame;
+		int captureFrameCount;
+		std::string capturePath;
+		std::string captureStatus;
+		/// The number of frames in the next capture, edited in the profiler window
+		int captureFrameInput;
+	};
+
+	/// Measures the time from its creation to its destruction on the CPU
+	class CpuProfileScope {
+	public:
+		explicit CpuProfileScope(const char* name) {
+			Profiler::getInstance().beginCpuScope(name);
+		}
+		~CpuProfileScope() {
+			Profiler::getInstance().endCpuScope();
+		}
+		CpuProfileScope(const CpuProfileScope&) = delete;
+		CpuProfileScope& operator=(const CpuProfileScope&) = delete;
+	};
+
+	/// Measures the time the GPU spends on the commands issued from its creation to its destruction
+	class GpuProfileScope {
+	public:
+		explicit GpuProfileScope(const char* name) :
+			index(Profiler::getInstance().beginGpuScope(name))
+		{ }
+		~GpuProfileScope() {
+			Profiler::getInstance().endGpuScope(index);
+		}
+		GpuProfileScope(const GpuProfileScope&) = delete;
+		GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+	private:
+		int index;
+	};
+}
+
+#define MATHVIZ_PROFILE_CONCAT_IMPL(a, b) a##b
+#define MATHVIZ_PROFILE_CONCAT(a, b) MATHVIZ_PROFILE_CONCAT_IMPL(a, b)
+/// Profile the CPU time until the end of the enclosing block
+#define MATHVIZ_PROFILE_CPU(name) MathViz::CpuProfileScope MATHVIZ_PROFILE_CONCAT(cpuProfileScope, __LINE__)(name)
+/// Profile the CPU and the GPU time until the end of the enclosing block
+#define MATHVIZ_PROFILE_GPU(name) \
+	MathViz::CpuProfileScope MATHVIZ_PROFILE_CONCAT(cpuProfileScope, __LINE__)(name); \
+	MathViz::GpuProfileScope MATHVIZ_PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
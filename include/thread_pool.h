@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace EC {
+	class ErrorCode;
+}
+
+namespace MathViz {
+	/// Pool of worker threads which split loops into chunks. Each worker has its own queue of chunks,
+	/// when it is empty the worker steals chunks from the other queues. The thread which starts a loop
+	/// takes part in it and returns after all chunks are done. While it waits it runs only chunks of its own loop,
+	/// so a thread never ends up inside an unrelated loop. Loops can be started from inside other loops.
+	class ThreadPool {
+	public:
+		ThreadPool();
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		~ThreadPool();
+		/// @brief Start the worker threads
+		/// @param[in] workerCount The number of threads which are started in addition to the calling
+		/// thread. If it is negative one thread less than the number of hardware threads is started.
+		EC::ErrorCode init(int workerCount);
+		/// Wait for the workers to finish their current chunks and join them
+		void freeMem();
+		/// The number of threads which run chunks, including the thread which starts the loop
+		int getThreadCount() const;
+		/// @brief Call f(begin, end) for consecutive ranges which cover [0;count). The ranges are processed in
+		/// parallel, so f must be safe to call from many threads at once. The call blocks until all ranges are done.
+		/// @tparam FuncT Callable which accepts two int64_t - the begin and the end of the range
+		/// @param[in] count The number of iterations in the loop
+		/// @param[in] grainSize The minimal number of iterations in a range. Each range except the last one
+		/// has a multiple of grainSize iterations.
+		/// @param[in] f The body of the loop
+		template<typename FuncT>
+		void parallelFor(int64_t count, int64_t grainSize, FuncT&& f) {
+			using Func = std::remove_reference_t<FuncT>;
+			Job job;
+			job.data = const_cast<void*>(static_cast<const void*>(&f));
+			job.run = [](void* data, int64_t begin, int64_t end) {
+				(*static_cast<Func*>(data))(begin, end);
+			};
+			run(job, count, grainSize);
+		}
+	private:
+		struct Job {
+			Job() : data(nullptr), run(nullptr), remaining(0) {}
+			void* data;
+			void(*run)(void* data, int64_t begin, int64_t end);
+			/// The number of ranges of the job which are not finished
+			std::atomic<int64_t> remaining;
+		};
+		struct Task {
+			Job* job;
+			int64_t begin;
+			int64_t end;
+		};
+		struct Queue {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+		/// Split the job in tasks, distribute them across all queues and help until the job is done
+		void run(Job& job, int64_t count, int64_t grainSize);
+		/// Run one task from the queue with the given index. If it is empty steal from the other queues.
+		/// @param[in] queueIndex The queue of the calling thread
+		/// @param[in] only If not null only tasks of this job are run
+		/// @returns true if a task was run
+		bool tryRunTask(int queueIndex, const Job* only);
+		void workerLoop(int queueIndex);
+		/// The queue of the calling thread. Threads which are not workers share the last queue.
+		int getQueueIndex() const;
+
+		std::vector<std::thread> workers;
+		/// One queue for each worker and one for the threads which are not workers
+		std::unique_ptr<Queue[]> queues;
+		int queueCount;
+		/// Total number of tasks in all queues. Workers sleep while it is zero.
+		std::atomic<int64_t> pendingTasks;
+		std::mutex sleepMutex;
+		std::condition_variable wakeUp;
+		bool stop;
+	};
+}
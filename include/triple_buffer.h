@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+
+namespace MathViz {
+	/// Hands the newest value from one producer thread to one consumer thread without locks. Each side owns
+	/// one of the three slots and the third one is shared. The producer publishes its slot by swapping it with
+	/// the shared one, the consumer takes the shared slot the same way. Neither side ever waits for the other.
+	/// Values which are published while the consumer does not take them are overwritten by newer ones.
+	template<typename T>
+	class TripleBuffer {
+	public:
+		TripleBuffer() :
+			shared(1),
+			back(0),
+			front(2)
+		{ }
+		TripleBuffer(const TripleBuffer&) = delete;
+		TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+		/// The slot of the producer. Only the producer thread can use it.
+		T& getWriteSlot() {
+			return slots[back];
+		}
+		/// Make the write slot the newest value, the producer gets another slot
+		void publish() {
+			back = shared.exchange(back | FreshBit, std::memory_order_acq_rel) & IndexMask;
+		}
+		/// Take the newest published value if it was not taken yet. Only the consumer thread can call it.
+		/// @returns true if getReadSlot changed
+		bool update() {
+			if ((shared.load(std::memory_order_relaxed) & FreshBit) == 0) {
+				return false;
+			}
+			front = shared.exchange(front, std::memory_order_acq_rel) & IndexMask;
+			return true;
+		}
+		/// The slot of the consumer. Only the consumer thread can use it.
+		T& getReadSlot() {
+			return slots[front];
+		}
+	private:
+		/// Set in shared when it holds a value which the consumer did not take
+		static constexpr int FreshBit = 4;
+		static constexpr int IndexMask = 3;
+		T slots[3];
+		std::atomic<int> shared;
+		/// Owned by the producer
+		int back;
+		/// Owned by the consumer
+		int front;
+	};
+}
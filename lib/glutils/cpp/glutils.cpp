@@ -1,6 +1,11 @@
 #include <cerrno>
 #include <memory>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
 #include "glad/glad.h" 
 #include "glutils.h"
 #include "error_code.h"
@@ -24,16 +29,438 @@ namespace GLUtils {
 		}
 	}
 
+	// =========================================================
+	// ===================== ERROR CHECK =======================
+	// =========================================================
+
+	static constexpr ErrorCheck defaultErrorCheck =
+		GLUTILS_ERROR_CHECK == GLUTILS_ERROR_CHECK_DEBUG_OUTPUT ? ErrorCheck::DebugOutput :
+		GLUTILS_ERROR_CHECK == GLUTILS_ERROR_CHECK_NONE ? ErrorCheck::None :
+		ErrorCheck::GetError;
+
+	/// The current error check. DebugOutput must be enabled in the context before it is used,
+	/// so it starts as GetError until setErrorCheck is called.
+	static std::atomic<ErrorCheck> errorCheck(
+		defaultErrorCheck == ErrorCheck::DebugOutput ? ErrorCheck::GetError : defaultErrorCheck
+	);
+
+	/// State written by the debug callback. The driver can call it from its own threads.
+	struct DebugOutputState {
+		std::mutex mutex;
+		/// Set when an error was reported which was not returned by checkGLError yet
+		std::atomic<bool> hasError{false};
+		unsigned int errorId = 0;
+		std::string errorText;
+		std::vector<DebugMessage> messages;
+	};
+
+	static DebugOutputState& getDebugOutputState() {
+		static DebugOutputState state;
+		return state;
+	}
+
+	static void GLAPIENTRY debugMessageCallback(
+		GLenum source,
+		GLenum type,
+		GLuint id,
+		GLenum severity,
+		GLsizei length,
+		const GLchar* message,
+		const void* userParam
+	) {
+		DebugOutputState& state = *static_cast<DebugOutputState*>(const_cast<void*>(userParam));
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (type == GL_DEBUG_TYPE_ERROR) {
+			// Keep the first error, the following ones are usually caused by it
+			if (!state.hasError) {
+				state.errorId = id;
+				state.errorText.assign(message, length >= 0 ? size_t(length) : strlen(message));
+				state.hasError = true;
+			}
+			return;
+		}
+		if (severity == GL_DEBUG_SEVERITY_NOTIFICATION) {
+			return;
+		}
+		for (DebugMessage& known : state.messages) {
+			if (known.id == id && known.source == source && known.type == type) {
+				known.count++;
+				return;
+			}
+		}
+		state.messages.push_back(DebugMessage{
+			id,
+			source,
+			type,
+			severity,
+			1,
+			std::string(message, length >= 0 ? size_t(length) : strlen(message))
+		});
+	}
+
+	EC::ErrorCode setErrorCheck(ErrorCheck check) {
+		const ErrorCheck previous = errorCheck.load();
+		if (check == ErrorCheck::DebugOutput && previous != ErrorCheck::DebugOutput) {
+			if (glDebugMessageCallback == nullptr) {
+				return EC::ErrorCode("KHR_debug is not supported by the context");
+			}
+			// Errors which happened before the switch would be lost
+			RETURN_ON_ERROR_CODE(checkGLError());
+			glEnable(GL_DEBUG_OUTPUT);
+			glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+			glDebugMessageCallback(debugMessageCallback, &getDebugOutputState());
+			glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_TRUE);
+			const GLenum err = glGetError();
+			if (err != GL_NO_ERROR) {
+				return EC::ErrorCode(err, "Failed to enable debug output: %s", getGLErrorString(err));
+			}
+		} else if (check != ErrorCheck::DebugOutput && previous == ErrorCheck::DebugOutput) {
+			glDebugMessageCallback(nullptr, nullptr);
+			glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+			glDisable(GL_DEBUG_OUTPUT);
+			getDebugOutputState().hasError = false;
+		}
+		errorCheck = check;
+		return EC::ErrorCode();
+	}
+
+	ErrorCheck getErrorCheck() {
+		return errorCheck.load();
+	}
+
+	std::vector<DebugMessage> getDebugMessages() {
+		DebugOutputState& state = getDebugOutputState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		return state.messages;
+	}
+
+	void clearDebugMessages() {
+		DebugOutputState& state = getDebugOutputState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.messages.clear();
+	}
+
+	// =========================================================
+	// ===================== EXTENSIONS ========================
+	// =========================================================
+
+	static constexpr GLenum GL_MAX_SHADER_COMPILER_THREADS_KHR = 0x91B0;
+	static constexpr GLenum GL_COMPLETION_STATUS_KHR = 0x91B1;
+	typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+	static std::atomic<bool> parallelShaderCompile(false);
+
+	static bool hasExtension(const char* name) {
+		int count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (int i = 0; i < count; ++i) {
+			const char* extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+			if (extension != nullptr && strcmp(extension, name) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void loadExtensions(GLADloadproc loader) {
+		PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxShaderCompilerThreads = nullptr;
+		if (hasExtension("GL_KHR_parallel_shader_compile")) {
+			maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)loader("glMaxShaderCompilerThreadsKHR");
+		} else if (hasExtension("GL_ARB_parallel_shader_compile")) {
+			maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)loader("glMaxShaderCompilerThreadsARB");
+		}
+		if (maxShaderCompilerThreads != nullptr) {
+			// 0xFFFFFFFF lets the driver pick the number of threads
+			maxShaderCompilerThreads(0xFFFFFFFF);
+		}
+		parallelShaderCompile = maxShaderCompilerThreads != nullptr;
+	}
+
+	bool hasParallelShaderCompile() {
+		return parallelShaderCompile.load(std::memory_order_relaxed);
+	}
+
+	EC::ErrorCode readFile(const char* path, std::string& content) {
+		std::unique_ptr<FILE, decltype(&fclose)> file(fopen(path, "rb"), &fclose);
+		if (file == nullptr) {
+			return EC::ErrorCode(errno, "Cannot open file %s path: %s", path, strerror(errno));
+		}
+		fseek(file.get(), 0L, SEEK_END);
+		const int64_t size = ftell(file.get());
+		rewind(file.get());
+		content.resize(size);
+		const int64_t bytesRead = fread(content.data(), 1, size, file.get());
+		if (bytesRead != size) {
+			return EC::ErrorCode(-1, "Failed to read file %s", path);
+		}
+		return EC::ErrorCode();
+	}
+
 	[[nodiscard]]
 	extern EC::ErrorCode checkGLError() {
-		GLenum err;
-		err = glGetError();
-		if (err != GL_NO_ERROR) {
-			return EC::ErrorCode(err, "OpenGL error: %s", getGLErrorString(err));
+		switch (errorCheck.load(std::memory_order_relaxed)) {
+			case ErrorCheck::GetError: {
+				const GLenum err = glGetError();
+				if (err != GL_NO_ERROR) {
+					return EC::ErrorCode(err, "OpenGL error: %s", getGLErrorString(err));
+				}
+				return EC::ErrorCode();
+			}
+			case ErrorCheck::DebugOutput: {
+				DebugOutputState& state = getDebugOutputState();
+				if (!state.hasError.load(std::memory_order_relaxed)) {
+					return EC::ErrorCode();
+				}
+				std::lock_guard<std::mutex> lock(state.mutex);
+				state.hasError = false;
+				// The error is also in the glGetError queue, it is removed so that GetError does not report it again
+				while (glGetError() != GL_NO_ERROR) {}
+				return EC::ErrorCode(int(state.errorId), "OpenGL error: %s", state.errorText.c_str());
+			}
+			default:
+				return EC::ErrorCode();
+		}
+	}
+
+	// =========================================================
+	// ===================== STATE CACHE =======================
+	// =========================================================
+
+	StateCache& StateCache::getCurrent() {
+		static thread_local StateCache cache;
+		return cache;
+	}
+
+	StateCache::StateCache() :
+		bufferTargetCount(0),
+		activeTextureUnit(-1),
+		capabilityCount(0),
+		statisticsEnabled(false)
+	{
+		textureTargets.fill(0);
+	}
+
+	template<typename T, size_t N>
+	StateCache::Binding<T>* StateCache::findBinding(std::array<Binding<T>, N>& bindings, int& count, GLenum key) {
+		for (int i = 0; i < count; ++i) {
+			if (bindings[i].key == key) {
+				return &bindings[i];
+			}
+		}
+		if (count == int(N)) {
+			return nullptr;
+		}
+		Binding<T>& binding = bindings[count++];
+		binding = Binding<T>();
+		binding.key = key;
+		return &binding;
+	}
+
+	void StateCache::count(bool issued) {
+		if (statisticsEnabled) {
+			if (issued) {
+				statistics.issued++;
+			} else {
+				statistics.elided++;
+			}
+		}
+	}
+
+	EC::ErrorCode StateCache::bindProgram(ProgramHandle handle) {
+		program.released = false;
+		if (program.value == handle) {
+			count(false);
+			return EC::ErrorCode();
+		}
+		count(true);
+		program.value = Unknown;
+		RETURN_ON_GL_ERROR(glUseProgram(handle));
+		program.value = handle;
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode StateCache::bindVAO(unsigned int handle) {
+		vao.released = false;
+		if (vao.value == handle) {
+			count(false);
+			return EC::ErrorCode();
+		}
+		count(true);
+		vao.value = Unknown;
+		RETURN_ON_GL_ERROR(glBindVertexArray(handle));
+		vao.value = handle;
+		// Each VAO has its own element array buffer
+		for (int i = 0; i < bufferTargetCount; ++i) {
+			if (buffers[i].key == GL_ELEMENT_ARRAY_BUFFER) {
+				buffers[i].value = Unknown;
+			}
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode StateCache::bindBuffer(GLenum target, BufferHandle handle) {
+		Binding<unsigned int>* binding = target == GL_ELEMENT_ARRAY_BUFFER ?
+			nullptr :
+			findBinding(buffers, bufferTargetCount, target);
+		if (binding == nullptr) {
+			count(true);
+			RETURN_ON_GL_ERROR(glBindBuffer(target, handle));
+			return EC::ErrorCode();
+		}
+		binding->released = false;
+		if (binding->value == handle) {
+			count(false);
+			return EC::ErrorCode();
+		}
+		count(true);
+		binding->value = Unknown;
+		RETURN_ON_GL_ERROR(glBindBuffer(target, handle));
+		binding->value = handle;
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode StateCache::bindTexture(int unit, GLenum target, unsigned int handle) {
+		assert(unit >= 0);
+		if (activeTextureUnit != unit) {
+			count(true);
+			activeTextureUnit = -1;
+			RETURN_ON_GL_ERROR(glActiveTexture(GL_TEXTURE0 + unit));
+			activeTextureUnit = unit;
+		} else {
+			count(false);
+		}
+		return bindTexture(target, handle);
+	}
+
+	EC::ErrorCode StateCache::bindTexture(GLenum target, unsigned int handle) {
+		const bool isKnownUnit = activeTextureUnit >= 0 && activeTextureUnit < MaxTextureUnits;
+		if (!isKnownUnit) {
+			count(true);
+			RETURN_ON_GL_ERROR(glBindTexture(target, handle));
+			return EC::ErrorCode();
+		}
+		Binding<unsigned int>& binding = textures[activeTextureUnit];
+		if (textureTargets[activeTextureUnit] == target && binding.value == handle) {
+			count(false);
+			return EC::ErrorCode();
 		}
+		count(true);
+		binding.value = Unknown;
+		RETURN_ON_GL_ERROR(glBindTexture(target, handle));
+		binding.value = handle;
+		textureTargets[activeTextureUnit] = target;
 		return EC::ErrorCode();
 	}
 
+	EC::ErrorCode StateCache::setEnabled(GLenum capability, bool enabled) {
+		Binding<unsigned int>* binding = findBinding(capabilities, capabilityCount, capability);
+		if (binding != nullptr && binding->value == unsigned(enabled)) {
+			count(false);
+			return EC::ErrorCode();
+		}
+		count(true);
+		if (binding != nullptr) {
+			binding->value = Unknown;
+		}
+		if (enabled) {
+			RETURN_ON_GL_ERROR(glEnable(capability));
+		} else {
+			RETURN_ON_GL_ERROR(glDisable(capability));
+		}
+		if (binding != nullptr) {
+			binding->value = unsigned(enabled);
+		}
+		return EC::ErrorCode();
+	}
+
+	void StateCache::releaseProgram() {
+		program.released = true;
+	}
+
+	void StateCache::releaseVAO() {
+		vao.released = true;
+	}
+
+	void StateCache::releaseBuffer(GLenum target) {
+		if (target == GL_ELEMENT_ARRAY_BUFFER) {
+			glBindBuffer(target, 0);
+			return;
+		}
+		Binding<unsigned int>* binding = findBinding(buffers, bufferTargetCount, target);
+		if (binding == nullptr) {
+			glBindBuffer(target, 0);
+			return;
+		}
+		binding->released = true;
+	}
+
+	void StateCache::onProgramDeleted(ProgramHandle handle) {
+		// A deleted program stays in use until another one is bound
+		if (program.value == handle) {
+			program.value = Unknown;
+		}
+	}
+
+	void StateCache::onVAODeleted(unsigned int handle) {
+		if (vao.value == handle) {
+			vao.value = 0;
+			vao.released = false;
+		}
+	}
+
+	void StateCache::onBufferDeleted(BufferHandle handle) {
+		for (int i = 0; i < bufferTargetCount; ++i) {
+			if (buffers[i].value == handle) {
+				buffers[i].value = 0;
+				buffers[i].released = false;
+			}
+		}
+	}
+
+	void StateCache::onTextureDeleted(unsigned int handle) {
+		for (Binding<unsigned int>& texture : textures) {
+			if (texture.value == handle) {
+				texture.value = 0;
+			}
+		}
+	}
+
+	EC::ErrorCode StateCache::flush() {
+		if (program.released) {
+			RETURN_ON_ERROR_CODE(bindProgram(0));
+		}
+		if (vao.released) {
+			RETURN_ON_ERROR_CODE(bindVAO(0));
+		}
+		for (int i = 0; i < bufferTargetCount; ++i) {
+			if (buffers[i].released) {
+				RETURN_ON_ERROR_CODE(bindBuffer(buffers[i].key, 0));
+			}
+		}
+		return EC::ErrorCode();
+	}
+
+	void StateCache::invalidate() {
+		program = Binding<unsigned int>();
+		vao = Binding<unsigned int>();
+		bufferTargetCount = 0;
+		textures.fill(Binding<unsigned int>());
+		textureTargets.fill(0);
+		activeTextureUnit = -1;
+		capabilityCount = 0;
+	}
+
+	void StateCache::setStatisticsEnabled(bool enabled) {
+		statisticsEnabled = enabled;
+	}
+
+	const StateCache::Statistics& StateCache::getStatistics() const {
+		return statistics;
+	}
+
+	void StateCache::resetStatistics() {
+		statistics = Statistics();
+	}
+
 	[[nodiscard]]
 	inline static GLenum convertBufferType(BufferType type) {
 		switch (type) {
@@ -41,6 +468,7 @@ namespace GLUtils {
 			case GLUtils::BufferType::Index:  return GL_ELEMENT_ARRAY_BUFFER;
 			case GLUtils::BufferType::Uniform: return GL_UNIFORM_BUFFER;
 			case GLUtils::BufferType::ShaderStorage: return GL_SHADER_STORAGE_BUFFER;
+			case GLUtils::BufferType::DrawIndirect: return GL_DRAW_INDIRECT_BUFFER;
 			default:
 			{
 				assert(false);
@@ -166,6 +594,28 @@ namespace GLUtils {
 		return -1;
 	}
 
+	/// Set the attribute pointers for the currently bound vertex buffer and enable the attributes
+	static EC::ErrorCode setAttributeLayout(const BufferLayout& layout) {
+		int offset = 0;
+		for (int i = 0; i < layout.getAttributes().size(); ++i) {
+			AttributeLayout attribute = layout.getAttributes()[i];
+			const GLenum attribType = convertVertexType(attribute.type);
+			const unsigned int location = layout.getFirstLocation() + i;
+			RETURN_ON_GL_ERROR(glVertexAttribPointer(
+				location,
+				attribute.count,
+				attribType,
+				attribute.normalized ? GL_TRUE : GL_FALSE,
+				layout.getStride(),
+				(const void*)offset
+			));
+			RETURN_ON_GL_ERROR(glEnableVertexAttribArray(location));
+			RETURN_ON_GL_ERROR(glVertexAttribDivisor(location, layout.getInstanceDivisor()));
+			offset += attribute.count * getTypeSize(attribute.type);
+		}
+		return EC::ErrorCode();
+	}
+
 	void BufferLayout::addAttribute(VertexType type, int count, bool normalized) {
 		layout.push_back({ count, type, normalized });
 		stride += getTypeSize(type) * count;
@@ -233,26 +683,15 @@ namespace GLUtils {
 	}
 
 	EC::ErrorCode BufferBase::setLayoutInternal(const BufferLayout& layout) {
-		int offset = 0;
-		for (int i = 0; i < layout.getAttributes().size(); ++i) {
-			AttributeLayout attribute = layout.getAttributes()[i];
-			const GLenum attribType = convertVertexType(attribute.type);
-			RETURN_ON_GL_ERROR(glVertexAttribPointer(
-				i,
-				attribute.count,
-				attribType,
-				attribute.normalized ? GL_TRUE : GL_FALSE,
-				layout.getStride(),
-				(const void*)offset
-			));
-			RETURN_ON_GL_ERROR(glEnableVertexAttribArray(i));
-			offset += attribute.count * getTypeSize(attribute.type);
-		}
-		return EC::ErrorCode();
+		return setAttributeLayout(layout);
 	}
 
 	void BufferBase::freeMem() {
-		glDeleteBuffers(1, &handle);
+		if (handle) {
+			glDeleteBuffers(1, &handle);
+			StateCache::getCurrent().onBufferDeleted(handle);
+			handle = 0;
+		}
 	}
 
 	BufferHandle BufferBase::getHandle() const {
@@ -260,8 +699,7 @@ namespace GLUtils {
 	}
 
 	EC::ErrorCode BufferBase::bind() const {
-		RETURN_ON_GL_ERROR(glBindBuffer(type, handle));
-		return EC::ErrorCode();
+		return StateCache::getCurrent().bindBuffer(type, handle);
 	}
 
 	EC::ErrorCode BufferBase::map(void*& map, BufferAccessType access) const {
@@ -276,7 +714,7 @@ namespace GLUtils {
 	}
 
 	EC::ErrorCode BufferBase::unbind() const {
-		RETURN_ON_GL_ERROR(glBindBuffer(type, 0));
+		StateCache::getCurrent().releaseBuffer(type);
 		return EC::ErrorCode();
 	}
 
@@ -293,36 +731,460 @@ namespace GLUtils {
 		bindingPosition(-1)
 	{ }
 
-	UniformBuffer::UniformBuffer(int bindingPosition) noexcept :
-		BufferBase(BufferType::Uniform),
-		bindingPosition(bindingPosition)
-	{ }
+	UniformBuffer::UniformBuffer(int bindingPosition) noexcept :
+		BufferBase(BufferType::Uniform),
+		bindingPosition(bindingPosition)
+	{ }
+
+	UniformBuffer::UniformBuffer(UniformBuffer&& ub) noexcept :
+		BufferBase(std::move(ub)),
+		bindingPosition(ub.bindingPosition)
+	{
+		ub.bindingPosition = -1;
+	}
+
+	UniformBuffer& UniformBuffer::operator=(UniformBuffer&& ub) noexcept {
+		BufferBase::operator=(std::move(ub));
+		bindingPosition = ub.bindingPosition;
+		ub.bindingPosition = 0;
+		return *this;
+	}
+
+	void UniformBuffer::setBindingPosition(unsigned int bindingPosition) {
+		this->bindingPosition = bindingPosition;
+	}
+
+	EC::ErrorCode UniformBuffer::bind() {
+		assert(bindingPosition >= 0);
+		RETURN_ON_ERROR_CODE(BufferBase::bind());
+		RETURN_ON_GL_ERROR(glBindBufferBase(type, bindingPosition, handle));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode UniformBuffer::bindRange(int64_t offset, int64_t size) {
+		assert(bindingPosition >= 0);
+		assert(offset % getOffsetAlignment() == 0);
+		RETURN_ON_ERROR_CODE(BufferBase::bind());
+		RETURN_ON_GL_ERROR(glBindBufferRange(type, bindingPosition, handle, offset, size));
+		return EC::ErrorCode();
+	}
+
+	int UniformBuffer::getOffsetAlignment() {
+		static const int alignment = []() {
+			int result = 256;
+			glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &result);
+			return result;
+		}();
+		return alignment;
+	}
+
+	ShaderStorageBuffer::ShaderStorageBuffer() noexcept :
+		BufferBase(BufferType::ShaderStorage),
+		bindingPosition(-1)
+	{ }
+
+	ShaderStorageBuffer::ShaderStorageBuffer(int bindingPosition) noexcept :
+		BufferBase(BufferType::ShaderStorage),
+		bindingPosition(bindingPosition)
+	{ }
+
+	ShaderStorageBuffer::ShaderStorageBuffer(ShaderStorageBuffer&& other) noexcept :
+		BufferBase(std::move(other)),
+		bindingPosition(other.bindingPosition)
+	{
+		other.bindingPosition = -1;
+	}
+
+	ShaderStorageBuffer& ShaderStorageBuffer::operator=(ShaderStorageBuffer&& other) noexcept {
+		BufferBase::operator=(std::move(other));
+		bindingPosition = other.bindingPosition;
+		other.bindingPosition = -1;
+		return *this;
+	}
+
+	void ShaderStorageBuffer::setBindingPosition(unsigned int bindingPosition) {
+		this->bindingPosition = bindingPosition;
+	}
+
+	EC::ErrorCode ShaderStorageBuffer::bind() const {
+		assert(bindingPosition >= 0);
+		RETURN_ON_ERROR_CODE(BufferBase::bind());
+		RETURN_ON_GL_ERROR(glBindBufferBase(type, bindingPosition, handle));
+		return EC::ErrorCode();
+	}
+
+	DrawIndirectBuffer::DrawIndirectBuffer() :
+		BufferBase(BufferType::DrawIndirect)
+	{ }
+
+	// =========================================================
+	// ================= STREAMING BUFFER ======================
+	// =========================================================
+
+	StreamingBuffer::StreamingBuffer() :
+		handle(0),
+		mapping(nullptr),
+		regionSize(0),
+		regionCount(0),
+		readRegion(0),
+		writeRegion(0),
+		stride(0)
+	{ }
+
+	StreamingBuffer::~StreamingBuffer() {
+		freeMem();
+	}
+
+	StreamingBuffer::StreamingBuffer(StreamingBuffer&& other) noexcept :
+		handle(other.handle),
+		mapping(other.mapping),
+		regionSize(other.regionSize),
+		regionCount(other.regionCount),
+		readRegion(other.readRegion),
+		writeRegion(other.writeRegion),
+		stride(other.stride),
+		fences(std::move(other.fences))
+	{
+		other.handle = 0;
+		other.mapping = nullptr;
+		other.fences.clear();
+	}
+
+	StreamingBuffer& StreamingBuffer::operator=(StreamingBuffer&& other) noexcept {
+		assert(&other != this);
+		freeMem();
+		handle = other.handle;
+		mapping = other.mapping;
+		regionSize = other.regionSize;
+		regionCount = other.regionCount;
+		readRegion = other.readRegion;
+		writeRegion = other.writeRegion;
+		stride = other.stride;
+		fences = std::move(other.fences);
+		other.handle = 0;
+		other.mapping = nullptr;
+		other.fences.clear();
+		return *this;
+	}
+
+	EC::ErrorCode StreamingBuffer::init(int64_t regionSizeIn, int regionCountIn, const BufferLayout& layout) {
+		assert(regionCountIn > 0);
+		assert(layout.getStride() > 0 && regionSizeIn % layout.getStride() == 0);
+		freeMem();
+		regionSize = regionSizeIn;
+		regionCount = regionCountIn;
+		stride = layout.getStride();
+		readRegion = 0;
+		writeRegion = 0;
+		fences.assign(regionCount, nullptr);
+
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		const int64_t size = regionSize * regionCount;
+		RETURN_ON_GL_ERROR(glGenBuffers(1, &handle));
+		RETURN_ON_ERROR_CODE(bind());
+		RETURN_ON_GL_ERROR(glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags));
+		void* mapped = nullptr;
+		RETURN_ON_GL_ERROR(mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+		mapping = static_cast<unsigned char*>(mapped);
+		RETURN_ON_ERROR_CODE(setAttributeLayout(layout));
+		RETURN_ON_ERROR_CODE(unbind());
+		return EC::ErrorCode();
+	}
+
+	/// Wait until the fence is signaled, delete it and set it to null. Null fences are signaled.
+	static EC::ErrorCode waitAndDeleteFence(GLsync& sync) {
+		if (sync == nullptr) {
+			return EC::ErrorCode();
+		}
+		// Flush only on the first wait, the fence might not have been submitted yet
+		GLbitfield waitFlags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		const GLuint64 timeoutNs = 1000000;
+		while (true) {
+			const GLenum status = glClientWaitSync(sync, waitFlags, timeoutNs);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+				break;
+			}
+			if (status == GL_WAIT_FAILED) {
+				return checkGLError();
+			}
+			waitFlags = 0;
+		}
+		glDeleteSync(sync);
+		sync = nullptr;
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode StreamingBuffer::waitRegion(int region) const {
+		return waitAndDeleteFence(fences[region]);
+	}
+
+	EC::ErrorCode StreamingBuffer::beginWrite(void*& region) {
+		assert(mapping != nullptr);
+		writeRegion = (readRegion + 1) % regionCount;
+		RETURN_ON_ERROR_CODE(waitRegion(writeRegion));
+		region = mapping + writeRegion * regionSize;
+		return EC::ErrorCode();
+	}
+
+	void StreamingBuffer::endWrite() {
+		readRegion = writeRegion;
+	}
+
+	EC::ErrorCode StreamingBuffer::fence() const {
+		GLsync& sync = fences[readRegion];
+		if (sync != nullptr) {
+			glDeleteSync(sync);
+		}
+		RETURN_ON_GL_ERROR(sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+		return EC::ErrorCode();
+	}
+
+	int StreamingBuffer::getFirstVertex() const {
+		return int(readRegion * regionSize / stride);
+	}
+
+	int64_t StreamingBuffer::getRegionSize() const {
+		return regionSize;
+	}
+
+	BufferHandle StreamingBuffer::getHandle() const {
+		return handle;
+	}
+
+	EC::ErrorCode StreamingBuffer::bind() const {
+		return StateCache::getCurrent().bindBuffer(GL_ARRAY_BUFFER, handle);
+	}
+
+	EC::ErrorCode StreamingBuffer::unbind() const {
+		StateCache::getCurrent().releaseBuffer(GL_ARRAY_BUFFER);
+		return EC::ErrorCode();
+	}
+
+	void StreamingBuffer::freeMem() {
+		for (int i = 0; i < int(fences.size()); ++i) {
+			[[maybe_unused]] const EC::ErrorCode err = waitRegion(i);
+		}
+		fences.clear();
+		if (handle != 0) {
+			StateCache& cache = StateCache::getCurrent();
+			if (!cache.bindBuffer(GL_ARRAY_BUFFER, handle).hasError()) {
+				glUnmapBuffer(GL_ARRAY_BUFFER);
+			}
+			glDeleteBuffers(1, &handle);
+			cache.onBufferDeleted(handle);
+			handle = 0;
+		}
+		mapping = nullptr;
+	}
+
+	// =========================================================
+	// ===================== FRAMEBUFFER =======================
+	// =========================================================
+
+	Framebuffer::Framebuffer() :
+		handle(0),
+		colorBuffer(0),
+		depthBuffer(0),
+		width(0),
+		height(0)
+	{ }
+
+	Framebuffer::~Framebuffer() {
+		freeMem();
+	}
+
+	Framebuffer::Framebuffer(Framebuffer&& other) noexcept :
+		handle(other.handle),
+		colorBuffer(other.colorBuffer),
+		depthBuffer(other.depthBuffer),
+		width(other.width),
+		height(other.height)
+	{
+		other.handle = 0;
+		other.colorBuffer = 0;
+		other.depthBuffer = 0;
+	}
+
+	Framebuffer& Framebuffer::operator=(Framebuffer&& other) noexcept {
+		freeMem();
+		handle = other.handle;
+		colorBuffer = other.colorBuffer;
+		depthBuffer = other.depthBuffer;
+		width = other.width;
+		height = other.height;
+		other.handle = 0;
+		other.colorBuffer = 0;
+		other.depthBuffer = 0;
+		return *this;
+	}
+
+	EC::ErrorCode Framebuffer::init(int widthIn, int heightIn) {
+		freeMem();
+		width = widthIn;
+		height = heightIn;
+		RETURN_ON_GL_ERROR(glGenRenderbuffers(1, &colorBuffer));
+		RETURN_ON_GL_ERROR(glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer));
+		RETURN_ON_GL_ERROR(glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height));
+		RETURN_ON_GL_ERROR(glGenRenderbuffers(1, &depthBuffer));
+		RETURN_ON_GL_ERROR(glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer));
+		RETURN_ON_GL_ERROR(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height));
+		RETURN_ON_GL_ERROR(glBindRenderbuffer(GL_RENDERBUFFER, 0));
+
+		RETURN_ON_GL_ERROR(glGenFramebuffers(1, &handle));
+		RETURN_ON_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, handle));
+		RETURN_ON_GL_ERROR(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer));
+		RETURN_ON_GL_ERROR(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer));
+		const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		RETURN_ON_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			return EC::ErrorCode(int(status), "Framebuffer is not complete. Status: %x", status);
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Framebuffer::bind() const {
+		assert(handle != 0);
+		RETURN_ON_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, handle));
+		RETURN_ON_GL_ERROR(glViewport(0, 0, width, height));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Framebuffer::unbind() const {
+		RETURN_ON_GL_ERROR(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+		return EC::ErrorCode();
+	}
+
+	int Framebuffer::getWidth() const {
+		return width;
+	}
+
+	int Framebuffer::getHeight() const {
+		return height;
+	}
+
+	void Framebuffer::freeMem() {
+		if (handle) {
+			glDeleteFramebuffers(1, &handle);
+			handle = 0;
+		}
+		if (colorBuffer) {
+			glDeleteRenderbuffers(1, &colorBuffer);
+			colorBuffer = 0;
+		}
+		if (depthBuffer) {
+			glDeleteRenderbuffers(1, &depthBuffer);
+			depthBuffer = 0;
+		}
+	}
+
+	// =========================================================
+	// ==================== PIXEL READBACK =====================
+	// =========================================================
+
+	PixelReadback::PixelReadback() :
+		width(0),
+		height(0),
+		first(0),
+		pendingCount(0)
+	{ }
+
+	PixelReadback::~PixelReadback() {
+		freeMem();
+	}
+
+	EC::ErrorCode PixelReadback::init(int widthIn, int heightIn, int bufferCount) {
+		assert(bufferCount > 0);
+		freeMem();
+		width = widthIn;
+		height = heightIn;
+		buffers.resize(bufferCount, 0);
+		fences.resize(bufferCount, nullptr);
+		RETURN_ON_GL_ERROR(glGenBuffers(bufferCount, buffers.data()));
+		StateCache& cache = StateCache::getCurrent();
+		for (const unsigned int buffer : buffers) {
+			RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_PACK_BUFFER, buffer));
+			RETURN_ON_GL_ERROR(glBufferData(GL_PIXEL_PACK_BUFFER, int64_t(width) * height * 4, nullptr, GL_STREAM_READ));
+		}
+		// releaseBuffer is lazy and would leave the buffer bound, then glReadPixels of other code would write into it
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode PixelReadback::read() {
+		assert(!isFull());
+		const int index = (first + pendingCount) % int(buffers.size());
+		StateCache& cache = StateCache::getCurrent();
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_PACK_BUFFER, buffers[index]));
+		RETURN_ON_GL_ERROR(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+		RETURN_ON_GL_ERROR(glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
+		// Unbind right away, otherwise glReadPixels of other code would write into the buffer
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+		RETURN_ON_GL_ERROR(fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+		pendingCount++;
+		return EC::ErrorCode();
+	}
 
-	UniformBuffer::UniformBuffer(UniformBuffer&& ub) noexcept :
-		BufferBase(std::move(ub)),
-		bindingPosition(ub.bindingPosition)
-	{
-		ub.bindingPosition = -1;
+	bool PixelReadback::isFull() const {
+		return pendingCount == int(buffers.size());
 	}
 
-	UniformBuffer& UniformBuffer::operator=(UniformBuffer&& ub) noexcept {
-		BufferBase::operator=(std::move(ub));
-		bindingPosition = ub.bindingPosition;
-		ub.bindingPosition = 0;
-		return *this;
+	int PixelReadback::getPendingCount() const {
+		return pendingCount;
 	}
 
-	void UniformBuffer::setBindingPosition(unsigned int bindingPosition) {
-		this->bindingPosition = bindingPosition;
+	EC::ErrorCode PixelReadback::mapOldest(bool wait, const unsigned char*& data) {
+		assert(pendingCount > 0);
+		data = nullptr;
+		GLsync& sync = fences[first];
+		if (wait) {
+			RETURN_ON_ERROR_CODE(waitAndDeleteFence(sync));
+		} else if (sync != nullptr) {
+			const GLenum status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (status == GL_WAIT_FAILED) {
+				return checkGLError();
+			}
+			if (status == GL_TIMEOUT_EXPIRED) {
+				return EC::ErrorCode();
+			}
+			glDeleteSync(sync);
+			sync = nullptr;
+		}
+		RETURN_ON_ERROR_CODE(StateCache::getCurrent().bindBuffer(GL_PIXEL_PACK_BUFFER, buffers[first]));
+		void* mapping = nullptr;
+		RETURN_ON_GL_ERROR(mapping = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, int64_t(width) * height * 4, GL_MAP_READ_BIT));
+		data = static_cast<const unsigned char*>(mapping);
+		return EC::ErrorCode();
 	}
 
-	EC::ErrorCode UniformBuffer::bind() {
-		assert(bindingPosition >= 0);
-		RETURN_ON_ERROR_CODE(BufferBase::bind());
-		RETURN_ON_GL_ERROR(glBindBufferBase(type, bindingPosition, handle));
+	EC::ErrorCode PixelReadback::unmapOldest() {
+		assert(pendingCount > 0);
+		StateCache& cache = StateCache::getCurrent();
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_PACK_BUFFER, buffers[first]));
+		RETURN_ON_GL_ERROR(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+		first = (first + 1) % int(buffers.size());
+		pendingCount--;
 		return EC::ErrorCode();
 	}
 
+	void PixelReadback::freeMem() {
+		for (GLsync& sync : fences) {
+			if (sync != nullptr) {
+				glDeleteSync(sync);
+			}
+		}
+		fences.clear();
+		if (!buffers.empty()) {
+			glDeleteBuffers(int(buffers.size()), buffers.data());
+			for (const unsigned int buffer : buffers) {
+				StateCache::getCurrent().onBufferDeleted(buffer);
+			}
+		}
+		buffers.clear();
+		first = 0;
+		pendingCount = 0;
+	}
+
 	// =========================================================
 	// ===================== SHADER ============================
 	// =========================================================
@@ -359,10 +1221,7 @@ namespace GLUtils {
 	}
 
 	EC::ErrorCode Shader::loadFromSource(const char* source, const int length, ShaderType type) {
-		const GLenum shaderType = convertShaderType(type);
-		RETURN_ON_GL_ERROR(handle = glCreateShader(shaderType););
-		RETURN_ON_GL_ERROR(glShaderSource(handle, 1, &source, &length));
-		RETURN_ON_GL_ERROR(glCompileShader(handle));
+		RETURN_ON_ERROR_CODE(compile(source, length, type));
 		{
 			const EC::ErrorCode err = checkShaderCompilationError();
 			if (err.hasError()) {
@@ -405,11 +1264,19 @@ namespace GLUtils {
 		return EC::ErrorCode();
 	}
 
+	EC::ErrorCode Shader::compile(const char* source, const int length, ShaderType type) {
+		const GLenum shaderType = convertShaderType(type);
+		RETURN_ON_GL_ERROR(handle = glCreateShader(shaderType););
+		RETURN_ON_GL_ERROR(glShaderSource(handle, 1, &source, &length));
+		RETURN_ON_GL_ERROR(glCompileShader(handle));
+		return EC::ErrorCode();
+	}
+
 	ShaderHandle Shader::getHandle() const {
 		return handle;
 	}
 
-	EC::ErrorCode Shader::checkShaderCompilationError() {
+	EC::ErrorCode Shader::checkShaderCompilationError() const {
 		int success;
 		RETURN_ON_GL_ERROR(glGetShaderiv(handle, GL_COMPILE_STATUS, &success))
 
@@ -425,17 +1292,29 @@ namespace GLUtils {
 	// =========================================================
 
 	EC::ErrorCode Pipeline::init(const char* path) {
-		std::unique_ptr<FILE, decltype(&fclose)> shaderFile(fopen(path, "rb"), &fclose);
-		if (shaderFile == nullptr) {
-			return EC::ErrorCode(errno, "Cannot open file %s path: %s", path, strerror(errno));
-		}
-		fseek(shaderFile.get(), 0L, SEEK_END);
-		const int64_t size = ftell(shaderFile.get());
-		rewind(shaderFile.get());
 		std::string joinedShader;
-		joinedShader.resize(size);
-		fread(joinedShader.data(), 1, size, shaderFile.get());
+		RETURN_ON_ERROR_CODE(readFile(path, joinedShader));
+		return initFromSource(joinedShader);
+	}
+
+	EC::ErrorCode Pipeline::initFromSource(const std::string& joinedShader) {
+		RETURN_ON_ERROR_CODE(compileFromSource(joinedShader));
+		return checkCompileErrors();
+	}
+
+	EC::ErrorCode Pipeline::checkCompileErrors() const {
+		for (const auto& it : shaders) {
+			RETURN_ON_ERROR_CODE(it.second.checkShaderCompilationError());
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Pipeline::compileStage(ShaderType type, const char* source, int length) {
+		return shaders[type].compile(source, length, type);
+	}
 
+	EC::ErrorCode Pipeline::compileFromSource(const std::string& joinedShader) {
+		const int64_t size = joinedShader.size();
 		// The internal convention is that when we have many shaders in a single file
 		// each shader will start with the line #shader <type_of_shader>
 		// After <type_of_shader> there must be a new line.
@@ -461,7 +1340,7 @@ namespace GLUtils {
 				return EC::ErrorCode("Unknown shader type: %s", shaderTypeStr.c_str());
 			}
 
-			RETURN_ON_ERROR_CODE(shaders[shaderType].loadFromSource(
+			RETURN_ON_ERROR_CODE(shaders[shaderType].compile(
 				joinedShader.c_str() + shaderStart,
 				shaderSize,
 				shaderType)
@@ -494,14 +1373,19 @@ namespace GLUtils {
 
 	Program::Program() : handle(0) { }
 
-	Program::Program(Program&& program) noexcept {
-		this->handle = program.handle;
+	Program::Program(Program&& program) noexcept :
+		handle(program.handle),
+		uniformLocations(std::move(program.uniformLocations)),
+		uniformBlocks(std::move(program.uniformBlocks))
+	{
 		program.handle = 0;
 	}
 
 	Program& Program::operator=(Program&& other) noexcept {
 		freeMem();
 		this->handle = other.handle;
+		uniformLocations = std::move(other.uniformLocations);
+		uniformBlocks = std::move(other.uniformBlocks);
 		other.handle = 0;
 		return *this;
 	}
@@ -511,51 +1395,159 @@ namespace GLUtils {
 	}
 
 	EC::ErrorCode Program::init(const Pipeline& pipeline) {
+		RETURN_ON_ERROR_CODE(link(pipeline));
+		return finishLink(pipeline);
+	}
+
+	EC::ErrorCode Program::link(const Pipeline& pipeline) {
+		freeMem();
 		RETURN_ON_GL_ERROR(handle = glCreateProgram(););
 		for (auto& it : pipeline) {
 			const ShaderHandle h = it.second.getHandle();
 			RETURN_ON_GL_ERROR(glAttachShader(handle, h));
 		}
+		// Some drivers return the binary only if they were told before linking
+		RETURN_ON_GL_ERROR(glProgramParameteri(handle, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
 		RETURN_ON_GL_ERROR(glLinkProgram(handle));
-		RETURN_ON_ERROR_CODE(checkProgramLinkErrors());
+		return EC::ErrorCode();
+	}
+
+	bool Program::isLinkComplete() const {
+		if (!hasParallelShaderCompile()) {
+			return true;
+		}
+		int complete = GL_TRUE;
+		glGetProgramiv(handle, GL_COMPLETION_STATUS_KHR, &complete);
+		return complete == GL_TRUE;
+	}
+
+	EC::ErrorCode Program::finishLink(const Pipeline& pipeline) {
+		const EC::ErrorCode linkErr = checkProgramLinkErrors();
+		if (linkErr.hasError()) {
+			// The link fails when a shader does not compile, the compile error tells more
+			RETURN_ON_ERROR_CODE(pipeline.checkCompileErrors());
+			return linkErr;
+		}
 		for (auto& it : pipeline) {
 			const ShaderHandle h = it.second.getHandle();
 			glDetachShader(handle, h);
 			assert(checkGLError().hasError() == false);
 		}
+		reflect();
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Program::initFromBinary(const void* binary, int size, GLenum format) {
+		freeMem();
+		RETURN_ON_GL_ERROR(handle = glCreateProgram(););
+		// An unknown format is a GL error, a binary from another driver fails the link status. Both are
+		// a cache miss, the error is taken from the queue so that it is not reported by the next check.
+		glProgramBinary(handle, format, binary, size);
+		const EC::ErrorCode binaryErr = checkGLError();
+		int success = GL_FALSE;
+		glGetProgramiv(handle, GL_LINK_STATUS, &success);
+		if (binaryErr.hasError() || !success) {
+			freeMem();
+			return EC::ErrorCode("The driver rejected the program binary");
+		}
+		reflect();
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode Program::getBinary(std::vector<unsigned char>& binary, GLenum& format) const {
+		int size = 0;
+		RETURN_ON_GL_ERROR(glGetProgramiv(handle, GL_PROGRAM_BINARY_LENGTH, &size));
+		binary.resize(size);
+		int length = 0;
+		RETURN_ON_GL_ERROR(glGetProgramBinary(handle, size, &length, &format, binary.data()));
+		binary.resize(length);
 		return EC::ErrorCode();
 	}
 
+	void Program::reflect() {
+		uniformLocations.clear();
+		uniformBlocks.clear();
+		std::string name;
+
+		int uniformCount = 0;
+		int maxNameLength = 0;
+		glGetProgramiv(handle, GL_ACTIVE_UNIFORMS, &uniformCount);
+		glGetProgramiv(handle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+		name.resize(maxNameLength);
+		for (int i = 0; i < uniformCount; ++i) {
+			int length = 0, arraySize = 0;
+			GLenum type;
+			glGetActiveUniform(handle, i, maxNameLength, &length, &arraySize, &type, name.data());
+			// Uniforms in blocks do not have locations
+			const int location = glGetUniformLocation(handle, name.c_str());
+			if (location == -1) {
+				continue;
+			}
+			std::string key(name.data(), length);
+			if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0) {
+				key.resize(key.size() - 3);
+			}
+			uniformLocations.emplace(std::move(key), location);
+		}
+
+		int blockCount = 0;
+		glGetProgramiv(handle, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+		for (int i = 0; i < blockCount; ++i) {
+			int nameLength = 0;
+			glGetActiveUniformBlockiv(handle, i, GL_UNIFORM_BLOCK_NAME_LENGTH, &nameLength);
+			name.resize(nameLength);
+			int length = 0;
+			glGetActiveUniformBlockName(handle, i, nameLength, &length, name.data());
+			uniformBlocks.emplace(std::string(name.data(), length), i);
+		}
+		assert(checkGLError().hasError() == false);
+	}
+
+	int Program::getUniformLocation(const char* name) const {
+		const auto it = uniformLocations.find(name);
+		return it == uniformLocations.end() ? -1 : it->second;
+	}
+
+	int Program::getUniformBlockIndex(const char* name) const {
+		const auto it = uniformBlocks.find(name);
+		return it == uniformBlocks.end() ? -1 : it->second;
+	}
+
 
 	ProgramHandle Program::getHandle() const {
 		return handle;
 	}
 
 	EC::ErrorCode Program::setUniform(const char* name, const glm::mat4& mat, bool transpose) const {
-		const int location = glGetUniformLocation(handle, name);
+		const int location = getUniformLocation(name);
 		glUniformMatrix4fv(location, 1, transpose, &mat[0][0]);
 		return GLUtils::checkGLError();
 	}
 
 	EC::ErrorCode Program::setUniform(const char* name, const glm::vec3& vec) const {
-		const int location = glGetUniformLocation(handle, name);
+		const int location = getUniformLocation(name);
 		glUniform3fv(location, 1, &vec.x);
 		return GLUtils::checkGLError();
 	}
 
+	EC::ErrorCode Program::setUniform(const char* name, const glm::vec2& vec) const {
+		const int location = getUniformLocation(name);
+		glUniform2fv(location, 1, &vec.x);
+		return GLUtils::checkGLError();
+	}
+
 	EC::ErrorCode Program::setUniform(const char* name, float value) const {
-		const int location = glGetUniformLocation(handle, name);
+		const int location = getUniformLocation(name);
 		glUniform1f(location, value);
 		return GLUtils::checkGLError();
 	}
 
 	EC::ErrorCode Program::bind() const {
-		glUseProgram(handle);
-		return checkGLError();
+		return StateCache::getCurrent().bindProgram(handle);
 	}
 
 	void Program::unbind() const {
-		glUseProgram(0);
+		StateCache::getCurrent().releaseProgram();
 	}
 
 	EC::ErrorCode Program::checkProgramLinkErrors() const {
@@ -574,8 +1566,125 @@ namespace GLUtils {
 		if (handle) {
 			glDeleteProgram(handle);
 			assert(checkGLError().hasError() == false);
+			StateCache::getCurrent().onProgramDeleted(handle);
 			handle = 0;
 		}
+		uniformLocations.clear();
+		uniformBlocks.clear();
+	}
+
+	// =========================================================
+	// ================= PROGRAM BINARY CACHE ==================
+	// =========================================================
+
+	/// Header of each file in the program binary cache
+	struct ProgramBinaryHeader {
+		static constexpr uint32_t Magic = 0x4250564d; // MVPB
+		uint32_t magic;
+		uint32_t format;
+		uint64_t key;
+		uint64_t size;
+	};
+
+	/// 64 bit FNV-1a
+	static uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; ++i) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	static uint64_t hashString(const GLubyte* str, uint64_t hash) {
+		const char* chars = reinterpret_cast<const char*>(str);
+		return chars == nullptr ? hash : hashBytes(chars, strlen(chars) + 1, hash);
+	}
+
+	ProgramBinaryCache::ProgramBinaryCache() :
+		driverHash(0),
+		enabled(false)
+	{ }
+
+	EC::ErrorCode ProgramBinaryCache::init(const char* directoryIn) {
+		enabled = false;
+		int formatCount = 0;
+		RETURN_ON_GL_ERROR(glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount));
+		if (formatCount == 0) {
+			return EC::ErrorCode();
+		}
+		std::error_code fsErr;
+		std::filesystem::create_directories(directoryIn, fsErr);
+		if (fsErr) {
+			return EC::ErrorCode(fsErr.value(), "Cannot create directory %s: %s", directoryIn, fsErr.message().c_str());
+		}
+		directory = directoryIn;
+		driverHash = hashString(glGetString(GL_VENDOR), hashBytes(nullptr, 0));
+		driverHash = hashString(glGetString(GL_RENDERER), driverHash);
+		driverHash = hashString(glGetString(GL_VERSION), driverHash);
+		enabled = true;
+		return EC::ErrorCode();
+	}
+
+	bool ProgramBinaryCache::isEnabled() const {
+		return enabled;
+	}
+
+	uint64_t ProgramBinaryCache::getKey(const std::string& source) const {
+		return hashBytes(source.data(), source.size(), driverHash);
+	}
+
+	std::string ProgramBinaryCache::getPath(uint64_t key) const {
+		char name[32];
+		snprintf(name, sizeof(name), "%016" PRIx64 ".bin", key);
+		return (std::filesystem::path(directory) / name).string();
+	}
+
+	bool ProgramBinaryCache::load(uint64_t key, Program& program) const {
+		if (!enabled) {
+			return false;
+		}
+		const std::string path = getPath(key);
+		std::unique_ptr<FILE, decltype(&fclose)> file(fopen(path.c_str(), "rb"), &fclose);
+		if (file == nullptr) {
+			return false;
+		}
+		ProgramBinaryHeader header;
+		if (fread(&header, sizeof(header), 1, file.get()) != 1 ||
+			header.magic != ProgramBinaryHeader::Magic ||
+			header.key != key
+		) {
+			return false;
+		}
+		std::vector<unsigned char> binary(header.size);
+		if (fread(binary.data(), 1, binary.size(), file.get()) != binary.size()) {
+			return false;
+		}
+		return !program.initFromBinary(binary.data(), int(binary.size()), header.format).hasError();
+	}
+
+	EC::ErrorCode ProgramBinaryCache::store(uint64_t key, const Program& program) const {
+		if (!enabled) {
+			return EC::ErrorCode();
+		}
+		std::vector<unsigned char> binary;
+		GLenum format = 0;
+		RETURN_ON_ERROR_CODE(program.getBinary(binary, format));
+		if (binary.empty()) {
+			return EC::ErrorCode();
+		}
+		const std::string path = getPath(key);
+		std::unique_ptr<FILE, decltype(&fclose)> file(fopen(path.c_str(), "wb"), &fclose);
+		if (file == nullptr) {
+			return EC::ErrorCode(errno, "Cannot open file %s: %s", path.c_str(), strerror(errno));
+		}
+		const ProgramBinaryHeader header{ProgramBinaryHeader::Magic, uint32_t(format), key, uint64_t(binary.size())};
+		if (fwrite(&header, sizeof(header), 1, file.get()) != 1 ||
+			fwrite(binary.data(), 1, binary.size(), file.get()) != binary.size()
+		) {
+			return EC::ErrorCode(-1, "Failed to write %s", path.c_str());
+		}
+		return EC::ErrorCode();
 	}
 	// =========================================================
 	// ========================= VAO ===========================
@@ -608,18 +1717,20 @@ namespace GLUtils {
 	[[nodiscard]]
 	EC::ErrorCode VAO::bind() const {
 		assert(handle != 0);
-		RETURN_ON_GL_ERROR(glBindVertexArray(handle));
-		return EC::ErrorCode();
+		return StateCache::getCurrent().bindVAO(handle);
 	}
 
 	void VAO::freeMem() {
-		assert(handle != 0);
-		glDeleteVertexArrays(1, &handle);
+		if (handle) {
+			glDeleteVertexArrays(1, &handle);
+			StateCache::getCurrent().onVAODeleted(handle);
+			handle = 0;
+		}
 	}
 
 	[[nodiscard]]
 	EC::ErrorCode VAO::unbind() const {
-		RETURN_ON_GL_ERROR(glBindVertexArray(0));
+		StateCache::getCurrent().releaseVAO();
 		return EC::ErrorCode();
 	}
 
@@ -725,21 +1836,384 @@ namespace GLUtils {
 		return EC::ErrorCode();
 	}
 
-	EC::ErrorCode Texture2D::bind(int unit) const {
-		RETURN_ON_GL_ERROR(glActiveTexture(GL_TEXTURE0 + unit));
-		RETURN_ON_GL_ERROR(glBindTexture(GL_TEXTURE_2D, texture));
+	EC::ErrorCode Texture2D::initStorage(
+		int widthIn,
+		int heightIn,
+		TextureWrap2D wrapU,
+		TextureWrap2D wrapV,
+		TextureFilter2D minFilter,
+		TextureFilter2D magFilter,
+		MipMapFilter2D mipMapFilter
+	) {
+		assert(widthIn > 0 && heightIn > 0);
+		freeMem();
+		width = widthIn;
+		height = heightIn;
+		channelsCount = 4;
+		int levels = 1;
+		if (mipMapFilter != MipMapFilter2D::None) {
+			for (int size = std::max(width, height); size > 1; size /= 2) {
+				levels++;
+			}
+		}
+		RETURN_ON_GL_ERROR(glGenTextures(1, &texture));
+		RETURN_ON_ERROR_CODE(bind());
+		RETURN_ON_GL_ERROR(glTexStorage2D(GL_TEXTURE_2D, levels, GL_RGBA8, width, height));
+
+		RETURN_ON_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, convertTextureWrap2D(wrapU)));
+		RETURN_ON_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, convertTextureWrap2D(wrapV)));
+
+		const int minFilter2DGL = mipMapFilter != MipMapFilter2D::None ?
+			convertMipMapFilter(minFilter, mipMapFilter) :
+			convertTextureFilter2D(minFilter);
+		RETURN_ON_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter2DGL));
+		RETURN_ON_GL_ERROR(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, convertTextureFilter2D(magFilter)));
 		return EC::ErrorCode();
 	}
 
-	EC::ErrorCode Texture2D::bind() const {
-		RETURN_ON_GL_ERROR(glBindTexture(GL_TEXTURE_2D, texture));
+	EC::ErrorCode Texture2D::uploadRows(int firstRow, int rowCount, const void* pixels) {
+		assert(texture != 0);
+		assert(firstRow >= 0 && rowCount >= 0 && firstRow + rowCount <= height);
+		RETURN_ON_ERROR_CODE(bind());
+		RETURN_ON_GL_ERROR(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+		RETURN_ON_GL_ERROR(glTexSubImage2D(
+			GL_TEXTURE_2D,
+			0,
+			0,
+			firstRow,
+			width,
+			rowCount,
+			GL_RGBA,
+			GL_UNSIGNED_BYTE,
+			pixels
+		));
 		return EC::ErrorCode();
 	}
 
+	EC::ErrorCode Texture2D::generateMipmaps() {
+		assert(texture != 0);
+		RETURN_ON_ERROR_CODE(bind());
+		RETURN_ON_GL_ERROR(glGenerateMipmap(GL_TEXTURE_2D));
+		return EC::ErrorCode();
+	}
+
+	int Texture2D::getWidth() const {
+		return width;
+	}
+
+	int Texture2D::getHeight() const {
+		return height;
+	}
+
+	EC::ErrorCode Texture2D::bind(int unit) const {
+		return StateCache::getCurrent().bindTexture(unit, GL_TEXTURE_2D, texture);
+	}
+
+	EC::ErrorCode Texture2D::bind() const {
+		return StateCache::getCurrent().bindTexture(GL_TEXTURE_2D, texture);
+	}
+
 	void Texture2D::freeMem() {
 		glDeleteTextures(1, &texture);
+		StateCache::getCurrent().onTextureDeleted(texture);
 		const EC::ErrorCode err = checkGLError();
 		assert(err.hasError() == false);
 		texture = 0;
 	}
+
+	// =========================================================
+	// ================ ASYNC TEXTURE LOADER ===================
+	// =========================================================
+
+	void AsyncTextureLoader::PixelsDeleter::operator()(unsigned char* pixels) const {
+		stbi_image_free(pixels);
+	}
+
+	AsyncTextureLoader::AsyncTextureLoader() :
+		stopping(false),
+		bufferSize(0),
+		nextBuffer(0),
+		pendingCount(0)
+	{ }
+
+	AsyncTextureLoader::~AsyncTextureLoader() {
+		freeMem();
+	}
+
+	EC::ErrorCode AsyncTextureLoader::init(int workerCount, int64_t bytesPerUpdate, int bufferCount) {
+		assert(workerCount > 0 && bytesPerUpdate > 0 && bufferCount > 0);
+		freeMem();
+		StateCache& cache = StateCache::getCurrent();
+		// Upload from client memory, not from a buffer which happens to be bound
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+		const unsigned char grey[4] = {128, 128, 128, 255};
+		RETURN_ON_ERROR_CODE(placeholder.initStorage(
+			1,
+			1,
+			TextureWrap2D::Repeat,
+			TextureWrap2D::Repeat,
+			TextureFilter2D::Nearest,
+			TextureFilter2D::Nearest,
+			MipMapFilter2D::None
+		));
+		RETURN_ON_ERROR_CODE(placeholder.uploadRows(0, 1, grey));
+
+		bufferSize = bytesPerUpdate;
+		buffers.resize(bufferCount, 0);
+		fences.resize(bufferCount, nullptr);
+		RETURN_ON_GL_ERROR(glGenBuffers(bufferCount, buffers.data()));
+		for (const unsigned int buffer : buffers) {
+			RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer));
+			RETURN_ON_GL_ERROR(glBufferData(GL_PIXEL_UNPACK_BUFFER, bufferSize, nullptr, GL_STREAM_DRAW));
+		}
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+
+		stopping = false;
+		workers.reserve(workerCount);
+		for (int i = 0; i < workerCount; ++i) {
+			workers.emplace_back(&AsyncTextureLoader::decodeLoop, this);
+		}
+		return EC::ErrorCode();
+	}
+
+	AsyncTextureLoader::Handle AsyncTextureLoader::load(const char* path, const Options& options) {
+		assert(!workers.empty());
+		const Handle handle = Handle(entries.size());
+		Entry& entry = entries.emplace_back();
+		entry.options = options;
+		entry.state = State::Decoding;
+		entry.path = path;
+		entry.width = 0;
+		entry.height = 0;
+		entry.uploadedRows = 0;
+		pendingCount++;
+		{
+			std::lock_guard lock(mutex);
+			jobs.push_back(DecodeJob{handle, entry.path});
+		}
+		hasWork.notify_one();
+		return handle;
+	}
+
+	void AsyncTextureLoader::decodeLoop() {
+		while (true) {
+			DecodeJob job;
+			{
+				std::unique_lock lock(mutex);
+				hasWork.wait(lock, [this]() { return stopping || !jobs.empty(); });
+				if (stopping) {
+					return;
+				}
+				job = std::move(jobs.front());
+				jobs.pop_front();
+			}
+			DecodeResult result{job.handle, nullptr, 0, 0};
+			int channelsInFile = 0;
+			result.pixels.reset(stbi_load(job.path.c_str(), &result.width, &result.height, &channelsInFile, 4));
+			std::lock_guard lock(mutex);
+			decoded.push_back(std::move(result));
+		}
+	}
+
+	EC::ErrorCode AsyncTextureLoader::update() {
+		RETURN_ON_ERROR_CODE(collectDecoded());
+		RETURN_ON_ERROR_CODE(generatePendingMipmaps());
+		return uploadNextChunk();
+	}
+
+	EC::ErrorCode AsyncTextureLoader::collectDecoded() {
+		std::vector<DecodeResult> results;
+		{
+			std::lock_guard lock(mutex);
+			results.swap(decoded);
+		}
+		for (DecodeResult& result : results) {
+			Entry& entry = entries[result.handle];
+			if (result.pixels == nullptr) {
+				entry.state = State::Failed;
+				entry.error = EC::ErrorCode("Failed to load texture: %s", entry.path.c_str());
+				pendingCount--;
+				continue;
+			}
+			entry.texture = std::make_unique<Texture2D>();
+			const Options& options = entry.options;
+			RETURN_ON_ERROR_CODE(entry.texture->initStorage(
+				result.width,
+				result.height,
+				options.wrapU,
+				options.wrapV,
+				options.minFilter,
+				options.magFilter,
+				options.mipMapFilter
+			));
+			entry.pixels = std::move(result.pixels);
+			entry.width = result.width;
+			entry.height = result.height;
+			entry.state = State::Uploading;
+			uploadQueue.push_back(result.handle);
+		}
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode AsyncTextureLoader::generatePendingMipmaps() {
+		// The last rows of these textures were uploaded on the previous update, generating the
+		// mipmaps one update later keeps the upload and the generation in different frames
+		for (const Handle handle : mipmapQueue) {
+			Entry& entry = entries[handle];
+			RETURN_ON_ERROR_CODE(entry.texture->generateMipmaps());
+			entry.state = State::Ready;
+			pendingCount--;
+		}
+		mipmapQueue.clear();
+		return EC::ErrorCode();
+	}
+
+	void AsyncTextureLoader::onRowsCopied(Handle handle) {
+		Entry& entry = entries[handle];
+		entry.pixels.reset();
+		uploadQueue.pop_front();
+		if (entry.options.mipMapFilter != MipMapFilter2D::None) {
+			entry.state = State::GeneratingMipmaps;
+			mipmapQueue.push_back(handle);
+		} else {
+			entry.state = State::Ready;
+			pendingCount--;
+		}
+	}
+
+	EC::ErrorCode AsyncTextureLoader::uploadNextChunk() {
+		if (uploadQueue.empty()) {
+			return EC::ErrorCode();
+		}
+		StateCache& cache = StateCache::getCurrent();
+		{
+			const Handle handle = uploadQueue.front();
+			Entry& entry = entries[handle];
+			const int64_t rowBytes = int64_t(entry.width) * 4;
+			if (rowBytes > bufferSize) {
+				RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+				RETURN_ON_ERROR_CODE(entry.texture->uploadRows(
+					entry.uploadedRows,
+					1,
+					entry.pixels.get() + entry.uploadedRows * rowBytes
+				));
+				if (++entry.uploadedRows == entry.height) {
+					onRowsCopied(handle);
+				}
+				return EC::ErrorCode();
+			}
+		}
+
+		// The buffer is reused only when the GPU has finished reading it, never wait for it
+		GLsync& sync = fences[nextBuffer];
+		if (sync != nullptr) {
+			const GLenum status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (status == GL_WAIT_FAILED) {
+				return checkGLError();
+			}
+			if (status == GL_TIMEOUT_EXPIRED) {
+				return EC::ErrorCode();
+			}
+			glDeleteSync(sync);
+			sync = nullptr;
+		}
+
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_UNPACK_BUFFER, buffers[nextBuffer]));
+		void* mapping = nullptr;
+		RETURN_ON_GL_ERROR(mapping = glMapBufferRange(
+			GL_PIXEL_UNPACK_BUFFER,
+			0,
+			bufferSize,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT
+		));
+		unsigned char* destination = static_cast<unsigned char*>(mapping);
+		copies.clear();
+		int64_t offset = 0;
+		while (!uploadQueue.empty()) {
+			const Handle handle = uploadQueue.front();
+			Entry& entry = entries[handle];
+			const int64_t rowBytes = int64_t(entry.width) * 4;
+			const int rowCount = int(std::min<int64_t>(entry.height - entry.uploadedRows, (bufferSize - offset) / rowBytes));
+			if (rowCount == 0) {
+				break;
+			}
+			std::memcpy(destination + offset, entry.pixels.get() + entry.uploadedRows * rowBytes, rowCount * rowBytes);
+			copies.push_back(Copy{handle, entry.uploadedRows, rowCount, offset});
+			offset += rowCount * rowBytes;
+			entry.uploadedRows += rowCount;
+			if (entry.uploadedRows == entry.height) {
+				onRowsCopied(handle);
+			}
+		}
+		RETURN_ON_GL_ERROR(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+		for (const Copy& copy : copies) {
+			RETURN_ON_ERROR_CODE(entries[copy.handle].texture->uploadRows(
+				copy.firstRow,
+				copy.rowCount,
+				reinterpret_cast<const void*>(copy.offset)
+			));
+		}
+		// Unbind right away, otherwise texture uploads of other code would read from the buffer
+		RETURN_ON_ERROR_CODE(cache.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+		RETURN_ON_GL_ERROR(sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+		nextBuffer = (nextBuffer + 1) % int(buffers.size());
+		return EC::ErrorCode();
+	}
+
+	EC::ErrorCode AsyncTextureLoader::bind(Handle handle, int unit) const {
+		assert(handle >= 0 && handle < int(entries.size()));
+		const Entry& entry = entries[handle];
+		return entry.state == State::Ready ? entry.texture->bind(unit) : placeholder.bind(unit);
+	}
+
+	bool AsyncTextureLoader::isReady(Handle handle) const {
+		assert(handle >= 0 && handle < int(entries.size()));
+		return entries[handle].state == State::Ready;
+	}
+
+	const EC::ErrorCode& AsyncTextureLoader::getError(Handle handle) const {
+		assert(handle >= 0 && handle < int(entries.size()));
+		return entries[handle].error;
+	}
+
+	int AsyncTextureLoader::getPendingCount() const {
+		return pendingCount;
+	}
+
+	void AsyncTextureLoader::freeMem() {
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+		hasWork.notify_all();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		workers.clear();
+		jobs.clear();
+		decoded.clear();
+		entries.clear();
+		uploadQueue.clear();
+		mipmapQueue.clear();
+		copies.clear();
+		for (GLsync& sync : fences) {
+			if (sync != nullptr) {
+				glDeleteSync(sync);
+			}
+		}
+		fences.clear();
+		if (!buffers.empty()) {
+			glDeleteBuffers(int(buffers.size()), buffers.data());
+			for (const unsigned int buffer : buffers) {
+				StateCache::getCurrent().onBufferDeleted(buffer);
+			}
+		}
+		buffers.clear();
+		if (bufferSize > 0) {
+			placeholder.freeMem();
+		}
+		bufferSize = 0;
+		nextBuffer = 0;
+		pendingCount = 0;
+	}
 }
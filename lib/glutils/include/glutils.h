@@ -1,16 +1,91 @@
 #pragma once
 #include <vector>
+#include <array>
+#include <string>
 #include <cinttypes>
 #include <unordered_map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "glad/glad.h"
 #include "glm/mat4x4.hpp"
+#include "glm/vec2.hpp"
 #include "error_code.h"
 
 
+/// Values of the GLUTILS_ERROR_CHECK CMake option. It selects the default ErrorCheck. When it is
+/// GLUTILS_ERROR_CHECK_NONE, RETURN_ON_GL_ERROR does not check anything and has no overhead.
+#define GLUTILS_ERROR_CHECK_GET_ERROR 0
+#define GLUTILS_ERROR_CHECK_DEBUG_OUTPUT 1
+#define GLUTILS_ERROR_CHECK_NONE 2
+#ifndef GLUTILS_ERROR_CHECK
+#define GLUTILS_ERROR_CHECK GLUTILS_ERROR_CHECK_GET_ERROR
+#endif
+
 namespace GLUtils {
 
+	/// How checkGLError finds errors
+	enum class ErrorCheck {
+		/// Call glGetError. Finds every error, but on some drivers it waits for the GPU.
+		GetError,
+		/// Errors are reported by the driver to a KHR_debug callback. The callback is synchronous, so
+		/// the error is known when the call which caused it returns, and checking it does not call GL.
+		/// Performance warnings and other messages are collected, see getDebugMessages.
+		DebugOutput,
+		/// No checks
+		None
+	};
+
+	/// Message reported through KHR_debug which is not an error
+	struct DebugMessage {
+		unsigned int id;
+		GLenum source;
+		GLenum type;
+		GLenum severity;
+		/// How many times the driver reported the message
+		int64_t count;
+		std::string text;
+	};
+
+	/// Switch the way errors are checked. Debug output is enabled in the current context when switching
+	/// to ErrorCheck::DebugOutput and disabled when switching away from it.
+	[[nodiscard]]
+	EC::ErrorCode setErrorCheck(ErrorCheck check);
+	[[nodiscard]]
+	ErrorCheck getErrorCheck();
+	/// Messages which are not errors reported since the last clearDebugMessages, e.g. GL_DEBUG_TYPE_PERFORMANCE
+	/// warnings. Each distinct message is listed once with the number of times it was reported.
+	[[nodiscard]]
+	std::vector<DebugMessage> getDebugMessages();
+	void clearDebugMessages();
+
+	/// Load the extensions which glad does not load. Must be called after the context is created and
+	/// glad is loaded. Currently this is KHR_parallel_shader_compile or ARB_parallel_shader_compile.
+	/// @param[in] loader - The function which returns the address of a GL function e.g. glfwGetProcAddress
+	void loadExtensions(GLADloadproc loader);
+	/// With parallel shader compile the driver compiles and links in its own threads, Program::link
+	/// returns right away and Program::isLinkComplete tells when Program::finishLink would not wait.
+	/// @returns true if loadExtensions found KHR_parallel_shader_compile or ARB_parallel_shader_compile
+	[[nodiscard]]
+	bool hasParallelShaderCompile();
+
+	/// Read the whole file
+	/// @param[in] path - The path to the file
+	/// @param[out] content - The content of the file
+	[[nodiscard]]
+	EC::ErrorCode readFile(const char* path, std::string& content);
+
+	/// @returns The first error since the last check, using the current ErrorCheck
 	extern EC::ErrorCode checkGLError();
 
+#if GLUTILS_ERROR_CHECK == GLUTILS_ERROR_CHECK_NONE
+	#define RETURN_ON_GL_ERROR(GLCall) \
+	{ \
+		GLCall; \
+	}
+#else
 	#define RETURN_ON_GL_ERROR(GLCall) \
 	{ \
 		GLCall; \
@@ -19,11 +94,112 @@ namespace GLUtils {
 			return err; \
 		} \
 	}
+#endif
 
 	using ShaderHandle = unsigned int;
 	using ProgramHandle = unsigned int;
 	using BufferHandle = unsigned int;
 
+	/// Remembers the objects bound to the GL context of the calling thread and skips the driver calls
+	/// which would not change anything. All wrappers in GLUtils bind through it.
+	///
+	/// Unbinding is lazy. Releasing an object does not call the driver, the object stays bound until
+	/// another one is bound, so drawing the same object several times binds it only once. Code which
+	/// relies on the default objects being bound must call flush first. Code which changes bindings
+	/// without the cache and does not restore them must call invalidate afterwards.
+	///
+	/// Element array buffers are part of the VAO state, their bindings always go to the driver.
+	class StateCache {
+	public:
+		struct Statistics {
+			Statistics() : issued(0), elided(0) {}
+			/// Calls which were passed to the driver
+			int64_t issued;
+			/// Calls which were skipped because they would not change the state
+			int64_t elided;
+		};
+		/// The cache for the GL context of the calling thread. One thread must use only one context.
+		[[nodiscard]]
+		static StateCache& getCurrent();
+		StateCache();
+
+		[[nodiscard]]
+		EC::ErrorCode bindProgram(ProgramHandle program);
+		[[nodiscard]]
+		EC::ErrorCode bindVAO(unsigned int vao);
+		/// @param[in] target - GL buffer target e.g. GL_ARRAY_BUFFER
+		/// @param[in] buffer - The buffer to bind, zero binds no buffer
+		[[nodiscard]]
+		EC::ErrorCode bindBuffer(GLenum target, BufferHandle buffer);
+		/// @param[in] unit - The texture unit, it becomes the active texture unit
+		/// @param[in] target - GL texture target e.g. GL_TEXTURE_2D
+		/// @param[in] texture - The texture to bind
+		[[nodiscard]]
+		EC::ErrorCode bindTexture(int unit, GLenum target, unsigned int texture);
+		/// Bind a texture to the active texture unit
+		[[nodiscard]]
+		EC::ErrorCode bindTexture(GLenum target, unsigned int texture);
+		/// glEnable or glDisable the capability
+		[[nodiscard]]
+		EC::ErrorCode setEnabled(GLenum capability, bool enabled);
+
+		/// Lazy unbind of the program, see the class description
+		void releaseProgram();
+		/// Lazy unbind of the VAO, see the class description
+		void releaseVAO();
+		/// Lazy unbind of the buffer bound to the target, see the class description
+		void releaseBuffer(GLenum target);
+
+		/// Must be called when an object is deleted. GL unbinds deleted objects and their handles can be reused.
+		void onProgramDeleted(ProgramHandle program);
+		void onVAODeleted(unsigned int vao);
+		void onBufferDeleted(BufferHandle buffer);
+		void onTextureDeleted(unsigned int texture);
+
+		/// Unbind all released objects
+		[[nodiscard]]
+		EC::ErrorCode flush();
+		/// Forget the known state, the next bind of each object goes to the driver
+		void invalidate();
+
+		/// When enabled the cache counts the issued and the elided calls
+		void setStatisticsEnabled(bool enabled);
+		[[nodiscard]]
+		const Statistics& getStatistics() const;
+		void resetStatistics();
+	private:
+		/// Value for state which is not known e.g. after invalidate
+		static constexpr unsigned int Unknown = ~0u;
+		static constexpr int MaxBufferTargets = 8;
+		static constexpr int MaxTextureUnits = 16;
+		static constexpr int MaxCapabilities = 16;
+		template<typename T>
+		struct Binding {
+			Binding() : key(0), value(Unknown), released(false) {}
+			GLenum key;
+			T value;
+			/// The object is bound in GL, but nobody uses it anymore
+			bool released;
+		};
+		/// Find the binding for the key or add a new one with unknown value
+		template<typename T, size_t N>
+		Binding<T>* findBinding(std::array<Binding<T>, N>& bindings, int& count, GLenum key);
+		void count(bool issued);
+
+		Binding<unsigned int> program;
+		Binding<unsigned int> vao;
+		std::array<Binding<unsigned int>, MaxBufferTargets> buffers;
+		int bufferTargetCount;
+		/// The key is the texture unit, each unit remembers only the last target
+		std::array<Binding<unsigned int>, MaxTextureUnits> textures;
+		std::array<GLenum, MaxTextureUnits> textureTargets;
+		int activeTextureUnit;
+		std::array<Binding<unsigned int>, MaxCapabilities> capabilities;
+		int capabilityCount;
+		Statistics statistics;
+		bool statisticsEnabled;
+	};
+
 	/// Wrapper enum for buffer types. Different API have different
 	/// kind of buffer types, but there is some intersection between
 	/// all the types. Currently it will contain only the most common types
@@ -31,7 +207,9 @@ namespace GLUtils {
 		Vertex,
 		Index,
 		Uniform,
-		ShaderStorage
+		ShaderStorage,
+		/// Parameters of indirect draw calls
+		DrawIndirect
 	};
 
 	/// Each buffer vertex is composed of some number of elements
@@ -56,8 +234,8 @@ namespace GLUtils {
 
 	class BufferLayout {
 	public:
-		BufferLayout() : stride(0) {}
-		explicit BufferLayout(int count) : layout(count), stride(0) {}
+		BufferLayout() : stride(0), firstLocation(0), divisor(0) {}
+		explicit BufferLayout(int count) : layout(count), stride(0), firstLocation(0), divisor(0) {}
 		BufferLayout(const BufferLayout&) = delete;
 		BufferLayout& operator=(const BufferLayout&) = delete;
 		BufferLayout(BufferLayout&&) = delete;
@@ -71,9 +249,29 @@ namespace GLUtils {
 		unsigned int getStride() const {
 			return stride;
 		}
+		/// Set the shader location of the first attribute, the other attributes use the following
+		/// locations. Used when several buffers feed the same VAO.
+		void setFirstLocation(unsigned int location) {
+			firstLocation = location;
+		}
+		[[nodiscard]]
+		unsigned int getFirstLocation() const {
+			return firstLocation;
+		}
+		/// Make the attributes advance once per divisor instances instead of once per vertex.
+		/// Zero (the default) is used for per vertex attributes.
+		void setInstanceDivisor(unsigned int divisorIn) {
+			divisor = divisorIn;
+		}
+		[[nodiscard]]
+		unsigned int getInstanceDivisor() const {
+			return divisor;
+		}
 	private:
 		std::vector<AttributeLayout> layout;
 		unsigned int stride;
+		unsigned int firstLocation;
+		unsigned int divisor;
 	};
 
 	/// Simple opengl buffer wrapper with ability to upload/free data and set layout for the shader
@@ -139,10 +337,181 @@ namespace GLUtils {
 		UniformBuffer& operator=(UniformBuffer&&) noexcept;;
 		void setBindingPosition(unsigned int bindingPosition);
 		EC::ErrorCode bind();
+		/// Bind part of the buffer to the binding position
+		/// @param[in] offset - Offset in bytes of the part, must be a multiple of getOffsetAlignment
+		/// @param[in] size - Size in bytes of the part
+		[[nodiscard]]
+		EC::ErrorCode bindRange(int64_t offset, int64_t size);
+		/// The alignment of the offsets passed to bindRange
+		[[nodiscard]]
+		static int getOffsetAlignment();
+	private:
+		int bindingPosition;
+	};
+
+	/// Buffer which can be read and written by shaders. It is bound to an indexed binding point
+	/// like UniformBuffer, but it has no size limit and arrays in it can have runtime size.
+	class ShaderStorageBuffer : public BufferBase {
+	public:
+		ShaderStorageBuffer() noexcept;
+		explicit ShaderStorageBuffer(int bindingPosition) noexcept;
+		ShaderStorageBuffer(ShaderStorageBuffer&&) noexcept;
+		ShaderStorageBuffer& operator=(ShaderStorageBuffer&&) noexcept;
+		void setBindingPosition(unsigned int bindingPosition);
+		[[nodiscard]]
+		EC::ErrorCode bind() const;
 	private:
 		int bindingPosition;
 	};
 
+	/// Layout of one command in a DrawIndirectBuffer used with glMultiDrawArraysIndirect
+	struct DrawArraysIndirectCommand {
+		unsigned int count;
+		unsigned int instanceCount;
+		unsigned int first;
+		unsigned int baseInstance;
+	};
+
+	/// Buffer of DrawArraysIndirectCommand. It must be bound when an indirect draw is issued.
+	class DrawIndirectBuffer : public BufferBase {
+	public:
+		DrawIndirectBuffer();
+	};
+
+	/// Vertex buffer for data which is rewritten every frame. The buffer is split into regions and stays
+	/// mapped for its whole lifetime. Each update is written to the next region while the GPU can still
+	/// read the previous ones. A fence is placed after the draw calls which read a region, so the region
+	/// is written again only after these draw calls are done.
+	class StreamingBuffer {
+	public:
+		StreamingBuffer();
+		~StreamingBuffer();
+		StreamingBuffer(const StreamingBuffer&) = delete;
+		StreamingBuffer& operator=(const StreamingBuffer&) = delete;
+		StreamingBuffer(StreamingBuffer&&) noexcept;
+		StreamingBuffer& operator=(StreamingBuffer&&) noexcept;
+		/// Allocate immutable storage for all regions and map it. Bind the VAO before calling this
+		/// in order to record the layout.
+		/// @param[in] regionSize - Size in bytes of one region. Must be a multiple of the layout stride.
+		/// @param[in] regionCount - The number of regions. Three regions are enough to never wait for the GPU
+		/// when the buffer is updated once per frame.
+		/// @param[in] layout - The layout of the vertices in each region
+		[[nodiscard]]
+		EC::ErrorCode init(int64_t regionSize, int regionCount, const BufferLayout& layout);
+		/// Get the next region for writing. If the GPU is still reading it, wait until it is done.
+		/// @param[out] region - Pointer to the mapped memory of the region. It is valid until endWrite.
+		[[nodiscard]]
+		EC::ErrorCode beginWrite(void*& region);
+		/// Make the region returned by the last call to beginWrite the one used for drawing
+		void endWrite();
+		/// Place a fence after the draw calls which read the current region. Must be called after
+		/// the last draw call which uses the region.
+		[[nodiscard]]
+		EC::ErrorCode fence() const;
+		/// The index of the first vertex of the region used for drawing. It must be added to the
+		/// first vertex of each draw call.
+		[[nodiscard]]
+		int getFirstVertex() const;
+		[[nodiscard]]
+		int64_t getRegionSize() const;
+		[[nodiscard]]
+		BufferHandle getHandle() const;
+		[[nodiscard]]
+		EC::ErrorCode bind() const;
+		[[nodiscard]]
+		EC::ErrorCode unbind() const;
+		/// Wait for the GPU to finish with all regions, unmap and destroy the buffer
+		void freeMem();
+	private:
+		/// Wait until the fence of the region is signaled and delete it
+		EC::ErrorCode waitRegion(int region) const;
+		unsigned int handle;
+		unsigned char* mapping;
+		int64_t regionSize;
+		int regionCount;
+		/// The region used for drawing
+		int readRegion;
+		/// The region returned by beginWrite
+		int writeRegion;
+		unsigned int stride;
+		/// One fence for each region, null if the region is not used by the GPU
+		mutable std::vector<GLsync> fences;
+	};
+
+	/// Offscreen render target with RGBA8 color and 24 bit depth
+	class Framebuffer {
+	public:
+		Framebuffer();
+		~Framebuffer();
+		Framebuffer(const Framebuffer&) = delete;
+		Framebuffer& operator=(const Framebuffer&) = delete;
+		Framebuffer(Framebuffer&&) noexcept;
+		Framebuffer& operator=(Framebuffer&&) noexcept;
+		/// @param[in] width - Width in pixels
+		/// @param[in] height - Height in pixels
+		[[nodiscard]]
+		EC::ErrorCode init(int width, int height);
+		/// Draw into the framebuffer and set the viewport to cover it
+		[[nodiscard]]
+		EC::ErrorCode bind() const;
+		/// Draw into the default framebuffer. The viewport is not changed.
+		[[nodiscard]]
+		EC::ErrorCode unbind() const;
+		[[nodiscard]]
+		int getWidth() const;
+		[[nodiscard]]
+		int getHeight() const;
+		void freeMem();
+	private:
+		unsigned int handle;
+		unsigned int colorBuffer;
+		unsigned int depthBuffer;
+		int width;
+		int height;
+	};
+
+	/// Ring of pixel pack buffers which read the bound framebuffer asynchronously. glReadPixels into a
+	/// pixel pack buffer returns immediately, the copy happens on the GPU after the draw calls before it.
+	/// The pixels are mapped a few frames later when the copy is done, so reading does not stall the GPU.
+	class PixelReadback {
+	public:
+		PixelReadback();
+		~PixelReadback();
+		PixelReadback(const PixelReadback&) = delete;
+		PixelReadback& operator=(const PixelReadback&) = delete;
+		/// @param[in] width - Width in pixels of the area which is read
+		/// @param[in] height - Height in pixels of the area which is read
+		/// @param[in] bufferCount - The maximal number of reads in flight
+		[[nodiscard]]
+		EC::ErrorCode init(int width, int height, int bufferCount);
+		/// Start reading the RGBA pixels of the bound framebuffer. Must not be called when isFull.
+		[[nodiscard]]
+		EC::ErrorCode read();
+		/// @returns true if all buffers are in flight and the oldest must be mapped before the next read
+		[[nodiscard]]
+		bool isFull() const;
+		/// The number of reads which are started and not unmapped
+		[[nodiscard]]
+		int getPendingCount() const;
+		/// Map the oldest read. The rows are bottom to top, each row is width * 4 bytes.
+		/// @param[in] wait - If true wait for the read to finish, otherwise data is nullptr when it is not finished
+		/// @param[out] data - The pixels, valid until unmapOldest
+		[[nodiscard]]
+		EC::ErrorCode mapOldest(bool wait, const unsigned char*& data);
+		/// Release the oldest read, its buffer is used by the next read
+		[[nodiscard]]
+		EC::ErrorCode unmapOldest();
+		void freeMem();
+	private:
+		std::vector<unsigned int> buffers;
+		std::vector<GLsync> fences;
+		int width;
+		int height;
+		/// The buffer of the oldest pending read
+		int first;
+		int pendingCount;
+	};
+
 	/// Shader type program wrapper
 	enum class ShaderType : short {
 		Vertex,
@@ -178,13 +547,21 @@ namespace GLUtils {
 		/// @param[in] type - Type of the shader e.g. vertex, fragment, etc...
 		[[nodiscard]]
 		EC::ErrorCode loadFromFile(const char* path, ShaderType type);
+		/// Start compiling the shader without waiting for the result. The errors are reported by
+		/// checkShaderCompilationError.
+		/// @param[in] source Source code for the shader
+		/// @param[in] length The length of the shader (in characters)
+		/// @param[in] type Type of the shader e.g. vertex, fragment, etc...
+		[[nodiscard]]
+		EC::ErrorCode compile(const char* source, int length, ShaderType type);
 		/// Return the api handle to the shader
 		[[nodiscard]]
 		ShaderHandle getHandle() const;
+		/// Call this in order to get compilation errors (if any) for the sahder. Waits for the compilation.
+		[[nodiscard]]
+		EC::ErrorCode checkShaderCompilationError() const;
 	private:
 		unsigned int handle;
-		/// Call this in order to get compilation errors (if any) for the sahder
-		EC::ErrorCode checkShaderCompilationError();
 	};
 
 	class Pipeline {
@@ -196,7 +573,30 @@ namespace GLUtils {
 		Pipeline& operator=(const Pipeline&) = delete;
 		Pipeline(Pipeline&&) = default;
 		Pipeline& operator=(Pipeline&&) = default;
+		/// Load all shaders from a file. Each shader in the file starts with a line #shader <type>
+		/// where <type> is either vertex or fragment.
+		/// @param[in] path The path to the file with the shaders
 		EC::ErrorCode init(const char* path);
+		/// Load all shaders from source in memory. The source has the same format as the files
+		/// passed to init(path).
+		/// @param[in] source The source code of all shaders in the pipeline
+		EC::ErrorCode initFromSource(const std::string& source);
+		/// Same as initFromSource, but it does not wait for the shaders to compile. The errors are reported
+		/// by checkCompileErrors, Program::finishLink calls it.
+		/// @param[in] source The source code of all shaders in the pipeline
+		[[nodiscard]]
+		EC::ErrorCode compileFromSource(const std::string& source);
+		/// Start compiling one stage of the pipeline without waiting for it, e.g. a stage which was split
+		/// at build time and does not need the #shader directives
+		/// @param[in] type The stage of the shader
+		/// @param[in] source The source code of the stage
+		/// @param[in] length The length of the source in characters
+		[[nodiscard]]
+		EC::ErrorCode compileStage(ShaderType type, const char* source, int length);
+		/// Wait for all shaders to compile
+		/// @returns The first compilation error
+		[[nodiscard]]
+		EC::ErrorCode checkCompileErrors() const;
 		It begin();
 		It end();
 		ConstIt begin() const;
@@ -216,11 +616,42 @@ namespace GLUtils {
 		// Move semantics
 		Program(Program&&) noexcept;
 		Program& operator=(Program&&) noexcept;
+		/// Link the program and reflect its active uniforms and uniform blocks
 		[[nodiscard]]
 		EC::ErrorCode init(const Pipeline& pipeline);
+		/// Start linking the program without waiting for the driver. The shaders of the pipeline may still be
+		/// compiling. finishLink must be called with the same pipeline before the program is used.
+		/// Starting all links first and finishing them afterwards lets the driver work on them in parallel.
+		[[nodiscard]]
+		EC::ErrorCode link(const Pipeline& pipeline);
+		/// @returns true if finishLink will not wait for the driver. Always true without parallel shader compile.
+		[[nodiscard]]
+		bool isLinkComplete() const;
+		/// Wait for the link started by link, check for compile and link errors and reflect the program
+		[[nodiscard]]
+		EC::ErrorCode finishLink(const Pipeline& pipeline);
+		/// Create the program from a binary returned by getBinary. Fails when the driver does not accept the
+		/// binary, e.g. after a driver update, then the program must be linked from source.
+		/// @param[in] binary - The program binary
+		/// @param[in] size - The size of the binary in bytes
+		/// @param[in] format - The format returned by getBinary
+		[[nodiscard]]
+		EC::ErrorCode initFromBinary(const void* binary, int size, GLenum format);
+		/// @param[out] binary - The driver specific binary of the linked program
+		/// @param[out] format - The format of the binary which must be passed to initFromBinary
+		[[nodiscard]]
+		EC::ErrorCode getBinary(std::vector<unsigned char>& binary, GLenum& format) const;
 		/// Return the api handle to the program
 		[[nodiscard]]
 		ProgramHandle getHandle() const;
+		/// @param[in] name - Name of a uniform which is not in a uniform block
+		/// @returns The location of the uniform or -1 if the program does not use it
+		[[nodiscard]]
+		int getUniformLocation(const char* name) const;
+		/// @param[in] name - Name of the uniform block
+		/// @returns The index of the block or -1 if the program does not use it
+		[[nodiscard]]
+		int getUniformBlockIndex(const char* name) const;
 		/// Set a uniform float mat4
 		/// @param[in] name - Name of the uniform must match a uniform in the shaders
 		/// @param[in] matrix - 4x4 matrix which will be transfered as uniform
@@ -232,6 +663,11 @@ namespace GLUtils {
 		/// @param[in] float - pointer to the first element of the matrix
 		[[nodiscard]]
 		EC::ErrorCode setUniform(const char* name, const glm::vec3& vector) const;
+		/// Set a uniform float vec2
+		/// @param[in] name - Name of the uniform must match a uniform in the shaders
+		/// @param[in] vector - The value of the uniform
+		[[nodiscard]]
+		EC::ErrorCode setUniform(const char* name, const glm::vec2& vector) const;
 		[[nodiscard]]
 		EC::ErrorCode setUniform(const char* name, float value) const;
 		[[nodiscard]]
@@ -239,9 +675,49 @@ namespace GLUtils {
 		void unbind() const;
 		void freeMem();
 	private:
+		/// Fill uniformLocations and uniformBlocks after the program is linked
+		void reflect();
 		unsigned int handle;
 		/// Call this in order to get link errors (if any) for the sahder program
 		EC::ErrorCode checkProgramLinkErrors() const;
+		/// Uniforms outside of blocks by name, arrays are stored without the [0] suffix
+		std::unordered_map<std::string, int> uniformLocations;
+		std::unordered_map<std::string, int> uniformBlocks;
+	};
+
+	/// Program binaries stored on the disk, so that the programs are not compiled on each start. Each binary
+	/// is keyed by a hash of the shader source and of the vendor, renderer and version strings of the driver,
+	/// so changing a shader or updating the driver uses a new entry. Binaries which the driver rejects anyway are
+	/// treated as a miss and overwritten by the next store.
+	class ProgramBinaryCache {
+	public:
+		ProgramBinaryCache();
+		/// Must be called after the context is created
+		/// @param[in] directory - The directory with the binaries, it is created if it does not exist
+		[[nodiscard]]
+		EC::ErrorCode init(const char* directory);
+		/// @returns false if init failed or if the driver does not support program binaries
+		[[nodiscard]]
+		bool isEnabled() const;
+		/// @param[in] source - The source of all shaders of the program
+		/// @returns The key of the program for load and store
+		[[nodiscard]]
+		uint64_t getKey(const std::string& source) const;
+		/// @param[in] key - Value returned by getKey
+		/// @param[out] program - Initialized from the binary on success
+		/// @returns true if the binary was found and accepted by the driver
+		[[nodiscard]]
+		bool load(uint64_t key, Program& program) const;
+		/// @param[in] key - Value returned by getKey
+		/// @param[in] program - Linked program
+		[[nodiscard]]
+		EC::ErrorCode store(uint64_t key, const Program& program) const;
+	private:
+		std::string getPath(uint64_t key) const;
+		std::string directory;
+		/// Hash of the vendor, renderer and version strings
+		uint64_t driverHash;
+		bool enabled;
 	};
 
 	/// VAO is special opengl feature. It "remembers" buffer layout.
@@ -357,9 +833,47 @@ namespace GLUtils {
 			MipMapFilter2D mipMapFilter
 		);
 
+		/// Allocate immutable RGBA8 storage without contents. The pixels are written with uploadRows.
+		/// When mipMapFilter is not None storage for the whole mip chain is allocated, but the levels
+		/// above 0 are undefined until generateMipmaps is called.
+		/// @param[in] width The width of the texture in pixels
+		/// @param[in] height The height of the texture in pixels
+		/// @param[in] wrapU Defines what will happen when texture coordinate go out of range [0;1]
+		/// in the u (horizontal) direction
+		/// @param[in] wrapV Defines what will happen when texture coordinate go out of range [0;1]
+		/// in the v (vertical) direction
+		/// @param[in] minFilter Filter used when one texel corresponds to less than a pixel
+		/// @param[in] magFilter Filter used when one texel corresponds to multiple pixels
+		/// @param[in] mipMapFilter Defines whether to use mipmaps and how to choose which mipmap to sample
+		[[nodiscard]]
+		EC::ErrorCode initStorage(
+			int width,
+			int height,
+			TextureWrap2D wrapU,
+			TextureWrap2D wrapV,
+			TextureFilter2D minFilter,
+			TextureFilter2D magFilter,
+			MipMapFilter2D mipMapFilter
+		);
+
+		/// Write rows of level 0 of a texture created with initStorage. The rows are tightly packed
+		/// RGBA8 pixels. If a buffer is bound to GL_PIXEL_UNPACK_BUFFER pixels is an offset in it.
+		/// @param[in] firstRow The index of the first row which is written
+		/// @param[in] rowCount The number of rows which are written
+		/// @param[in] pixels Pointer to the pixels or offset in the bound pixel unpack buffer
+		[[nodiscard]]
+		EC::ErrorCode uploadRows(int firstRow, int rowCount, const void* pixels);
+
+		/// Compute all mip levels from level 0
+		[[nodiscard]]
+		EC::ErrorCode generateMipmaps();
+
 		[[nodiscard]]
 		EC::ErrorCode bind(int unit) const;
 
+		int getWidth() const;
+		int getHeight() const;
+
 		void freeMem();
 	private:
 		/// Some actions do not require setting the texture unit.
@@ -372,4 +886,136 @@ namespace GLUtils {
 		int height;
 		int channelsCount;
 	};
-}
\ No newline at end of file
+
+	/// Loads textures without stalling the GL thread. Image files are decoded on worker threads. The
+	/// decoded pixels are copied into a ring of pixel unpack buffers and uploaded with glTexSubImage2D,
+	/// at most one buffer per update, so the cost of a frame does not depend on the number or the size
+	/// of the textures being loaded. The textures use immutable storage and their mipmaps are generated
+	/// on the update after the last row is uploaded. Until a texture is ready a 1x1 placeholder is bound
+	/// in its place. All methods except the decoding must be called on the GL thread.
+	class AsyncTextureLoader {
+	public:
+		using Handle = int;
+
+		struct Options {
+			TextureWrap2D wrapU = TextureWrap2D::Repeat;
+			TextureWrap2D wrapV = TextureWrap2D::Repeat;
+			TextureFilter2D minFilter = TextureFilter2D::Linear;
+			TextureFilter2D magFilter = TextureFilter2D::Linear;
+			MipMapFilter2D mipMapFilter = MipMapFilter2D::Linear;
+		};
+
+		AsyncTextureLoader();
+		~AsyncTextureLoader();
+		AsyncTextureLoader(const AsyncTextureLoader&) = delete;
+		AsyncTextureLoader& operator=(const AsyncTextureLoader&) = delete;
+		/// @param[in] workerCount - The number of threads which decode image files, must be positive
+		/// @param[in] bytesPerUpdate - The size of each pixel unpack buffer, the maximal number of bytes
+		/// uploaded by one call to update. Images with rows larger than this are uploaded one row per update
+		/// straight from memory.
+		/// @param[in] bufferCount - The number of pixel unpack buffers, the uploads of the last bufferCount
+		/// updates can be in flight at the same time
+		[[nodiscard]]
+		EC::ErrorCode init(int workerCount, int64_t bytesPerUpdate, int bufferCount = 3);
+		/// Queue a texture for loading. The image is converted to RGBA regardless of the channels in the file.
+		/// @param[in] path - The path to the image file
+		/// @param[in] options - Sampling options of the created texture
+		/// @returns Handle which is used to bind the texture
+		Handle load(const char* path, const Options& options);
+		/// Move the loading forward, must be called once per frame
+		[[nodiscard]]
+		EC::ErrorCode update();
+		/// Bind the texture if it is ready and the placeholder otherwise
+		[[nodiscard]]
+		EC::ErrorCode bind(Handle handle, int unit) const;
+		[[nodiscard]]
+		bool isReady(Handle handle) const;
+		/// @returns The reason a texture could not be loaded, or no error if it is ready or still loading
+		[[nodiscard]]
+		const EC::ErrorCode& getError(Handle handle) const;
+		/// The number of textures which are neither ready nor failed
+		[[nodiscard]]
+		int getPendingCount() const;
+		/// Stop the workers and delete all textures
+		void freeMem();
+	private:
+		struct PixelsDeleter {
+			void operator()(unsigned char* pixels) const;
+		};
+		using Pixels = std::unique_ptr<unsigned char, PixelsDeleter>;
+
+		enum class State {
+			Decoding,
+			Uploading,
+			GeneratingMipmaps,
+			Ready,
+			Failed
+		};
+
+		struct Entry {
+			std::unique_ptr<Texture2D> texture;
+			Options options;
+			State state;
+			std::string path;
+			/// The decoded image, released when all rows are copied
+			Pixels pixels;
+			int width;
+			int height;
+			int uploadedRows;
+			EC::ErrorCode error;
+		};
+
+		struct DecodeJob {
+			Handle handle;
+			std::string path;
+		};
+
+		struct DecodeResult {
+			Handle handle;
+			Pixels pixels;
+			int width;
+			int height;
+		};
+
+		/// Rows of one texture copied into the current pixel unpack buffer
+		struct Copy {
+			Handle handle;
+			int firstRow;
+			int rowCount;
+			int64_t offset;
+		};
+
+		void decodeLoop();
+		/// Create storage for the images decoded since the last update
+		[[nodiscard]]
+		EC::ErrorCode collectDecoded();
+		[[nodiscard]]
+		EC::ErrorCode generatePendingMipmaps();
+		/// Copy rows of the textures waiting for upload to the next pixel unpack buffer and upload them
+		[[nodiscard]]
+		EC::ErrorCode uploadNextChunk();
+		/// Called when all rows of a texture are copied
+		void onRowsCopied(Handle handle);
+
+		std::vector<std::thread> workers;
+		/// Guards jobs, decoded and stopping, which are shared with the workers
+		std::mutex mutex;
+		std::condition_variable hasWork;
+		std::deque<DecodeJob> jobs;
+		std::vector<DecodeResult> decoded;
+		bool stopping;
+
+		std::vector<Entry> entries;
+		/// Textures with storage whose rows are not all copied, the rows are copied in this order
+		std::deque<Handle> uploadQueue;
+		/// Textures uploaded during the last update which need mipmaps
+		std::vector<Handle> mipmapQueue;
+		std::vector<Copy> copies;
+		std::vector<unsigned int> buffers;
+		std::vector<GLsync> fences;
+		Texture2D placeholder;
+		int64_t bufferSize;
+		int nextBuffer;
+		int pendingCount;
+	};
+}